@@ -5,8 +5,25 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include "lz_codec.h"
 
 #define BUFFER_SIZE 1024
+#define FEED_PAGE_SIZE 10  // Posts fetched per feed page
+#define FEED_FRAME_POSTS 32    // Most posts the server packs into one feed frame
+#define FEED_FLAG_BATCHED 0x1  // Request flag: answer with batched feed frames
+#define FEED_FLAG_LOG_LAYOUT 0x2  // Request flag: records exactly as the server stores them
+#define FEED_FLAG_COMPRESSED 0x4  // Request flag: compressed pages are welcome
+#define FEED_FRAME_LAST 0x1    // Frame flag: last frame of this feed page
+#define FEED_FRAME_VARLEN 0x2  // Frame flag: records are PostRecordHeader + text
+#define FEED_FRAME_LIVE 0x4    // Frame flag: a new post pushed to a live feed subscriber
+#define FEED_FRAME_PADDED 0x8  // Frame flag: each record is followed by its checksum and padded to 8 bytes
+#define FEED_FRAME_COMPRESSED 0x10  // Frame flag: a FeedCompressedHeader and the page's frames, LZ compressed
+#define FEED_PAGE_MAX_BYTES 16384  // Largest decompressed page (100 padded posts and their frames)
+#define MAX_POST_LENGTH 99     // Longest post text in bytes
+#define LODI_WIRE_MAGIC 0x32444F4C  // "LOD2": first word of a variable-length frame
+#define REQUEST_FLAG_TRACED 0x80000000U  // Header flag: an 8-byte trace ID follows the header, before the text
 
 void DieWithError(char *errorMessage)
 {
@@ -30,21 +47,88 @@ typedef struct {
 
 // Messages to Lodi Server (TCP Connection)
 typedef struct {
-    enum{login,post,feed,follow,unfollow,logout} messageType;
+    enum{login,post,feed,follow,unfollow,logout,subscribe,search,trending} messageType;
     unsigned int userID;
     unsigned int recipientID;
     unsigned long timestamp;
     unsigned long digitalSig;
     char message[100];
+    unsigned int feedLimit;     // Feed: max posts per page (0 = server default)
+    enum{cursorNone,cursorBeforeID,cursorAfterID,cursorBeforeTime,cursorAfterTime} cursorType;
+    unsigned int feedFlags;     // Feed: FEED_FLAG_* options
+    unsigned long cursor;       // Feed: post ID or server timestamp (microseconds) to page from
 } PClientToLodiServer;
 
 // Messages from Lodi Server (TCP Acknowledgments)
 typedef struct {
-    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout} messageType;
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
     unsigned int userID;
     char message[100];
 } LodiServerMessage;
 
+// Batched feed response: each frame is a FeedFrameHeader followed by postCount
+// FeedPostRecords, the last frame of a page has FEED_FRAME_LAST set
+typedef struct {
+    unsigned int messageType;   // ackFeed, or ackSearch for search results
+    unsigned int userID;
+    unsigned int postCount;     // Records following this header
+    unsigned int flags;         // FEED_FRAME_* flags
+} FeedFrameHeader;
+
+// Follows the header of a FEED_FRAME_COMPRESSED frame, whose postCount is the
+// posts of the whole page; the compressed bytes expand to the page's frames
+typedef struct {
+    unsigned int rawLength;         // Bytes of frames once decompressed
+    unsigned int compressedLength;  // Compressed bytes following this header
+} FeedCompressedHeader;
+
+// Where feed frames are read from: the socket, or a page decompressed into memory
+typedef struct {
+    int sock;
+    char *page;                 // NULL until a compressed page arrives
+    unsigned int length;
+    unsigned int offset;
+} FeedReader;
+
+typedef struct {
+    unsigned int postID;
+    unsigned int userID;        // Author
+    unsigned long postedAt;     // Server receive time in microseconds
+    char message[100];
+} FeedPostRecord;
+
+// Variable-length request: this header, then bodyLength bytes of text (no terminator)
+typedef struct {
+    unsigned int magic;         // LODI_WIRE_MAGIC
+    unsigned int messageType;   // PClientToLodiServer message type
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    unsigned int feedLimit;
+    unsigned int cursorType;
+    unsigned long cursor;
+    unsigned int feedFlags;
+    unsigned int bodyLength;    // Bytes of text following the header
+} LodiRequestHeader;
+
+// Variable-length response: this header, then bodyLength bytes of text
+typedef struct {
+    unsigned int magic;         // LODI_WIRE_MAGIC
+    unsigned int messageType;   // LodiServerMessage message type
+    unsigned int userID;
+    unsigned int bodyLength;    // Bytes of text following the header
+} LodiResponseHeader;
+
+// Variable-length feed record: this header, then length bytes of post text
+typedef struct {
+    unsigned long postedAt;     // Server receive time in microseconds
+    unsigned int postID;
+    unsigned int userID;        // Author
+    unsigned int length;        // Bytes of post text following the header
+    unsigned int timestamp;     // Client timestamp of the post request
+} PostRecordHeader;
+
 // RSA
 // Modular exponentiation: (base^exp) mod n
 unsigned long modExp(unsigned long base, unsigned long exp, unsigned long n) {
@@ -73,12 +157,117 @@ char *getUserAction() {
     return action;
 }
 
+// Receive exactly len bytes (handle partial reads), returns 0 on failure or early close
+int recvAll(int sock, void *buf, unsigned int len) {
+    unsigned int totalBytesRcvd = 0;
+    while (totalBytesRcvd < len) {
+        int r = recv(sock, (char *)buf + totalBytesRcvd, (int)(len - totalBytesRcvd), 0);
+        if (r <= 0) return 0;
+        totalBytesRcvd += r;
+    }
+    return 1;
+}
+
+// Read len bytes of a feed response, returns 0 if they are not there
+int readFeed(FeedReader *reader, void *buf, unsigned int len) {
+    if (reader->page == NULL) return recvAll(reader->sock, buf, len);
+    if (reader->length - reader->offset < len) return 0;
+    memcpy(buf, reader->page + reader->offset, len);
+    reader->offset += len;
+    return 1;
+}
+
+// Receive the rest of a FEED_FRAME_COMPRESSED frame and decompress it into page,
+// from which reader then returns the page's frames. Returns 0 on failure.
+int inflateFeedPage(FeedReader *reader, char *page, unsigned int capacity) {
+    FeedCompressedHeader sizes;
+    char compressed[FEED_PAGE_MAX_BYTES];
+    if (!recvAll(reader->sock, &sizes, sizeof(sizes)) || sizes.rawLength > capacity ||
+        sizes.compressedLength > sizeof(compressed) ||
+        !recvAll(reader->sock, compressed, sizes.compressedLength))
+        return 0;
+    if (lzDecompress(compressed, sizes.compressedLength, page, capacity) != (int)sizes.rawLength) return 0;
+
+    reader->page = page;
+    reader->length = sizes.rawLength;
+    reader->offset = 0;
+    return 1;
+}
+
+// Send a request as a variable-length frame (header, the trace ID when traceID
+// is not 0, then only the used part of the message), returns 0 on failure
+int sendTracedLodiRequest(int sock, PClientToLodiServer *request, unsigned long traceID) {
+    LodiRequestHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = LODI_WIRE_MAGIC;
+    header.messageType = request->messageType;
+    header.userID = request->userID;
+    header.recipientID = request->recipientID;
+    header.timestamp = request->timestamp;
+    header.digitalSig = request->digitalSig;
+    header.feedLimit = request->feedLimit;
+    header.cursorType = request->cursorType;
+    header.cursor = request->cursor;
+    header.feedFlags = request->feedFlags & ~REQUEST_FLAG_TRACED;
+    header.bodyLength = strnlen(request->message, MAX_POST_LENGTH);
+    if (traceID != 0)
+        header.feedFlags |= REQUEST_FLAG_TRACED;
+
+    struct iovec iov[3] = {{&header, sizeof(header)}, {&traceID, traceID ? sizeof(traceID) : 0},
+                           {request->message, header.bodyLength}};
+    int iovcnt = 3;
+    struct iovec *next = iov;
+    while (iovcnt > 0) {
+        ssize_t s = writev(sock, next, iovcnt);
+        if (s <= 0) return 0;
+        while (iovcnt > 0 && (size_t)s >= next->iov_len) {
+            s -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char *)next->iov_base + s;
+            next->iov_len -= s;
+        }
+    }
+    return 1;
+}
+
+int sendLodiRequest(int sock, PClientToLodiServer *request) {
+    return sendTracedLodiRequest(sock, request, 0);
+}
+
+// Random ID that ties together the spans the servers record for one login
+unsigned long newTraceID() {
+    unsigned long id = 0;
+    FILE *random = fopen("/dev/urandom", "r");
+    if (random != NULL) {
+        if (fread(&id, sizeof(id), 1, random) != 1) id = 0;
+        fclose(random);
+    }
+    if (id == 0)
+        id = ((unsigned long)time(NULL) << 20) ^ ((unsigned long)getpid() << 1) ^ 1;
+    return id;
+}
+
+// Receive a variable-length response into a LodiServerMessage, returns 0 on failure
+int recvLodiResponse(int sock, LodiServerMessage *response) {
+    LodiResponseHeader header;
+    if (!recvAll(sock, &header, sizeof(header))) return 0;
+    if (header.magic != LODI_WIRE_MAGIC || header.bodyLength >= sizeof(response->message)) return 0;
+
+    response->messageType = header.messageType;
+    response->userID = header.userID;
+    if (!recvAll(sock, response->message, header.bodyLength)) return 0;
+    response->message[header.bodyLength] = '\0';
+    return 1;
+}
+
 // Helper function to send request to Lodi Server and receive response, returns 0 on failure, 1 on success
 int sendRequestToServer(char *lodiServerIP, unsigned short lodiServerPort,
                         PClientToLodiServer *request, LodiServerMessage *response) {
     int tcpSock;
     struct sockaddr_in lodiServerAddr;
-    char buffer[BUFFER_SIZE];
 
     // Create TCP socket
     if ((tcpSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
@@ -100,16 +289,10 @@ int sendRequestToServer(char *lodiServerIP, unsigned short lodiServerPort,
     }
 
     // Send request (ensure all bytes sent)
-    unsigned int requestLen = sizeof(PClientToLodiServer);
-    unsigned int sent = 0;
-    while (sent < requestLen) {
-        int s = send(tcpSock, ((char *)request) + sent, requestLen - sent, 0);
-        if (s <= 0) {
-            printf("(LodiClient) Error: Failed to send request\n");
-            close(tcpSock);
-            return 0;
-        }
-        sent += s;
+    if (!sendLodiRequest(tcpSock, request)) {
+        printf("(LodiClient) Error: Failed to send request\n");
+        close(tcpSock);
+        return 0;
     }
 
     // Set receive timeout
@@ -117,28 +300,12 @@ int sendRequestToServer(char *lodiServerIP, unsigned short lodiServerPort,
     setsockopt(tcpSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
     // Receive response (handle partial reads)
-    unsigned int expected = sizeof(LodiServerMessage);
-    unsigned int totalBytesRcvd = 0;
-    while (totalBytesRcvd < expected) {
-        int r = recv(tcpSock, buffer + totalBytesRcvd, (int)(expected - totalBytesRcvd), 0);
-        if (r < 0) {
-            printf("(LodiClient) Error: Failed to receive response\n");
-            close(tcpSock);
-            return 0;
-        }
-        if (r == 0) break; // Connection closed
-        totalBytesRcvd += r;
-    }
-
-    if (totalBytesRcvd < expected) {
+    if (!recvLodiResponse(tcpSock, response)) {
         printf("(LodiClient) Error: Incomplete response from server\n");
         close(tcpSock);
         return 0;
     }
 
-    // Copy response
-    memcpy(response, buffer, sizeof(LodiServerMessage));
-
     // Close connection
     close(tcpSock);
 
@@ -152,9 +319,12 @@ void displayMenu() {
     printf("2. View feed (posts from idols)\n");
     printf("3. Follow an idol\n");
     printf("4. Unfollow an idol\n");
-    printf("5. Logout / Quit\n");
+    printf("5. Watch live feed (new posts as they arrive)\n");
+    printf("6. Search posts\n");
+    printf("7. Trending hashtags and words\n");
+    printf("8. Logout / Quit\n");
     printf("======================================\n");
-    printf("Enter your choice (1-5): ");
+    printf("Enter your choice (1-8): ");
 }
 
 // Function to get session choice
@@ -225,18 +395,21 @@ int handlePost(char *lodiServerIP, unsigned short lodiServerPort,
     }
 }
 
-// View feed (get posts from followed idols) - receives multiple messages
-int handleFeed(char *lodiServerIP, unsigned short lodiServerPort,
-               unsigned int userID, unsigned long d, unsigned long n) {
-    printf("\n--- VIEW FEED ---\n");
-
+// Fetch and print one page of the feed, or of the search results for query when it
+// is not NULL (newest first) - receives batched frames.
+// Returns the number of posts shown, or -1 on failure; oldestTime is set to the
+// receive time of the last (oldest) post shown so the next page can start before
+// it. Times rather than post IDs order posts across the shards behind lodi_router.
+int requestFeedPage(char *lodiServerIP, unsigned short lodiServerPort,
+                    unsigned int userID, unsigned long d, unsigned long n, const char *query,
+                    int cursorType, unsigned long cursor, unsigned long *oldestTime) {
     int tcpSock;
     struct sockaddr_in lodiServerAddr;
 
     // Create TCP socket
     if ((tcpSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
         printf("(LodiClient) Error: Failed to create TCP socket\n");
-        return 0;
+        return -1;
     }
 
     // Configure server address
@@ -249,7 +422,7 @@ int handleFeed(char *lodiServerIP, unsigned short lodiServerPort,
     if (connect(tcpSock, (struct sockaddr *)&lodiServerAddr, sizeof(lodiServerAddr)) < 0) {
         printf("(LodiClient) Error: Failed to connect to server\n");
         close(tcpSock);
-        return 0;
+        return -1;
     }
 
     // Create timestamp: time(NULL) % 500
@@ -260,87 +433,269 @@ int handleFeed(char *lodiServerIP, unsigned short lodiServerPort,
 
     // Fill PClientToLodiServer struct
     PClientToLodiServer request;
-    request.messageType = feed;
+    request.messageType = query != NULL ? search : feed;
     request.userID = userID;
     request.recipientID = 0;
     request.timestamp = timestamp;
     request.digitalSig = digitalSig;
-    memset(request.message, 0, sizeof(request.message)); // Empty message field
+    memset(request.message, 0, sizeof(request.message)); // Empty message field unless searching
+    if (query != NULL)
+        strncpy(request.message, query, MAX_POST_LENGTH);
+    request.feedLimit = FEED_PAGE_SIZE;
+    request.cursorType = cursorType;
+    // Variable-length requests are always answered with batched frames; in the
+    // server's post log layout its records need no copying or formatting. Large
+    // pages may come compressed.
+    request.feedFlags = FEED_FLAG_LOG_LAYOUT | FEED_FLAG_COMPRESSED;
+    request.cursor = cursor;
 
     // Send request (ensure all bytes sent)
-    printf("(LodiClient) Sending FEED request to server...\n");
-    unsigned int requestLen = sizeof(PClientToLodiServer);
-    unsigned int sent = 0;
-    while (sent < requestLen) {
-        int s = send(tcpSock, ((char *)&request) + sent, requestLen - sent, 0);
-        if (s <= 0) {
-            printf("(LodiClient) Error: Failed to send request\n");
-            close(tcpSock);
-            return 0;
-        }
-        sent += s;
+    printf("(LodiClient) Sending %s request to server...\n", query != NULL ? "SEARCH" : "FEED");
+    if (!sendLodiRequest(tcpSock, &request)) {
+        printf("(LodiClient) Error: Failed to send request\n");
+        close(tcpSock);
+        return -1;
     }
 
     // Set receive timeout
     struct timeval tv = {10, 0};
     setsockopt(tcpSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    printf("\n*** YOUR FEED ***\n");
     int postCount = 0;
 
-    // Loop to receive multiple posts until END_OF_FEED signal
-    while (1) {
-        LodiServerMessage response;
-        char buffer[BUFFER_SIZE];
-
-        // Receive response 
-        unsigned int expected = sizeof(LodiServerMessage);
-        unsigned int totalBytesRcvd = 0;
-        while (totalBytesRcvd < expected) {
-            int r = recv(tcpSock, buffer + totalBytesRcvd, (int)(expected - totalBytesRcvd), 0);
-            if (r < 0) {
-                printf("(LodiClient) Error: Failed to receive response\n");
-                close(tcpSock);
-                return 0;
-            }
-            if (r == 0) break; // Connection closed
-            totalBytesRcvd += r;
-        }
-
-        if (totalBytesRcvd < expected) {
+    // Receive variable-length frames until the one flagged as last. A compressed
+    // page is a single frame holding all of them.
+    FeedReader reader = {tcpSock, NULL, 0, 0};
+    char page[FEED_PAGE_MAX_BYTES];
+    for (;;) {
+        FeedFrameHeader header;
+        if (!readFeed(&reader, &header, sizeof(header))) {
             printf("(LodiClient) Error: Incomplete response from server\n");
             close(tcpSock);
-            return 0;
+            return -1;
         }
 
-        // Copy response
-        memcpy(&response, buffer, sizeof(LodiServerMessage));
-
-        // Check if this is the end signal
-        if (strcmp(response.message, "END_OF_FEED") == 0) {
-            break;
+        if (header.messageType == ackBusy) {
+            printf("Server is busy or you are sending too many requests, try again later\n");
+            close(tcpSock);
+            return -1;
         }
-
-        // Check response type
-        if (response.messageType != ackFeed) {
+        if (header.messageType == (query != NULL ? ackSearch : ackFeed) &&
+            (header.flags & FEED_FRAME_COMPRESSED) && reader.page == NULL) {
+            if (!inflateFeedPage(&reader, page, sizeof(page))) {
+                printf("(LodiClient) Error: Bad compressed page from server\n");
+                close(tcpSock);
+                return -1;
+            }
+            continue;
+        }
+        if (header.messageType != (query != NULL ? ackSearch : ackFeed) ||
+            !(header.flags & FEED_FRAME_VARLEN) || (header.flags & FEED_FRAME_COMPRESSED) ||
+            header.postCount > FEED_FRAME_POSTS) {
             printf("Error: Unexpected response from server\n");
             close(tcpSock);
-            return 0;
+            return -1;
         }
 
-        // Display this post
-        printf("%s\n", response.message);
-        postCount++;
+        // Display the posts, remembering the last (oldest) ID for paging
+        for (unsigned int i = 0; i < header.postCount; i++) {
+            PostRecordHeader record;
+            char text[MAX_POST_LENGTH + 8];
+            if (!readFeed(&reader, &record, sizeof(record)) || record.length > MAX_POST_LENGTH) {
+                printf("(LodiClient) Error: Incomplete response from server\n");
+                close(tcpSock);
+                return -1;
+            }
+            unsigned int padded = (header.flags & FEED_FRAME_PADDED) ?
+                                  ((sizeof(record) + record.length + sizeof(unsigned int) + 7) & ~7U) - sizeof(record) :
+                                  record.length;
+            if (!readFeed(&reader, text, padded)) {
+                printf("(LodiClient) Error: Incomplete response from server\n");
+                close(tcpSock);
+                return -1;
+            }
+            text[record.length] = '\0';
+
+            printf("#%u User %u: %s\n", record.postID, record.userID, text);
+            *oldestTime = record.postedAt;
+            postCount++;
+        }
+
+        if (header.flags & FEED_FRAME_LAST) break;
     }
 
     close(tcpSock);
+    return postCount;
+}
+
+// View feed (get posts from followed idols) one page at a time, newest first
+int handleFeed(char *lodiServerIP, unsigned short lodiServerPort,
+               unsigned int userID, unsigned long d, unsigned long n) {
+    printf("\n--- VIEW FEED ---\n");
+    printf("\n*** YOUR FEED ***\n");
+
+    int cursorType = cursorNone;
+    unsigned long cursor = 0;
+    int totalPosts = 0;
+
+    for (;;) {
+        unsigned long oldestTime = 0;
+        int pagePosts = requestFeedPage(lodiServerIP, lodiServerPort, userID, d, n, NULL,
+                                        cursorType, cursor, &oldestTime);
+        if (pagePosts < 0) return 0;
+        totalPosts += pagePosts;
 
-    if (postCount == 0) {
+        // A short page means there is nothing older left
+        if (pagePosts < FEED_PAGE_SIZE) break;
+
+        printf("Show older posts? (y/n): ");
+        char answer[10];
+        if (fgets(answer, sizeof(answer), stdin) == NULL || answer[0] != 'y') break;
+
+        cursorType = cursorBeforeTime;
+        cursor = oldestTime;
+    }
+
+    if (totalPosts == 0) {
         printf("No posts to display. Follow some users to see their posts!\n");
     } else {
-        printf("\n--- End of feed (%d posts) ---\n", postCount);
+        printf("\n--- End of feed (%d posts) ---\n", totalPosts);
+    }
+
+    return 1;
+}
+
+// Search all posts for the ones containing every word of a query, newest first
+int handleSearch(char *lodiServerIP, unsigned short lodiServerPort,
+                 unsigned int userID, unsigned long d, unsigned long n) {
+    printf("\n--- SEARCH POSTS ---\n");
+
+    char query[MAX_POST_LENGTH + 1];
+    printf("Enter the words to search for: ");
+    if (fgets(query, sizeof(query), stdin) == NULL) {
+        printf("Error reading search\n");
+        return 0;
+    }
+    size_t len = strlen(query);
+    if (len > 0 && query[len - 1] == '\n') {
+        query[len - 1] = '\0';
+    }
+
+    printf("\n*** SEARCH RESULTS ***\n");
+    int cursorType = cursorNone;
+    unsigned long cursor = 0;
+    int totalPosts = 0;
+
+    for (;;) {
+        unsigned long oldestTime = 0;
+        int pagePosts = requestFeedPage(lodiServerIP, lodiServerPort, userID, d, n, query,
+                                        cursorType, cursor, &oldestTime);
+        if (pagePosts < 0) return 0;
+        totalPosts += pagePosts;
+
+        // A short page means there are no older matches left
+        if (pagePosts < FEED_PAGE_SIZE) break;
+
+        printf("Show older results? (y/n): ");
+        char answer[10];
+        if (fgets(answer, sizeof(answer), stdin) == NULL || answer[0] != 'y') break;
+
+        cursorType = cursorBeforeTime;
+        cursor = oldestTime;
+    }
+
+    if (totalPosts == 0) {
+        printf("No posts contain \"%s\"\n", query);
+    } else {
+        printf("\n--- End of results (%d posts) ---\n", totalPosts);
+    }
+
+    return 1;
+}
+
+// Show the hashtags and words trending over the last 5 minutes or hour
+int handleTrending(char *lodiServerIP, unsigned short lodiServerPort,
+                   unsigned int userID, unsigned long d, unsigned long n) {
+    printf("\n--- TRENDING ---\n");
+
+    char window[10];
+    printf("Trending over the last 5 minutes or hour? (5m/1h): ");
+    if (fgets(window, sizeof(window), stdin) == NULL) {
+        printf("Error reading window\n");
+        return 0;
+    }
+    window[strcspn(window, "\n")] = '\0';
+
+    int tcpSock;
+    struct sockaddr_in lodiServerAddr;
+
+    // Create TCP socket
+    if ((tcpSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        printf("(LodiClient) Error: Failed to create TCP socket\n");
+        return 0;
+    }
+
+    // Configure server address
+    memset(&lodiServerAddr, 0, sizeof(lodiServerAddr));
+    lodiServerAddr.sin_family = AF_INET;
+    lodiServerAddr.sin_addr.s_addr = inet_addr(lodiServerIP);
+    lodiServerAddr.sin_port = htons(lodiServerPort);
+
+    // Connect to server
+    if (connect(tcpSock, (struct sockaddr *)&lodiServerAddr, sizeof(lodiServerAddr)) < 0) {
+        printf("(LodiClient) Error: Failed to connect to server\n");
+        close(tcpSock);
+        return 0;
     }
 
+    // Create timestamp and digital signature
+    unsigned long timestamp = (unsigned long)time(NULL) % 500;
+    unsigned long digitalSig = createDigitalSignature(timestamp, d, n);
+
+    // Fill PClientToLodiServer struct, the message names the window
+    PClientToLodiServer request;
+    memset(&request, 0, sizeof(request));
+    request.messageType = trending;
+    request.userID = userID;
+    request.timestamp = timestamp;
+    request.digitalSig = digitalSig;
+    strncpy(request.message, strcmp(window, "1h") == 0 ? "1h" : "5m", MAX_POST_LENGTH);
+    request.feedLimit = 10;
+    request.cursorType = cursorNone;
+
+    printf("(LodiClient) Sending TRENDING request to server...\n");
+    if (!sendLodiRequest(tcpSock, &request)) {
+        printf("(LodiClient) Error: Failed to send request\n");
+        close(tcpSock);
+        return 0;
+    }
+
+    // Set receive timeout
+    struct timeval tv = {10, 0};
+    setsockopt(tcpSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // One response per line until END_OF_TRENDING
+    printf("\n*** TRENDING (last %s) ***\n", request.message);
+    int lines = 0;
+    for (;;) {
+        LodiServerMessage response;
+        if (!recvLodiResponse(tcpSock, &response)) {
+            printf("(LodiClient) Error: Incomplete response from server\n");
+            close(tcpSock);
+            return 0;
+        }
+        if (response.messageType != ackTrending) {
+            printf("Error: %s\n", response.message);
+            close(tcpSock);
+            return 0;
+        }
+        if (strcmp(response.message, "END_OF_TRENDING") == 0) break;
+        printf("%s\n", response.message);
+        lines++;
+    }
+    if (lines == 0) printf("Nothing is trending yet\n");
+
+    close(tcpSock);
     return 1;
 }
 
@@ -460,6 +815,114 @@ int handleUnfollow(char *lodiServerIP, unsigned short lodiServerPort,
     }
 }
 
+// Watch the live feed: subscribe and print the posts the server pushes until Enter is pressed
+int handleLiveFeed(char *lodiServerIP, unsigned short lodiServerPort,
+                   unsigned int userID, unsigned long d, unsigned long n) {
+    printf("\n--- LIVE FEED ---\n");
+
+    int tcpSock;
+    struct sockaddr_in lodiServerAddr;
+
+    // Create TCP socket
+    if ((tcpSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        printf("(LodiClient) Error: Failed to create TCP socket\n");
+        return 0;
+    }
+
+    // Configure server address
+    memset(&lodiServerAddr, 0, sizeof(lodiServerAddr));
+    lodiServerAddr.sin_family = AF_INET;
+    lodiServerAddr.sin_addr.s_addr = inet_addr(lodiServerIP);
+    lodiServerAddr.sin_port = htons(lodiServerPort);
+
+    // Connect to server
+    if (connect(tcpSock, (struct sockaddr *)&lodiServerAddr, sizeof(lodiServerAddr)) < 0) {
+        printf("(LodiClient) Error: Failed to connect to server\n");
+        close(tcpSock);
+        return 0;
+    }
+
+    // Create timestamp: time(NULL) % 500
+    unsigned long timestamp = (unsigned long)time(NULL) % 500;
+
+    // Fill PClientToLodiServer struct
+    PClientToLodiServer request;
+    memset(&request, 0, sizeof(request));
+    request.messageType = subscribe;
+    request.userID = userID;
+    request.timestamp = timestamp;
+    request.digitalSig = createDigitalSignature(timestamp, d, n);
+
+    printf("(LodiClient) Sending SUBSCRIBE request to server...\n");
+    if (!sendLodiRequest(tcpSock, &request)) {
+        printf("(LodiClient) Error: Failed to send request\n");
+        close(tcpSock);
+        return 0;
+    }
+
+    // Wait for the ack with a timeout, pushed posts may take any time after it
+    struct timeval tv = {10, 0};
+    setsockopt(tcpSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    LodiServerMessage response;
+    if (!recvLodiResponse(tcpSock, &response)) {
+        printf("(LodiClient) Error: Incomplete response from server\n");
+        close(tcpSock);
+        return 0;
+    }
+    if (response.messageType != ackSubscribe || strncmp(response.message, "Error", 5) == 0) {
+        printf("Error: Could not subscribe\n");
+        printf("Server message: %s\n", response.message);
+        close(tcpSock);
+        return 0;
+    }
+    tv.tv_sec = 0;
+    setsockopt(tcpSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    printf("Server response: %s\n", response.message);
+    printf("Waiting for new posts from your idols, press Enter to stop...\n");
+
+    int livePosts = 0;
+    for (;;) {
+        struct pollfd fds[2] = {{tcpSock, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) break;
+
+        if (fds[1].revents & POLLIN) {
+            char line[10];
+            if (fgets(line, sizeof(line), stdin) == NULL || strchr(line, '\n') != NULL) break;
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        // Each pushed post comes as its own one-post frame
+        FeedFrameHeader header;
+        if (!recvAll(tcpSock, &header, sizeof(header))) {
+            printf("(LodiClient) Live feed closed by the server\n");
+            break;
+        }
+        if (header.messageType != ackFeed || !(header.flags & FEED_FRAME_LIVE) ||
+            !(header.flags & FEED_FRAME_VARLEN) || header.postCount > FEED_FRAME_POSTS) {
+            printf("Error: Unexpected response from server\n");
+            break;
+        }
+        for (unsigned int i = 0; i < header.postCount; i++) {
+            PostRecordHeader record;
+            char text[MAX_POST_LENGTH + 1];
+            if (!recvAll(tcpSock, &record, sizeof(record)) || record.length > MAX_POST_LENGTH ||
+                !recvAll(tcpSock, text, record.length)) {
+                printf("(LodiClient) Error: Incomplete response from server\n");
+                close(tcpSock);
+                return 0;
+            }
+            text[record.length] = '\0';
+            printf("[new] #%u User %u: %s\n", record.postID, record.userID, text);
+            livePosts++;
+        }
+    }
+
+    close(tcpSock);
+    printf("\n--- Live feed stopped (%d new posts) ---\n", livePosts);
+    return 1;
+}
+
 // Logout
 int handleLogout(char *lodiServerIP, unsigned short lodiServerPort,
                  unsigned int userID, unsigned long d, unsigned long n) {
@@ -621,11 +1084,13 @@ int main(int argc, char *argv[]) {
         loginMsg.timestamp = timestamp;
         loginMsg.digitalSig = digitalSig;
         memset(loginMsg.message, 0, sizeof(loginMsg.message)); // Initialize message field
+        unsigned long traceID = newTraceID();
         
         printf("(LodiCLient) Sending login message\n");
         printf("(LodiCLient) User ID: %u\n", loginMsg.userID);
         printf("(LodiCLient) Timestamp: %lu\n", loginMsg.timestamp);
         printf("(LodiCLient) Digital Signature: %lu\n", loginMsg.digitalSig);
+        printf("(LodiCLient) Trace ID: %016lx\n", traceID);
         
         // Create a separate TCP socket for the login 
         int tcpSock;
@@ -637,16 +1102,10 @@ int main(int argc, char *argv[]) {
             DieWithError("(LodiCLient) connect() failed");
         }
 
-        // Send the login struct over TCP (ensure all bytes are sent) 
-        unsigned int loginMsgLen = sizeof(loginMsg);
-        unsigned int sent = 0;
-        while (sent < loginMsgLen) {
-            int s = send(tcpSock, ((char *)&loginMsg) + sent, loginMsgLen - sent, 0);
-            if (s <= 0) {
-                close(tcpSock);
-                DieWithError("(LodiCLient) send() failed");
-            }
-            sent += s;
+        // Send the login request over TCP (ensure all bytes are sent)
+        if (!sendTracedLodiRequest(tcpSock, &loginMsg, traceID)) {
+            close(tcpSock);
+            DieWithError("(LodiCLient) send() failed");
         }
 
         printf("(LodiCLient) Login message sent to Lodi Server\n");
@@ -656,25 +1115,14 @@ int main(int argc, char *argv[]) {
         struct timeval tv = {10, 0};
         setsockopt(tcpSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-        // Receive exactly the ACK struct size into buffer (handle partial reads)  
-        unsigned int expected = sizeof(LodiServerMessage);
-        unsigned int totalBytesRcvd = 0;
-        while (totalBytesRcvd < expected) {
-            int r = recv(tcpSock, buffer + totalBytesRcvd, (int)(expected - totalBytesRcvd), 0);
-            if (r < 0) {
-                close(tcpSock);
-                DieWithError("(LodiCLient) recv() failed");
-            }
-            if (r == 0) break; 
-            totalBytesRcvd += r;
-        }
-
-        if (totalBytesRcvd < expected) {
+        // Receive the ACK (handle partial reads)
+        LodiServerMessage loginAck;
+        if (!recvLodiResponse(tcpSock, &loginAck)) {
             close(tcpSock);
             DieWithError("(LodiCLient) Incomplete response from Lodi Server");
         }
 
-        LodiServerMessage *lodiResponse = (LodiServerMessage *)buffer;
+        LodiServerMessage *lodiResponse = &loginAck;
         if (lodiResponse->messageType == ackLogin) {
             printf("(LodiCLient) Login successful\n");
             printf("(LodiCLient) Confirmed User ID: %u\n", lodiResponse->userID);
@@ -706,10 +1154,19 @@ int main(int argc, char *argv[]) {
                         handleUnfollow(lodiServerIP, lodiServerPort, userID, d, n);
                         break;
                     case 5:
+                        handleLiveFeed(lodiServerIP, lodiServerPort, userID, d, n);
+                        break;
+                    case 6:
+                        handleSearch(lodiServerIP, lodiServerPort, userID, d, n);
+                        break;
+                    case 7:
+                        handleTrending(lodiServerIP, lodiServerPort, userID, d, n);
+                        break;
+                    case 8:
                         sessionActive = !handleLogout(lodiServerIP, lodiServerPort, userID, d, n);
                         break;
                     default:
-                        printf("Invalid choice. Please enter a number between 1-5.\n");
+                        printf("Invalid choice. Please enter a number between 1-8.\n");
                         break;
                 }
             }
@@ -0,0 +1,935 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include "server_log.h"
+#include "server_stats.h"
+#include "lz_codec.h"
+
+#define ROUTER_PORT 2926                // Clients connect here, as they would to a single lodi_server
+#define SHARD_DEFAULT_FIRST_PORT 2927   // Shard i listens on the first port + i unless -p says otherwise
+#define ROUTER_MAX_SHARDS 64
+#define ROUTER_DEFAULT_WORKERS 64       // Threads serving requests unless -w says otherwise
+#define ROUTER_QUEUE_SIZE 1024          // Accepted connections waiting for a worker
+#define MAXPENDING 1024                 // Listen backlog
+#define REQUEST_READ_TIMEOUT 1          // Seconds a client may take to send its request
+#define SHARD_TIMEOUT 20                // Seconds a shard may take to answer (logins wait for the TFA approval)
+#define RELAY_BATCH 64                  // Most subscription events handled per wake-up
+#define FEED_DEFAULT_LIMIT 20           // Same page limits as lodi_server
+#define FEED_MAX_LIMIT 100
+#define FEED_FRAME_POSTS 32
+#define FEED_FLAG_BATCHED 0x1
+#define FEED_FLAG_COMPRESSED 0x4
+#define FEED_FRAME_LAST 0x1
+#define FEED_FRAME_VARLEN 0x2
+#define FEED_FRAME_LIVE 0x4
+#define FEED_FRAME_COMPRESSED 0x10
+#define FEED_COMPRESS_MIN 512           // Same compression thresholds as lodi_server
+#define FEED_COMPRESS_SAVING 8
+#define TRENDING_DEFAULT_LIMIT 10
+#define TRENDING_TOP 32
+#define TRENDING_MAX_KEY 63
+#define MAX_POST_LENGTH 99
+#define LODI_WIRE_MAGIC 0x32444F4C      // "LOD2": first word of a variable-length frame
+#define REQUEST_FLAG_TRACED 0x80000000U // Header flag: an 8-byte trace ID follows the header, before the text
+
+void DieWithError(char *errorMessage)
+{
+	perror(errorMessage);
+	exit(1);
+}
+
+// Same wire structs as lodi_server. Old clients send the fixed-size request up
+// to message (LEGACY_REQUEST_SIZE), the fields after it come from variable-length
+// requests only.
+typedef struct {
+    enum{login,post,feed,follow,unfollow,logout,subscribe,search,trending,stats} messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    char message[100];
+    unsigned int feedLimit;
+    enum{cursorNone,cursorBeforeID,cursorAfterID,cursorBeforeTime,cursorAfterTime} cursorType;
+    unsigned int feedFlags;
+    unsigned long cursor;
+} PClientToLodiServer;
+#define LEGACY_REQUEST_SIZE ((offsetof(PClientToLodiServer, feedLimit) + 7) & ~(size_t)7)
+
+typedef struct {
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
+    unsigned int userID;
+    char message[100];
+} LodiServerMessage;
+
+typedef struct {
+    unsigned int messageType;
+    unsigned int userID;
+    unsigned int postCount;
+    unsigned int flags;
+} FeedFrameHeader;
+
+typedef struct {
+    unsigned int rawLength;
+    unsigned int compressedLength;
+} FeedCompressedHeader;
+
+typedef struct {
+    unsigned int postID;
+    unsigned int userID;
+    unsigned long postedAt;
+    char message[100];
+} FeedPostRecord;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    unsigned int feedLimit;
+    unsigned int cursorType;
+    unsigned long cursor;
+    unsigned int feedFlags;
+    unsigned int bodyLength;
+} LodiRequestHeader;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int messageType;
+    unsigned int userID;
+    unsigned int bodyLength;
+} LodiResponseHeader;
+
+typedef struct {
+    unsigned long postedAt;
+    unsigned int postID;
+    unsigned int userID;
+    unsigned int length;
+    unsigned int timestamp;
+} PostRecordHeader;
+
+// A client request, decoded and as received (forwarded to a shard unchanged)
+typedef struct {
+    PClientToLodiServer msg;
+    int varlen;                 // Client sent a LodiRequestHeader
+    char raw[sizeof(LodiRequestHeader) + sizeof(unsigned long) + sizeof(PClientToLodiServer)];
+    int rawLength;
+} RouterRequest;
+
+// A post gathered from a shard's feed or search page
+typedef struct {
+    PostRecordHeader header;    // postID is the router-wide ID
+    char text[MAX_POST_LENGTH];
+} RoutedPost;
+
+// Hashtag or term count summed over the shards' trending lists
+typedef struct {
+    int kind;                   // 0 hashtag, 1 term
+    char key[TRENDING_MAX_KEY + 1];
+    double weight;
+} TrendingCount;
+
+// A live feed relayed from every shard to one client. The relay thread owns it
+// once it is set up.
+typedef struct Subscription Subscription;
+typedef struct {
+    Subscription *subscription;
+    int shard;                  // -1 for the client connection
+} RelayEndpoint;
+
+struct Subscription {
+    unsigned int userID;
+    int clientSocket;
+    int varlen;
+    int shardSockets[ROUTER_MAX_SHARDS];
+    RelayEndpoint endpoints[ROUTER_MAX_SHARDS + 1];
+    int closed;
+    Subscription *nextClosed;
+};
+
+// Shards on localhost (-n, -p)
+unsigned int shardCount = 0;
+unsigned short firstShardPort = SHARD_DEFAULT_FIRST_PORT;
+
+// Connections waiting for a worker (guarded by queueLock)
+int connectionQueue[ROUTER_QUEUE_SIZE];
+int queueHead = 0;
+int queueCount = 0;
+pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+pthread_cond_t queueSpace = PTHREAD_COND_INITIALIZER;
+
+int relayEpoll = -1;
+
+// Dumped by a stats request
+#define REQUEST_TYPES 10
+const char *requestTypeNames[REQUEST_TYPES] = {"login", "post", "feed", "follow", "unfollow", "logout",
+                                               "subscribe", "search", "trending", "stats"};
+LatencyHistogram requestLatency[REQUEST_TYPES];
+LatencyHistogram shardPageLatency;      // One shard's part of a scattered feed or search
+unsigned long shardErrors = 0;
+unsigned long idCursorPages = 0;
+unsigned long relayedPosts = 0;
+unsigned long liveSubscriptions = 0;
+unsigned long compressedPages = 0;
+
+// Shard that owns a user: posts by the user and follows of the user (by
+// anyone) live there, so every shard can answer its part of a feed alone.
+// The hash mixes the ID so consecutive IDs spread out; changing it or the
+// shard count moves users to other shards.
+unsigned int shardOf(unsigned int userID) {
+    unsigned int h = userID;
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return h % shardCount;
+}
+
+// Router-wide post ID: shards number their posts from 0 each
+unsigned int routedPostID(unsigned int postID, int shard) {
+    return postID * shardCount + shard;
+}
+
+int recvAll(int sock, void *buf, unsigned int len) {
+    unsigned int totalBytesRcvd = 0;
+    while (totalBytesRcvd < len) {
+        int r = recv(sock, (char *)buf + totalBytesRcvd, (int)(len - totalBytesRcvd), 0);
+        if (r <= 0) return 0;
+        totalBytesRcvd += r;
+    }
+    return 1;
+}
+
+int sendAll(int sock, const void *buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t s = send(sock, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+        if (s <= 0) return 0;
+        sent += s;
+    }
+    return 1;
+}
+
+// Receive one request in either wire format, returns 0 on failure
+int receiveRouterRequest(int sock, RouterRequest *request) {
+    unsigned int firstWord;
+    if (!recvAll(sock, &firstWord, sizeof(firstWord))) return 0;
+    memcpy(request->raw, &firstWord, sizeof(firstWord));
+
+    if (firstWord != LODI_WIRE_MAGIC) {
+        request->varlen = 0;
+        request->rawLength = LEGACY_REQUEST_SIZE;
+        if (!recvAll(sock, request->raw + sizeof(firstWord), request->rawLength - sizeof(firstWord))) return 0;
+        memset(&request->msg, 0, sizeof(request->msg));
+        memcpy(&request->msg, request->raw, offsetof(PClientToLodiServer, feedLimit));
+        request->msg.message[sizeof(request->msg.message) - 1] = '\0';
+        return 1;
+    }
+
+    LodiRequestHeader header;
+    if (!recvAll(sock, request->raw + sizeof(firstWord), sizeof(header) - sizeof(firstWord))) return 0;
+    memcpy(&header, request->raw, sizeof(header));
+    if (header.bodyLength > MAX_POST_LENGTH) return 0;
+    unsigned int traceLength = (header.feedFlags & REQUEST_FLAG_TRACED) ? sizeof(unsigned long) : 0;
+    if (!recvAll(sock, request->raw + sizeof(header), traceLength + header.bodyLength)) return 0;
+    request->rawLength = sizeof(header) + traceLength + header.bodyLength;
+
+    request->varlen = 1;
+    memset(&request->msg, 0, sizeof(request->msg));
+    request->msg.messageType = header.messageType;
+    request->msg.userID = header.userID;
+    request->msg.recipientID = header.recipientID;
+    request->msg.timestamp = header.timestamp;
+    request->msg.digitalSig = header.digitalSig;
+    request->msg.feedLimit = header.feedLimit;
+    request->msg.cursorType = header.cursorType;
+    request->msg.feedFlags = header.feedFlags & ~REQUEST_FLAG_TRACED;
+    request->msg.cursor = header.cursor;
+    memcpy(request->msg.message, request->raw + sizeof(header) + traceLength, header.bodyLength);
+    request->msg.message[header.bodyLength] = '\0';
+    return 1;
+}
+
+// Send one response in the client's wire format
+int sendMessage(int clientSocket, int varlen, unsigned int messageType, unsigned int userID, const char *text) {
+    if (!varlen) {
+        LodiServerMessage response;
+        memset(&response, 0, sizeof(response));
+        response.messageType = messageType;
+        response.userID = userID;
+        snprintf(response.message, sizeof(response.message), "%s", text);
+        return sendAll(clientSocket, &response, sizeof(response));
+    }
+
+    char frame[sizeof(LodiResponseHeader) + MAX_POST_LENGTH];
+    LodiResponseHeader header = {LODI_WIRE_MAGIC, messageType, userID, strnlen(text, MAX_POST_LENGTH)};
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), text, header.bodyLength);
+    return sendAll(clientSocket, frame, sizeof(header) + header.bodyLength);
+}
+
+// Connect to a shard, returns the socket or -1
+int connectShard(int shard) {
+    int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in shardAddr;
+    memset(&shardAddr, 0, sizeof(shardAddr));
+    shardAddr.sin_family = AF_INET;
+    shardAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    shardAddr.sin_port = htons(firstShardPort + shard);
+    if (connect(sock, (struct sockaddr *)&shardAddr, sizeof(shardAddr)) < 0) {
+        LOG_WARN("(LodiRouter) Cannot reach shard %d on port %u\n", shard, firstShardPort + shard);
+        __atomic_fetch_add(&shardErrors, 1, __ATOMIC_RELAXED);
+        close(sock);
+        return -1;
+    }
+
+    struct timeval tv = {SHARD_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return sock;
+}
+
+// Send a variable-length request built from msg to a shard
+int sendShardRequest(int sock, PClientToLodiServer *msg, unsigned int feedLimit) {
+    char frame[sizeof(LodiRequestHeader) + MAX_POST_LENGTH];
+    LodiRequestHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = LODI_WIRE_MAGIC;
+    header.messageType = msg->messageType;
+    header.userID = msg->userID;
+    header.timestamp = msg->timestamp;
+    header.digitalSig = msg->digitalSig;
+    header.feedLimit = feedLimit;
+    header.cursorType = msg->cursorType;
+    header.cursor = msg->cursor;
+    header.bodyLength = strnlen(msg->message, MAX_POST_LENGTH);
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), msg->message, header.bodyLength);
+    return sendAll(sock, frame, sizeof(header) + header.bodyLength);
+}
+
+// Pass a request to the shard that owns it unchanged and copy the answer back
+// until the shard closes the connection
+int forwardRequest(RouterRequest *request, int shard, int clientSocket) {
+    int sock = connectShard(shard);
+    if (sock < 0)
+        return sendMessage(clientSocket, request->varlen, ackBusy, request->msg.userID,
+                           "Server unavailable, try again later");
+
+    int ok = sendAll(sock, request->raw, request->rawLength);
+    char buffer[4096];
+    for (;;) {
+        int r = recv(sock, buffer, sizeof(buffer), 0);
+        if (r <= 0) break;
+        if (!sendAll(clientSocket, buffer, r)) {
+            ok = 0;
+            break;
+        }
+    }
+    close(sock);
+    return ok;
+}
+
+// Read a shard's page of variable-length frames into posts (router-wide IDs).
+// Returns the posts read, -1 on failure, -2 if the shard turned the request away.
+int readShardPage(int sock, int shard, RoutedPost *posts, int max) {
+    int count = 0;
+    for (;;) {
+        FeedFrameHeader frame;
+        if (!recvAll(sock, &frame, sizeof(frame))) return -1;
+        if (frame.messageType == ackBusy) return -2;
+        if (!(frame.flags & FEED_FRAME_VARLEN) || frame.postCount > FEED_FRAME_POSTS) return -1;
+
+        for (unsigned int i = 0; i < frame.postCount; i++) {
+            PostRecordHeader header;
+            char text[MAX_POST_LENGTH];
+            if (!recvAll(sock, &header, sizeof(header)) || header.length > MAX_POST_LENGTH ||
+                !recvAll(sock, text, header.length))
+                return -1;
+            if (count == max) continue;
+            header.postID = routedPostID(header.postID, shard);
+            posts[count].header = header;
+            memcpy(posts[count].text, text, header.length);
+            count++;
+        }
+        if (frame.flags & FEED_FRAME_LAST) return count;
+    }
+}
+
+// Newest first
+int compareRoutedPosts(const void *a, const void *b) {
+    unsigned long x = ((const RoutedPost *)a)->header.postedAt;
+    unsigned long y = ((const RoutedPost *)b)->header.postedAt;
+    return (x < y) - (x > y);
+}
+
+// Send a merged page in the client's format: variable-length or fixed-size
+// frames, or one message per post and END_OF_FEED for old clients. A page typed
+// ackBusy is the empty answer to a request that was turned away.
+int sendRoutedPage(int clientSocket, RouterRequest *request, unsigned int messageType,
+                   RoutedPost *posts, int count) {
+    PClientToLodiServer *msg = &request->msg;
+    if (!request->varlen && !(msg->feedFlags & FEED_FLAG_BATCHED)) {
+        for (int i = 0; i < count; i++) {
+            char text[sizeof(((LodiServerMessage *)0)->message)];
+            snprintf(text, sizeof(text), "#%u User %u: %.*s", posts[i].header.postID, posts[i].header.userID,
+                     (int)posts[i].header.length, posts[i].text);
+            if (!sendMessage(clientSocket, 0, messageType, msg->userID, text)) return 0;
+        }
+        return sendMessage(clientSocket, 0, messageType, msg->userID,
+                           messageType == ackBusy ? "Server busy, try again later" : "END_OF_FEED");
+    }
+
+    // The whole page is built first so it can go out compressed
+    char page[(FEED_MAX_LIMIT / FEED_FRAME_POSTS + 1) * sizeof(FeedFrameHeader) + FEED_MAX_LIMIT * sizeof(FeedPostRecord)];
+    unsigned int frameFlags = request->varlen ? FEED_FRAME_VARLEN : 0;
+    size_t length = 0;
+    int first = 0;
+    do {
+        int frameCount = count - first < FEED_FRAME_POSTS ? count - first : FEED_FRAME_POSTS;
+        FeedFrameHeader header = {messageType, msg->userID, frameCount,
+                                  (first + frameCount == count ? FEED_FRAME_LAST : 0) | frameFlags};
+        memcpy(page + length, &header, sizeof(header));
+        length += sizeof(header);
+
+        for (int i = first; i < first + frameCount; i++) {
+            if (request->varlen) {
+                memcpy(page + length, &posts[i].header, sizeof(PostRecordHeader));
+                memcpy(page + length + sizeof(PostRecordHeader), posts[i].text, posts[i].header.length);
+                length += sizeof(PostRecordHeader) + posts[i].header.length;
+            } else {
+                FeedPostRecord record;
+                memset(&record, 0, sizeof(record));
+                record.postID = posts[i].header.postID;
+                record.userID = posts[i].header.userID;
+                record.postedAt = posts[i].header.postedAt;
+                memcpy(record.message, posts[i].text, posts[i].header.length);
+                memcpy(page + length, &record, sizeof(record));
+                length += sizeof(record);
+            }
+        }
+        first += frameCount;
+    } while (first < count);
+
+    // Like lodi_server, compress only pages that are large enough and shrink enough
+    if ((msg->feedFlags & FEED_FLAG_COMPRESSED) && length >= FEED_COMPRESS_MIN) {
+        char packed[sizeof(FeedFrameHeader) + sizeof(FeedCompressedHeader) + sizeof(page)];
+        size_t prefix = sizeof(FeedFrameHeader) + sizeof(FeedCompressedHeader);
+        int compressed = lzCompress(page, length, packed + prefix, length - length / FEED_COMPRESS_SAVING);
+        if (compressed > 0) {
+            FeedFrameHeader header = {messageType, msg->userID, count,
+                                      FEED_FRAME_LAST | FEED_FRAME_COMPRESSED | frameFlags};
+            FeedCompressedHeader sizes = {length, compressed};
+            memcpy(packed, &header, sizeof(header));
+            memcpy(packed + sizeof(header), &sizes, sizeof(sizes));
+            __atomic_fetch_add(&compressedPages, 1, __ATOMIC_RELAXED);
+            return sendAll(clientSocket, packed, prefix + compressed);
+        }
+    }
+    return sendAll(clientSocket, page, length);
+}
+
+// Feed or search: ask every shard for the page, merge the answers by receive
+// time and send the newest (or, after a cursor, the oldest) limit of them
+int scatterFeed(RouterRequest *request, int clientSocket) {
+    PClientToLodiServer *msg = &request->msg;
+    unsigned int messageType = msg->messageType == search ? ackSearch : ackFeed;
+    int limit = msg->feedLimit;
+    if (limit <= 0) limit = FEED_DEFAULT_LIMIT;
+    if (limit > FEED_MAX_LIMIT) limit = FEED_MAX_LIMIT;
+
+    // Post IDs are only ordered within a shard, pages across shards go by time
+    if (msg->cursorType == cursorBeforeID || msg->cursorType == cursorAfterID) {
+        LOG_WARN("(LodiRouter) User %u paged by post ID, only time cursors work across shards\n", msg->userID);
+        __atomic_fetch_add(&idCursorPages, 1, __ATOMIC_RELAXED);
+        return sendRoutedPage(clientSocket, request, messageType, NULL, 0);
+    }
+    int after = msg->messageType == feed && msg->cursorType == cursorAfterTime;
+
+    RoutedPost *posts = malloc(sizeof(RoutedPost) * limit * shardCount);
+    int sockets[ROUTER_MAX_SHARDS];
+    if (posts == NULL) return 0;
+
+    // Send every request before reading any answer so the shards work in parallel
+    for (unsigned int s = 0; s < shardCount; s++) {
+        sockets[s] = connectShard(s);
+        if (sockets[s] >= 0 && !sendShardRequest(sockets[s], msg, limit)) {
+            close(sockets[s]);
+            sockets[s] = -1;
+        }
+    }
+
+    int count = 0;
+    int failed = 0;
+    for (unsigned int s = 0; s < shardCount; s++) {
+        if (sockets[s] < 0) {
+            failed = 1;
+            continue;
+        }
+        unsigned long start = statsNow();
+        int read = readShardPage(sockets[s], s, posts + count, limit);
+        histogramRecordSince(&shardPageLatency, start);
+        close(sockets[s]);
+        if (read < 0) {
+            if (read == -1) {
+                LOG_WARN("(LodiRouter) Incomplete page from shard %u\n", s);
+                __atomic_fetch_add(&shardErrors, 1, __ATOMIC_RELAXED);
+            }
+            failed = 1;
+            continue;
+        }
+        count += read;
+    }
+
+    // A page with a shard missing would silently skip posts, so none is sent
+    int ok;
+    if (failed) {
+        ok = sendRoutedPage(clientSocket, request, ackBusy, NULL, 0);
+    } else {
+        qsort(posts, count, sizeof(RoutedPost), compareRoutedPosts);
+        int first = after && count > limit ? count - limit : 0;
+        int pageLen = count - first < limit ? count - first : limit;
+        LOG_DEBUG("(LodiRouter) %s page for user %u: %d posts from %u shards\n",
+                  msg->messageType == search ? "Search" : "Feed", msg->userID, pageLen, shardCount);
+        ok = sendRoutedPage(clientSocket, request, messageType, posts + first, pageLen);
+    }
+    free(posts);
+    return ok;
+}
+
+// Heaviest first
+int compareTrendingCounts(const void *a, const void *b) {
+    double x = ((const TrendingCount *)a)->weight;
+    double y = ((const TrendingCount *)b)->weight;
+    return (x < y) - (x > y);
+}
+
+// Trending: every shard counts its own posts, so the router adds up the counts
+// of each shard's top list and ranks the sums
+int scatterTrending(RouterRequest *request, int clientSocket) {
+    PClientToLodiServer *msg = &request->msg;
+    int limit = msg->feedLimit;
+    if (limit <= 0) limit = TRENDING_DEFAULT_LIMIT;
+    if (limit > TRENDING_TOP) limit = TRENDING_TOP;
+
+    int sockets[ROUTER_MAX_SHARDS];
+    for (unsigned int s = 0; s < shardCount; s++) {
+        sockets[s] = connectShard(s);
+        if (sockets[s] >= 0 && !sendShardRequest(sockets[s], msg, TRENDING_TOP)) {
+            close(sockets[s]);
+            sockets[s] = -1;
+        }
+    }
+
+    TrendingCount *counts = malloc(sizeof(TrendingCount) * 2 * TRENDING_TOP * shardCount);
+    int countLen = 0;
+    int failed = counts == NULL;
+    for (unsigned int s = 0; s < shardCount; s++) {
+        if (sockets[s] < 0 || failed) {
+            failed = 1;
+            if (sockets[s] >= 0) close(sockets[s]);
+            continue;
+        }
+        for (;;) {
+            LodiResponseHeader header;
+            char line[MAX_POST_LENGTH + 1];
+            if (!recvAll(sockets[s], &header, sizeof(header)) || header.bodyLength > MAX_POST_LENGTH ||
+                !recvAll(sockets[s], line, header.bodyLength) || header.messageType != ackTrending) {
+                failed = 1;
+                break;
+            }
+            line[header.bodyLength] = '\0';
+            if (strcmp(line, "END_OF_TRENDING") == 0) break;
+
+            // "<hashtag|term> <rank>. <key> (~<count> posts)"
+            char kind[8];
+            char key[TRENDING_MAX_KEY + 1];
+            double weight;
+            if (sscanf(line, "%7s %*d. %63s (~%lf posts)", kind, key, &weight) != 3) continue;
+            int k = strcmp(kind, "hashtag") == 0 ? 0 : 1;
+            int i = 0;
+            while (i < countLen && (counts[i].kind != k || strcmp(counts[i].key, key) != 0)) i++;
+            if (i == countLen) {
+                if (countLen == 2 * TRENDING_TOP * (int)shardCount) continue;
+                counts[i].kind = k;
+                strcpy(counts[i].key, key);
+                counts[i].weight = 0;
+                countLen++;
+            }
+            counts[i].weight += weight;
+        }
+        close(sockets[s]);
+    }
+
+    if (failed) {
+        free(counts);
+        return sendMessage(clientSocket, request->varlen, ackBusy, msg->userID, "Server busy, try again later");
+    }
+
+    qsort(counts, countLen, sizeof(TrendingCount), compareTrendingCounts);
+    for (int k = 0; k < 2; k++) {
+        int rank = 0;
+        for (int i = 0; i < countLen && rank < limit; i++) {
+            if (counts[i].kind != k) continue;
+            char line[sizeof(((LodiServerMessage *)0)->message)];
+            snprintf(line, sizeof(line), "%s %d. %s (~%.1f posts)", k == 0 ? "hashtag" : "term", ++rank,
+                     counts[i].key, counts[i].weight);
+            if (!sendMessage(clientSocket, request->varlen, ackTrending, msg->userID, line)) {
+                free(counts);
+                return 0;
+            }
+        }
+    }
+    free(counts);
+    return sendMessage(clientSocket, request->varlen, ackTrending, msg->userID, "END_OF_TRENDING");
+}
+
+// Logout ends the user's live feeds, which are held open on every shard
+int broadcastLogout(RouterRequest *request, int clientSocket) {
+    unsigned int home = shardOf(request->msg.userID);
+    for (unsigned int s = 0; s < shardCount; s++) {
+        if (s == home) continue;
+        int sock = connectShard(s);
+        if (sock < 0) continue;
+        if (sendShardRequest(sock, &request->msg, 0)) {
+            char buffer[256];
+            while (recv(sock, buffer, sizeof(buffer), 0) > 0)
+                ;
+        }
+        close(sock);
+    }
+    return forwardRequest(request, home, clientSocket);
+}
+
+// Close every connection of a subscription; the relay thread frees it later
+void closeSubscription(Subscription *subscription, const char *reason) {
+    if (subscription->closed) return;
+    subscription->closed = 1;
+    LOG_INFO("(LodiRouter) Ending live feed of user %u (%s)\n", subscription->userID, reason);
+    for (unsigned int s = 0; s < shardCount; s++) {
+        if (subscription->shardSockets[s] < 0) continue;
+        epoll_ctl(relayEpoll, EPOLL_CTL_DEL, subscription->shardSockets[s], NULL);
+        close(subscription->shardSockets[s]);
+    }
+    epoll_ctl(relayEpoll, EPOLL_CTL_DEL, subscription->clientSocket, NULL);
+    close(subscription->clientSocket);
+    __atomic_fetch_sub(&liveSubscriptions, 1, __ATOMIC_RELAXED);
+}
+
+// Move one pushed frame from a shard to the subscriber. Sends never block: like
+// lodi_server, a subscriber that cannot keep up is dropped.
+int relayFrame(Subscription *subscription, int shard) {
+    int sock = subscription->shardSockets[shard];
+    char frame[sizeof(FeedFrameHeader) + FEED_FRAME_POSTS * (sizeof(PostRecordHeader) + MAX_POST_LENGTH)];
+    FeedFrameHeader header;
+    if (!recvAll(sock, &header, sizeof(header)) || !(header.flags & FEED_FRAME_VARLEN) ||
+        header.postCount > FEED_FRAME_POSTS)
+        return 0;
+
+    header.userID = subscription->userID;
+    size_t length = sizeof(header);
+    memcpy(frame, &header, sizeof(header));
+    for (unsigned int i = 0; i < header.postCount; i++) {
+        PostRecordHeader *record = (PostRecordHeader *)(frame + length);
+        if (!recvAll(sock, record, sizeof(*record)) || record->length > MAX_POST_LENGTH ||
+            !recvAll(sock, record + 1, record->length))
+            return 0;
+        record->postID = routedPostID(record->postID, shard);
+        length += sizeof(*record) + record->length;
+
+        if (!subscription->varlen) {
+            LodiServerMessage legacy;
+            legacy.messageType = ackFeed;
+            legacy.userID = subscription->userID;
+            snprintf(legacy.message, sizeof(legacy.message), "#%u User %u: %.*s", record->postID,
+                     record->userID, (int)record->length, (char *)(record + 1));
+            if (send(subscription->clientSocket, &legacy, sizeof(legacy), MSG_DONTWAIT | MSG_NOSIGNAL) !=
+                sizeof(legacy))
+                return 0;
+        }
+    }
+    __atomic_fetch_add(&relayedPosts, header.postCount, __ATOMIC_RELAXED);
+    if (!subscription->varlen) return 1;
+    return send(subscription->clientSocket, frame, length, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)length;
+}
+
+// Relay thread: pushes from the shards go to their subscribers as they come in
+void *relayWorker(void *arg) {
+    for (;;) {
+        struct epoll_event events[RELAY_BATCH];
+        int ready = epoll_wait(relayEpoll, events, RELAY_BATCH, -1);
+        if (ready < 0) {
+            if (errno != EINTR) perror("(LodiRouter) epoll_wait() failed");
+            continue;
+        }
+
+        Subscription *closedList = NULL;
+        for (int i = 0; i < ready; i++) {
+            RelayEndpoint *endpoint = events[i].data.ptr;
+            Subscription *subscription = endpoint->subscription;
+            if (subscription->closed) continue;
+
+            const char *reason = NULL;
+            if (endpoint->shard < 0)
+                reason = "client closed the connection";
+            else if (!relayFrame(subscription, endpoint->shard))
+                reason = "shard ended it or client too slow";
+            if (reason != NULL) {
+                closeSubscription(subscription, reason);
+                subscription->nextClosed = closedList;
+                closedList = subscription;
+            }
+        }
+
+        // Freed only now, later events of this batch may still point at them
+        while (closedList != NULL) {
+            Subscription *next = closedList->nextClosed;
+            free(closedList);
+            closedList = next;
+        }
+    }
+    return NULL;
+}
+
+// Subscribe: hold a live feed open on every shard (each pushes posts by its own
+// authors) and hand the connections to the relay thread
+int startSubscription(RouterRequest *request, int clientSocket) {
+    PClientToLodiServer *msg = &request->msg;
+    Subscription *subscription = calloc(1, sizeof(Subscription));
+    if (subscription == NULL) return 0;
+    subscription->userID = msg->userID;
+    subscription->clientSocket = clientSocket;
+    subscription->varlen = request->varlen;
+
+    // Every shard must accept, the home shard's ack goes to the client
+    char ack[MAX_POST_LENGTH + 1] = "Error: Server unavailable, try again later";
+    unsigned int ackType = ackBusy;
+    int ok = 1;
+    for (unsigned int s = 0; s < shardCount; s++) {
+        int sock = connectShard(s);
+        subscription->shardSockets[s] = sock;
+        LodiResponseHeader header;
+        char text[MAX_POST_LENGTH + 1];
+        if (sock < 0 || !sendShardRequest(sock, msg, 0) || !recvAll(sock, &header, sizeof(header)) ||
+            header.bodyLength > MAX_POST_LENGTH || !recvAll(sock, text, header.bodyLength)) {
+            ok = 0;
+            continue;
+        }
+        text[header.bodyLength] = '\0';
+        if (header.messageType != ackSubscribe || strncmp(text, "Error", 5) == 0) {
+            ok = 0;
+            ackType = header.messageType;
+            strcpy(ack, text);
+        } else if (ok && s == shardOf(msg->userID)) {
+            ackType = header.messageType;
+            strcpy(ack, text);
+        }
+    }
+
+    if (ok && !sendMessage(clientSocket, request->varlen, ackType, msg->userID, ack)) ok = 0;
+    if (!ok) {
+        if (ackType != ackSubscribe)
+            sendMessage(clientSocket, request->varlen, ackType, msg->userID, ack);
+        for (unsigned int s = 0; s < shardCount; s++)
+            if (subscription->shardSockets[s] >= 0) close(subscription->shardSockets[s]);
+        free(subscription);
+        return 0;
+    }
+
+    // Pushes are read whole once epoll reports them, a stalled shard must not hold up the relay
+    struct timeval tv = {REQUEST_READ_TIMEOUT, 0};
+    __atomic_fetch_add(&liveSubscriptions, 1, __ATOMIC_RELAXED);
+    for (unsigned int s = 0; s <= shardCount; s++) {
+        int sock = s < shardCount ? subscription->shardSockets[s] : clientSocket;
+        subscription->endpoints[s].subscription = subscription;
+        subscription->endpoints[s].shard = s < shardCount ? (int)s : -1;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        struct epoll_event event = {EPOLLIN, {.ptr = &subscription->endpoints[s]}};
+        epoll_ctl(relayEpoll, EPOLL_CTL_ADD, sock, &event);
+    }
+    LOG_INFO("(LodiRouter) User %u subscribed on %u shards\n", msg->userID, shardCount);
+    return 1;
+}
+
+// Serve one client connection, returns 1 if it was handed to the relay thread
+int serveConnection(int clientSocket) {
+    struct timeval tv = {REQUEST_READ_TIMEOUT, 0};
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    RouterRequest request;
+    if (!receiveRouterRequest(clientSocket, &request)) {
+        LOG_INFO("(LodiRouter) Incomplete or invalid request received\n");
+        return 0;
+    }
+    PClientToLodiServer *msg = &request.msg;
+    LOG_DEBUG("(LodiRouter) Request type %d from user %u\n", msg->messageType, msg->userID);
+
+    unsigned long start = statsNow();
+    int kept = 0;
+    switch (msg->messageType) {
+        case login:
+        case post:
+            forwardRequest(&request, shardOf(msg->userID), clientSocket);
+            break;
+        case follow:
+        case unfollow:
+            // Follows are kept with the followed author, next to their posts
+            forwardRequest(&request, shardOf(msg->recipientID), clientSocket);
+            break;
+        case logout:
+            broadcastLogout(&request, clientSocket);
+            break;
+        case feed:
+        case search:
+            scatterFeed(&request, clientSocket);
+            break;
+        case trending:
+            scatterTrending(&request, clientSocket);
+            break;
+        case subscribe:
+            kept = startSubscription(&request, clientSocket);
+            break;
+        case stats: {
+            // Only answered for clients on this host
+            char dump[STATS_DUMP_MAX];
+            if (statsPeerIsLocal(clientSocket))
+                sendAll(clientSocket, dump, statsDump(dump, sizeof(dump)));
+            else
+                LOG_WARN("(LodiRouter) Ignoring a stats request from another host\n");
+            break;
+        }
+        default:
+            LOG_ERROR("(LodiRouter) Error: Unknown message type %d\n", msg->messageType);
+            sendMessage(clientSocket, request.varlen, ackLogin, msg->userID, "Error: Unknown message type");
+            break;
+    }
+    if ((unsigned int)msg->messageType < REQUEST_TYPES)
+        histogramRecordSince(&requestLatency[msg->messageType], start);
+    return kept;
+}
+
+void *requestWorker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&queueLock);
+        while (queueCount == 0)
+            pthread_cond_wait(&queueReady, &queueLock);
+        int clientSocket = connectionQueue[queueHead];
+        queueHead = (queueHead + 1) % ROUTER_QUEUE_SIZE;
+        queueCount--;
+        pthread_cond_signal(&queueSpace);
+        pthread_mutex_unlock(&queueLock);
+
+        if (!serveConnection(clientSocket))
+            close(clientSocket);
+    }
+    return NULL;
+}
+
+void printUsage(char *program) {
+    fprintf(stderr, "Usage: %s -n <shards> [options]\n", program);
+    fprintf(stderr, "  -n <shards>     lodi_server shards on localhost (1 to %d)\n", ROUTER_MAX_SHARDS);
+    fprintf(stderr, "  -p <port>       port of shard 0, shard i listens on port + i (default %d)\n",
+            SHARD_DEFAULT_FIRST_PORT);
+    fprintf(stderr, "  -w <threads>    threads serving requests (default %d)\n", ROUTER_DEFAULT_WORKERS);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int workers = ROUTER_DEFAULT_WORKERS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            shardCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            int port = atoi(argv[++i]);
+            if (port < 1 || port > 65535)
+                printUsage(argv[0]);
+            firstShardPort = port;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers < 1)
+                printUsage(argv[0]);
+        } else {
+            printUsage(argv[0]);
+        }
+    }
+    if (shardCount < 1 || shardCount > ROUTER_MAX_SHARDS || firstShardPort + shardCount - 1 > 65535)
+        printUsage(argv[0]);
+
+    logStart();
+    signal(SIGPIPE, SIG_IGN);
+    statsStart("router");
+    for (int i = 0; i < REQUEST_TYPES; i++)
+        statsRegisterHistogram(requestTypeNames[i], &requestLatency[i]);
+    statsRegisterHistogram("shard.page", &shardPageLatency);
+    statsRegisterCounter("shard.errors", &shardErrors);
+    statsRegisterCounter("feed.idCursorPages", &idCursorPages);
+    statsRegisterCounter("live.subscriptions", &liveSubscriptions);
+    statsRegisterCounter("live.relayedPosts", &relayedPosts);
+    statsRegisterCounter("feed.compressedPages", &compressedPages);
+
+    LOG_INFO("(LodiRouter) Lodi Router listening on port %d\n", ROUTER_PORT);
+    LOG_INFO("(LodiRouter) %u shard(s) on localhost ports %u-%u, %d worker threads\n",
+             shardCount, firstShardPort, firstShardPort + shardCount - 1, workers);
+
+    int listenSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenSocket < 0)
+        DieWithError("(LodiRouter) socket() failed");
+    int reuse = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in routerAddr;
+    memset(&routerAddr, 0, sizeof(routerAddr));
+    routerAddr.sin_family = AF_INET;
+    routerAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    routerAddr.sin_port = htons(ROUTER_PORT);
+    if (bind(listenSocket, (struct sockaddr *)&routerAddr, sizeof(routerAddr)) < 0)
+        DieWithError("(LodiRouter) bind() failed");
+    if (listen(listenSocket, MAXPENDING) < 0)
+        DieWithError("(LodiRouter) listen() failed");
+
+    relayEpoll = epoll_create1(0);
+    if (relayEpoll < 0)
+        DieWithError("(LodiRouter) epoll_create1() failed");
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, relayWorker, NULL) != 0)
+        DieWithError("(LodiRouter) pthread_create() failed");
+    pthread_detach(thread);
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&thread, NULL, requestWorker, NULL) != 0)
+            DieWithError("(LodiRouter) pthread_create() failed");
+        pthread_detach(thread);
+    }
+
+    for (;;) {
+        int clientSocket = accept(listenSocket, NULL, NULL);
+        if (clientSocket < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("(LodiRouter) accept() failed");
+            if (errno == EMFILE || errno == ENFILE)
+                usleep(100000);
+            continue;
+        }
+
+        // Wait for a free slot rather than drop the connection
+        pthread_mutex_lock(&queueLock);
+        while (queueCount == ROUTER_QUEUE_SIZE)
+            pthread_cond_wait(&queueSpace, &queueLock);
+        connectionQueue[(queueHead + queueCount) % ROUTER_QUEUE_SIZE] = clientSocket;
+        queueCount++;
+        pthread_cond_signal(&queueReady);
+        pthread_mutex_unlock(&queueLock);
+    }
+}
@@ -1,16 +1,101 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+#include <ctype.h>
+#include <math.h>
+#include "server_log.h"
+#include "server_stats.h"
+#include "server_trace.h"
+#include "lz_codec.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define BUFFER_SIZE 1024
+#define LODI_DEFAULT_PORT 2926 // TCP and UDP port unless -P says otherwise (shards behind lodi_router use others)
 #define MAX_TIMESTAMP_DIFF 30  // 30 seconds tolerance for timestamp
-#define MAXPENDING 5
-#define MAX_POSTS 1000  // Maximum number of posts to store
-#define MAX_USERS 100   // Maximum number of users
+#define MAXPENDING 1024        // Listen backlog unless -l says otherwise (capped by net.core.somaxconn)
+#define ACCEPT_BATCH 64        // Most connections accepted per wake-up
+#define EPOLL_BATCH 64         // Most readiness events taken per wake-up
+#define REQUEST_READ_TIMEOUT 1 // Seconds a client may take to finish sending a started request (-i blocking)
+#define REQUEST_MAX_SIZE 256   // Larger than a request in either wire format
+#define CONNECTION_IDLE_NANOS 10000000000UL  // Connections that send nothing for 10 s are closed
+#define ACCEPT_PAUSE_NANOS 100000000UL       // Accepting stops this long when out of descriptors
+#define URING_ENTRIES 256      // io_uring submission queue entries
+#define URING_BUFFERS 1024     // Receive buffers registered with the ring (power of two)
+#define URING_BUFFER_SIZE REQUEST_MAX_SIZE
+#define URING_BUFFER_GROUP 1
+#define URING_ACCEPT 1         // user_data of the multishot accept (connections use their address)
+#define URING_CANCEL 2         // user_data of cancellations, their completions are ignored
+#define URING_RECEIVED 1       // WaitingConnection.finished: request in (or connection failed)
+#define URING_EXPIRED 2        // WaitingConnection.finished: closed for sending nothing
+#define ADMISSION_DEFAULT_QUEUE 1024  // Requests each priority class can queue unless -a says otherwise
+#define ADMISSION_CHEAP_WEIGHT 4      // Cheap requests served for each expensive one when both wait
+#define ADMISSION_REPORT_INTERVAL 100 // Requests between admission queue reports
+#define LOGIN_WORKERS 8               // Logins that can wait on the PKE and TFA servers at once
+#define LOGIN_QUEUE_SIZE 256          // Logins waiting for a worker before new ones get ackBusy
+#define LOGIN_REPLY_TIMEOUT 20        // Seconds to wait for a PKE or TFA reply (TFA waits 15 s for the user)
+#define POST_SEGMENT_SIZE (4 * 1024 * 1024)  // Bytes per memory-mapped post log segment
+#define FEED_DEFAULT_LIMIT 20  // Posts per feed page when the client does not ask for a limit
+#define FEED_MAX_LIMIT 100     // Largest feed page a client can ask for
+#define FEED_FRAME_POSTS 32    // Most posts packed into one batched feed frame
+#define FEED_FLAG_BATCHED 0x1  // Request flag: answer with batched feed frames
+#define FEED_FLAG_LOG_LAYOUT 0x2  // Request flag: variable-length records exactly as stored in the post log
+#define FEED_FLAG_COMPRESSED 0x4  // Request flag: the client takes compressed pages
+#define FEED_FRAME_LAST 0x1    // Frame flag: last frame of this feed page
+#define FEED_FRAME_VARLEN 0x2  // Frame flag: records are PostRecordHeader + text
+#define FEED_FRAME_LIVE 0x4    // Frame flag: a new post pushed to a live feed subscriber
+#define FEED_FRAME_PADDED 0x8  // Frame flag: each record is followed by its checksum and padded to 8 bytes, as in the post log
+#define FEED_FRAME_COMPRESSED 0x10  // Frame flag: a FeedCompressedHeader and the page's frames, LZ compressed
+#define FEED_COMPRESS_MIN 512  // Smallest serialized page worth compressing
+#define FEED_COMPRESS_SAVING 8  // A compressed page must be at least 1/8 smaller than the original
+#define MAX_SUBSCRIBERS 1024   // Most connections held open for live feed pushes
+#define SEARCH_MAX_TOKEN 31    // Longest search token kept, longer words are cut
+#define SEARCH_MAX_TOKENS 50   // Most tokens taken from one post or query
+#define SEARCH_BLOCK_IDS 128   // Post IDs per posting list block
+#define TRENDING_WINDOWS 2     // Sliding windows counted (5 minutes, 1 hour)
+#define TRENDING_DEPTH 4       // Hash rows of each count-min sketch
+#define TRENDING_WIDTH 4096    // Counters per sketch row (power of two)
+#define TRENDING_TOP 32        // Hashtags and terms tracked per window
+#define TRENDING_DEFAULT_LIMIT 10   // Entries of each kind returned unless feedLimit says otherwise
+#define TRENDING_RESCALE 20.0       // Window lifetimes after which weights are scaled back down
+#define TRENDING_REPLAY_LIFETIMES 5 // Longest-window lifetimes of posts recounted at startup
+#define MAX_POST_LENGTH 99     // Longest post text in bytes
+#define LODI_WIRE_MAGIC 0x32444F4C  // "LOD2": first word of a variable-length frame
+#define REQUEST_FLAG_TRACED 0x80000000U  // Header flag: an 8-byte trace ID follows the header, before the text
+#define COMMIT_QUEUE_SIZE 1024      // Most post acks waiting for a group commit
+#define COMMIT_DEFAULT_BATCH 32     // Posts made durable by one msync() unless -b says otherwise
+#define COMMIT_DEFAULT_WINDOW 1000  // Microseconds a post may wait for its batch to fill
+#define FOLLOW_LOG_MAGIC 0x474F4C46       // "FLOG": mixed into every follow log record check
+#define FOLLOW_SNAPSHOT_MAGIC 0x31474C46  // "FLG1": first word of a follow graph snapshot
+#define FOLLOW_SNAPSHOT_INTERVAL 10000    // Fewest follow log records written before a new snapshot
+#define FOLLOW_SNAPSHOT_RETRY 1           // Seconds before a snapshot that could not be written is retried
+#define SCAN_CHUNK_POSTS 4096             // Posts handed to a scan kernel at a time
+#define SCAN_MAX_AUTHOR (1U << 26)        // Largest author ID the scan bitmap covers (8 MB)
+#define SCAN_WAVE_CHUNKS 8                // Most chunks per scan thread in one wave
+#define SCAN_MAX_THREADS 64               // Most threads in the scan pool
+#define FEED_CACHE_DEFAULT_MB 16          // Memory for cached feed pages unless -c says otherwise
+#define RATE_DEFAULT_USER 20              // Request tokens per second of each user unless -r says otherwise
+#define RATE_DEFAULT_GLOBAL 5000          // Request tokens per second of the server unless -g says otherwise
+#define RATE_BURST_SECONDS 2              // Seconds of tokens a bucket can save up
+#define RATE_DEFAULT_SHED_DEPTH 256       // Queued work above which requests are shed unless -q says otherwise
 
 void DieWithError(char *errorMessage)
 {
@@ -21,21 +106,89 @@ void DieWithError(char *errorMessage)
 
 // TCP Connection client to server message
 typedef struct {
-    enum{login,post,feed,follow,unfollow,logout} messageType;
+    enum{login,post,feed,follow,unfollow,logout,subscribe,search,trending,stats} messageType;
     unsigned int userID;
     unsigned int recipientID;
     unsigned long timestamp;
     unsigned long digitalSig;
     char message[100];
+    // Only carried by variable-length requests, 0 (the defaults) for fixed-size ones
+    unsigned int feedLimit;     // Feed: max posts per page (0 = server default)
+    enum{cursorNone,cursorBeforeID,cursorAfterID,cursorBeforeTime,cursorAfterTime} cursorType;
+    unsigned int feedFlags;     // Feed: FEED_FLAG_* options
+    unsigned long cursor;       // Feed: post ID or server timestamp (microseconds) to page from
+    unsigned long traceID;      // Login: trace of this login
 } PClientToLodiServer;
 
+// Fixed-size clients send the original struct: the fields up to message,
+// padded to 8 bytes (136)
+#define LEGACY_REQUEST_SIZE ((offsetof(PClientToLodiServer, feedLimit) + 7) & ~(size_t)7)
+
 // TCP connections server to client acks
 typedef struct {
-    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout} messageType;
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
     unsigned int userID;
     char message[100];
 } LodiServerMessage;
 
+// Batched feed response: each frame is a FeedFrameHeader followed by postCount
+// FeedPostRecords, the last frame of a page has FEED_FRAME_LAST set
+typedef struct {
+    unsigned int messageType;   // ackFeed, or ackSearch for search results
+    unsigned int userID;
+    unsigned int postCount;     // Records following this header
+    unsigned int flags;         // FEED_FRAME_* flags
+} FeedFrameHeader;
+
+// Follows the header of a FEED_FRAME_COMPRESSED frame, whose postCount is the
+// posts of the whole page; the compressed bytes expand to the page's frames
+typedef struct {
+    unsigned int rawLength;         // Bytes of frames once decompressed
+    unsigned int compressedLength;  // Compressed bytes following this header
+} FeedCompressedHeader;
+
+typedef struct {
+    unsigned int postID;
+    unsigned int userID;        // Author
+    unsigned long postedAt;     // Server receive time in microseconds
+    char message[100];
+} FeedPostRecord;
+
+// Variable-length request: this header, then bodyLength bytes of text (no terminator).
+// Old clients send a bare PClientToLodiServer, whose first word is a message
+// type and can never equal LODI_WIRE_MAGIC.
+typedef struct {
+    unsigned int magic;         // LODI_WIRE_MAGIC
+    unsigned int messageType;   // PClientToLodiServer message type
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    unsigned int feedLimit;
+    unsigned int cursorType;
+    unsigned long cursor;
+    unsigned int feedFlags;     // FEED_FLAG_* options, and REQUEST_FLAG_TRACED
+    unsigned int bodyLength;    // Bytes of text following the header (and trace ID)
+} LodiRequestHeader;
+
+// Variable-length response to a LodiRequestHeader request: this header, then
+// bodyLength bytes of text. Feeds are answered with FEED_FRAME_VARLEN frames.
+typedef struct {
+    unsigned int magic;         // LODI_WIRE_MAGIC
+    unsigned int messageType;   // LodiServerMessage message type
+    unsigned int userID;
+    unsigned int bodyLength;    // Bytes of text following the header
+} LodiResponseHeader;
+
+// Variable-length feed record: this header, then length bytes of post text
+typedef struct {
+    unsigned long postedAt;     // Server receive time in microseconds
+    unsigned int postID;
+    unsigned int userID;        // Author
+    unsigned int length;        // Bytes of post text following the header
+    unsigned int timestamp;     // Client timestamp of the post request
+} PostRecordHeader;
+
 typedef struct {
     enum { ackRegisterKey, responsePublicKey } messageType;
     unsigned int userID;
@@ -52,6 +205,7 @@ typedef struct {
     enum {registerKey, requestKey} messageType;
     unsigned int userID;
     unsigned int publicKey;
+    unsigned long traceID;      // Login trace, the PKE Server records its lookup under it
 } LodiServerToPKEServer;
 
 // To TFA Server (request authentication)
@@ -60,481 +214,6273 @@ typedef struct {
     unsigned int userID;
     unsigned long timestamp;
     unsigned long digitalSig;
+    unsigned long traceID;      // Login trace, passed on to the TFA client in pushTFA
 } LodiServerToTFAServer;
 
-// Post storage structure
+// Post log: posts are appended as a PostRecordHeader, the text and a CRC-32C of
+// both (padded to 8 bytes) to fixed-size segment files that stay memory-mapped
+// for reading. The post ID is its position in the log; postLocations maps it to
+// its record.
+typedef struct {
+    char *base;                 // Mapping of the whole segment file
+    int fd;
+    unsigned int used;          // Bytes of records written so far
+} PostSegment;
+
+typedef struct {
+    unsigned int segment;
+    unsigned int offset;        // Offset of the record within the segment
+} PostLocation;
+
+// Follow graph persistence: every follow/unfollow is appended to lodi_follows.wal
+// before it is acked, and the whole graph is periodically written to
+// lodi_follows.snap (FollowSnapshotHeader, then per user its ID, count and the
+// IDs it follows), after which the log starts over. The server copies the graph,
+// moves the log aside to lodi_follows.wal.old and lets a background thread write
+// the copy; the old log is replayed too until that snapshot is stored.
 typedef struct {
+    unsigned int op;            // follow or unfollow
     unsigned int userID;
-    unsigned long timestamp;
-    char message[100];
-} Post;
+    unsigned int idolID;
+    unsigned int check;         // op ^ userID ^ idolID ^ FOLLOW_LOG_MAGIC, catches a torn tail
+} FollowLogRecord;
+
+typedef struct {
+    unsigned int magic;         // FOLLOW_SNAPSHOT_MAGIC
+    unsigned int userCount;     // Users with a following list
+    unsigned long edgeCount;    // Follow relationships in the snapshot
+} FollowSnapshotHeader;
+
+// Open-addressing hash index from a user ID to their position in some array
+typedef struct {
+    unsigned int *userIDs;      // User ID of each slot
+    unsigned int *positions;    // Array position + 1 of each slot, 0 for a free slot
+    unsigned int size;          // Slots (power of two)
+    unsigned int count;         // Slots in use
+} UserDirectory;
+
+// Follow graph: a hash-indexed directory of per-user ID lists. A list that is being
+// changed is an open-addressing hash set; compactFollowGraph() packs every list
+// into one array of sorted slices (CSR layout) that is searched by bisection.
+#define FOLLOW_SET_EMPTY 0xFFFFFFFFU    // Free hash set slot (not a valid user ID)
+#define FOLLOW_SET_DELETED 0xFFFFFFFEU  // Slot of a removed ID (not a valid user ID)
+typedef struct {
+    unsigned int userID;        // The user who owns this list
+    unsigned int count;         // IDs in the list
+    unsigned int *set;          // Hash set of the IDs, NULL while the list is compacted
+    unsigned int setSize;       // Slots in set (power of two)
+    unsigned int setUsed;       // Slots holding an ID or FOLLOW_SET_DELETED
+    unsigned long csrStart;     // First ID in the graph's csrIDs while compacted
+} FollowList;
 
-// Per-user following list structure
-#define MAX_FOLLOWING_PER_USER 100
 typedef struct {
-    unsigned int userID;                           // The user who owns this list
-    unsigned int following[MAX_FOLLOWING_PER_USER]; // IDs of users they follow
-    int followingCount;                             // Number of users they follow
-} UserFollowingList;
+    FollowList *lists;
+    unsigned int listCount;
+    unsigned int listCapacity;
+    UserDirectory directory;    // userID -> index in lists
+    unsigned int *csrIDs;       // Sorted slices of the compacted lists
+    unsigned long csrLength;
+    unsigned long edgeCount;    // IDs in all lists
+} FollowGraph;
 
-// Global storage for posts
-Post posts[MAX_POSTS];
+// Requests only ever see durable changes. The dispatch thread holds publishLock
+// while it serves a request, and the committer takes it to publish a batch once
+// it is on disk, or to roll back everything from a batch that could not be synced.
+pthread_mutex_t publishLock = PTHREAD_MUTEX_INITIALIZER;
+int publishedPosts = 0;               // Posts readers see, always a durable prefix of the log
+unsigned long commitEpoch = 0;        // Bumped by each rollback; changes made before it are lost
+
+// Global storage for posts (appended by the main thread and cut back by a rollback,
+// both under publishLock; the segment table is also guarded by postLogLock so the
+// committer can sync it while it grows)
+char postLogDir[256] = ".";
+PostSegment *postSegments = NULL;
+int segmentCount = 0;
+int segmentCapacity = 0;
+PostLocation *postLocations = NULL;
 int postCount = 0;
+int postLocationCapacity = 0;
+// Post metadata kept column-wise next to the log, indexed by post ID like postLocations
+unsigned int *postAuthors = NULL;     // Author of each post
+unsigned long *postTimes = NULL;      // Server receive time of each post (postedAt)
+unsigned int postMaxAuthor = 0;       // Largest author ID in postAuthors
+pthread_mutex_t postLogLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Global storage for who each user follows (guarded by publishLock)
+FollowGraph followingGraph;
+
+// Follow log state (written under publishLock, synced by the committer)
+int followLogFd = -1;
+int followLogRecords = 0;             // Records in the log since the last snapshot
+unsigned long followLogAppended = 0;  // Records ever appended (guarded by followLogLock)
+unsigned long followLogSynced = 0;    // Records known to be on disk (only touched by the committer)
+pthread_mutex_t followLogLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Follow changes made to the graph but not durable yet, oldest first, so a failed
+// commit can undo them (guarded by publishLock). At most the queued changes, a
+// batch being synced and the request being served are pending at once.
+typedef struct {
+    unsigned int op;                  // follow or unfollow
+    unsigned int userID;
+    unsigned int idolID;
+    int logRecords;                   // followLogRecords before the change was logged
+} PendingFollow;
+
+#define PENDING_FOLLOWS (2 * COMMIT_QUEUE_SIZE + 1)
+PendingFollow pendingFollows[PENDING_FOLLOWS];
+unsigned long pendingFollowHead = 0;  // Oldest pending change, numbered over all changes ever made
+unsigned long pendingFollowTail = 0;
+
+// Snapshot copy handed to the snapshot thread (guarded by snapshotLock)
+char *snapshotBuffer = NULL;          // Copy waiting to be written or being written, NULL if none
+size_t snapshotSize = 0;
+pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t snapshotReady = PTHREAD_COND_INITIALIZER;
+LatencyHistogram snapshotPause;       // Graph held up while it is copied and the log moved aside
+LatencyHistogram snapshotWrite;       // Writing and syncing a copy, off the request path
+
+// Slot for an ID in a power-of-two sized hash table
+unsigned int hashID(unsigned int id, unsigned int size) {
+    return (id * 2654435761U) & (size - 1);
+}
+
+// Position stored for a user, returns -1 if they are not in the directory
+int directoryFind(UserDirectory *directory, unsigned int userID) {
+    if (directory->size == 0) return -1;
+
+    unsigned int slot = hashID(userID, directory->size);
+    while (directory->positions[slot] != 0) {
+        if (directory->userIDs[slot] == userID) return directory->positions[slot] - 1;
+        slot = (slot + 1) & (directory->size - 1);
+    }
+    return -1;
+}
+
+// Rehash the directory into size slots, returns 0 if out of memory
+int resizeDirectory(UserDirectory *directory, unsigned int size) {
+    unsigned int *userIDs = malloc(sizeof(unsigned int) * size);
+    unsigned int *positions = calloc(size, sizeof(unsigned int));
+    if (userIDs == NULL || positions == NULL) {
+        free(userIDs);
+        free(positions);
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < directory->size; i++) {
+        if (directory->positions[i] == 0) continue;
+        unsigned int slot = hashID(directory->userIDs[i], size);
+        while (positions[slot] != 0)
+            slot = (slot + 1) & (size - 1);
+        userIDs[slot] = directory->userIDs[i];
+        positions[slot] = directory->positions[i];
+    }
+
+    free(directory->userIDs);
+    free(directory->positions);
+    directory->userIDs = userIDs;
+    directory->positions = positions;
+    directory->size = size;
+    return 1;
+}
+
+// Add a user who is not in the directory yet, returns 0 if out of memory
+int directoryInsert(UserDirectory *directory, unsigned int userID, unsigned int position) {
+    // Keep the directory at most half full so probes stay short
+    if ((directory->count + 1) * 2 > directory->size &&
+        !resizeDirectory(directory, directory->size ? directory->size * 2 : 1024))
+        return 0;
+
+    unsigned int slot = hashID(userID, directory->size);
+    while (directory->positions[slot] != 0)
+        slot = (slot + 1) & (directory->size - 1);
+    directory->userIDs[slot] = userID;
+    directory->positions[slot] = position + 1;
+    directory->count++;
+    return 1;
+}
+
+void freeDirectory(UserDirectory *directory) {
+    free(directory->userIDs);
+    free(directory->positions);
+    memset(directory, 0, sizeof(UserDirectory));
+}
+
+// Find a user's list, returns NULL if they have none
+FollowList* findFollowList(FollowGraph *graph, unsigned int userID) {
+    int position = directoryFind(&graph->directory, userID);
+    return position < 0 ? NULL : &graph->lists[position];
+}
+
+// Get or create a user's list, returns NULL if out of memory.
+// Creating a list can move the others, so earlier FollowList pointers go stale.
+FollowList* getFollowList(FollowGraph *graph, unsigned int userID) {
+    FollowList *list = findFollowList(graph, userID);
+    if (list != NULL) return list;
 
-// Global storage for user following lists
-UserFollowingList userFollowingLists[MAX_USERS];
-int userListCount = 0;
+    if (graph->listCount == graph->listCapacity) {
+        unsigned int newCapacity = graph->listCapacity ? graph->listCapacity * 2 : 1024;
+        FollowList *grown = realloc(graph->lists, sizeof(FollowList) * newCapacity);
+        if (grown == NULL) return NULL;
+        graph->lists = grown;
+        graph->listCapacity = newCapacity;
+    }
+    if (!directoryInsert(&graph->directory, userID, graph->listCount)) return NULL;
+
+    list = &graph->lists[graph->listCount++];
+    memset(list, 0, sizeof(FollowList));
+    list->userID = userID;
+    return list;
+}
+
+// Step through a list's IDs (in no particular order unless compacted).
+// Start with *cursor = 0, returns 0 once every ID has been seen.
+int nextInFollowList(FollowGraph *graph, FollowList *list, unsigned long *cursor, unsigned int *id) {
+    if (list->set == NULL) {
+        if (*cursor >= list->count) return 0;
+        *id = graph->csrIDs[list->csrStart + (*cursor)++];
+        return 1;
+    }
 
-// Helper function to get or create a user's following list, returns pointer to the user's list, or NULL if storage is full
-UserFollowingList* getUserFollowingList(unsigned int userID) {
-    // Check if user already has a list
-    for (int i = 0; i < userListCount; i++) {
-        if (userFollowingLists[i].userID == userID) {
-            return &userFollowingLists[i];
+    while (*cursor < list->setSize) {
+        unsigned int value = list->set[(*cursor)++];
+        if (value < FOLLOW_SET_DELETED) {
+            *id = value;
+            return 1;
         }
     }
+    return 0;
+}
 
-    // User doesn't have a list yet, create one
-    if (userListCount >= MAX_USERS) {
-        printf("(LodiServer) ERROR: Cannot create more user following lists (max %d)\n", MAX_USERS);
-        return NULL;
+// Slot holding id in a list's hash set, or the free slot where it would go
+unsigned int followSetSlot(FollowList *list, unsigned int id) {
+    unsigned int slot = hashID(id, list->setSize);
+    while (list->set[slot] != id && list->set[slot] != FOLLOW_SET_EMPTY)
+        slot = (slot + 1) & (list->setSize - 1);
+    return slot;
+}
+
+// Move a list's IDs into a fresh hash set with room for count more, dropping
+// removed slots. Also turns a compacted list back into a hash set.
+// Returns 0 if out of memory.
+int rehashFollowList(FollowGraph *graph, FollowList *list, unsigned int extra) {
+    // Start at most 3/8 full so the set can grow a while before the next rehash
+    unsigned int size = 8;
+    while (size * 3 < (list->count + extra) * 8)
+        size *= 2;
+
+    unsigned int *set = malloc(sizeof(unsigned int) * size);
+    if (set == NULL) return 0;
+    memset(set, 0xFF, sizeof(unsigned int) * size);
+
+    FollowList old = *list;
+    list->set = set;
+    list->setSize = size;
+    list->setUsed = 0;
+
+    unsigned long cursor = 0;
+    unsigned int id;
+    while (nextInFollowList(graph, &old, &cursor, &id)) {
+        set[followSetSlot(list, id)] = id;
+        list->setUsed++;
+    }
+    free(old.set);
+    return 1;
+}
+
+// Check whether a list contains id: one hash probe, or a bisection of its CSR slice
+int followListContains(FollowGraph *graph, FollowList *list, unsigned int id) {
+    if (id >= FOLLOW_SET_DELETED) return 0;
+    if (list->set != NULL) return list->set[followSetSlot(list, id)] == id;
+
+    unsigned int *ids = graph->csrIDs + list->csrStart;
+    unsigned int low = 0, high = list->count;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (ids[mid] < id)
+            low = mid + 1;
+        else
+            high = mid;
     }
+    return low < list->count && ids[low] == id;
+}
 
-    // Initialize new list
-    userFollowingLists[userListCount].userID = userID;
-    userFollowingLists[userListCount].followingCount = 0;
-    printf("(LodiServer) Created new following list for user %u at index %d\n", userID, userListCount);
+// Add id to a list, returns 1 if added, 0 if already there, -1 if out of memory or id is reserved
+int followListAdd(FollowGraph *graph, FollowList *list, unsigned int id) {
+    if (id >= FOLLOW_SET_DELETED) return -1;
+    if (followListContains(graph, list, id)) return 0;
 
-    userListCount++;
-    return &userFollowingLists[userListCount - 1];
+    // Keep the hash set (removed slots included) at most 3/4 full
+    if ((list->set == NULL || (list->setUsed + 1) * 4 > list->setSize * 3) &&
+        !rehashFollowList(graph, list, 1))
+        return -1;
+
+    list->set[followSetSlot(list, id)] = id;
+    list->setUsed++;
+    list->count++;
+    graph->edgeCount++;
+    return 1;
 }
 
-// RSA
-unsigned long modExp(unsigned long base, unsigned long exp, unsigned long n) {
-    unsigned long result = 1;
-    base = base % n;
+// Remove id from a list, returns 1 if removed, 0 if it was not there, -1 if out of memory
+int followListRemove(FollowGraph *graph, FollowList *list, unsigned int id) {
+    if (!followListContains(graph, list, id)) return 0;
+    if (list->set == NULL && !rehashFollowList(graph, list, 0)) return -1;
 
-    while (exp > 0) {
-        if (exp % 2 == 1)
-            result = (result * base) % n;
-        exp = exp >> 1;
-        base = (base * base) % n;
+    list->set[followSetSlot(list, id)] = FOLLOW_SET_DELETED;
+    list->count--;
+    graph->edgeCount--;
+    return 1;
+}
+
+int compareIDs(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
+
+// Pack every list into one array of sorted slices and free the hash sets.
+// Returns 0 (leaving the graph as it was) if out of memory.
+int compactFollowGraph(FollowGraph *graph) {
+    unsigned int *csrIDs = malloc(sizeof(unsigned int) * (graph->edgeCount ? graph->edgeCount : 1));
+    if (csrIDs == NULL) return 0;
+
+    unsigned long length = 0;
+    for (unsigned int i = 0; i < graph->listCount; i++) {
+        FollowList *list = &graph->lists[i];
+        unsigned long start = length;
+        unsigned long cursor = 0;
+        unsigned int id;
+        while (nextInFollowList(graph, list, &cursor, &id))
+            csrIDs[length++] = id;
+
+        // Slices copied from a compacted list are already sorted
+        if (list->set != NULL) {
+            qsort(csrIDs + start, list->count, sizeof(unsigned int), compareIDs);
+            free(list->set);
+            list->set = NULL;
+            list->setSize = list->setUsed = 0;
+        }
+        list->csrStart = start;
     }
 
-    return result;
+    free(graph->csrIDs);
+    graph->csrIDs = csrIDs;
+    graph->csrLength = length;
+    return 1;
 }
 
-// Request public Key from PKE
-unsigned int requestPublicKey(int sock, char *pkeServerIP, unsigned short pkeServerPort,
-                              unsigned int userID, unsigned long n) {
-    struct sockaddr_in pkeServerAddr;
-    struct sockaddr_in fromAddr;
-    unsigned int fromSize;
-    LodiServerToPKEServer request;
-    PKServerToPClientOrLodiServer response;
-    int recvMsgSize;
+// Drop every list of a graph
+void clearFollowGraph(FollowGraph *graph) {
+    for (unsigned int i = 0; i < graph->listCount; i++)
+        free(graph->lists[i].set);
+    free(graph->lists);
+    freeDirectory(&graph->directory);
+    free(graph->csrIDs);
+    memset(graph, 0, sizeof(FollowGraph));
+}
 
-    printf("\n(LodiServer) Requesting public key for user %u from PKE Server...\n", userID);
+// Bytes of memory held by a graph
+unsigned long followGraphBytes(FollowGraph *graph) {
+    unsigned long bytes = sizeof(FollowList) * graph->listCapacity +
+                          sizeof(unsigned int) * (2UL * graph->directory.size + graph->csrLength);
+    for (unsigned int i = 0; i < graph->listCount; i++)
+        bytes += sizeof(unsigned int) * graph->lists[i].setSize;
+    return bytes;
+}
 
-    // Prepare request message
-    request.messageType = requestKey;
-    request.userID = userID;
-    request.publicKey = 0;
+// Reverse follower index: each idol's followers as a roaring-style compressed
+// bitmap. IDs are split by their high 16 bits into containers; a container is
+// a sorted array of the low 16 bits while small and a 65536-bit bitmap once it
+// holds more than ROARING_ARRAY_MAX IDs.
+#define ROARING_ARRAY_MAX 4096      // Most IDs in an array container
+#define ROARING_BITMAP_WORDS 1024   // 64-bit words in a bitmap container
+typedef struct {
+    unsigned short key;         // High 16 bits shared by the container's IDs
+    unsigned short isBitmap;    // 1 if values is a bitmap, 0 if a sorted array
+    unsigned int count;         // IDs in the container
+    unsigned int capacity;      // Slots in a sorted array
+    void *values;               // unsigned short[capacity] or unsigned long[ROARING_BITMAP_WORDS]
+} RoaringContainer;
 
-    // Configure PKE server address
-    memset(&pkeServerAddr, 0, sizeof(pkeServerAddr));
-    pkeServerAddr.sin_family = AF_INET;
-    pkeServerAddr.sin_addr.s_addr = inet_addr(pkeServerIP);
-    pkeServerAddr.sin_port = htons(pkeServerPort);
+typedef struct {
+    RoaringContainer *containers;   // Sorted by key
+    unsigned int containerCount;
+    unsigned int containerCapacity;
+    unsigned int count;             // IDs in the set
+} RoaringSet;
 
-    // Send request to PKE Server
-    if (sendto(sock, &request, sizeof(request), 0,
-               (struct sockaddr *)&pkeServerAddr, sizeof(pkeServerAddr)) != sizeof(request)) {
-        printf("(LodiServer) Error: Failed to send request to PKE Server\n");
-        return 0;
+typedef struct {
+    unsigned int userID;        // The idol who owns this set
+    RoaringSet followers;       // IDs of users following them
+} FollowerSet;
+
+typedef struct {
+    FollowerSet *sets;
+    unsigned int setCount;
+    unsigned int setCapacity;
+    UserDirectory directory;    // userID -> index in sets
+    unsigned long edgeCount;
+} FollowerIndex;
+
+// Index of the container for key, or where it would be inserted (*found = 0)
+unsigned int roaringContainerIndex(RoaringSet *set, unsigned short key, int *found) {
+    unsigned int low = 0, high = set->containerCount;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (set->containers[mid].key < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    *found = low < set->containerCount && set->containers[low].key == key;
+    return low;
+}
+
+// Position of value in an array container, or where it would be inserted
+unsigned int roaringArrayIndex(RoaringContainer *container, unsigned short value) {
+    unsigned short *values = container->values;
+    unsigned int low = 0, high = container->count;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (values[mid] < value)
+            low = mid + 1;
+        else
+            high = mid;
     }
+    return low;
+}
 
-    printf("(LodiServer) Request sent to PKE Server at %s:%u\n", pkeServerIP, pkeServerPort);
+int roaringContains(RoaringSet *set, unsigned int id) {
+    int found;
+    unsigned int i = roaringContainerIndex(set, id >> 16, &found);
+    if (!found) return 0;
 
-    // Receive response from PKE Server
-    fromSize = sizeof(fromAddr);
-    if ((recvMsgSize = recvfrom(sock, &response, sizeof(response), 0,
-                                (struct sockaddr *)&fromAddr, &fromSize)) < 0) {
-        printf("(LodiServer) Error: Failed to receive response from PKE Server\n");
-        return 0;
+    RoaringContainer *container = &set->containers[i];
+    unsigned short value = id & 0xFFFF;
+    if (container->isBitmap)
+        return (((unsigned long *)container->values)[value >> 6] >> (value & 63)) & 1;
+
+    unsigned int position = roaringArrayIndex(container, value);
+    return position < container->count && ((unsigned short *)container->values)[position] == value;
+}
+
+// Drop container i from a set
+void roaringRemoveContainer(RoaringSet *set, unsigned int i) {
+    free(set->containers[i].values);
+    memmove(&set->containers[i], &set->containers[i + 1], sizeof(RoaringContainer) * (set->containerCount - i - 1));
+    set->containerCount--;
+}
+
+// Turn a full array container into a bitmap, returns 0 if out of memory
+int roaringArrayToBitmap(RoaringContainer *container) {
+    unsigned long *bits = calloc(ROARING_BITMAP_WORDS, sizeof(unsigned long));
+    if (bits == NULL) return 0;
+
+    unsigned short *values = container->values;
+    for (unsigned int i = 0; i < container->count; i++)
+        bits[values[i] >> 6] |= 1UL << (values[i] & 63);
+    free(values);
+    container->values = bits;
+    container->isBitmap = 1;
+    container->capacity = 0;
+    return 1;
+}
+
+// Turn a bitmap container that has shrunk back into an array (stays a bitmap if out of memory)
+void roaringBitmapToArray(RoaringContainer *container) {
+    unsigned short *values = malloc(sizeof(unsigned short) * container->count);
+    if (values == NULL) return;
+
+    unsigned long *bits = container->values;
+    unsigned int count = 0;
+    for (unsigned int w = 0; w < ROARING_BITMAP_WORDS; w++) {
+        for (unsigned long word = bits[w]; word != 0; word &= word - 1)
+            values[count++] = w * 64 + __builtin_ctzl(word);
     }
+    free(bits);
+    container->values = values;
+    container->isBitmap = 0;
+    container->capacity = container->count;
+}
 
-    printf("(LodiServer) Received response from %s:%u\n",
-           inet_ntoa(fromAddr.sin_addr), ntohs(fromAddr.sin_port));
+// Add id to a set, returns 1 if added, 0 if already there, -1 if out of memory
+int roaringAdd(RoaringSet *set, unsigned int id) {
+    int found;
+    unsigned int i = roaringContainerIndex(set, id >> 16, &found);
+    if (!found) {
+        if (set->containerCount == set->containerCapacity) {
+            unsigned int newCapacity = set->containerCapacity ? set->containerCapacity * 2 : 1;
+            RoaringContainer *grown = realloc(set->containers, sizeof(RoaringContainer) * newCapacity);
+            if (grown == NULL) return -1;
+            set->containers = grown;
+            set->containerCapacity = newCapacity;
+        }
+        memmove(&set->containers[i + 1], &set->containers[i], sizeof(RoaringContainer) * (set->containerCount - i));
+        memset(&set->containers[i], 0, sizeof(RoaringContainer));
+        set->containers[i].key = id >> 16;
+        set->containerCount++;
+    }
 
+    RoaringContainer *container = &set->containers[i];
+    unsigned short value = id & 0xFFFF;
+    if (!container->isBitmap) {
+        unsigned int position = roaringArrayIndex(container, value);
+        unsigned short *values = container->values;
+        if (position < container->count && values[position] == value) return 0;
 
-    if (response.messageType == responsePublicKey && response.userID == userID) {
-        printf("(LodiServer) Public key received: %u\n", response.publicKey);
-        printf("(LodiServer) Verifying digital signature...\n");
-        return response.publicKey;
+        if (container->count == ROARING_ARRAY_MAX) {
+            if (!roaringArrayToBitmap(container)) return -1;
+        } else {
+            if (container->count == container->capacity) {
+                unsigned int newCapacity = container->capacity ? container->capacity * 2 : 4;
+                if (newCapacity > ROARING_ARRAY_MAX) newCapacity = ROARING_ARRAY_MAX;
+                values = realloc(values, sizeof(unsigned short) * newCapacity);
+                if (values == NULL) {
+                    if (container->count == 0) roaringRemoveContainer(set, i);
+                    return -1;
+                }
+                container->values = values;
+                container->capacity = newCapacity;
+            }
+            memmove(&values[position + 1], &values[position], sizeof(unsigned short) * (container->count - position));
+            values[position] = value;
+            container->count++;
+            set->count++;
+            return 1;
+        }
+    }
+
+    unsigned long *bits = container->values;
+    if ((bits[value >> 6] >> (value & 63)) & 1) return 0;
+    bits[value >> 6] |= 1UL << (value & 63);
+    container->count++;
+    set->count++;
+    return 1;
+}
+
+// Remove id from a set, returns 1 if removed, 0 if it was not there
+int roaringRemove(RoaringSet *set, unsigned int id) {
+    int found;
+    unsigned int i = roaringContainerIndex(set, id >> 16, &found);
+    if (!found) return 0;
+
+    RoaringContainer *container = &set->containers[i];
+    unsigned short value = id & 0xFFFF;
+    if (container->isBitmap) {
+        unsigned long *bits = container->values;
+        if (!((bits[value >> 6] >> (value & 63)) & 1)) return 0;
+        bits[value >> 6] &= ~(1UL << (value & 63));
+        container->count--;
+        if (container->count == ROARING_ARRAY_MAX)
+            roaringBitmapToArray(container);
+    } else {
+        unsigned short *values = container->values;
+        unsigned int position = roaringArrayIndex(container, value);
+        if (position >= container->count || values[position] != value) return 0;
+        memmove(&values[position], &values[position + 1], sizeof(unsigned short) * (container->count - position - 1));
+        container->count--;
+    }
+
+    set->count--;
+    if (container->count == 0)
+        roaringRemoveContainer(set, i);
+    return 1;
+}
+
+// Step through a set's IDs in ascending order.
+// Start with *cursor = 0, returns 0 once every ID has been seen.
+int roaringNext(RoaringSet *set, unsigned long *cursor, unsigned int *id) {
+    unsigned int i = *cursor >> 32;
+    unsigned int position = *cursor & 0xFFFFFFFFUL;
+
+    for (; i < set->containerCount; i++, position = 0) {
+        RoaringContainer *container = &set->containers[i];
+        if (!container->isBitmap) {
+            if (position < container->count) {
+                *id = ((unsigned int)container->key << 16) | ((unsigned short *)container->values)[position];
+                *cursor = ((unsigned long)i << 32) | (position + 1);
+                return 1;
+            }
+            continue;
+        }
+
+        unsigned long *bits = container->values;
+        for (unsigned int w = position >> 6; w < ROARING_BITMAP_WORDS; w++) {
+            unsigned long word = bits[w];
+            if (w == position >> 6)
+                word &= ~0UL << (position & 63);
+            if (word != 0) {
+                unsigned int value = w * 64 + __builtin_ctzl(word);
+                *id = ((unsigned int)container->key << 16) | value;
+                *cursor = ((unsigned long)i << 32) | (value + 1);
+                return 1;
+            }
+        }
     }
 
-    printf("(LodiServer) Error: Invalid response from PKE Server\n");
+    *cursor = (unsigned long)i << 32;
     return 0;
 }
 
-// Function to request TFA Authentication
-int requestTFAAuthentication(int sock, char *tfaServerIP, unsigned short tfaServerPort,
-                             unsigned int userID) {
-    struct sockaddr_in tfaServerAddr;
-    LodiServerToTFAServer request;
-    TFAServerToLodiServer response; 
-    int recvMsgSize;
-    
-    printf("\n(LodiServer) Requesting authentication for user %u from TFA Server...\n", userID);
-    
-    // Prepare request message
-    request.messageType = requestAuth;
-    request.userID = userID;
-    
-    // Configure TFA server address
-    memset(&tfaServerAddr, 0, sizeof(tfaServerAddr));
-    tfaServerAddr.sin_family = AF_INET;
-    tfaServerAddr.sin_addr.s_addr = inet_addr(tfaServerIP);
-    tfaServerAddr.sin_port = htons(tfaServerPort);
-    
-    // Send request to TFA Server
-    if (sendto(sock, &request, sizeof(request), 0,
-               (struct sockaddr *)&tfaServerAddr, sizeof(tfaServerAddr)) != sizeof(request)) {
-        printf("(LodiServer) Error: Failed to send request to TFA Server\n");
-        return 0;
+// Size of the intersection of two containers with the same key
+unsigned int roaringContainerAndCount(RoaringContainer *a, RoaringContainer *b) {
+    unsigned int count = 0;
+
+    if (a->isBitmap && b->isBitmap) {
+        unsigned long *x = a->values, *y = b->values;
+        for (unsigned int w = 0; w < ROARING_BITMAP_WORDS; w++)
+            count += __builtin_popcountl(x[w] & y[w]);
+        return count;
+    }
+
+    // Array against bitmap: test each array value's bit
+    if (a->isBitmap || b->isBitmap) {
+        RoaringContainer *array = a->isBitmap ? b : a;
+        unsigned long *bits = a->isBitmap ? a->values : b->values;
+        unsigned short *values = array->values;
+        for (unsigned int i = 0; i < array->count; i++)
+            count += (bits[values[i] >> 6] >> (values[i] & 63)) & 1;
+        return count;
+    }
+
+    // Two arrays: bisect the larger one when sizes are far apart, otherwise merge
+    RoaringContainer *small = a->count <= b->count ? a : b;
+    RoaringContainer *large = a->count <= b->count ? b : a;
+    unsigned short *x = small->values, *y = large->values;
+    if (small->count * 32 < large->count) {
+        for (unsigned int i = 0; i < small->count; i++) {
+            unsigned int position = roaringArrayIndex(large, x[i]);
+            count += position < large->count && y[position] == x[i];
+        }
+        return count;
+    }
+
+    unsigned int i = 0, j = 0;
+    while (i < small->count && j < large->count) {
+        if (x[i] < y[j]) {
+            i++;
+        } else if (y[j] < x[i]) {
+            j++;
+        } else {
+            count++;
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+// Size of the intersection of two sets, container by container
+unsigned long roaringAndCount(RoaringSet *a, RoaringSet *b) {
+    unsigned long count = 0;
+    unsigned int i = 0, j = 0;
+
+    while (i < a->containerCount && j < b->containerCount) {
+        if (a->containers[i].key < b->containers[j].key) {
+            i++;
+        } else if (b->containers[j].key < a->containers[i].key) {
+            j++;
+        } else {
+            count += roaringContainerAndCount(&a->containers[i], &b->containers[j]);
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+// Fill an empty set from count sorted, distinct IDs, returns 0 if out of memory
+int roaringFromSorted(RoaringSet *set, unsigned int *ids, unsigned long count) {
+    unsigned long first = 0;
+    while (first < count) {
+        // IDs sharing the next key go into one container
+        unsigned long last = first;
+        while (last < count && ids[last] >> 16 == ids[first] >> 16)
+            last++;
+        unsigned int size = last - first;
+
+        if (set->containerCount == set->containerCapacity) {
+            unsigned int newCapacity = set->containerCapacity ? set->containerCapacity * 2 : 1;
+            RoaringContainer *grown = realloc(set->containers, sizeof(RoaringContainer) * newCapacity);
+            if (grown == NULL) return 0;
+            set->containers = grown;
+            set->containerCapacity = newCapacity;
+        }
+
+        RoaringContainer *container = &set->containers[set->containerCount];
+        container->key = ids[first] >> 16;
+        container->count = size;
+        if (size > ROARING_ARRAY_MAX) {
+            unsigned long *bits = calloc(ROARING_BITMAP_WORDS, sizeof(unsigned long));
+            if (bits == NULL) return 0;
+            for (unsigned long i = first; i < last; i++)
+                bits[(ids[i] & 0xFFFF) >> 6] |= 1UL << (ids[i] & 63);
+            container->isBitmap = 1;
+            container->capacity = 0;
+            container->values = bits;
+        } else {
+            unsigned short *values = malloc(sizeof(unsigned short) * size);
+            if (values == NULL) return 0;
+            for (unsigned long i = first; i < last; i++)
+                values[i - first] = ids[i] & 0xFFFF;
+            container->isBitmap = 0;
+            container->capacity = size;
+            container->values = values;
+        }
+        set->containerCount++;
+        set->count += size;
+        first = last;
+    }
+    return 1;
+}
+
+void roaringFree(RoaringSet *set) {
+    for (unsigned int i = 0; i < set->containerCount; i++)
+        free(set->containers[i].values);
+    free(set->containers);
+    memset(set, 0, sizeof(RoaringSet));
+}
+
+// Bytes of memory held by a set
+unsigned long roaringBytes(RoaringSet *set) {
+    unsigned long bytes = sizeof(RoaringContainer) * set->containerCapacity;
+    for (unsigned int i = 0; i < set->containerCount; i++) {
+        if (set->containers[i].isBitmap)
+            bytes += sizeof(unsigned long) * ROARING_BITMAP_WORDS;
+        else
+            bytes += sizeof(unsigned short) * set->containers[i].capacity;
+    }
+    return bytes;
+}
+
+// Find an idol's follower set, returns NULL if nobody has followed them
+FollowerSet* findFollowerSet(FollowerIndex *index, unsigned int userID) {
+    int position = directoryFind(&index->directory, userID);
+    return position < 0 ? NULL : &index->sets[position];
+}
+
+// Get or create an idol's follower set, returns NULL if out of memory
+FollowerSet* getFollowerSet(FollowerIndex *index, unsigned int userID) {
+    FollowerSet *set = findFollowerSet(index, userID);
+    if (set != NULL) return set;
+
+    if (index->setCount == index->setCapacity) {
+        unsigned int newCapacity = index->setCapacity ? index->setCapacity * 2 : 1024;
+        FollowerSet *grown = realloc(index->sets, sizeof(FollowerSet) * newCapacity);
+        if (grown == NULL) return NULL;
+        index->sets = grown;
+        index->setCapacity = newCapacity;
+    }
+    if (!directoryInsert(&index->directory, userID, index->setCount)) return NULL;
+
+    set = &index->sets[index->setCount++];
+    memset(set, 0, sizeof(FollowerSet));
+    set->userID = userID;
+    return set;
+}
+
+// Drop every set of an index
+void clearFollowerIndex(FollowerIndex *index) {
+    for (unsigned int i = 0; i < index->setCount; i++)
+        roaringFree(&index->sets[i].followers);
+    free(index->sets);
+    freeDirectory(&index->directory);
+    memset(index, 0, sizeof(FollowerIndex));
+}
+
+// Bytes of memory held by an index
+unsigned long followerIndexBytes(FollowerIndex *index) {
+    unsigned long bytes = sizeof(FollowerSet) * index->setCapacity + sizeof(unsigned int) * 2UL * index->directory.size;
+    for (unsigned int i = 0; i < index->setCount; i++)
+        bytes += roaringBytes(&index->sets[i].followers);
+    return bytes;
+}
+
+// Per-user materialized timeline (fan-out-on-write mode).
+// Bounded ring of post indexes, oldest entries are overwritten once full.
+#define TIMELINE_CAPACITY 256
+typedef struct {
+    unsigned int userID;                 // The user who reads this timeline
+    int postIndex[TIMELINE_CAPACITY];    // Post IDs
+    unsigned long written;               // Total entries ever pushed
+} Timeline;
+
+typedef struct {
+    Timeline *timelines;
+    unsigned int timelineCount;
+    unsigned int timelineCapacity;
+    UserDirectory directory;             // userID -> index in timelines
+} TimelineIndex;
+
+// Per-author post index: every post by the author (oldest first), plus the
+// ones that were not fanned out because the author was above the hybrid threshold
+typedef struct {
+    unsigned int userID;      // The author who owns this index
+    int *postIndex;           // IDs of all their posts
+    int count;
+    int capacity;
+    int *pulledIndex;         // Posts left for readers to merge at read time
+    int pulledCount;
+    int pulledCapacity;
+} AuthorPosts;
+
+typedef struct {
+    AuthorPosts *authors;
+    unsigned int authorCount;
+    unsigned int authorCapacity;
+    UserDirectory directory;    // userID -> index in authors
+} AuthorIndex;
+
+// Latency counter for one feed path
+typedef struct {
+    const char *name;
+    unsigned long count;
+    unsigned long totalNanos;
+    unsigned long maxNanos;
+    LatencyHistogram histogram;        // The same samples, dumped by a stats request
+} PathLatency;
+
+// Background fan-out queue of post indexes waiting to be pushed to followers
+#define FANOUT_QUEUE_SIZE 1024
+
+// Feed engine, selected on the command line:
+//   read   - merge the post lists of followed authors on every feed request (default)
+//   scan   - scan the author column of all posts on every feed request (-s)
+//   write  - push posts into follower timelines (-f)
+//   hybrid - push posts from ordinary authors, merge posts from authors with
+//            more than hybridThreshold followers at read time (-t <threshold>)
+enum {feedModeRead, feedModeScan, feedModeWrite, feedModeHybrid} feedMode = feedModeRead;
+int hybridThreshold = 0;
+
+// Global storage for per-author post indexes (guarded by publishLock)
+AuthorIndex authorIndex;
+
+// Per-path latency counters (guarded by latencyLock)
+PathLatency pushLatency = {"push", 0, 0, 0};          // Fan-out of one post to all followers
+PathLatency timelineLatency = {"timeline", 0, 0, 0};  // Reading a materialized timeline
+PathLatency pullLatency = {"pull", 0, 0, 0};          // Merging above-threshold authors at read time
+PathLatency scanLatency = {"scan", 0, 0, 0};          // Scanning the author column of the post log
+pthread_mutex_t latencyLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Global storage for the reverse follower index and timelines (guarded by fanoutLock)
+FollowerIndex followerIndex;
+TimelineIndex timelineIndex;
+pthread_mutex_t fanoutLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Post waiting in the fan-out queue
+typedef struct {
+    int postIndex;
+    unsigned int authorID;
+} FanoutEntry;
+
+// Fan-out queue state (guarded by fanoutQueueLock)
+FanoutEntry fanoutQueue[FANOUT_QUEUE_SIZE];
+int fanoutQueueHead = 0;
+int fanoutQueueCount = 0;
+int fanoutBusy = 0;                   // The fan-out thread is pushing a post
+pthread_mutex_t fanoutQueueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fanoutQueueReady = PTHREAD_COND_INITIALIZER;
+
+// Post or follow ack held back until the change is durable
+typedef struct {
+    int clientSocket;                  // -1 for benchmark posts without a client
+    int varlen;                        // Wire format of the request
+    LodiServerMessage response;
+    int postIndex;                     // Post to publish once durable, -1 for none
+    int followChange;                  // A follow graph change, undone if its batch fails
+    unsigned long epoch;               // commitEpoch when the change was made
+    unsigned long queuedAt;            // nowNanos() when the change was written
+} CommitEntry;
+
+// Group commit tunables (-b, -w)
+int commitBatchSize = COMMIT_DEFAULT_BATCH;
+int commitWindowMicros = COMMIT_DEFAULT_WINDOW;
+
+// Group commit queue state (guarded by commitQueueLock)
+CommitEntry commitQueue[COMMIT_QUEUE_SIZE];
+int commitQueueHead = 0;
+int commitQueueCount = 0;
+int commitInFlight = 0;               // Taken by the committer, not yet acked
+unsigned long commitBatches = 0;      // Number of msync() rounds
+unsigned long committedPosts = 0;
+pthread_mutex_t commitQueueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commitQueueReady = PTHREAD_COND_INITIALIZER;
+pthread_cond_t commitQueueSpace = PTHREAD_COND_INITIALIZER;
+
+// How far the post log is durable (only touched by the committer)
+int syncedSegments = 0;               // Segment files whose size and name are durable
+int syncedSegment = 0;
+unsigned int syncedOffset = 0;
+
+// Enqueue-to-ack latency of posts (guarded by latencyLock)
+PathLatency commitLatency = {"commit", 0, 0, 0};
+
+// Place of this server among the shards behind lodi_router (-S), 0 of 1 when unsharded
+unsigned int shardIndex = 0;
+unsigned int shardCount = 1;
+
+// Monotonic clock in nanoseconds, used for latency counters
+unsigned long nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Wall clock in microseconds, used to timestamp posts
+unsigned long nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+// Add one sample (measured from startNanos until now) to a latency counter
+void recordLatency(PathLatency *latency, unsigned long startNanos) {
+    unsigned long elapsed = nowNanos() - startNanos;
+
+    pthread_mutex_lock(&latencyLock);
+    latency->count++;
+    latency->totalNanos += elapsed;
+    if (elapsed > latency->maxNanos)
+        latency->maxNanos = elapsed;
+    pthread_mutex_unlock(&latencyLock);
+    histogramRecord(&latency->histogram, elapsed);
+}
+
+// Append a value to a growable int array, returns 0 if out of memory
+int appendIndex(int **array, int *count, int *capacity, int value) {
+    if (*count == *capacity) {
+        int newCapacity = *capacity ? *capacity * 2 : 16;
+        int *grown = realloc(*array, sizeof(int) * newCapacity);
+        if (grown == NULL) return 0;
+        *array = grown;
+        *capacity = newCapacity;
+    }
+    (*array)[(*count)++] = value;
+    return 1;
+}
+
+// Find an author's post index, returns NULL if they have never posted
+AuthorPosts* findAuthorPosts(unsigned int userID) {
+    int position = directoryFind(&authorIndex.directory, userID);
+    return position < 0 ? NULL : &authorIndex.authors[position];
+}
+
+// Get or create an author's post index, returns NULL if out of memory.
+// Creating one can move the others, so earlier AuthorPosts pointers go stale.
+AuthorPosts* getAuthorPosts(unsigned int userID) {
+    AuthorPosts* author = findAuthorPosts(userID);
+    if (author != NULL) return author;
+
+    if (authorIndex.authorCount == authorIndex.authorCapacity) {
+        unsigned int newCapacity = authorIndex.authorCapacity ? authorIndex.authorCapacity * 2 : 1024;
+        AuthorPosts *grown = realloc(authorIndex.authors, sizeof(AuthorPosts) * newCapacity);
+        if (grown == NULL) return NULL;
+        authorIndex.authors = grown;
+        authorIndex.authorCapacity = newCapacity;
+    }
+    if (!directoryInsert(&authorIndex.directory, userID, authorIndex.authorCount)) return NULL;
+
+    author = &authorIndex.authors[authorIndex.authorCount++];
+    memset(author, 0, sizeof(AuthorPosts));
+    author->userID = userID;
+    return author;
+}
+
+// Record that follower now follows idol in the reverse index
+void addFollower(unsigned int idolID, unsigned int followerID) {
+    pthread_mutex_lock(&fanoutLock);
+    FollowerSet* set = getFollowerSet(&followerIndex, idolID);
+    int added = set == NULL ? -1 : roaringAdd(&set->followers, followerID);
+    if (added < 0)
+        LOG_ERROR("(LodiServer) ERROR: Out of memory indexing follower %u of user %u\n", followerID, idolID);
+    else
+        followerIndex.edgeCount += added;
+    pthread_mutex_unlock(&fanoutLock);
+}
+
+// Remove follower from idol's entry in the reverse index
+void removeFollower(unsigned int idolID, unsigned int followerID) {
+    pthread_mutex_lock(&fanoutLock);
+    FollowerSet* set = findFollowerSet(&followerIndex, idolID);
+    if (set != NULL)
+        followerIndex.edgeCount -= roaringRemove(&set->followers, followerID);
+    pthread_mutex_unlock(&fanoutLock);
+}
+
+// Check whether follower follows idol, using the reverse index
+int isFollowedBy(unsigned int idolID, unsigned int followerID) {
+    pthread_mutex_lock(&fanoutLock);
+    FollowerSet* set = findFollowerSet(&followerIndex, idolID);
+    int following = set != NULL && roaringContains(&set->followers, followerID);
+    pthread_mutex_unlock(&fanoutLock);
+    return following;
+}
+
+// Number of users following both a and b (a bitmap intersection)
+unsigned long countCommonFollowers(unsigned int a, unsigned int b) {
+    unsigned long count = 0;
+
+    pthread_mutex_lock(&fanoutLock);
+    FollowerSet* setA = findFollowerSet(&followerIndex, a);
+    FollowerSet* setB = findFollowerSet(&followerIndex, b);
+    if (setA != NULL && setB != NULL)
+        count = roaringAndCount(&setA->followers, &setB->followers);
+    pthread_mutex_unlock(&fanoutLock);
+
+    return count;
+}
+
+// Find a user's timeline, returns NULL if nothing was ever pushed to them.
+// Caller must hold fanoutLock.
+Timeline* findTimeline(unsigned int userID) {
+    int position = directoryFind(&timelineIndex.directory, userID);
+    return position < 0 ? NULL : &timelineIndex.timelines[position];
+}
+
+// Get or create a user's timeline, returns NULL if out of memory. Caller must hold
+// fanoutLock. Creating one can move the others, so earlier Timeline pointers go stale.
+Timeline* getTimeline(unsigned int userID) {
+    Timeline* timeline = findTimeline(userID);
+    if (timeline != NULL) return timeline;
+
+    if (timelineIndex.timelineCount == timelineIndex.timelineCapacity) {
+        unsigned int newCapacity = timelineIndex.timelineCapacity ? timelineIndex.timelineCapacity * 2 : 1024;
+        Timeline *grown = realloc(timelineIndex.timelines, sizeof(Timeline) * newCapacity);
+        if (grown == NULL) return NULL;
+        timelineIndex.timelines = grown;
+        timelineIndex.timelineCapacity = newCapacity;
+    }
+    if (!directoryInsert(&timelineIndex.directory, userID, timelineIndex.timelineCount)) return NULL;
+
+    timeline = &timelineIndex.timelines[timelineIndex.timelineCount++];
+    timeline->userID = userID;
+    timeline->written = 0;
+    return timeline;
+}
+
+// Number of followers an idol currently has
+int getFollowerCount(unsigned int idolID) {
+    int count = 0;
+
+    pthread_mutex_lock(&fanoutLock);
+    FollowerSet* set = findFollowerSet(&followerIndex, idolID);
+    if (set != NULL)
+        count = set->followers.count;
+    pthread_mutex_unlock(&fanoutLock);
+
+    return count;
+}
+
+// Push one post into the timeline of every follower of its author
+void fanoutPost(int postIndex, unsigned int authorID) {
+    unsigned long start = nowNanos();
+
+    pthread_mutex_lock(&fanoutLock);
+    FollowerSet* set = findFollowerSet(&followerIndex, authorID);
+    unsigned long cursor = 0;
+    unsigned int followerID;
+    while (set != NULL && roaringNext(&set->followers, &cursor, &followerID)) {
+        Timeline* timeline = getTimeline(followerID);
+        if (timeline == NULL) {
+            LOG_ERROR("(LodiServer) ERROR: Out of memory pushing post %d to user %u\n", postIndex, followerID);
+            continue;
+        }
+        timeline->postIndex[timeline->written % TIMELINE_CAPACITY] = postIndex;
+        timeline->written++;
+    }
+    pthread_mutex_unlock(&fanoutLock);
+
+    recordLatency(&pushLatency, start);
+}
+
+// Queue a post for background fan-out, returns 0 if the queue is full
+int enqueueFanout(int postIndex, unsigned int authorID) {
+    int queued = 0;
+
+    pthread_mutex_lock(&fanoutQueueLock);
+    if (fanoutQueueCount < FANOUT_QUEUE_SIZE) {
+        FanoutEntry *entry = &fanoutQueue[(fanoutQueueHead + fanoutQueueCount) % FANOUT_QUEUE_SIZE];
+        entry->postIndex = postIndex;
+        entry->authorID = authorID;
+        fanoutQueueCount++;
+        queued = 1;
+        pthread_cond_signal(&fanoutQueueReady);
+    }
+    pthread_mutex_unlock(&fanoutQueueLock);
+
+    return queued;
+}
+
+// Background thread: drains the fan-out queue so publishPost() can ack right away
+void *fanoutWorker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&fanoutQueueLock);
+        while (fanoutQueueCount == 0)
+            pthread_cond_wait(&fanoutQueueReady, &fanoutQueueLock);
+
+        FanoutEntry entry = fanoutQueue[fanoutQueueHead];
+        fanoutQueueHead = (fanoutQueueHead + 1) % FANOUT_QUEUE_SIZE;
+        fanoutQueueCount--;
+        fanoutBusy = 1;
+        pthread_mutex_unlock(&fanoutQueueLock);
+
+        fanoutPost(entry.postIndex, entry.authorID);
+
+        pthread_mutex_lock(&fanoutQueueLock);
+        fanoutBusy = 0;
+        pthread_mutex_unlock(&fanoutQueueLock);
+    }
+    return NULL;
+}
+
+// Copy a user's timeline (oldest first) into out, returns number of entries
+int readTimeline(unsigned int userID, int *out) {
+    int count = 0;
+
+    pthread_mutex_lock(&fanoutLock);
+    Timeline* timeline = findTimeline(userID);
+    if (timeline != NULL) {
+        unsigned long start = 0;
+        if (timeline->written > TIMELINE_CAPACITY)
+            start = timeline->written - TIMELINE_CAPACITY;
+        for (unsigned long k = start; k < timeline->written; k++) {
+            out[count++] = timeline->postIndex[k % TIMELINE_CAPACITY];
+        }
+    }
+    pthread_mutex_unlock(&fanoutLock);
+
+    return count;
+}
+
+// RSA
+unsigned long modExp(unsigned long base, unsigned long exp, unsigned long n) {
+    unsigned long result = 1;
+    base = base % n;
+
+    while (exp > 0) {
+        if (exp % 2 == 1)
+            result = (result * base) % n;
+        exp = exp >> 1;
+        base = (base * base) % n;
+    }
+
+    return result;
+}
+
+// Request public Key from PKE
+unsigned int requestPublicKey(int sock, char *pkeServerIP, unsigned short pkeServerPort,
+                              unsigned int userID, unsigned long n, unsigned long traceID) {
+    struct sockaddr_in pkeServerAddr;
+    struct sockaddr_in fromAddr;
+    unsigned int fromSize;
+    LodiServerToPKEServer request;
+    PKServerToPClientOrLodiServer response;
+    int recvMsgSize;
+
+    LOG_INFO("\n(LodiServer) Requesting public key for user %u from PKE Server...\n", userID);
+
+    // Prepare request message
+    request.messageType = requestKey;
+    request.userID = userID;
+    request.publicKey = 0;
+    request.traceID = traceID;
+
+    // Configure PKE server address
+    memset(&pkeServerAddr, 0, sizeof(pkeServerAddr));
+    pkeServerAddr.sin_family = AF_INET;
+    pkeServerAddr.sin_addr.s_addr = inet_addr(pkeServerIP);
+    pkeServerAddr.sin_port = htons(pkeServerPort);
+
+    // Send request to PKE Server
+    if (sendto(sock, &request, sizeof(request), 0,
+               (struct sockaddr *)&pkeServerAddr, sizeof(pkeServerAddr)) != sizeof(request)) {
+        LOG_ERROR("(LodiServer) Error: Failed to send request to PKE Server\n");
+        return 0;
+    }
+
+    LOG_INFO("(LodiServer) Request sent to PKE Server at %s:%u\n", pkeServerIP, pkeServerPort);
+
+    // Receive response from PKE Server
+    fromSize = sizeof(fromAddr);
+    if ((recvMsgSize = recvfrom(sock, &response, sizeof(response), 0,
+                                (struct sockaddr *)&fromAddr, &fromSize)) < 0) {
+        LOG_ERROR("(LodiServer) Error: Failed to receive response from PKE Server\n");
+        return 0;
+    }
+
+    char fromIP[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &fromAddr.sin_addr, fromIP, sizeof(fromIP));
+    LOG_INFO("(LodiServer) Received response from %s:%u\n", fromIP, ntohs(fromAddr.sin_port));
+
+
+    if (response.messageType == responsePublicKey && response.userID == userID) {
+        LOG_INFO("(LodiServer) Public key received: %u\n", response.publicKey);
+        LOG_INFO("(LodiServer) Verifying digital signature...\n");
+        return response.publicKey;
+    }
+
+    LOG_ERROR("(LodiServer) Error: Invalid response from PKE Server\n");
+    return 0;
+}
+
+// Function to request TFA Authentication
+int requestTFAAuthentication(int sock, char *tfaServerIP, unsigned short tfaServerPort,
+                             unsigned int userID, unsigned long traceID) {
+    struct sockaddr_in tfaServerAddr;
+    LodiServerToTFAServer request;
+    TFAServerToLodiServer response; 
+    int recvMsgSize;
+    
+    LOG_INFO("\n(LodiServer) Requesting authentication for user %u from TFA Server...\n", userID);
+    
+    // Prepare request message
+    request.messageType = requestAuth;
+    request.userID = userID;
+    request.timestamp = 0;
+    request.digitalSig = 0;
+    request.traceID = traceID;
+    
+    // Configure TFA server address
+    memset(&tfaServerAddr, 0, sizeof(tfaServerAddr));
+    tfaServerAddr.sin_family = AF_INET;
+    tfaServerAddr.sin_addr.s_addr = inet_addr(tfaServerIP);
+    tfaServerAddr.sin_port = htons(tfaServerPort);
+    
+    // Send request to TFA Server
+    if (sendto(sock, &request, sizeof(request), 0,
+               (struct sockaddr *)&tfaServerAddr, sizeof(tfaServerAddr)) != sizeof(request)) {
+        LOG_ERROR("(LodiServer) Error: Failed to send request to TFA Server\n");
+        return 0;
+    }
+    
+    LOG_INFO("(LodiServer) Request sent to TFA Server at %s:%u\n", tfaServerIP, tfaServerPort);
+    LOG_INFO("(LodiServer) Waiting for user to approve on TFA client...\n");
+    
+    // Receive response from TFA Server
+
+    struct sockaddr_in fromAddr;
+    unsigned int fromSize = sizeof(fromAddr);
+    
+    if ((recvMsgSize = recvfrom(sock, &response, sizeof(response), 0,
+                                (struct sockaddr *)&fromAddr, &fromSize)) < 0) {
+        LOG_ERROR("(LodiServer) Error: Failed to receive response from TFA Server\n");
+        return 0;
+    }
+    
+    char fromIP[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &fromAddr.sin_addr, fromIP, sizeof(fromIP));
+    LOG_INFO("(LodiServer) Received response from %s:%u\n", fromIP, ntohs(fromAddr.sin_port));
+    
+    if (response.messageType == responseAuth && response.userID == userID) {
+        LOG_INFO("(LodiServer) Authentication successful for user %u\n", userID);
+        return 1;
+    }
+    else if (response.messageType == responseAuthFail && response.userID == userID) {
+        LOG_WARN("(LodiServer) Authentication denied for user %u\n", userID);
+        return 0;
+    }
+
+    LOG_ERROR("(LodiServer) Error: Invalid response from TFA Server\n");
+    return 0;
+}
+
+// On-disk size of a post record: header, text and checksum, padded to 8 bytes
+unsigned int postRecordSize(unsigned int length) {
+    return (sizeof(PostRecordHeader) + length + sizeof(unsigned int) + 7) & ~7U;
+}
+
+// CRC-32C lookup table, filled on first use
+unsigned int crc32cTable[256];
+pthread_once_t crc32cTableOnce = PTHREAD_ONCE_INIT;
+
+void fillCrc32cTable() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0x82F63B78U & -(crc & 1));
+        crc32cTable[i] = crc;
+    }
+}
+
+// CRC-32C of a record's header and text, the value stored after the text
+unsigned int postRecordChecksum(const PostRecordHeader *record) {
+    pthread_once(&crc32cTableOnce, fillCrc32cTable);
+    const unsigned char *bytes = (const unsigned char *)record;
+    size_t length = sizeof(PostRecordHeader) + record->length;
+    unsigned int crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < length; i++)
+        crc = (crc >> 8) ^ crc32cTable[(crc ^ bytes[i]) & 0xFF];
+    return ~crc;
+}
+
+// Checksum stored after a record's text (not aligned, so copied out)
+unsigned int storedChecksum(const PostRecordHeader *record) {
+    unsigned int checksum;
+    memcpy(&checksum, (const char *)(record + 1) + record->length, sizeof(checksum));
+    return checksum;
+}
+
+// Record of a stored post, read straight from the segment mapping
+PostRecordHeader *postRecord(int postIndex) {
+    PostLocation *location = &postLocations[postIndex];
+    return (PostRecordHeader *)(postSegments[location->segment].base + location->offset);
+}
+
+// Text of a stored post (postRecord()->length bytes, not NUL terminated)
+const char *postBody(int postIndex) {
+    return (const char *)(postRecord(postIndex) + 1);
+}
+
+// File name of a post log segment
+void postSegmentPath(char *path, size_t size, int segment) {
+    snprintf(path, size, "%s/lodi_posts_%06d.log", postLogDir, segment);
+}
+
+// Map segment file number segment (creating it if asked) and add it to postSegments.
+// Returns 1 on success, 0 if the file does not exist or cannot be mapped.
+int mapPostSegment(int segment, int create) {
+    char path[300];
+    postSegmentPath(path, sizeof(path), segment);
+
+    int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) return 0;
+
+    // Segments are allocated at full size up front so the mapping never changes
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < POST_SEGMENT_SIZE && ftruncate(fd, POST_SEGMENT_SIZE) < 0)) {
+        close(fd);
+        return 0;
+    }
+
+    char *base = mmap(NULL, POST_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    if (segmentCount == segmentCapacity) {
+        int newCapacity = segmentCapacity ? segmentCapacity * 2 : 16;
+        PostSegment *grown = realloc(postSegments, sizeof(PostSegment) * newCapacity);
+        if (grown == NULL) {
+            munmap(base, POST_SEGMENT_SIZE);
+            close(fd);
+            return 0;
+        }
+        postSegments = grown;
+        segmentCapacity = newCapacity;
+    }
+
+    postSegments[segmentCount].base = base;
+    postSegments[segmentCount].fd = fd;
+    postSegments[segmentCount].used = 0;
+    segmentCount++;
+    return 1;
+}
+
+// Remember where post postCount lives and its author and receive time columns,
+// returns 0 if out of memory
+int addPostLocation(int segment, unsigned int offset, unsigned int userID, unsigned long postedAt) {
+    if (postCount == postLocationCapacity) {
+        int newCapacity = postLocationCapacity ? postLocationCapacity * 2 : 1024;
+        PostLocation *grown = realloc(postLocations, sizeof(PostLocation) * newCapacity);
+        if (grown == NULL) return 0;
+        postLocations = grown;
+        unsigned int *authors = realloc(postAuthors, sizeof(unsigned int) * newCapacity);
+        if (authors == NULL) return 0;
+        postAuthors = authors;
+        unsigned long *times = realloc(postTimes, sizeof(unsigned long) * newCapacity);
+        if (times == NULL) return 0;
+        postTimes = times;
+        postLocationCapacity = newCapacity;
+    }
+
+    postLocations[postCount].segment = segment;
+    postLocations[postCount].offset = offset;
+    postAuthors[postCount] = userID;
+    postTimes[postCount] = postedAt;
+    if (userID > postMaxAuthor)
+        postMaxAuthor = userID;
+    postCount++;
+    return 1;
+}
+
+// Clear segment from offset on if anything was written there, returns 1 if it was.
+// Only records that were never acked can lie past the last good one; clearing
+// them keeps later appends from ever being read together with their leftovers.
+int truncatePostSegment(PostSegment *segment, unsigned int offset) {
+    unsigned int end = POST_SEGMENT_SIZE;
+    while (end > offset && segment->base[end - 1] == 0)
+        end--;
+    if (end == offset) return 0;
+
+    memset(segment->base + offset, 0, end - offset);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    unsigned int from = offset & ~(unsigned int)(pageSize - 1);
+    if (msync(segment->base + from, end - from, MS_SYNC) < 0)
+        perror("(LodiServer) Cannot truncate post log segment");
+    return 1;
+}
+
+// Map every existing segment in dir and rebuild the offset and author indexes
+// by hopping over the records. Recovery stops at the first record that is
+// missing or fails its checksum: the log is cut there and later segment files
+// are removed. Returns the number of posts recovered.
+int openPostLog(const char *dir) {
+    snprintf(postLogDir, sizeof(postLogDir), "%s", dir);
+
+    while (mapPostSegment(segmentCount, 0)) {
+        PostSegment *segment = &postSegments[segmentCount - 1];
+        unsigned int offset = 0;
+
+        while (offset + sizeof(PostRecordHeader) <= POST_SEGMENT_SIZE) {
+            PostRecordHeader *record = (PostRecordHeader *)(segment->base + offset);
+
+            // The rest of a segment is zero-filled; a torn or foreign record also ends it
+            if (record->postedAt == 0 || record->postID != (unsigned int)postCount ||
+                record->length > MAX_POST_LENGTH ||
+                offset + postRecordSize(record->length) > POST_SEGMENT_SIZE ||
+                storedChecksum(record) != postRecordChecksum(record))
+                break;
+
+            if (!addPostLocation(segmentCount - 1, offset, record->userID, record->postedAt)) return postCount;
+            AuthorPosts* author = getAuthorPosts(record->userID);
+            if (author == NULL || !appendIndex(&author->postIndex, &author->count, &author->capacity, postCount - 1))
+                LOG_ERROR("(LodiServer) ERROR: Out of memory indexing post %d\n", postCount - 1);
+            offset += postRecordSize(record->length);
+        }
+        segment->used = offset;
+
+        if (truncatePostSegment(segment, offset)) {
+            LOG_WARN("(LodiServer) Post log cut after post %d: segment %d holds a torn record\n",
+                     postCount - 1, segmentCount - 1);
+            for (int next = segmentCount; ; next++) {
+                char path[300];
+                postSegmentPath(path, sizeof(path), next);
+                if (unlink(path) < 0) break;
+                LOG_WARN("(LodiServer) Removed post log segment %d written after it\n", next);
+            }
+            break;
+        }
+    }
+
+    // Everything recovered is already on disk
+    publishedPosts = postCount;
+    syncedSegments = segmentCount;
+    syncedSegment = segmentCount ? segmentCount - 1 : 0;
+    syncedOffset = segmentCount ? postSegments[segmentCount - 1].used : 0;
+    return postCount;
+}
+
+// Unmap all segments, deleting the files if asked
+void closePostLog(int removeFiles) {
+    for (int i = 0; i < segmentCount; i++) {
+        munmap(postSegments[i].base, POST_SEGMENT_SIZE);
+        close(postSegments[i].fd);
+        if (removeFiles) {
+            char path[300];
+            postSegmentPath(path, sizeof(path), i);
+            unlink(path);
+        }
+    }
+    segmentCount = 0;
+    postCount = 0;
+    publishedPosts = 0;
+}
+
+// Append a post to the log, returns its ID or -1 if it could not be stored
+int storePost(unsigned int userID, unsigned long timestamp, const char *text, unsigned int length) {
+    unsigned int size = postRecordSize(length);
+
+    // Start a new segment when the current one cannot hold the record
+    if (segmentCount == 0 || postSegments[segmentCount - 1].used + size > POST_SEGMENT_SIZE) {
+        pthread_mutex_lock(&postLogLock);
+        int mapped = mapPostSegment(segmentCount, 1);
+        pthread_mutex_unlock(&postLogLock);
+        if (!mapped) {
+            perror("(LodiServer) Cannot create post log segment");
+            return -1;
+        }
+    }
+
+    // Keep receive times strictly increasing so they order posts exactly like their IDs.
+    // A shard only uses times equal to its index modulo the shard count, so no two
+    // shards ever give a post the same time and the router's time cursors are exact.
+    unsigned long postedAt = nowMicros();
+    if (postCount > 0 && postedAt <= postTimes[postCount - 1])
+        postedAt = postTimes[postCount - 1] + 1;
+    postedAt += (shardIndex + shardCount - postedAt % shardCount) % shardCount;
+
+    PostSegment *segment = &postSegments[segmentCount - 1];
+    PostRecordHeader *record = (PostRecordHeader *)(segment->base + segment->used);
+    if (!addPostLocation(segmentCount - 1, segment->used, userID, postedAt)) return -1;
+
+    // MAP_SHARED pages reach the disk in any order, so after a crash any part of
+    // a record may be missing; the checksum lets recovery tell
+    memcpy(record + 1, text, length);
+    record->postID = postCount - 1;
+    record->userID = userID;
+    record->length = length;
+    record->timestamp = (unsigned int)timestamp;
+    record->postedAt = postedAt;
+    unsigned int checksum = postRecordChecksum(record);
+    memcpy((char *)(record + 1) + length, &checksum, sizeof(checksum));
+
+    pthread_mutex_lock(&postLogLock);
+    segment->used += size;
+    pthread_mutex_unlock(&postLogLock);
+    return postCount - 1;
+}
+
+// Drop post postIndex and every later one (none of them published) from the log:
+// clear their records and remove the segment files started after the first one.
+// The committer's sync position moves back so the cleared bytes get flushed too.
+void truncatePostLog(int postIndex) {
+    if (postIndex >= postCount) return;
+    PostLocation cut = postLocations[postIndex];
+
+    pthread_mutex_lock(&postLogLock);
+    for (int s = segmentCount - 1; s > (int)cut.segment; s--) {
+        char path[300];
+        munmap(postSegments[s].base, POST_SEGMENT_SIZE);
+        close(postSegments[s].fd);
+        postSegmentPath(path, sizeof(path), s);
+        unlink(path);
+    }
+    segmentCount = cut.segment + 1;
+    PostSegment *segment = &postSegments[cut.segment];
+    memset(segment->base + cut.offset, 0, segment->used - cut.offset);
+    segment->used = cut.offset;
+    pthread_mutex_unlock(&postLogLock);
+
+    postCount = postIndex;
+    if (syncedSegments > segmentCount)
+        syncedSegments = segmentCount;
+    if (syncedSegment > (int)cut.segment || (syncedSegment == (int)cut.segment && syncedOffset > cut.offset)) {
+        syncedSegment = cut.segment;
+        syncedOffset = cut.offset;
+    }
+}
+
+// Flush every post stored so far to disk, returns 0 if msync() or fsync() failed
+int syncPostLog() {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    unsigned int lastUsed = 0;
+    int ok = 1;
+
+    pthread_mutex_lock(&postLogLock);
+    int lastSegment = segmentCount - 1;
+    pthread_mutex_unlock(&postLogLock);
+
+    for (int s = syncedSegment; s <= lastSegment; s++) {
+        pthread_mutex_lock(&postLogLock);
+        char *base = postSegments[s].base;
+        int fd = postSegments[s].fd;
+        unsigned int used = postSegments[s].used;
+        pthread_mutex_unlock(&postLogLock);
+
+        // Only the pages written since the last commit, msync() wants a page-aligned start
+        unsigned int from = (s == syncedSegment ? syncedOffset : 0) & ~(unsigned int)(pageSize - 1);
+        if (used > from && msync(base + from, used - from, MS_SYNC) < 0) ok = 0;
+        lastUsed = used;
+
+        // A new segment file also needs its size and directory entry on disk
+        if (s >= syncedSegments && fsync(fd) < 0) ok = 0;
+    }
+
+    if (lastSegment >= syncedSegments) {
+        int dirFd = open(postLogDir, O_RDONLY);
+        if (dirFd < 0 || fsync(dirFd) < 0) ok = 0;
+        if (dirFd >= 0) close(dirFd);
+    }
+
+    if (ok && lastSegment >= 0) {
+        syncedSegment = lastSegment;
+        syncedOffset = lastUsed;
+        syncedSegments = lastSegment + 1;
+    }
+    return ok;
+}
+
+// Hold a change's ack until its batch is durable, waits while the queue is full.
+// Must not be called under publishLock, the committer needs it to make room.
+void enqueueCommit(CommitEntry *change) {
+    pthread_mutex_lock(&commitQueueLock);
+    while (commitQueueCount == COMMIT_QUEUE_SIZE)
+        pthread_cond_wait(&commitQueueSpace, &commitQueueLock);
+
+    CommitEntry *entry = &commitQueue[(commitQueueHead + commitQueueCount) % COMMIT_QUEUE_SIZE];
+    *entry = *change;
+    entry->queuedAt = nowNanos();
+    commitQueueCount++;
+    pthread_cond_signal(&commitQueueReady);
+    pthread_mutex_unlock(&commitQueueLock);
+}
+
+// Posting list of one search term: the IDs of the posts containing it, ascending.
+// IDs are stored in blocks of SEARCH_BLOCK_IDS; a block's first ID is kept in
+// blockFirst and the rest as varint-coded gaps, so a list can be entered at any
+// block and read backwards block by block.
+typedef struct {
+    unsigned char *bytes;       // Varint gaps of every block, back to back
+    unsigned int length;
+    unsigned int capacity;
+    int *blockFirst;            // First post ID of each block
+    unsigned int *blockOffset;  // Where each block's gaps start in bytes
+    unsigned int blockCount;
+    unsigned int blockCapacity;
+    unsigned int count;         // IDs in the list
+    int lastID;                 // Newest ID added
+} PostingList;
+
+typedef struct {
+    char *token;
+    PostingList postings;
+} SearchTerm;
+
+// Inverted index from normalized tokens to posting lists (guarded by publishLock)
+typedef struct {
+    SearchTerm *terms;
+    unsigned int termCount;
+    unsigned int termCapacity;
+    unsigned int *slots;        // Term index + 1 of each hash slot, 0 for a free slot
+    unsigned int slotCount;     // Slots (power of two)
+    unsigned long postings;     // IDs in all lists
+} SearchIndex;
+
+SearchIndex searchIndex;
+
+// Split text into normalized tokens: runs of letters, digits and non-ASCII bytes,
+// lowercased and cut to SEARCH_MAX_TOKEN bytes. If hashtags is not NULL it is set
+// to 1 for each token written right after a '#'. Returns the number of tokens.
+int tokenize(const char *text, unsigned int length, char tokens[][SEARCH_MAX_TOKEN + 1], int *hashtags,
+             int maxTokens) {
+    int count = 0;
+    unsigned int i = 0;
+
+    while (i < length && count < maxTokens) {
+        unsigned char c = text[i];
+        if (!isalnum(c) && c < 0x80) {
+            i++;
+            continue;
+        }
+        if (hashtags != NULL)
+            hashtags[count] = i > 0 && text[i - 1] == '#';
+        int tokenLength = 0;
+        while (i < length && (isalnum((unsigned char)text[i]) || (unsigned char)text[i] >= 0x80)) {
+            if (tokenLength < SEARCH_MAX_TOKEN)
+                tokens[count][tokenLength++] = tolower((unsigned char)text[i]);
+            i++;
+        }
+        tokens[count][tokenLength] = '\0';
+        count++;
+    }
+    return count;
+}
+
+// FNV-1a hash of a token
+unsigned int hashToken(const char *token) {
+    unsigned int hash = 2166136261U;
+    for (; *token; token++)
+        hash = (hash ^ (unsigned char)*token) * 16777619U;
+    return hash;
+}
+
+// Hash slot holding a token, or the free slot where it would go
+unsigned int searchSlot(SearchIndex *index, const char *token) {
+    unsigned int slot = hashToken(token) & (index->slotCount - 1);
+    while (index->slots[slot] != 0 && strcmp(index->terms[index->slots[slot] - 1].token, token) != 0)
+        slot = (slot + 1) & (index->slotCount - 1);
+    return slot;
+}
+
+// Find a token's term, returns NULL if no post contains it
+SearchTerm* findSearchTerm(SearchIndex *index, const char *token) {
+    if (index->slotCount == 0) return NULL;
+    unsigned int slot = searchSlot(index, token);
+    return index->slots[slot] ? &index->terms[index->slots[slot] - 1] : NULL;
+}
+
+// Get or create a token's term, returns NULL if out of memory
+SearchTerm* getSearchTerm(SearchIndex *index, const char *token) {
+    SearchTerm *term = findSearchTerm(index, token);
+    if (term != NULL) return term;
+
+    // Keep the table at most half full so probes stay short
+    if ((index->termCount + 1) * 2 > index->slotCount) {
+        unsigned int slotCount = index->slotCount ? index->slotCount * 2 : 4096;
+        unsigned int *slots = calloc(slotCount, sizeof(unsigned int));
+        if (slots == NULL) return NULL;
+        for (unsigned int t = 0; t < index->termCount; t++) {
+            unsigned int slot = hashToken(index->terms[t].token) & (slotCount - 1);
+            while (slots[slot] != 0)
+                slot = (slot + 1) & (slotCount - 1);
+            slots[slot] = t + 1;
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->slotCount = slotCount;
+    }
+    if (index->termCount == index->termCapacity) {
+        unsigned int newCapacity = index->termCapacity ? index->termCapacity * 2 : 4096;
+        SearchTerm *grown = realloc(index->terms, sizeof(SearchTerm) * newCapacity);
+        if (grown == NULL) return NULL;
+        index->terms = grown;
+        index->termCapacity = newCapacity;
+    }
+
+    char *copy = strdup(token);
+    if (copy == NULL) return NULL;
+    unsigned int slot = searchSlot(index, token);
+    term = &index->terms[index->termCount++];
+    memset(term, 0, sizeof(SearchTerm));
+    term->token = copy;
+    term->postings.lastID = -1;
+    index->slots[slot] = index->termCount;
+    return term;
+}
+
+// Append a post ID (newer than every ID in the list), returns 0 if out of memory
+int postingAppend(PostingList *list, int postID) {
+    if (postID <= list->lastID) return 1;
+
+    if (list->count % SEARCH_BLOCK_IDS == 0) {
+        // Start a new block, its first ID is kept outside the byte stream
+        if (list->blockCount == list->blockCapacity) {
+            unsigned int newCapacity = list->blockCapacity ? list->blockCapacity * 2 : 1;
+            int *first = realloc(list->blockFirst, sizeof(int) * newCapacity);
+            if (first == NULL) return 0;
+            list->blockFirst = first;
+            unsigned int *offsets = realloc(list->blockOffset, sizeof(unsigned int) * newCapacity);
+            if (offsets == NULL) return 0;
+            list->blockOffset = offsets;
+            list->blockCapacity = newCapacity;
+        }
+        list->blockFirst[list->blockCount] = postID;
+        list->blockOffset[list->blockCount] = list->length;
+        list->blockCount++;
+    } else {
+        if (list->length + 5 > list->capacity) {
+            unsigned int newCapacity = list->capacity ? list->capacity * 2 : 8;
+            unsigned char *grown = realloc(list->bytes, newCapacity);
+            if (grown == NULL) return 0;
+            list->bytes = grown;
+            list->capacity = newCapacity;
+        }
+        // Gap to the previous ID, seven bits per byte, high bit set on all but the last
+        unsigned int gap = postID - list->lastID;
+        while (gap >= 0x80) {
+            list->bytes[list->length++] = (gap & 0x7F) | 0x80;
+            gap >>= 7;
+        }
+        list->bytes[list->length++] = gap;
+    }
+
+    list->count++;
+    list->lastID = postID;
+    return 1;
+}
+
+// Decode one block into ids (ascending), returns how many IDs it holds
+int postingDecodeBlock(PostingList *list, unsigned int block, int *ids) {
+    unsigned int offset = list->blockOffset[block];
+    unsigned int end = block + 1 < list->blockCount ? list->blockOffset[block + 1] : list->length;
+    int count = 0;
+
+    ids[count++] = list->blockFirst[block];
+    while (offset < end) {
+        unsigned int gap = 0;
+        int shift = 0;
+        while (list->bytes[offset] & 0x80) {
+            gap |= (unsigned int)(list->bytes[offset++] & 0x7F) << shift;
+            shift += 7;
+        }
+        gap |= (unsigned int)list->bytes[offset++] << shift;
+        ids[count] = ids[count - 1] + gap;
+        count++;
+    }
+    return count;
+}
+
+// Reads a posting list one decoded block at a time
+typedef struct {
+    PostingList *list;
+    int block;                  // Block held in ids, -1 for none
+    int ids[SEARCH_BLOCK_IDS];
+    int count;
+} PostingCursor;
+
+// Whether the list holds postID, decoding only the block it would be in
+int postingContains(PostingCursor *cursor, int postID) {
+    PostingList *list = cursor->list;
+    if (list->count == 0 || postID < list->blockFirst[0] || postID > list->lastID) return 0;
+
+    // Last block starting at or before postID
+    int low = 0, high = list->blockCount - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (list->blockFirst[mid] <= postID)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    if (cursor->block != low) {
+        cursor->count = postingDecodeBlock(list, low, cursor->ids);
+        cursor->block = low;
+    }
+
+    int first = 0, last = cursor->count - 1;
+    while (first <= last) {
+        int mid = first + (last - first) / 2;
+        if (cursor->ids[mid] == postID) return 1;
+        if (cursor->ids[mid] < postID)
+            first = mid + 1;
+        else
+            last = mid - 1;
+    }
+    return 0;
+}
+
+// Add every token of a post to the index, returns 0 if out of memory
+int indexPostText(SearchIndex *index, int postID, const char *text, unsigned int length) {
+    char tokens[SEARCH_MAX_TOKENS][SEARCH_MAX_TOKEN + 1];
+    int tokenCount = tokenize(text, length, tokens, NULL, SEARCH_MAX_TOKENS);
+
+    for (int i = 0; i < tokenCount; i++) {
+        SearchTerm *term = getSearchTerm(index, tokens[i]);
+        if (term == NULL) return 0;
+        unsigned int before = term->postings.count;
+        if (!postingAppend(&term->postings, postID)) return 0;
+        index->postings += term->postings.count - before;
+    }
+    return 1;
+}
+
+// Bytes used by the index
+unsigned long searchIndexBytes(SearchIndex *index) {
+    unsigned long bytes = sizeof(unsigned int) * index->slotCount + sizeof(SearchTerm) * index->termCapacity;
+    for (unsigned int t = 0; t < index->termCount; t++) {
+        PostingList *list = &index->terms[t].postings;
+        bytes += strlen(index->terms[t].token) + 1 + list->capacity +
+                 (sizeof(int) + sizeof(unsigned int)) * list->blockCapacity;
+    }
+    return bytes;
+}
+
+int comparePostingCounts(const void *a, const void *b) {
+    unsigned int x = (*(PostingCursor * const *)a)->list->count;
+    unsigned int y = (*(PostingCursor * const *)b)->list->count;
+    return (x > y) - (x < y);
+}
+
+// Newest posts (below bound) containing every token of the query, at most limit.
+// The rarest token's list is walked backwards a block at a time and each candidate
+// is checked against the other lists, so only a few blocks are ever decoded.
+// Returns the number of results, or -1 if the query has no tokens.
+int searchPosts(SearchIndex *index, const char *query, int bound, int limit, int *results) {
+    char tokens[SEARCH_MAX_TOKENS][SEARCH_MAX_TOKEN + 1];
+    int tokenCount = tokenize(query, strlen(query), tokens, NULL, SEARCH_MAX_TOKENS);
+    if (tokenCount == 0) return -1;
+
+    PostingCursor *cursors = malloc(sizeof(PostingCursor) * tokenCount);
+    PostingCursor **order = malloc(sizeof(PostingCursor *) * tokenCount);
+    if (cursors == NULL || order == NULL) {
+        free(cursors);
+        free(order);
+        return 0;
+    }
+    for (int i = 0; i < tokenCount; i++) {
+        SearchTerm *term = findSearchTerm(index, tokens[i]);
+        if (term == NULL) {
+            free(cursors);
+            free(order);
+            return 0;
+        }
+        cursors[i].list = &term->postings;
+        cursors[i].block = -1;
+        order[i] = &cursors[i];
+    }
+    qsort(order, tokenCount, sizeof(PostingCursor *), comparePostingCounts);
+
+    PostingCursor *rarest = order[0];
+    int found = 0;
+    for (int block = (int)rarest->list->blockCount - 1; block >= 0 && found < limit; block--) {
+        if (rarest->list->blockFirst[block] >= bound) continue;
+        rarest->count = postingDecodeBlock(rarest->list, block, rarest->ids);
+        rarest->block = block;
+
+        for (int i = rarest->count - 1; i >= 0 && found < limit; i--) {
+            int postID = rarest->ids[i];
+            if (postID >= bound) continue;
+            int match = 1;
+            for (int t = 1; t < tokenCount && match; t++)
+                match = order[t]->list == rarest->list || postingContains(order[t], postID);
+            if (match)
+                results[found++] = postID;
+        }
+    }
+
+    free(cursors);
+    free(order);
+    return found;
+}
+
+// Index the posts recovered from the post log
+void buildSearchIndex() {
+    unsigned long start = nowNanos();
+    for (int i = 0; i < postCount; i++) {
+        if (!indexPostText(&searchIndex, i, postBody(i), postRecord(i)->length)) {
+            LOG_ERROR("(LodiServer) ERROR: Out of memory building the search index\n");
+            break;
+        }
+    }
+    LOG_INFO("(LodiServer) Search index: %u terms, %lu postings in %.1f MB, built in %.1f ms\n",
+           searchIndex.termCount, searchIndex.postings, searchIndexBytes(&searchIndex) / 1048576.0,
+           (nowNanos() - start) / 1e6);
+}
+
+// Heavy hitters of one window: the TRENDING_TOP keys with the largest estimated
+// weight, as a min-heap so the weakest one is replaced first
+typedef struct {
+    char key[SEARCH_MAX_TOKEN + 2];     // Hashtags keep their '#'
+    double weight;
+} TrendingEntry;
+
+typedef struct {
+    TrendingEntry entries[TRENDING_TOP];
+    int count;
+} TrendingHeap;
+
+// Streaming counts over one sliding window. Counts decay exponentially with a mean
+// lifetime of the window, using forward decay: a post at time t adds
+// e^((t - landmark) / lifetime), and estimates are scaled back down when read.
+// Every weight grows by the same factor, so heap order never goes stale. The
+// count-min sketch and heaps are fixed size, memory does not grow with posts.
+typedef struct {
+    const char *name;
+    double lifetimeMicros;
+    unsigned long landmark;             // Time the weights are measured from, 0 before the first post
+    float counters[TRENDING_DEPTH][TRENDING_WIDTH];
+    TrendingHeap hashtags;
+    TrendingHeap terms;
+} TrendingWindow;
+
+// Trending windows (guarded by publishLock)
+TrendingWindow trendingWindows[TRENDING_WINDOWS] = {{"5m", 300e6}, {"1h", 3600e6}};
+
+// Common words never reported as trending terms
+const char *trendingStopWords[] = {
+    "the", "and", "for", "you", "are", "was", "but", "not", "with", "this", "that", "have",
+    "from", "they", "just", "its", "all", "can", "what", "out", "our", "your", "about",
+    "will", "has", "had", "get", "got", "one", "who", "how", "why", "when", "there", NULL
+};
+
+int isTrendingTerm(const char *token) {
+    if (strlen(token) < 3) return 0;
+    for (int i = 0; trendingStopWords[i] != NULL; i++) {
+        if (strcmp(token, trendingStopWords[i]) == 0) return 0;
+    }
+    return 1;
+}
+
+// Scale every weight of a window by factor
+void scaleTrendingWindow(TrendingWindow *window, double factor) {
+    for (int row = 0; row < TRENDING_DEPTH; row++) {
+        for (int i = 0; i < TRENDING_WIDTH; i++)
+            window->counters[row][i] *= factor;
+    }
+    for (int i = 0; i < window->hashtags.count; i++)
+        window->hashtags.entries[i].weight *= factor;
+    for (int i = 0; i < window->terms.count; i++)
+        window->terms.entries[i].weight *= factor;
+}
+
+// Add weight to a key with a conservative update (only the smallest counters
+// grow), returns the key's new estimate
+double sketchAdd(TrendingWindow *window, const char *key, double weight) {
+    unsigned int hash = hashToken(key);
+    unsigned int slots[TRENDING_DEPTH];
+    double estimate = -1;
+
+    for (int row = 0; row < TRENDING_DEPTH; row++) {
+        // Remix the hash per row so keys sharing low bits part ways
+        unsigned int mixed = hash ^ (row * 0x9E3779B9U);
+        mixed ^= mixed >> 16;
+        mixed *= 0x85EBCA6BU;
+        mixed ^= mixed >> 13;
+        mixed *= 0xC2B2AE35U;
+        mixed ^= mixed >> 16;
+        slots[row] = mixed & (TRENDING_WIDTH - 1);
+        if (estimate < 0 || window->counters[row][slots[row]] < estimate)
+            estimate = window->counters[row][slots[row]];
+    }
+    estimate += weight;
+    for (int row = 0; row < TRENDING_DEPTH; row++) {
+        if (window->counters[row][slots[row]] < estimate)
+            window->counters[row][slots[row]] = estimate;
+    }
+    return estimate;
+}
+
+void trendingSiftDown(TrendingHeap *heap, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap->count && heap->entries[left].weight < heap->entries[smallest].weight) smallest = left;
+        if (right < heap->count && heap->entries[right].weight < heap->entries[smallest].weight) smallest = right;
+        if (smallest == i) return;
+
+        TrendingEntry tmp = heap->entries[i];
+        heap->entries[i] = heap->entries[smallest];
+        heap->entries[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Offer a key with its new estimate to the heavy hitters
+void trendingOffer(TrendingHeap *heap, const char *key, double estimate) {
+    // Estimates only grow, so a key at or below the weakest entry is not in the heap
+    if (heap->count == TRENDING_TOP && estimate <= heap->entries[0].weight) return;
+
+    for (int i = 0; i < heap->count; i++) {
+        if (strcmp(heap->entries[i].key, key) == 0) {
+            heap->entries[i].weight = estimate;
+            trendingSiftDown(heap, i);
+            return;
+        }
+    }
+
+    if (heap->count < TRENDING_TOP) {
+        // Sift the new entry up
+        int i = heap->count++;
+        while (i > 0 && heap->entries[(i - 1) / 2].weight > estimate) {
+            heap->entries[i] = heap->entries[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        snprintf(heap->entries[i].key, sizeof(heap->entries[i].key), "%s", key);
+        heap->entries[i].weight = estimate;
+    } else if (estimate > heap->entries[0].weight) {
+        snprintf(heap->entries[0].key, sizeof(heap->entries[0].key), "%s", key);
+        heap->entries[0].weight = estimate;
+        trendingSiftDown(heap, 0);
+    }
+}
+
+// Count the hashtags and terms of a post posted at postedAt (microseconds) in every
+// window. A post counts once per key however often it repeats it.
+void countTrending(const char *text, unsigned int length, unsigned long postedAt) {
+    char tokens[SEARCH_MAX_TOKENS][SEARCH_MAX_TOKEN + 1];
+    int hashtags[SEARCH_MAX_TOKENS];
+    int tokenCount = tokenize(text, length, tokens, hashtags, SEARCH_MAX_TOKENS);
+
+    // Keys counted for this post, hashtags prefixed with '#'
+    char keys[SEARCH_MAX_TOKENS][SEARCH_MAX_TOKEN + 2];
+    int keyCount = 0;
+    for (int i = 0; i < tokenCount; i++) {
+        if (!hashtags[i] && !isTrendingTerm(tokens[i])) continue;
+        snprintf(keys[keyCount], sizeof(keys[keyCount]), "%s%s", hashtags[i] ? "#" : "", tokens[i]);
+
+        int repeated = 0;
+        for (int j = 0; j < keyCount && !repeated; j++)
+            repeated = strcmp(keys[j], keys[keyCount]) == 0;
+        if (!repeated) keyCount++;
+    }
+
+    for (int w = 0; w < TRENDING_WINDOWS; w++) {
+        TrendingWindow *window = &trendingWindows[w];
+        if (window->landmark == 0)
+            window->landmark = postedAt;
+
+        // Rescale before the weights get too large for a float
+        double age = ((double)postedAt - window->landmark) / window->lifetimeMicros;
+        if (age > TRENDING_RESCALE) {
+            scaleTrendingWindow(window, exp(-age));
+            window->landmark = postedAt;
+            age = 0;
+        }
+        double weight = exp(age);
+
+        for (int k = 0; k < keyCount; k++) {
+            double estimate = sketchAdd(window, keys[k], weight);
+            trendingOffer(keys[k][0] == '#' ? &window->hashtags : &window->terms, keys[k], estimate);
+        }
+    }
+}
+
+// Count the posts recent enough to still weigh in the longest window
+void buildTrending() {
+    double longest = 0;
+    for (int w = 0; w < TRENDING_WINDOWS; w++) {
+        if (trendingWindows[w].lifetimeMicros > longest)
+            longest = trendingWindows[w].lifetimeMicros;
+    }
+
+    unsigned long now = nowMicros();
+    unsigned long since = now > TRENDING_REPLAY_LIFETIMES * longest ? now - TRENDING_REPLAY_LIFETIMES * longest : 0;
+    int first = postCount;
+    while (first > 0 && postTimes[first - 1] >= since)
+        first--;
+    for (int i = first; i < postCount; i++)
+        countTrending(postBody(i), postRecord(i)->length, postTimes[i]);
+    LOG_INFO("(LodiServer) Trending: %d recent posts counted, %lu KB of sketches\n",
+           postCount - first, (unsigned long)sizeof(trendingWindows) / 1024);
+}
+
+int compareTrendingEntries(const void *a, const void *b) {
+    double x = ((const TrendingEntry *)a)->weight;
+    double y = ((const TrendingEntry *)b)->weight;
+    return (x < y) - (x > y);
+}
+
+// Top entries of a heap, heaviest first, with weights turned into decayed post counts at now.
+// Returns how many were written to top.
+int trendingTop(TrendingWindow *window, TrendingHeap *heap, unsigned long now, int limit, TrendingEntry *top) {
+    memcpy(top, heap->entries, sizeof(TrendingEntry) * heap->count);
+    qsort(top, heap->count, sizeof(TrendingEntry), compareTrendingEntries);
+
+    double scale = exp(-((double)now - window->landmark) / window->lifetimeMicros);
+    int count = heap->count < limit ? heap->count : limit;
+    for (int i = 0; i < count; i++)
+        top[i].weight *= scale;
+    return count;
+}
+
+// Connection kept open by a subscribe request, new posts by followed authors are pushed down it
+typedef struct {
+    unsigned int userID;
+    int clientSocket;
+    int varlen;                        // Wire format of the subscribe request
+} Subscriber;
+
+// Live feed subscribers (guarded by publishLock)
+Subscriber subscribers[MAX_SUBSCRIBERS];
+int subscriberCount = 0;
+
+// Close a subscriber's connection and drop it from the table
+void dropSubscriber(int i, const char *reason) {
+    LOG_INFO("(LodiServer) Dropping live feed subscriber for user %u (%s)\n", subscribers[i].userID, reason);
+    close(subscribers[i].clientSocket);
+    subscribers[i] = subscribers[--subscriberCount];
+}
+
+// Drop subscribers whose client has hung up
+void pruneSubscribers() {
+    for (int i = subscriberCount - 1; i >= 0; i--) {
+        char byte;
+        if (recv(subscribers[i].clientSocket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+            dropSubscriber(i, "client closed the connection");
+    }
+}
+
+// Push a newly stored post to every subscriber following its author. Sends never
+// block: a subscriber whose socket buffer is full is too slow and is dropped.
+void pushPostToSubscribers(int postIndex) {
+    if (subscriberCount == 0) return;
+
+    PostRecordHeader *record = postRecord(postIndex);
+    LodiServerMessage legacy;
+    legacy.messageType = ackFeed;
+    snprintf(legacy.message, sizeof(legacy.message), "#%d User %u: %.*s", postIndex, record->userID,
+             (int)record->length, postBody(postIndex));
+
+    FeedFrameHeader header;
+    header.messageType = ackFeed;
+    header.postCount = 1;
+    header.flags = FEED_FRAME_LAST | FEED_FRAME_VARLEN | FEED_FRAME_LIVE;
+    char frame[sizeof(FeedFrameHeader) + sizeof(PostRecordHeader) + MAX_POST_LENGTH];
+    memcpy(frame + sizeof(FeedFrameHeader), record, sizeof(PostRecordHeader));
+    memcpy(frame + sizeof(FeedFrameHeader) + sizeof(PostRecordHeader), postBody(postIndex), record->length);
+    size_t frameLength = sizeof(FeedFrameHeader) + sizeof(PostRecordHeader) + record->length;
+
+    int pushed = 0;
+    for (int i = subscriberCount - 1; i >= 0; i--) {
+        Subscriber *subscriber = &subscribers[i];
+        FollowList* list = findFollowList(&followingGraph, subscriber->userID);
+        if (list == NULL || !followListContains(&followingGraph, list, record->userID)) continue;
+
+        char *bytes = (char *)&legacy;
+        size_t length = sizeof(legacy);
+        if (subscriber->varlen) {
+            header.userID = subscriber->userID;
+            memcpy(frame, &header, sizeof(header));
+            bytes = frame;
+            length = frameLength;
+        } else {
+            legacy.userID = subscriber->userID;
+        }
+
+        // A partial frame cannot be finished later without blocking, so it ends the subscription too
+        ssize_t sent = send(subscriber->clientSocket, bytes, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent != (ssize_t)length)
+            dropSubscriber(i, sent < 0 ? "connection lost or too slow" : "too slow");
+        else
+            pushed++;
+    }
+    if (pushed > 0)
+        LOG_INFO("(LodiServer) Post %d pushed to %d live subscriber(s)\n", postIndex, pushed);
+}
+
+// Wire format a feed page was serialized in, part of the cache key
+enum {feedFormatLegacy, feedFormatBatched, feedFormatVarlen, feedFormatLogLayout,
+      feedFormatCompressed = 0x10};   // Added to a framed format for clients that take compressed pages
+
+// One serialized feed response, kept to answer a repeat of the same request
+typedef struct FeedCacheEntry {
+    unsigned int userID;
+    int format;                        // feedFormatLegacy, feedFormatBatched, feedFormatVarlen or feedFormatLogLayout,
+                                       // plus feedFormatCompressed
+    int limit;                         // Key: the request as the client sent it
+    int cursorType;
+    unsigned long cursor;
+    int after;                         // The page ran forwards from the cursor
+    int full;                          // The page held limit posts
+    char *bytes;                       // Exactly what was sent to the client
+    size_t length;
+    struct FeedCacheEntry *newer;      // LRU list
+    struct FeedCacheEntry *older;
+    struct FeedCacheEntry *nextOfUser; // Other cached pages of the same user
+} FeedCacheEntry;
+
+typedef struct {
+    unsigned int userID;
+    FeedCacheEntry *entries;
+} FeedCacheUser;
+
+// Per-user cache of serialized feed pages, bounded by maxBytes with LRU eviction
+// (guarded by publishLock)
+typedef struct {
+    FeedCacheUser *users;
+    unsigned int userCount;
+    unsigned int userCapacity;
+    UserDirectory directory;           // userID -> index in users
+    FeedCacheEntry *newest;
+    FeedCacheEntry *oldest;
+    int entryCount;
+    size_t bytes;                      // Entries and their serialized pages
+    size_t maxBytes;                   // 0 turns the cache off (-c)
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;       // Entries dropped because their page changed
+    unsigned long evictions;           // Entries dropped to stay within maxBytes
+} FeedCache;
+
+FeedCache feedCache = {.maxBytes = (size_t)FEED_CACHE_DEFAULT_MB << 20};
+
+// Cache slot of a user, created on demand. Returns NULL if out of memory or create is 0.
+FeedCacheUser* findFeedCacheUser(unsigned int userID, int create) {
+    int position = directoryFind(&feedCache.directory, userID);
+    if (position >= 0) return &feedCache.users[position];
+    if (!create) return NULL;
+
+    if (feedCache.userCount == feedCache.userCapacity) {
+        unsigned int newCapacity = feedCache.userCapacity ? feedCache.userCapacity * 2 : 256;
+        FeedCacheUser *grown = realloc(feedCache.users, sizeof(FeedCacheUser) * newCapacity);
+        if (grown == NULL) return NULL;
+        feedCache.users = grown;
+        feedCache.userCapacity = newCapacity;
+    }
+    if (!directoryInsert(&feedCache.directory, userID, feedCache.userCount)) return NULL;
+
+    FeedCacheUser *user = &feedCache.users[feedCache.userCount++];
+    user->userID = userID;
+    user->entries = NULL;
+    return user;
+}
+
+// Unlink an entry from the LRU list and its user and free it
+void dropFeedCacheEntry(FeedCacheEntry *entry) {
+    if (entry->newer) entry->newer->older = entry->older; else feedCache.newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer; else feedCache.oldest = entry->newer;
+
+    FeedCacheUser *user = findFeedCacheUser(entry->userID, 0);
+    FeedCacheEntry **link = &user->entries;
+    while (*link != entry)
+        link = &(*link)->nextOfUser;
+    *link = entry->nextOfUser;
+
+    feedCache.entryCount--;
+    feedCache.bytes -= sizeof(FeedCacheEntry) + entry->length;
+    free(entry->bytes);
+    free(entry);
+}
+
+// Cached page for exactly this request, or NULL. A hit becomes the newest entry.
+FeedCacheEntry* lookupFeedCache(PClientToLodiServer *msg, int format) {
+    if (feedCache.maxBytes == 0) return NULL;
+
+    FeedCacheUser *user = findFeedCacheUser(msg->userID, 0);
+    FeedCacheEntry *entry = user != NULL ? user->entries : NULL;
+    while (entry != NULL && (entry->format != format || entry->limit != msg->feedLimit ||
+                             entry->cursorType != msg->cursorType || entry->cursor != msg->cursor))
+        entry = entry->nextOfUser;
+
+    if (entry == NULL) {
+        feedCache.misses++;
+        return NULL;
+    }
+    feedCache.hits++;
+    if (entry != feedCache.newest) {
+        entry->newer->older = entry->older;
+        if (entry->older) entry->older->newer = entry->newer; else feedCache.oldest = entry->newer;
+        entry->newer = NULL;
+        entry->older = feedCache.newest;
+        feedCache.newest->newer = entry;
+        feedCache.newest = entry;
+    }
+    return entry;
+}
+
+// Keep a serialized page for later repeats of msg, evicting the least recently
+// used pages to make room. Takes ownership of bytes.
+void storeFeedCache(PClientToLodiServer *msg, int format, int after, int full, char *bytes, size_t length) {
+    size_t needed = sizeof(FeedCacheEntry) + length;
+    if (needed > feedCache.maxBytes) {
+        free(bytes);
+        return;
+    }
+    while (feedCache.bytes + needed > feedCache.maxBytes) {
+        dropFeedCacheEntry(feedCache.oldest);
+        feedCache.evictions++;
+    }
+
+    FeedCacheUser *user = findFeedCacheUser(msg->userID, 1);
+    FeedCacheEntry *entry = malloc(sizeof(FeedCacheEntry));
+    if (user == NULL || entry == NULL) {
+        free(entry);
+        free(bytes);
+        return;
+    }
+    entry->userID = msg->userID;
+    entry->format = format;
+    entry->limit = msg->feedLimit;
+    entry->cursorType = msg->cursorType;
+    entry->cursor = msg->cursor;
+    entry->after = after;
+    entry->full = full;
+    entry->bytes = bytes;
+    entry->length = length;
+
+    entry->newer = NULL;
+    entry->older = feedCache.newest;
+    if (feedCache.newest) feedCache.newest->newer = entry; else feedCache.oldest = entry;
+    feedCache.newest = entry;
+    entry->nextOfUser = user->entries;
+    user->entries = entry;
+
+    feedCache.entryCount++;
+    feedCache.bytes += needed;
+}
+
+// Drop every cached page of a user (their following list changed)
+void invalidateUserFeedCache(unsigned int userID) {
+    FeedCacheUser *user = findFeedCacheUser(userID, 0);
+    while (user != NULL && user->entries != NULL) {
+        dropFeedCacheEntry(user->entries);
+        feedCache.invalidations++;
+    }
+}
+
+// Drop the pages of one follower that a new post by someone they follow lands in.
+// The post is newer than every stored post, so forward pages only change if they
+// were not full yet and backward pages only if their cursor lies after the post.
+// Timelines also lose old posts as new ones are pushed, so every page of a
+// fan-out-on-write user changes.
+void invalidateFollowerFeedCache(unsigned int userID, int postIndex, unsigned long postedAt) {
+    FeedCacheUser *user = findFeedCacheUser(userID, 0);
+    FeedCacheEntry *entry = user != NULL ? user->entries : NULL;
+
+    while (entry != NULL) {
+        FeedCacheEntry *next = entry->nextOfUser;
+        int affected;
+        if (feedMode == feedModeWrite || feedMode == feedModeHybrid)
+            affected = 1;
+        else if (entry->after)
+            affected = !entry->full;
+        else if (entry->cursorType == cursorBeforeID)
+            affected = (unsigned long)postIndex < entry->cursor;
+        else if (entry->cursorType == cursorBeforeTime)
+            affected = postedAt < entry->cursor;
+        else
+            affected = 1;
+
+        if (affected) {
+            dropFeedCacheEntry(entry);
+            feedCache.invalidations++;
+        }
+        entry = next;
+    }
+}
+
+// A new post: invalidate the affected pages of the author's followers. Walks
+// whichever is smaller, the author's followers or the users in the cache.
+void invalidateFeedCacheForPost(unsigned int authorID, int postIndex, unsigned long postedAt) {
+    if (feedCache.entryCount == 0) return;
+
+    if ((unsigned int)getFollowerCount(authorID) <= feedCache.userCount) {
+        pthread_mutex_lock(&fanoutLock);
+        FollowerSet* set = findFollowerSet(&followerIndex, authorID);
+        unsigned long cursor = 0;
+        unsigned int followerID;
+        while (set != NULL && roaringNext(&set->followers, &cursor, &followerID))
+            invalidateFollowerFeedCache(followerID, postIndex, postedAt);
+        pthread_mutex_unlock(&fanoutLock);
+        return;
+    }
+
+    for (unsigned int i = 0; i < feedCache.userCount; i++) {
+        if (feedCache.users[i].entries == NULL) continue;
+        FollowList* list = findFollowList(&followingGraph, feedCache.users[i].userID);
+        if (list != NULL && followListContains(&followingGraph, list, authorID))
+            invalidateFollowerFeedCache(feedCache.users[i].userID, postIndex, postedAt);
+    }
+}
+
+// Print the feed cache counters
+void printFeedCacheStats() {
+    unsigned long lookups = feedCache.hits + feedCache.misses;
+    LOG_INFO("(LodiServer) Feed cache: %lu hits, %lu misses (%.1f%% hit rate), %d pages in %.1f of %.1f MB, "
+           "%lu invalidated, %lu evicted\n",
+           feedCache.hits, feedCache.misses, lookups ? 100.0 * feedCache.hits / lookups : 0.0,
+           feedCache.entryCount, feedCache.bytes / 1048576.0, feedCache.maxBytes / 1048576.0,
+           feedCache.invalidations, feedCache.evictions);
+}
+
+// Handle post message: store the post, which stays invisible until publishPost().
+// Returns its index if the ack must wait for the group commit, -1 if it failed.
+int handlePost(PClientToLodiServer *msg, LodiServerMessage *response) {
+    LOG_INFO("\n(LodiServer) --- HANDLE POST ---\n");
+    LOG_INFO("(LodiServer) User %u wants to post: \"%s\"\n", msg->userID, msg->message);
+
+    // Store the post, only its actual length is kept
+    unsigned int length = strnlen(msg->message, MAX_POST_LENGTH);
+    int postIndex = storePost(msg->userID, msg->timestamp, msg->message, length);
+    if (postIndex < 0) {
+        LOG_ERROR("(LodiServer) ERROR: Could not append post to the log\n");
+        response->messageType = ackPost;
+        response->userID = msg->userID;
+        strcpy(response->message, "Error: Server could not store the post");
+        return -1;
+    }
+
+    LOG_INFO("(LodiServer) Post stored at index %d\n", postIndex);
+    LOG_INFO("(LodiServer) User ID: %u\n", postRecord(postIndex)->userID);
+    LOG_INFO("(LodiServer) Timestamp: %u\n", postRecord(postIndex)->timestamp);
+    LOG_INFO("(LodiServer) Message: \"%.*s\" (%u bytes)\n", (int)length, postBody(postIndex), length);
+    LOG_INFO("(LodiServer) Total posts now: %d\n", postCount);
+
+    // Send success response
+    response->messageType = ackPost;
+    response->userID = msg->userID;
+    strcpy(response->message, "Post successful");
+    LOG_INFO("(LodiServer) Post successfully stored, ack waits for group commit\n");
+    return postIndex;
+}
+
+// Make a durable post visible: index it under its author and for search and
+// trending, drop the cached feed pages it lands in, push it to live subscribers
+// and fan it out to followers. Runs on the committer under publishLock, in post order.
+void publishPost(int postIndex) {
+    unsigned int userID = postRecord(postIndex)->userID;
+    unsigned int length = postRecord(postIndex)->length;
+    publishedPosts = postIndex + 1;
+
+    // Index the post under its author
+    AuthorPosts* author = getAuthorPosts(userID);
+    if (author == NULL || !appendIndex(&author->postIndex, &author->count, &author->capacity, postIndex))
+        LOG_ERROR("(LodiServer) ERROR: Out of memory indexing post\n");
+
+    // Cached feed pages of followers that this post lands in are stale now
+    invalidateFeedCacheForPost(userID, postIndex, postTimes[postIndex]);
+    pushPostToSubscribers(postIndex);
+    if (!indexPostText(&searchIndex, postIndex, postBody(postIndex), length))
+        LOG_ERROR("(LodiServer) ERROR: Out of memory adding post to the search index\n");
+    countTrending(postBody(postIndex), length, postTimes[postIndex]);
+
+    if (feedMode == feedModeHybrid && author != NULL &&
+        getFollowerCount(userID) > hybridThreshold) {
+        // Too many followers to push to, readers merge this post in at read time
+        LOG_INFO("(LodiServer) User %u is above the hybrid threshold, post will be merged at read time\n",
+               userID);
+        if (!appendIndex(&author->pulledIndex, &author->pulledCount, &author->pulledCapacity, postIndex))
+            LOG_ERROR("(LodiServer) ERROR: Out of memory indexing post\n");
+    } else if ((feedMode == feedModeWrite || feedMode == feedModeHybrid) &&
+               !enqueueFanout(postIndex, userID)) {
+        // Hand the post to the fan-out thread, only fan out inline if its queue is full
+        LOG_WARN("(LodiServer) Fan-out queue full, pushing post to followers inline\n");
+        fanoutPost(postIndex, userID);
+    }
+}
+
+// Add idol to a user's following list and the reverse index.
+// Returns 1 if added, 0 if already following, -1 if out of memory or the ID is reserved
+int addFollowing(unsigned int userID, unsigned int idolID) {
+    FollowList* userList = getFollowList(&followingGraph, userID);
+    if (userList == NULL) return -1;
+
+    int added = followListAdd(&followingGraph, userList, idolID);
+    if (added > 0) {
+        addFollower(idolID, userID);
+        invalidateUserFeedCache(userID);
+    }
+    return added;
+}
+
+// Remove idol from a user's following list and the reverse index.
+// Returns 1 if removed, 0 if not following them, -1 if the user follows nobody, -2 if out of memory
+int removeFollowing(unsigned int userID, unsigned int idolID) {
+    FollowList* userList = findFollowList(&followingGraph, userID);
+    if (userList == NULL || userList->count == 0) return -1;
+
+    int removed = followListRemove(&followingGraph, userList, idolID);
+    if (removed < 0) return -2;
+    if (removed > 0) {
+        removeFollower(idolID, userID);
+        invalidateUserFeedCache(userID);
+    }
+    return removed;
+}
+
+int compareFollowListUsers(const void *a, const void *b) {
+    unsigned int x = followingGraph.lists[*(const unsigned int *)a].userID;
+    unsigned int y = followingGraph.lists[*(const unsigned int *)b].userID;
+    return (x > y) - (x < y);
+}
+
+// Fill the reverse index from the following lists in two counting passes:
+// every idol's followers are laid out as a sorted slice of one array, and each
+// slice is then packed into containers in one go. Returns 0 if out of memory.
+int fillFollowerIndex() {
+    unsigned int listCount = followingGraph.listCount;
+    unsigned long cursor;
+    unsigned int id;
+
+    // Count each idol's followers (held in the still empty set's count for now)
+    for (unsigned int i = 0; i < listCount; i++) {
+        for (cursor = 0; nextInFollowList(&followingGraph, &followingGraph.lists[i], &cursor, &id);) {
+            FollowerSet* set = getFollowerSet(&followerIndex, id);
+            if (set == NULL) return 0;
+            set->followers.count++;
+        }
+    }
+
+    unsigned int setCount = followerIndex.setCount;
+    unsigned long *starts = malloc(sizeof(unsigned long) * (setCount + 1));
+    unsigned int *order = malloc(sizeof(unsigned int) * (listCount ? listCount : 1));
+    unsigned int *ids = malloc(sizeof(unsigned int) * (followingGraph.edgeCount ? followingGraph.edgeCount : 1));
+    if (starts == NULL || order == NULL || ids == NULL) {
+        free(starts);
+        free(order);
+        free(ids);
+        return 0;
+    }
+
+    starts[0] = 0;
+    for (unsigned int i = 0; i < setCount; i++) {
+        starts[i + 1] = starts[i] + followerIndex.sets[i].followers.count;
+        followerIndex.sets[i].followers.count = 0;
+    }
+
+    // Visiting followers in user ID order leaves every slice sorted
+    for (unsigned int i = 0; i < listCount; i++)
+        order[i] = i;
+    qsort(order, listCount, sizeof(unsigned int), compareFollowListUsers);
+    for (unsigned int i = 0; i < listCount; i++) {
+        FollowList* user = &followingGraph.lists[order[i]];
+        for (cursor = 0; nextInFollowList(&followingGraph, user, &cursor, &id);) {
+            FollowerSet* set = findFollowerSet(&followerIndex, id);
+            ids[starts[set - followerIndex.sets] + set->followers.count++] = user->userID;
+        }
+    }
+
+    int ok = 1;
+    for (unsigned int i = 0; ok && i < setCount; i++) {
+        RoaringSet* followers = &followerIndex.sets[i].followers;
+        followers->count = 0;
+        ok = roaringFromSorted(followers, ids + starts[i], starts[i + 1] - starts[i]);
+    }
+    followerIndex.edgeCount = starts[setCount];
+
+    free(starts);
+    free(order);
+    free(ids);
+    return ok;
+}
+
+// Rebuild the reverse index from the following lists.
+// Returns 0 (and an empty index) if out of memory.
+int rebuildFollowerIndex() {
+    pthread_mutex_lock(&fanoutLock);
+    clearFollowerIndex(&followerIndex);
+    int ok = fillFollowerIndex();
+    if (!ok)
+        clearFollowerIndex(&followerIndex);
+    pthread_mutex_unlock(&fanoutLock);
+    return ok;
+}
+
+// Path of a follow graph file in the data directory
+void followFilePath(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/%s", postLogDir, name);
+}
+
+// Copy the follow graph in the snapshot file layout, returns NULL if out of memory.
+// Lists that are hash sets are copied as they are; sortFollowSnapshot() sorts them
+// later, away from the graph.
+char *copyFollowSnapshot(size_t *sizeOut) {
+    FollowSnapshotHeader header = {FOLLOW_SNAPSHOT_MAGIC, 0, followingGraph.edgeCount};
+    for (unsigned int i = 0; i < followingGraph.listCount; i++) {
+        if (followingGraph.lists[i].count > 0)
+            header.userCount++;
+    }
+
+    // Build the file in memory so it goes out in one write()
+    size_t size = sizeof(header) + sizeof(unsigned int) * (2UL * header.userCount + header.edgeCount);
+    char *buffer = malloc(size);
+    if (buffer == NULL) return NULL;
+    memcpy(buffer, &header, sizeof(header));
+    unsigned int *out = (unsigned int *)(buffer + sizeof(header));
+    for (unsigned int i = 0; i < followingGraph.listCount; i++) {
+        FollowList* list = &followingGraph.lists[i];
+        if (list->count == 0) continue;
+        *out++ = list->userID;
+        *out++ = list->count;
+        if (list->set == NULL) {
+            memcpy(out, followingGraph.csrIDs + list->csrStart, sizeof(unsigned int) * list->count);
+            out += list->count;
+            continue;
+        }
+        unsigned long cursor = 0;
+        unsigned int id;
+        while (nextInFollowList(&followingGraph, list, &cursor, &id))
+            *out++ = id;
+    }
+    *sizeOut = size;
+    return buffer;
+}
+
+// Sort the slices of a snapshot copy that came from hash sets
+void sortFollowSnapshot(char *buffer, size_t size) {
+    FollowSnapshotHeader header;
+    memcpy(&header, buffer, sizeof(header));
+    unsigned int *in = (unsigned int *)(buffer + sizeof(header));
+    for (unsigned int i = 0; i < header.userCount; i++) {
+        unsigned int count = in[1];
+        in += 2;
+        for (unsigned int j = 1; j < count; j++) {
+            if (in[j - 1] >= in[j]) {
+                qsort(in, count, sizeof(unsigned int), compareIDs);
+                break;
+            }
+        }
+        in += count;
+    }
+}
+
+void syncFollowDir() {
+    int dirFd = open(postLogDir, O_RDONLY);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+}
+
+// Write a snapshot copy to a temporary file and rename it over the old snapshot,
+// then drop lodi_follows.wal.old, which it holds. Returns 0 on failure.
+int storeFollowSnapshot(const char *buffer, size_t size) {
+    // Write to a temporary file and rename it so a crash leaves the old snapshot intact
+    char tmpPath[300], path[300], oldLogPath[300];
+    followFilePath(tmpPath, sizeof(tmpPath), "lodi_follows.snap.tmp");
+    followFilePath(path, sizeof(path), "lodi_follows.snap");
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write(fd, buffer, size) == (ssize_t)size && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok || rename(tmpPath, path) < 0) {
+        perror("(LodiServer) ERROR: Cannot write follow graph snapshot");
+        unlink(tmpPath);
+        return 0;
+    }
+    syncFollowDir();
+
+    // Replaying the old log over the new snapshot would be harmless, so it can go after the rename
+    followFilePath(oldLogPath, sizeof(oldLogPath), "lodi_follows.wal.old");
+    unlink(oldLogPath);
+    return 1;
+}
+
+// Write the whole follow graph to a new snapshot and start the log over, returns 0 on failure.
+// Only used while nothing else touches the graph (at startup and by the benchmarks).
+int writeFollowSnapshot() {
+    // Compact the following lists first; the snapshot is then just the sorted slices
+    if (!compactFollowGraph(&followingGraph)) return 0;
+    size_t size;
+    char *buffer = copyFollowSnapshot(&size);
+    if (buffer == NULL) return 0;
+    int ok = storeFollowSnapshot(buffer, size);
+    free(buffer);
+    if (!ok) return 0;
+
+    // Everything in the log is now in the snapshot; replaying it again would be harmless
+    if (followLogFd >= 0 && ftruncate(followLogFd, 0) == 0)
+        followLogRecords = 0;
+    return 1;
+}
+
+// Move the follow log aside to lodi_follows.wal.old and start a new one, returns 0 on failure
+int rotateFollowLog() {
+    char path[300], oldPath[300];
+    followFilePath(path, sizeof(path), "lodi_follows.wal");
+    followFilePath(oldPath, sizeof(oldPath), "lodi_follows.wal.old");
+    if (rename(path, oldPath) < 0) {
+        perror("(LodiServer) ERROR: Cannot move the follow log aside");
+        return 0;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("(LodiServer) ERROR: Cannot start a new follow log");
+        rename(oldPath, path);
+        return 0;
+    }
+    // Changes logged from now on must still be found after a crash
+    syncFollowDir();
+    close(followLogFd);
+    followLogFd = fd;
+    followLogRecords = 0;
+    return 1;
+}
+
+// Background thread: writes the snapshot copies handed over by the committer,
+// retrying one that fails until it is stored, since the old log waits for it
+void *snapshotWorker(void *arg) {
+    pthread_mutex_lock(&snapshotLock);
+    for (;;) {
+        while (snapshotBuffer == NULL)
+            pthread_cond_wait(&snapshotReady, &snapshotLock);
+        char *buffer = snapshotBuffer;
+        size_t size = snapshotSize;
+        pthread_mutex_unlock(&snapshotLock);
+
+        unsigned long start = statsNow();
+        sortFollowSnapshot(buffer, size);
+        while (!storeFollowSnapshot(buffer, size))
+            sleep(FOLLOW_SNAPSHOT_RETRY);
+        histogramRecordSince(&snapshotWrite, start);
+        LOG_INFO("(LodiServer) Follow graph snapshot of %zu bytes written in %.1f ms\n",
+                 size, (statsNow() - start) / 1e6);
+        free(buffer);
+
+        pthread_mutex_lock(&snapshotLock);
+        snapshotBuffer = NULL;
+    }
+    return NULL;
+}
+
+// Append a follow graph change to the log, returns 0 if it could not be written
+int appendFollowLog(unsigned int op, unsigned int userID, unsigned int idolID) {
+    FollowLogRecord record = {op, userID, idolID, op ^ userID ^ idolID ^ FOLLOW_LOG_MAGIC};
+    if (followLogFd < 0 || write(followLogFd, &record, sizeof(record)) != sizeof(record)) {
+        perror("(LodiServer) ERROR: Cannot append to follow log");
+        return 0;
+    }
+
+    pthread_mutex_lock(&followLogLock);
+    followLogAppended++;
+    pthread_mutex_unlock(&followLogLock);
+    followLogRecords++;
+    return 1;
+}
+
+// Snapshot once the log is long compared to the graph, so rewriting it stays cheap
+// per change. Only while no change is pending: a snapshot must not hold anything a
+// rollback could still take back. Runs on the committer under publishLock, which
+// is only held for the copy; the snapshot thread writes it.
+void snapshotFollowGraphIfDue() {
+    if (pendingFollowHead != pendingFollowTail ||
+        followLogRecords < FOLLOW_SNAPSHOT_INTERVAL || followLogRecords < followingGraph.edgeCount / 4)
+        return;
+
+    // Until the last copy is stored its log is still lodi_follows.wal.old
+    pthread_mutex_lock(&snapshotLock);
+    int busy = snapshotBuffer != NULL;
+    pthread_mutex_unlock(&snapshotLock);
+    if (busy) return;
+
+    unsigned long start = statsNow();
+    size_t size;
+    char *buffer = copyFollowSnapshot(&size);
+    if (buffer == NULL) {
+        LOG_ERROR("(LodiServer) ERROR: Out of memory copying the follow graph for a snapshot\n");
+        return;
+    }
+    if (!rotateFollowLog()) {
+        free(buffer);
+        return;
+    }
+    histogramRecordSince(&snapshotPause, start);
+
+    pthread_mutex_lock(&snapshotLock);
+    snapshotBuffer = buffer;
+    snapshotSize = size;
+    pthread_cond_signal(&snapshotReady);
+    pthread_mutex_unlock(&snapshotLock);
+}
+
+// Log a follow change already made to the graph and remember it until it is durable,
+// returns 0 if it could not be logged
+int logFollowChange(unsigned int op, unsigned int userID, unsigned int idolID) {
+    if (pendingFollowTail - pendingFollowHead == PENDING_FOLLOWS) return 0;
+    PendingFollow *change = &pendingFollows[pendingFollowTail % PENDING_FOLLOWS];
+    change->op = op;
+    change->userID = userID;
+    change->idolID = idolID;
+    change->logRecords = followLogRecords;
+    if (!appendFollowLog(op, userID, idolID)) return 0;
+    pendingFollowTail++;
+    return 1;
+}
+
+// Undo every pending follow change, newest first, and cut them from the follow log
+void rollbackFollowChanges() {
+    if (pendingFollowHead == pendingFollowTail) return;
+    int logRecords = pendingFollows[pendingFollowHead % PENDING_FOLLOWS].logRecords;
+
+    while (pendingFollowTail > pendingFollowHead) {
+        PendingFollow *change = &pendingFollows[--pendingFollowTail % PENDING_FOLLOWS];
+        int undone = change->op == follow ? removeFollowing(change->userID, change->idolID) :
+                                            addFollowing(change->userID, change->idolID);
+        if (undone < 0)
+            LOG_ERROR("(LodiServer) ERROR: Out of memory undoing a change of user %u's follows\n", change->userID);
+    }
+
+    if (ftruncate(followLogFd, (off_t)logRecords * sizeof(FollowLogRecord)) < 0 || fdatasync(followLogFd) < 0)
+        perror("(LodiServer) ERROR: Cannot cut the follow log");
+    followLogRecords = logRecords;
+}
+
+// Flush the follow log records appended so far, returns 0 if fdatasync() failed
+int syncFollowLog() {
+    pthread_mutex_lock(&followLogLock);
+    unsigned long appended = followLogAppended;
+    pthread_mutex_unlock(&followLogLock);
+
+    if (appended == followLogSynced) return 1;
+    if (fdatasync(followLogFd) < 0) return 0;
+    followLogSynced = appended;
+    return 1;
+}
+
+// Read a whole file into a malloc()ed buffer, returns NULL if it does not exist
+char *readWholeFile(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    char *buffer = NULL;
+    if (fstat(fd, &st) == 0 && (buffer = malloc(st.st_size + 1)) != NULL) {
+        size_t got = 0;
+        while (got < (size_t)st.st_size) {
+            ssize_t n = read(fd, buffer + got, st.st_size - got);
+            if (n <= 0) break;
+            got += n;
+        }
+        *size = got;
+    }
+    close(fd);
+    return buffer;
+}
+
+// Replace the follow graph with the snapshot, loaded straight into compacted
+// lists, and rebuild the reverse index. Returns the number of edges loaded.
+unsigned long loadFollowSnapshot() {
+    char path[300];
+    size_t size = 0;
+    followFilePath(path, sizeof(path), "lodi_follows.snap");
+
+    clearFollowGraph(&followingGraph);
+    char *buffer = readWholeFile(path, &size);
+    if (buffer == NULL) {
+        rebuildFollowerIndex();
+        return 0;
+    }
+
+    FollowSnapshotHeader header;
+    unsigned int *csrIDs = NULL;
+    unsigned long length = 0;
+    if (size >= sizeof(header)) {
+        memcpy(&header, buffer, sizeof(header));
+        unsigned int *in = (unsigned int *)(buffer + sizeof(header));
+        unsigned int *end = (unsigned int *)(buffer + size);
+        if (header.magic == FOLLOW_SNAPSHOT_MAGIC)
+            csrIDs = malloc(sizeof(unsigned int) * (end - in + 1));
+
+        for (unsigned int i = 0; csrIDs != NULL && i < header.userCount; i++) {
+            if (end - in < 2 || (unsigned long)(end - in - 2) < in[1]) break;
+            unsigned int count = in[1];
+            FollowList* list = getFollowList(&followingGraph, in[0]);
+            in += 2;
+            if (list == NULL) break;
+
+            // A user appears once in a snapshot; keep the first slice if not
+            if (list->count == 0) {
+                memcpy(csrIDs + length, in, sizeof(unsigned int) * count);
+                list->csrStart = length;
+                list->count = count;
+
+                // Snapshots are written sorted, but bisection must never see an unsorted slice
+                for (unsigned int j = 1; j < count; j++) {
+                    if (in[j - 1] >= in[j]) {
+                        qsort(csrIDs + length, count, sizeof(unsigned int), compareIDs);
+                        break;
+                    }
+                }
+                length += count;
+            }
+            in += count;
+        }
+    }
+    free(buffer);
+
+    followingGraph.csrIDs = csrIDs;
+    followingGraph.csrLength = length;
+    followingGraph.edgeCount = length;
+    if (!rebuildFollowerIndex())
+        LOG_ERROR("(LodiServer) ERROR: Out of memory rebuilding the follower index\n");
+    return length;
+}
+
+// Replay a follow log over the snapshot and drop a torn tail, returns the number of records applied
+int replayFollowLog(const char *name) {
+    char path[300];
+    size_t size = 0;
+    followFilePath(path, sizeof(path), name);
+    char *buffer = readWholeFile(path, &size);
+    if (buffer == NULL) return 0;
+
+    int applied = 0;
+    FollowLogRecord *records = (FollowLogRecord *)buffer;
+    for (size_t i = 0; i < size / sizeof(FollowLogRecord); i++) {
+        FollowLogRecord *record = &records[i];
+        if (record->check != (record->op ^ record->userID ^ record->idolID ^ FOLLOW_LOG_MAGIC)) break;
+
+        if (record->op == follow)
+            addFollowing(record->userID, record->idolID);
+        else if (record->op == unfollow)
+            removeFollowing(record->userID, record->idolID);
+        applied++;
+    }
+
+    free(buffer);
+    if (truncate(path, (off_t)applied * sizeof(FollowLogRecord)) < 0 && applied > 0)
+        perror("(LodiServer) Cannot trim follow log");
+    return applied;
+}
+
+// Restore the follow graph from the data directory and open its log for appending.
+// A replayed log is folded into a fresh snapshot right away. Returns the number of edges.
+unsigned long openFollowLog() {
+    unsigned long start = nowNanos();
+    unsigned long snapshotEdges = loadFollowSnapshot();
+    // A log moved aside for a snapshot that was never stored comes first
+    int replayed = replayFollowLog("lodi_follows.wal.old");
+    replayed += replayFollowLog("lodi_follows.wal");
+
+    char path[300];
+    followFilePath(path, sizeof(path), "lodi_follows.wal");
+    followLogFd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (followLogFd < 0)
+        perror("(LodiServer) ERROR: Cannot open follow log");
+
+    unsigned long edges = followingGraph.edgeCount;
+    LOG_INFO("(LodiServer) Follow graph: %lu edges (%lu from snapshot, %d log records) loaded in %.1f ms\n",
+           edges, snapshotEdges, replayed, (nowNanos() - start) / 1e6);
+
+    if (replayed > 0)
+        writeFollowSnapshot();
+    return edges;
+}
+
+// Close the follow log, used by the benchmarks
+void closeFollowLog() {
+    if (followLogFd >= 0) close(followLogFd);
+    followLogFd = -1;
+    followLogRecords = 0;
+}
+
+// Skeleton: Handle follow request, returns 1 if the graph changed and the ack must wait for the group commit
+int handleFollow(PClientToLodiServer *msg, LodiServerMessage *response) {
+    LOG_INFO("\n(LodiServer) --- HANDLE FOLLOW ---\n");
+    LOG_INFO("(LodiServer) User %u wants to follow user %u\n", msg->userID, msg->recipientID);
+
+    int result = addFollowing(msg->userID, msg->recipientID);
+    response->messageType = ackFollow;
+    response->userID = msg->userID;
+
+    if (result < 0) {
+        LOG_ERROR("(LodiServer) ERROR: Could not add user %u to the following list of user %u\n",
+               msg->recipientID, msg->userID);
+        strcpy(response->message, "Error: Server could not store the follow");
+        return 0;
+    }
+
+    // Check if already following this idol
+    if (result == 0) {
+        LOG_INFO("(LodiServer) User %u is already following user %u\n", msg->userID, msg->recipientID);
+        strcpy(response->message, "You are already following this user");
+        return 0;
+    }
+
+    // Log the change before it is acked, undo it if the log cannot be written
+    if (!logFollowChange(follow, msg->userID, msg->recipientID)) {
+        removeFollowing(msg->userID, msg->recipientID);
+        strcpy(response->message, "Error: Server could not store the follow");
+        return 0;
+    }
+
+    LOG_INFO("(LodiServer) User %u now following user %u\n", msg->userID, msg->recipientID);
+    LOG_INFO("(LodiServer) User %u is now following %u users\n", msg->userID,
+           findFollowList(&followingGraph, msg->userID)->count);
+    LOG_INFO("(LodiServer) Users %u and %u have %lu followers in common\n", msg->userID, msg->recipientID,
+           countCommonFollowers(msg->userID, msg->recipientID));
+
+    // Send success response, telling the user when the follow is now mutual
+    if (isFollowedBy(msg->userID, msg->recipientID))
+        strcpy(response->message, "Follow successful, you now follow each other");
+    else
+        strcpy(response->message, "Follow successful");
+    LOG_INFO("(LodiServer) Follow relationship successfully stored\n");
+    return 1;
+}
+
+// Skeleton: Handle unfollow request, returns 1 if the graph changed and the ack must wait for the group commit
+int handleUnfollow(PClientToLodiServer *msg, LodiServerMessage *response) {
+    LOG_INFO("\n(LodiServer) --- HANDLE UNFOLLOW ---\n");
+    LOG_INFO("(LodiServer) User %u wants to unfollow user %u\n", msg->userID, msg->recipientID);
+
+    int result = removeFollowing(msg->userID, msg->recipientID);
+    response->messageType = ackUnfollow;
+    response->userID = msg->userID;
+
+    // Check if user has a following list
+    if (result == -1) {
+        LOG_INFO("(LodiServer) User %u has no following list\n", msg->userID);
+        strcpy(response->message, "You are not following anyone");
+        return 0;
+    }
+
+    if (result == 0) {
+        LOG_INFO("(LodiServer) User %u is not following user %u\n", msg->userID, msg->recipientID);
+        strcpy(response->message, "You are not following this user");
+        return 0;
+    }
+
+    if (result == -2) {
+        LOG_ERROR("(LodiServer) ERROR: Out of memory removing user %u from the following list of user %u\n",
+               msg->recipientID, msg->userID);
+        strcpy(response->message, "Error: Server could not store the unfollow");
+        return 0;
+    }
+
+    // Log the change before it is acked, undo it if the log cannot be written
+    if (!logFollowChange(unfollow, msg->userID, msg->recipientID)) {
+        addFollowing(msg->userID, msg->recipientID);
+        strcpy(response->message, "Error: Server could not store the unfollow");
+        return 0;
+    }
+
+    LOG_INFO("(LodiServer) User %u unfollowed user %u\n", msg->userID, msg->recipientID);
+    LOG_INFO("(LodiServer) User %u is now following %u users\n", msg->userID,
+           findFollowList(&followingGraph, msg->userID)->count);
+
+    // Send success response
+    strcpy(response->message, "Unfollow successful");
+    LOG_INFO("(LodiServer) Unfollow successfully processed\n");
+    return 1;
+}
+
+// One sorted (oldest first) list of post indexes that a feed is merged from
+typedef struct {
+    const int *postIndex;
+    int count;
+} FeedSource;
+
+// Position of a feed source in the merge heap
+typedef struct {
+    int source;
+    int pos;
+    int postIndex;
+} FeedHeapEntry;
+
+// Turn the request's cursor into an exclusive post ID bound.
+// Returns 1 if the page runs forwards (posts newer than bound), 0 if backwards.
+int resolveFeedCursor(PClientToLodiServer *msg, int *bound) {
+    unsigned long cursor = msg->cursor;
+    int lo = 0;
+    int hi = publishedPosts;
+
+    switch (msg->cursorType) {
+        case cursorBeforeID:
+            *bound = cursor < (unsigned long)publishedPosts ? (int)cursor : publishedPosts;
+            return 0;
+        case cursorAfterID:
+            *bound = cursor < (unsigned long)publishedPosts ? (int)cursor : publishedPosts;
+            return 1;
+        case cursorBeforeTime:
+        case cursorAfterTime:
+            // Receive times increase with post ID, so binary search for the first
+            // post at or after (before-cursor) or strictly after (after-cursor) the time
+            while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                unsigned long postedAt = postTimes[mid];
+                if (postedAt < cursor || (msg->cursorType == cursorAfterTime && postedAt == cursor))
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (msg->cursorType == cursorBeforeTime) {
+                *bound = lo;
+                return 0;
+            }
+            *bound = lo - 1;
+            return 1;
+        default:
+            *bound = publishedPosts;
+            return 0;
+    }
+}
+
+// Heap order for the feed merge: newest first backwards, oldest first forwards
+int feedHeapBefore(FeedHeapEntry *a, FeedHeapEntry *b, int after) {
+    return after ? a->postIndex < b->postIndex : a->postIndex > b->postIndex;
+}
+
+void feedHeapSiftDown(FeedHeapEntry *heap, int heapSize, int i, int after) {
+    for (;;) {
+        int best = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heapSize && feedHeapBefore(&heap[left], &heap[best], after)) best = left;
+        if (right < heapSize && feedHeapBefore(&heap[right], &heap[best], after)) best = right;
+        if (best == i) return;
+
+        FeedHeapEntry tmp = heap[i];
+        heap[i] = heap[best];
+        heap[best] = tmp;
+        i = best;
+    }
+}
+
+// K-way merge of the sources into one page of at most limit post indexes.
+// Each source is entered at the cursor with a binary search and only advanced
+// as its posts are taken, so posts outside the page are never looked at.
+// The page comes out in merge order: newest first backwards, oldest first forwards.
+int mergeFeedPage(FeedSource *sources, int sourceCount, int after, int bound, int limit, int *page) {
+    FeedHeapEntry *heap = malloc(sizeof(FeedHeapEntry) * (sourceCount > 0 ? sourceCount : 1));
+    if (heap == NULL) {
+        LOG_ERROR("(LodiServer) ERROR: Out of memory merging feed\n");
+        return 0;
+    }
+    int heapSize = 0;
+
+    for (int s = 0; s < sourceCount; s++) {
+        // First position holding a post index greater than bound (forwards)
+        // or at least bound (backwards)
+        int lo = 0;
+        int hi = sources[s].count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (sources[s].postIndex[mid] < bound || (after && sources[s].postIndex[mid] == bound))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        int pos = after ? lo : lo - 1;
+        if (pos < 0 || pos >= sources[s].count) continue;
+
+        heap[heapSize].source = s;
+        heap[heapSize].pos = pos;
+        heap[heapSize].postIndex = sources[s].postIndex[pos];
+        heapSize++;
+    }
+    for (int i = heapSize / 2 - 1; i >= 0; i--)
+        feedHeapSiftDown(heap, heapSize, i, after);
+
+    int pageLen = 0;
+    while (pageLen < limit && heapSize > 0) {
+        page[pageLen++] = heap[0].postIndex;
+
+        // Advance the source we just took from, or drop it once exhausted
+        FeedSource *source = &sources[heap[0].source];
+        heap[0].pos += after ? 1 : -1;
+        if (heap[0].pos >= 0 && heap[0].pos < source->count) {
+            heap[0].postIndex = source->postIndex[heap[0].pos];
+        } else {
+            heap[0] = heap[--heapSize];
+        }
+        feedHeapSiftDown(heap, heapSize, 0, after);
+    }
+
+    free(heap);
+    return pageLen;
+}
+
+// Scan kernel: appends the IDs of posts first..last-1 whose author has its bit set
+// in the following bitmap to out, in ascending order, and returns how many it found.
+// The kernels are built with optimization on even though the rest of the server is
+// not, unoptimized intrinsics spill every vector to the stack.
+typedef int (*PostScanKernel)(const unsigned int *authors, const unsigned int *following,
+                              int first, int last, int *out);
+
+// Test one post's author against the following bitmap
+__attribute__((optimize("O2")))
+int scanPostsScalar(const unsigned int *authors, const unsigned int *following,
+                    int first, int last, int *out) {
+    int found = 0;
+    for (int i = first; i < last; i++) {
+        if ((following[authors[i] >> 5] >> (authors[i] & 31)) & 1)
+            out[found++] = i;
+    }
+    return found;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Four authors at a time. SSE4.1 has no gather or per-lane shift, so the bitmap words
+// are loaded one by one and 1 << (author & 31) is built from a float exponent.
+__attribute__((target("sse4.1"), optimize("O2")))
+int scanPostsSSE4(const unsigned int *authors, const unsigned int *following,
+                  int first, int last, int *out) {
+    const __m128i low5 = _mm_set1_epi32(31);
+    const __m128i bias = _mm_set1_epi32(127);
+    const __m128i zero = _mm_setzero_si128();
+    int found = 0;
+    int i = first;
+
+    for (; i + 4 <= last; i += 4) {
+        __m128i ids = _mm_loadu_si128((const __m128i *)(authors + i));
+        __m128i words = _mm_set_epi32(following[authors[i + 3] >> 5], following[authors[i + 2] >> 5],
+                                      following[authors[i + 1] >> 5], following[authors[i] >> 5]);
+        // 2^n as a float has exponent n + 127, converting back gives the bit (2^31 converts
+        // to 0x80000000, which is the bit we want too)
+        __m128i shift = _mm_and_si128(ids, low5);
+        __m128i bit = _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(shift, bias), 23)));
+        __m128i miss = _mm_cmpeq_epi32(_mm_and_si128(words, bit), zero);
+        int mask = ~_mm_movemask_ps(_mm_castsi128_ps(miss)) & 0xF;
+        while (mask) {
+            out[found++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return found + scanPostsScalar(authors, following, i, last, out + found);
+}
+
+// Eight authors at a time: gather the bitmap words, shift each lane by its own bit
+__attribute__((target("avx2"), optimize("O2")))
+int scanPostsAVX2(const unsigned int *authors, const unsigned int *following,
+                  int first, int last, int *out) {
+    const __m256i low5 = _mm256_set1_epi32(31);
+    const __m256i ones = _mm256_set1_epi32(1);
+    int found = 0;
+    int i = first;
+
+    for (; i + 8 <= last; i += 8) {
+        __m256i ids = _mm256_loadu_si256((const __m256i *)(authors + i));
+        __m256i words = _mm256_i32gather_epi32((const int *)following, _mm256_srli_epi32(ids, 5), 4);
+        __m256i bits = _mm256_and_si256(_mm256_srlv_epi32(words, _mm256_and_si256(ids, low5)), ones);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(bits, ones)));
+        while (mask) {
+            out[found++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return found + scanPostsScalar(authors, following, i, last, out + found);
+}
+#endif
+
+// Best scan kernel this CPU supports, picked by selectScanKernel()
+PostScanKernel scanKernel = scanPostsScalar;
+const char *scanKernelName = "scalar";
+
+void selectScanKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scanKernel = scanPostsAVX2;
+        scanKernelName = "avx2";
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        scanKernel = scanPostsSSE4;
+        scanKernelName = "sse4.1";
+    }
+#endif
+}
+
+// Bitmap with a bit set for every followed author that has posted, NULL if out of memory
+unsigned int *buildFollowingBitmap(FollowList *list) {
+    unsigned int *following = calloc((postMaxAuthor >> 5) + 1, sizeof(unsigned int));
+    if (following == NULL) return NULL;
+
+    unsigned long cursor;
+    unsigned int idolID;
+    for (cursor = 0; nextInFollowList(&followingGraph, list, &cursor, &idolID);) {
+        if (idolID <= postMaxAuthor)
+            following[idolID >> 5] |= 1U << (idolID & 31);
+    }
+    return following;
+}
+
+// Chunks of the current wave left for one scan thread: the owner takes them from
+// next upwards (nearest the cursor first), idle threads steal from end downwards
+typedef struct {
+    int next;
+    int end;
+    pthread_mutex_t lock;
+} ScanDeque;
+
+// Work-stealing pool that scans the author column in waves of chunks. The thread
+// that submits a wave works on it as thread 0, so one thread means a plain serial scan.
+// Only the main thread submits waves.
+typedef struct {
+    int threadCount;                   // Threads started, including the submitter
+    int activeThreads;                 // Threads taking part in the next wave
+    ScanDeque deques[SCAN_MAX_THREADS];
+    int *results;                      // SCAN_CHUNK_POSTS matches per chunk of a wave
+    int *found;                        // Number of matches per chunk
+    unsigned long scannedPosts;        // Posts scanned by the last scanPostsParallel()
+
+    // The wave being scanned
+    const unsigned int *authors;
+    const unsigned int *following;
+    int after;
+    int start;                         // Post at the cursor side of the wave
+    int end;                           // Far end of the scanned range
+
+    int wave;                          // Bumped for every wave to wake the helpers
+    int busyThreads;                   // Helpers still working on the wave
+    pthread_mutex_t lock;
+    pthread_cond_t waveReady;
+    pthread_cond_t waveDone;
+} ScanPool;
+
+ScanPool scanPool;
+int scanThreads = 0;                   // Size of the scan pool (-p), 0 means one per core
+
+// Scan one chunk of the current wave into its result slot
+void scanPoolChunk(int chunk) {
+    int first, last;
+    if (scanPool.after) {
+        first = scanPool.start + chunk * SCAN_CHUNK_POSTS;
+        last = first + SCAN_CHUNK_POSTS < scanPool.end ? first + SCAN_CHUNK_POSTS : scanPool.end;
+    } else {
+        last = scanPool.start - chunk * SCAN_CHUNK_POSTS;
+        first = last - SCAN_CHUNK_POSTS > scanPool.end ? last - SCAN_CHUNK_POSTS : scanPool.end;
+    }
+    scanPool.found[chunk] = scanKernel(scanPool.authors, scanPool.following, first, last,
+                                       scanPool.results + chunk * SCAN_CHUNK_POSTS);
+}
+
+// Next chunk for a thread: its own first, otherwise the last one of another thread.
+// Returns -1 once the wave is used up.
+int takeScanChunk(int thread) {
+    ScanDeque *own = &scanPool.deques[thread];
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end) {
+        int chunk = own->next++;
+        pthread_mutex_unlock(&own->lock);
+        return chunk;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (int i = 1; i < scanPool.activeThreads; i++) {
+        ScanDeque *victim = &scanPool.deques[(thread + i) % scanPool.activeThreads];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            int chunk = --victim->end;
+            pthread_mutex_unlock(&victim->lock);
+            return chunk;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return -1;
+}
+
+// Scan helper thread: works on every wave it is active for
+void *scanWorker(void *arg) {
+    int thread = (int)(long)arg;
+    int seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&scanPool.lock);
+        while (scanPool.wave == seen)
+            pthread_cond_wait(&scanPool.waveReady, &scanPool.lock);
+        seen = scanPool.wave;
+        int active = thread < scanPool.activeThreads;
+        pthread_mutex_unlock(&scanPool.lock);
+        if (!active) continue;
+
+        int chunk;
+        while ((chunk = takeScanChunk(thread)) >= 0)
+            scanPoolChunk(chunk);
+
+        pthread_mutex_lock(&scanPool.lock);
+        if (--scanPool.busyThreads == 0)
+            pthread_cond_signal(&scanPool.waveDone);
+        pthread_mutex_unlock(&scanPool.lock);
+    }
+    return NULL;
+}
+
+// Start the scan pool with threads - 1 helpers, returns 0 if out of memory
+int startScanPool(int threads) {
+    int chunks = threads * SCAN_WAVE_CHUNKS;
+    scanPool.results = malloc(sizeof(int) * chunks * SCAN_CHUNK_POSTS);
+    scanPool.found = malloc(sizeof(int) * chunks);
+    if (scanPool.results == NULL || scanPool.found == NULL) return 0;
+
+    scanPool.threadCount = threads;
+    scanPool.activeThreads = threads;
+    pthread_mutex_init(&scanPool.lock, NULL);
+    pthread_cond_init(&scanPool.waveReady, NULL);
+    pthread_cond_init(&scanPool.waveDone, NULL);
+    for (int t = 0; t < threads; t++)
+        pthread_mutex_init(&scanPool.deques[t].lock, NULL);
+
+    for (int t = 1; t < threads; t++) {
+        pthread_t helper;
+        if (pthread_create(&helper, NULL, scanWorker, (void *)(long)t) != 0) return 0;
+        pthread_detach(helper);
+    }
+    return 1;
+}
+
+// Scan chunks 0..chunks-1 of the wave at scanPool.start, split evenly over the
+// active threads, and wait until they are all done
+void scanWave(int chunks) {
+    int threads = scanPool.activeThreads;
+    for (int t = 0; t < threads; t++) {
+        pthread_mutex_lock(&scanPool.deques[t].lock);
+        scanPool.deques[t].next = chunks * t / threads;
+        scanPool.deques[t].end = chunks * (t + 1) / threads;
+        pthread_mutex_unlock(&scanPool.deques[t].lock);
+    }
+
+    pthread_mutex_lock(&scanPool.lock);
+    scanPool.busyThreads = threads - 1;
+    scanPool.wave++;
+    pthread_cond_broadcast(&scanPool.waveReady);
+    pthread_mutex_unlock(&scanPool.lock);
+
+    int chunk;
+    while ((chunk = takeScanChunk(0)) >= 0)
+        scanPoolChunk(chunk);
+
+    pthread_mutex_lock(&scanPool.lock);
+    while (scanPool.busyThreads > 0)
+        pthread_cond_wait(&scanPool.waveDone, &scanPool.lock);
+    pthread_mutex_unlock(&scanPool.lock);
+}
+
+// Scan the author column of total posts from the cursor in parallel waves and keep
+// posts by followed authors. Same page contract as mergeFeedPage. Waves start with
+// one chunk per thread and double, so a page found near the cursor costs little.
+int scanPostsParallel(const unsigned int *authors, int total, const unsigned int *following,
+                      int after, int bound, int limit, int *page) {
+    scanPool.authors = authors;
+    scanPool.following = following;
+    scanPool.after = after;
+    scanPool.scannedPosts = 0;
+    int start = after ? bound + 1 : (bound < total ? bound : total);
+    int end = after ? total : 0;
+    scanPool.end = end;
+
+    int waveChunks = scanPool.activeThreads;
+    int pageLen = 0;
+    while (pageLen < limit && (after ? start < end : start > end)) {
+        int remaining = after ? end - start : start - end;
+        int chunks = (remaining + SCAN_CHUNK_POSTS - 1) / SCAN_CHUNK_POSTS;
+        if (chunks > waveChunks) chunks = waveChunks;
+        scanPool.start = start;
+        scanWave(chunks);
+
+        // Chunks are numbered away from the cursor, so taking them in order keeps the page sorted
+        for (int c = 0; c < chunks && pageLen < limit; c++) {
+            int *results = scanPool.results + c * SCAN_CHUNK_POSTS;
+            if (after) {
+                for (int i = 0; i < scanPool.found[c] && pageLen < limit; i++)
+                    page[pageLen++] = results[i];
+            } else {
+                for (int i = scanPool.found[c] - 1; i >= 0 && pageLen < limit; i--)
+                    page[pageLen++] = results[i];
+            }
+        }
+
+        int scanned = chunks * SCAN_CHUNK_POSTS < remaining ? chunks * SCAN_CHUNK_POSTS : remaining;
+        scanPool.scannedPosts += scanned;
+        start += after ? scanned : -scanned;
+        if (waveChunks * 2 <= scanPool.activeThreads * SCAN_WAVE_CHUNKS)
+            waveChunks *= 2;
+    }
+    return pageLen;
+}
+
+// Fan-out-on-scan: test the authors of the post log against the followed users,
+// spread over the scan pool. Same page contract as mergeFeedPage.
+int scanFeedPage(FollowList *list, int after, int bound, int limit, int *page) {
+    unsigned int *following = buildFollowingBitmap(list);
+    if (following == NULL) {
+        LOG_ERROR("(LodiServer) ERROR: Out of memory scanning feed\n");
+        return 0;
+    }
+
+    int pageLen = scanPostsParallel(postAuthors, publishedPosts, following, after, bound, limit, page);
+    free(following);
+    return pageLen;
+}
+
+// qsort comparator for post indexes
+int compareInts(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Format a page for old clients: one fixed-size message per post and the
+// END_OF_FEED message, back to back so they go out with one write. Returns the
+// malloc'd messages (pageLen + 1 of them), NULL if out of memory.
+LodiServerMessage *formatFeedMessages(unsigned int messageType, unsigned int userID, int *page, int pageLen) {
+    LodiServerMessage *messages = calloc(pageLen + 1, sizeof(LodiServerMessage));
+    if (messages == NULL) return NULL;
+
+    for (int i = 0; i <= pageLen; i++) {
+        messages[i].messageType = messageType;
+        messages[i].userID = userID;
+        if (i == pageLen) {
+            strcpy(messages[i].message, "END_OF_FEED");
+            break;
+        }
+        snprintf(messages[i].message, sizeof(messages[i].message),
+                "#%d User %u: %.*s", page[i], postRecord(page[i])->userID,
+                (int)postRecord(page[i])->length, postBody(page[i]));
+        LOG_INFO("(LodiServer) Sending post %d: %s\n", i + 1, messages[i].message);
+    }
+    return messages;
+}
+
+// Send a whole iovec array, resuming after partial writes. Returns 1 on success.
+int sendAllv(int sock, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t s = writev(sock, iov, iovcnt);
+        if (s <= 0) return 0;
+
+        // Skip the fully written entries and trim the partially written one
+        while (iovcnt > 0 && (size_t)s >= iov->iov_len) {
+            s -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + s;
+            iov->iov_len -= s;
+        }
+    }
+    return 1;
+}
+
+// Copy the bytes an iovec array points at into one buffer, NULL if out of memory
+char *flattenIovec(struct iovec *iov, int iovcnt, size_t *length) {
+    *length = 0;
+    for (int i = 0; i < iovcnt; i++)
+        *length += iov[i].iov_len;
+
+    char *bytes = malloc(*length > 0 ? *length : 1);
+    if (bytes == NULL) return NULL;
+    size_t offset = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(bytes + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    return bytes;
+}
+
+// Frame flags of the feed format a request asked for: 0 for fixed-size records
+// (old clients), else variable-length records, padded as in the post log if
+// the client asked for its layout. FEED_FRAME_COMPRESSED if the client takes
+// compressed pages.
+unsigned int feedFrameFlags(PClientToLodiServer *msg, int varlen) {
+    unsigned int flags = (msg->feedFlags & FEED_FLAG_COMPRESSED) ? FEED_FRAME_COMPRESSED : 0;
+    if (!varlen) return flags;
+    return flags | FEED_FRAME_VARLEN | ((msg->feedFlags & FEED_FLAG_LOG_LAYOUT) ? FEED_FRAME_PADDED : 0);
+}
+
+unsigned long compressedPages = 0;      // Feed pages compressed
+unsigned long compressSkippedPages = 0; // Pages a client would have taken compressed, sent as they were
+unsigned long compressSavedBytes = 0;   // Bytes compression kept off the wire
+
+// Wrap a serialized feed page in one FEED_FRAME_COMPRESSED frame: the frame
+// header, a FeedCompressedHeader and the page compressed. A page under
+// FEED_COMPRESS_MIN bytes, or one that would not shrink by 1/FEED_COMPRESS_SAVING,
+// is not worth decompressing and gives NULL, as does running out of memory.
+char *compressFeedPage(unsigned int messageType, unsigned int userID, int pageLen, unsigned int frameFlags,
+                       const char *bytes, size_t length, size_t *packedLength) {
+    if (length < FEED_COMPRESS_MIN) {
+        __atomic_fetch_add(&compressSkippedPages, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    size_t prefix = sizeof(FeedFrameHeader) + sizeof(FeedCompressedHeader);
+    size_t capacity = length - length / FEED_COMPRESS_SAVING;
+    char *packed = malloc(prefix + capacity);
+    if (packed == NULL) return NULL;
+    int compressed = lzCompress(bytes, length, packed + prefix, capacity);
+    if (compressed == 0) {
+        __atomic_fetch_add(&compressSkippedPages, 1, __ATOMIC_RELAXED);
+        free(packed);
+        return NULL;
+    }
+
+    FeedFrameHeader header = {messageType, userID, pageLen, frameFlags | FEED_FRAME_COMPRESSED | FEED_FRAME_LAST};
+    FeedCompressedHeader sizes = {length, compressed};
+    memcpy(packed, &header, sizeof(header));
+    memcpy(packed + sizeof(header), &sizes, sizeof(sizes));
+    *packedLength = prefix + compressed;
+    __atomic_fetch_add(&compressedPages, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&compressSavedBytes, length - *packedLength, __ATOMIC_RELAXED);
+    return packed;
+}
+
+// Send a feed page (newest first) as batched frames of up to FEED_FRAME_POSTS
+// records each, all handed to the kernel with one gathered write. Variable-length
+// records are the stored records themselves, so the iovec points straight into
+// the segment mappings, and posts stored back to back go out as one entry when
+// padded (FEED_FRAME_PADDED) like the log. With FEED_FRAME_COMPRESSED the page
+// is sent compressed if that pays off.
+// If copy is not NULL it gets a malloc'd copy of the bytes sent (NULL if out of memory).
+int sendFeedFrames(int clientSocket, unsigned int messageType, unsigned int userID, int *page, int pageLen,
+                   unsigned int frameFlags, char **copy, size_t *copyLength) {
+    int compress = (frameFlags & FEED_FRAME_COMPRESSED) != 0;
+    frameFlags &= ~FEED_FRAME_COMPRESSED;
+    int frameCount = pageLen == 0 ? 1 : (pageLen + FEED_FRAME_POSTS - 1) / FEED_FRAME_POSTS;
+    FeedFrameHeader headers[(FEED_MAX_LIMIT + FEED_FRAME_POSTS - 1) / FEED_FRAME_POSTS];
+    FeedPostRecord records[FEED_MAX_LIMIT];
+    struct iovec iov[(FEED_MAX_LIMIT + FEED_FRAME_POSTS - 1) / FEED_FRAME_POSTS + FEED_MAX_LIMIT];
+    char fromLog[sizeof(iov) / sizeof(iov[0])];
+    int iovcnt = 0;
+
+    if (!(frameFlags & FEED_FRAME_VARLEN)) {
+        for (int i = 0; i < pageLen; i++) {
+            PostRecordHeader *record = postRecord(page[i]);
+            records[i].postID = page[i];
+            records[i].userID = record->userID;
+            records[i].postedAt = record->postedAt;
+            memset(records[i].message, 0, sizeof(records[i].message));
+            memcpy(records[i].message, postBody(page[i]), record->length);
+        }
+    }
+
+    for (int f = 0; f < frameCount; f++) {
+        int first = f * FEED_FRAME_POSTS;
+        int count = pageLen - first < FEED_FRAME_POSTS ? pageLen - first : FEED_FRAME_POSTS;
+
+        headers[f].messageType = messageType;
+        headers[f].userID = userID;
+        headers[f].postCount = count;
+        headers[f].flags = (f == frameCount - 1 ? FEED_FRAME_LAST : 0) | frameFlags;
+
+        iov[iovcnt].iov_base = &headers[f];
+        iov[iovcnt].iov_len = sizeof(FeedFrameHeader);
+        fromLog[iovcnt] = 0;
+        iovcnt++;
+        if (frameFlags & FEED_FRAME_VARLEN) {
+            for (int i = first; i < first + count; i++) {
+                PostRecordHeader *record = postRecord(page[i]);
+                size_t length = (frameFlags & FEED_FRAME_PADDED) ? postRecordSize(record->length) :
+                                sizeof(PostRecordHeader) + record->length;
+                struct iovec *last = &iov[iovcnt - 1];
+                if (fromLog[iovcnt - 1] && (char *)last->iov_base + last->iov_len == (char *)record) {
+                    last->iov_len += length;
+                } else {
+                    iov[iovcnt].iov_base = record;
+                    iov[iovcnt].iov_len = length;
+                    fromLog[iovcnt] = 1;
+                    iovcnt++;
+                }
+            }
+        } else if (count > 0) {
+            iov[iovcnt].iov_base = &records[first];
+            iov[iovcnt].iov_len = sizeof(FeedPostRecord) * count;
+            fromLog[iovcnt] = 0;
+            iovcnt++;
+        }
+    }
+
+    // The cache and compression both need the page in one buffer
+    size_t length = 0;
+    char *bytes = (compress || copy != NULL) ? flattenIovec(iov, iovcnt, &length) : NULL;
+    size_t packedLength;
+    char *packed = (compress && bytes != NULL) ?
+                   compressFeedPage(messageType, userID, pageLen, frameFlags, bytes, length, &packedLength) : NULL;
+    int sent;
+    if (packed != NULL) {
+        LOG_INFO("(LodiServer) Feed page compressed from %zu to %zu bytes\n", length, packedLength);
+        free(bytes);
+        bytes = packed;
+        length = packedLength;
+        struct iovec packedIov = {packed, packedLength};
+        sent = sendAllv(clientSocket, &packedIov, 1);
+    } else {
+        sent = sendAllv(clientSocket, iov, iovcnt);
+    }
+
+    if (copy != NULL) {
+        *copy = bytes;
+        *copyLength = length;
+    } else {
+        free(bytes);
+    }
+    if (!sent) {
+        LOG_ERROR("(LodiServer) Error sending feed frames\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Send a single response, variable-length (header + text) for clients that
+// sent a LodiRequestHeader and fixed-size for old clients. Returns 1 on success.
+int sendResponse(int clientSocket, LodiServerMessage *response, int varlen) {
+    if (!varlen) {
+        struct iovec iov = {response, sizeof(*response)};
+        return sendAllv(clientSocket, &iov, 1);
+    }
+
+    LodiResponseHeader header;
+    header.magic = LODI_WIRE_MAGIC;
+    header.messageType = response->messageType;
+    header.userID = response->userID;
+    header.bodyLength = strnlen(response->message, sizeof(response->message));
+
+    struct iovec iov[2] = {{&header, sizeof(header)}, {response->message, header.bodyLength}};
+    return sendAllv(clientSocket, iov, 2);
+}
+
+// Take back everything that is not published after a failed sync: the posts past
+// publishedPosts and the pending follow changes. Requests made before this see
+// commitEpoch change and are answered with an error. Runs under publishLock.
+void rollbackCommit() {
+    LOG_WARN("(LodiServer) Rolling back %d post(s) and %lu follow change(s) that could not be synced\n",
+             postCount - publishedPosts, pendingFollowTail - pendingFollowHead);
+    truncatePostLog(publishedPosts);
+    rollbackFollowChanges();
+    commitEpoch++;
+}
+
+// Background thread: makes queued posts and follow changes durable in batches of
+// up to commitBatchSize with one msync()/fdatasync() each, then publishes them and
+// sends their acks
+void *commitWorker(void *arg) {
+    static CommitEntry batch[COMMIT_QUEUE_SIZE];
+
+    for (;;) {
+        pthread_mutex_lock(&commitQueueLock);
+        while (commitQueueCount == 0)
+            pthread_cond_wait(&commitQueueReady, &commitQueueLock);
+
+        // Wait for a full batch, but never keep the oldest post waiting longer than the window
+        while (commitQueueCount < commitBatchSize) {
+            long remaining = commitWindowMicros * 1000L - (long)(nowNanos() - commitQueue[commitQueueHead].queuedAt);
+            if (remaining <= 0) break;
+
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += (deadline.tv_nsec + remaining) / 1000000000L;
+            deadline.tv_nsec = (deadline.tv_nsec + remaining) % 1000000000L;
+            pthread_cond_timedwait(&commitQueueReady, &commitQueueLock, &deadline);
+        }
+
+        int count = commitQueueCount < commitBatchSize ? commitQueueCount : commitBatchSize;
+        for (int i = 0; i < count; i++)
+            batch[i] = commitQueue[(commitQueueHead + i) % COMMIT_QUEUE_SIZE];
+        commitQueueHead = (commitQueueHead + count) % COMMIT_QUEUE_SIZE;
+        commitQueueCount -= count;
+        commitInFlight = count;
+        pthread_cond_broadcast(&commitQueueSpace);
+        pthread_mutex_unlock(&commitQueueLock);
+
+        // Every change in the batch was written before it was queued, so one sync covers them all
+        int durable = syncPostLog() && syncFollowLog();
+        if (!durable)
+            perror("(LodiServer) ERROR: Group commit failed");
+
+        // Publish the batch, or drop it and everything written after it, before any ack goes out
+        pthread_mutex_lock(&publishLock);
+        if (!durable)
+            rollbackCommit();
+        for (int i = 0; i < count; i++) {
+            CommitEntry *entry = &batch[i];
+            if (entry->epoch != commitEpoch)
+                strcpy(entry->response.message, "Error: Server could not store the change");
+            else if (entry->postIndex >= 0)
+                publishPost(entry->postIndex);
+            else if (entry->followChange)
+                pendingFollowHead++;
+        }
+        snapshotFollowGraphIfDue();
+        pthread_mutex_unlock(&publishLock);
+
+        int acked = 0;
+        for (int i = 0; i < count; i++) {
+            CommitEntry *entry = &batch[i];
+            recordLatency(&commitLatency, entry->queuedAt);
+            if (entry->clientSocket < 0) continue;
+
+            if (!sendResponse(entry->clientSocket, &entry->response, entry->varlen))
+                LOG_ERROR("(LodiServer) Error: Failed to send ack to user %u\n", entry->response.userID);
+            close(entry->clientSocket);
+            acked++;
+        }
+        if (acked > 0)
+            LOG_INFO("(LodiServer) Group commit: %d request(s) durable, acks sent\n", acked);
+
+        pthread_mutex_lock(&commitQueueLock);
+        commitInFlight = 0;
+        commitBatches++;
+        committedPosts += count;
+        pthread_cond_broadcast(&commitQueueSpace);
+        pthread_mutex_unlock(&commitQueueLock);
+    }
+    return NULL;
+}
+
+// Receive exactly len bytes (handle partial reads), returns 0 on failure or early close
+int recvAll(int sock, void *buf, unsigned int len) {
+    unsigned int totalBytesRcvd = 0;
+    while (totalBytesRcvd < len) {
+        int r = recv(sock, (char *)buf + totalBytesRcvd, (int)(len - totalBytesRcvd), 0);
+        if (r <= 0) return 0;
+        totalBytesRcvd += r;
+    }
+    return 1;
+}
+
+// Fill msg from a variable-length request header (the trace ID and text follow it)
+void decodeRequestHeader(LodiRequestHeader *header, PClientToLodiServer *msg) {
+    memset(msg, 0, sizeof(*msg));
+    msg->messageType = header->messageType;
+    msg->userID = header->userID;
+    msg->recipientID = header->recipientID;
+    msg->timestamp = header->timestamp;
+    msg->digitalSig = header->digitalSig;
+    msg->feedLimit = header->feedLimit;
+    msg->cursorType = header->cursorType;
+    msg->feedFlags = header->feedFlags & ~REQUEST_FLAG_TRACED;
+    msg->cursor = header->cursor;
+}
+
+// Fill msg from a fixed-size request, leaving paging and tracing at their defaults
+void decodeLegacyRequest(const char *data, PClientToLodiServer *msg) {
+    memset(msg, 0, sizeof(*msg));
+    memcpy(msg, data, offsetof(PClientToLodiServer, feedLimit));
+}
+
+// Receive one request in either wire format into msg. Sets *varlen when the
+// client used variable-length framing. Returns the bytes received, 0 on failure.
+int receiveRequest(int sock, PClientToLodiServer *msg, int *varlen) {
+    unsigned int firstWord;
+    if (!recvAll(sock, &firstWord, sizeof(firstWord))) return 0;
+
+    if (firstWord != LODI_WIRE_MAGIC) {
+        // Old fixed-size client: the first word was the message type
+        char legacy[LEGACY_REQUEST_SIZE];
+        *varlen = 0;
+        memcpy(legacy, &firstWord, sizeof(firstWord));
+        if (!recvAll(sock, legacy + sizeof(firstWord), LEGACY_REQUEST_SIZE - sizeof(firstWord))) return 0;
+        decodeLegacyRequest(legacy, msg);
+        return LEGACY_REQUEST_SIZE;
+    }
+
+    LodiRequestHeader header;
+    header.magic = firstWord;
+    if (!recvAll(sock, (char *)&header + sizeof(firstWord), sizeof(header) - sizeof(firstWord))) return 0;
+    if (header.bodyLength > MAX_POST_LENGTH) {
+        LOG_INFO("(LodiServer) Request body too long (%u bytes)\n", header.bodyLength);
+        return 0;
+    }
+
+    *varlen = 1;
+    decodeRequestHeader(&header, msg);
+    if ((header.feedFlags & REQUEST_FLAG_TRACED) && !recvAll(sock, &msg->traceID, sizeof(msg->traceID))) return 0;
+    if (!recvAll(sock, msg->message, header.bodyLength)) return 0;
+    msg->message[header.bodyLength] = '\0';
+
+    return sizeof(header) + ((header.feedFlags & REQUEST_FLAG_TRACED) ? sizeof(msg->traceID) : 0) + header.bodyLength;
+}
+
+// Decode a request from the first length bytes received on a connection.
+// Returns its size once all of it is there, 0 if more bytes are needed, -1 if
+// it is invalid.
+int parseRequest(const char *data, int length, PClientToLodiServer *msg, int *varlen) {
+    unsigned int firstWord;
+    if (length < (int)sizeof(firstWord)) return 0;
+    memcpy(&firstWord, data, sizeof(firstWord));
+
+    if (firstWord != LODI_WIRE_MAGIC) {
+        if (length < (int)LEGACY_REQUEST_SIZE) return 0;
+        *varlen = 0;
+        decodeLegacyRequest(data, msg);
+        return LEGACY_REQUEST_SIZE;
+    }
+
+    LodiRequestHeader header;
+    if (length < (int)sizeof(header)) return 0;
+    memcpy(&header, data, sizeof(header));
+    if (header.bodyLength > MAX_POST_LENGTH) {
+        LOG_INFO("(LodiServer) Request body too long (%u bytes)\n", header.bodyLength);
+        return -1;
+    }
+    int traceLength = (header.feedFlags & REQUEST_FLAG_TRACED) ? sizeof(msg->traceID) : 0;
+    int size = sizeof(header) + traceLength + header.bodyLength;
+    if (length < size) return 0;
+
+    *varlen = 1;
+    decodeRequestHeader(&header, msg);
+    memcpy(&msg->traceID, data + sizeof(header), traceLength);
+    memcpy(msg->message, data + sizeof(header) + traceLength, header.bodyLength);
+    msg->message[header.bodyLength] = '\0';
+    return size;
+}
+
+// A request read off its connection, waiting in an admission queue to be served
+typedef struct {
+    PClientToLodiServer msg;
+    int clientSocket;
+    int varlen;
+    int size;                           // Bytes received
+    struct sockaddr_in clientAddr;
+    unsigned long acceptedAt;           // nowNanos() when the connection was accepted
+} PendingRequest;
+
+// FIFO of the requests of one priority class
+typedef struct {
+    const char *name;
+    PendingRequest *entries;
+    int head;
+    int count;
+    int capacity;
+    unsigned long admitted;
+    unsigned long full;                 // Requests turned away because the queue was full
+    LatencyHistogram wait;              // Accept to dispatch
+} AdmissionQueue;
+
+// Accepted connection whose request has not arrived yet, registered with epoll
+// (or with a multishot recv on the io_uring backend)
+typedef struct WaitingConnection {
+    int clientSocket;
+    struct sockaddr_in clientAddr;
+    unsigned long acceptedAt;
+    struct WaitingConnection *prev;
+    struct WaitingConnection *next;
+    char received[REQUEST_MAX_SIZE];    // Request bytes so far
+    int receivedLength;
+    int finished;                       // io_uring: off the waiting list, freed once its recv ends
+} WaitingConnection;
+
+// Cheap requests (posts, follows, trending) and expensive ones (feeds, searches,
+// logins, subscribes) queue separately so a burst of feeds cannot hold posts up
+enum {classCheap, classExpensive};
+
+// Admission state (only touched by the main thread)
+AdmissionQueue admissionQueues[2] = {{"cheap"}, {"expensive"}};
+int admissionQueueSize = ADMISSION_DEFAULT_QUEUE;   // Requests each class can queue (-a)
+int listenBacklog = MAXPENDING;                     // Connections the kernel holds for accept() (-l)
+int cheapStreak = 0;                  // Cheap requests served in a row while expensive ones waited
+unsigned long dispatchedRequests = 0;
+WaitingConnection *waitingHead = NULL;  // Oldest first
+WaitingConnection *waitingTail = NULL;
+int waitingCount = 0;
+unsigned long acceptResumeAt = 0;     // nowNanos() to re-arm the listener after running out of descriptors
+
+// Logins waiting for a login worker (guarded by loginQueueLock)
+PendingRequest loginQueue[LOGIN_QUEUE_SIZE];
+int loginQueueHead = 0;
+int loginQueueCount = 0;
+unsigned long loginQueueFull = 0;     // Logins turned away because every worker was busy and the queue full
+pthread_mutex_t loginQueueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t loginQueueReady = PTHREAD_COND_INITIALIZER;
+
+// How the listener and the connections waiting to send a request are served (-i)
+enum {ioBackendEpoll, ioBackendUring, ioBackendBlocking} ioBackend = ioBackendEpoll;
+const char *ioBackendNames[] = {"epoll", "io_uring", "blocking"};
+
+// Token bucket: holds up to burst tokens and refills at rate tokens per second
+typedef struct {
+    double tokens;
+    unsigned long refilledAt;           // nowNanos() of the last refill, 0 for a new bucket
+} TokenBucket;
+
+// Rate limits checked before a request reaches its handler (only touched by the main thread)
+typedef struct {
+    double userRate;                    // Tokens per second of each user, 0 for no limit (-r)
+    double globalRate;                  // Tokens per second of the whole server, 0 for no limit (-g)
+    int shedDepth;                      // Queued work above which expensive requests are shed (-q)
+    TokenBucket global;
+    TokenBucket *users;                 // One bucket per user seen
+    unsigned int userCount;
+    unsigned int userCapacity;
+    UserDirectory directory;            // userID -> index in users
+    unsigned long userLimited;
+    unsigned long globalLimited;
+    unsigned long shed;
+} RateLimiter;
+
+RateLimiter rateLimiter = {RATE_DEFAULT_USER, RATE_DEFAULT_GLOBAL, RATE_DEFAULT_SHED_DEPTH};
+
+// Tokens a request takes: feeds, searches and logins (which wait on the PKE and
+// TFA servers) cost more than posts and follows; logout is always let through
+int requestCost(int messageType) {
+    switch (messageType) {
+        case logout: return 0;
+        case feed: case subscribe: return 2;
+        case login: case search: return 4;
+        default: return 1;
+    }
+}
+
+// Refill a bucket and take cost tokens from it, returns 0 if it holds too few
+int takeTokens(TokenBucket *bucket, double rate, int cost, unsigned long now) {
+    double burst = rate * RATE_BURST_SECONDS;
+    if (bucket->refilledAt == 0) {
+        bucket->tokens = burst;
+    } else {
+        bucket->tokens += (now - bucket->refilledAt) / 1e9 * rate;
+        if (bucket->tokens > burst) bucket->tokens = burst;
+    }
+    bucket->refilledAt = now;
+
+    if (bucket->tokens < cost) return 0;
+    bucket->tokens -= cost;
+    return 1;
+}
+
+// A user's bucket, created full on first use; NULL if out of memory
+TokenBucket *findUserBucket(RateLimiter *limiter, unsigned int userID) {
+    int position = directoryFind(&limiter->directory, userID);
+    if (position >= 0) return &limiter->users[position];
+
+    if (limiter->userCount == limiter->userCapacity) {
+        unsigned int capacity = limiter->userCapacity ? limiter->userCapacity * 2 : 64;
+        TokenBucket *grown = realloc(limiter->users, sizeof(TokenBucket) * capacity);
+        if (grown == NULL) return NULL;
+        limiter->users = grown;
+        limiter->userCapacity = capacity;
+    }
+    if (!directoryInsert(&limiter->directory, userID, limiter->userCount)) return NULL;
+
+    TokenBucket *bucket = &limiter->users[limiter->userCount++];
+    bucket->tokens = 0;
+    bucket->refilledAt = 0;
+    return bucket;
+}
+
+// Work waiting behind the request being admitted: connections in the listen
+// backlog, requests in the admission queues, posts and follow changes waiting
+// to be committed or fanned out, and logins waiting for a login worker
+int queuedWork(int listenSocket) {
+    int depth = admissionQueues[classCheap].count + admissionQueues[classExpensive].count;
+    struct tcp_info info;
+    socklen_t infoLength = sizeof(info);
+    if (getsockopt(listenSocket, IPPROTO_TCP, TCP_INFO, &info, &infoLength) == 0)
+        depth += info.tcpi_unacked;     // Accept queue length while listening
+
+    pthread_mutex_lock(&commitQueueLock);
+    depth += commitQueueCount;
+    pthread_mutex_unlock(&commitQueueLock);
+    pthread_mutex_lock(&fanoutQueueLock);
+    depth += fanoutQueueCount;
+    pthread_mutex_unlock(&fanoutQueueLock);
+    pthread_mutex_lock(&loginQueueLock);
+    depth += loginQueueCount;
+    pthread_mutex_unlock(&loginQueueLock);
+    return depth;
+}
+
+// Decide whether a request may go on to its handler, returns NULL if so or the
+// reason it is turned away. Past shedDepth of queued work only cheap requests
+// get in, past twice that only logouts.
+const char *admitRequest(RateLimiter *limiter, PClientToLodiServer *msg, int listenSocket) {
+    int cost = requestCost(msg->messageType);
+    if (cost == 0) return NULL;
+
+    if (limiter->shedDepth > 0) {
+        int depth = queuedWork(listenSocket);
+        if (depth > 2 * limiter->shedDepth || (depth > limiter->shedDepth && cost > 1)) {
+            limiter->shed++;
+            return "Server overloaded, try again later";
+        }
+    }
+
+    unsigned long now = nowNanos();
+    if (limiter->userRate > 0) {
+        TokenBucket *bucket = findUserBucket(limiter, msg->userID);
+        if (bucket != NULL && !takeTokens(bucket, limiter->userRate, cost, now)) {
+            limiter->userLimited++;
+            return "Rate limit exceeded, slow down";
+        }
+    }
+    if (limiter->globalRate > 0 && !takeTokens(&limiter->global, limiter->globalRate, cost, now)) {
+        limiter->globalLimited++;
+        return "Server busy, try again later";
+    }
+    return NULL;
+}
+
+// Turn a request away with an ackBusy: feed and search requests that expect
+// frames get an empty last frame, everything else a single response
+int rejectRequest(PClientToLodiServer *msg, int clientSocket, int varlen, const char *reason) {
+    LOG_WARN("(LodiServer) Rejected request type %d from user %u: %s (%lu user limited, %lu global limited, %lu shed)\n",
+           msg->messageType, msg->userID, reason, rateLimiter.userLimited, rateLimiter.globalLimited, rateLimiter.shed);
+
+    if ((msg->messageType == feed || msg->messageType == search) &&
+        (varlen || (msg->feedFlags & FEED_FLAG_BATCHED)))
+        return sendFeedFrames(clientSocket, ackBusy, msg->userID, NULL, 0, feedFrameFlags(msg, varlen), NULL, NULL);
+
+    LodiServerMessage response;
+    response.messageType = ackBusy;
+    response.userID = msg->userID;
+    snprintf(response.message, sizeof(response.message), "%s", reason);
+    return sendResponse(clientSocket, &response, varlen);
+}
+
+// Allocate the admission queues, returns 0 if out of memory
+int startAdmission() {
+    for (int c = 0; c < 2; c++) {
+        AdmissionQueue *queue = &admissionQueues[c];
+        queue->entries = malloc(sizeof(PendingRequest) * admissionQueueSize);
+        if (queue->entries == NULL) return 0;
+        queue->capacity = admissionQueueSize;
+    }
+    return 1;
+}
+
+int requestClass(int messageType) {
+    return requestCost(messageType) > 1 ? classExpensive : classCheap;
+}
+
+void printAdmissionStats() {
+    LOG_INFO("(LodiServer) Admission after %lu requests (%d connections waiting to send one):\n",
+           dispatchedRequests, waitingCount);
+    for (int c = 0; c < 2; c++) {
+        AdmissionQueue *queue = &admissionQueues[c];
+        unsigned long avg = queue->wait.count ? queue->wait.totalNanos / queue->wait.count : 0;
+        LOG_INFO("(LodiServer)   %-9s queued=%d admitted=%lu full=%lu wait avg=%luus p99=%luus max=%luus\n",
+               queue->name, queue->count, queue->admitted, queue->full, avg / 1000,
+               histogramPercentile(&queue->wait, 99) / 1000, queue->wait.maxNanos / 1000);
+    }
+}
+
+// Add a request to the back of its class queue, returns 0 if the queue is full
+int enqueueRequest(PendingRequest *request) {
+    AdmissionQueue *queue = &admissionQueues[requestClass(request->msg.messageType)];
+    if (queue->count == queue->capacity) {
+        queue->full++;
+        return 0;
+    }
+    queue->entries[(queue->head + queue->count) % queue->capacity] = *request;
+    queue->count++;
+    queue->admitted++;
+    return 1;
+}
+
+// Take the next request to serve, returns 0 if none is queued. Cheap requests go
+// first, but after ADMISSION_CHEAP_WEIGHT of them in a row a waiting expensive
+// request gets its turn, so neither class starves.
+int nextRequest(PendingRequest *request) {
+    AdmissionQueue *cheap = &admissionQueues[classCheap];
+    AdmissionQueue *expensive = &admissionQueues[classExpensive];
+    AdmissionQueue *queue;
+
+    if (cheap->count > 0 && (expensive->count == 0 || cheapStreak < ADMISSION_CHEAP_WEIGHT)) {
+        queue = cheap;
+        cheapStreak = expensive->count > 0 ? cheapStreak + 1 : 0;
+    } else if (expensive->count > 0) {
+        queue = expensive;
+        cheapStreak = 0;
+    } else {
+        return 0;
+    }
+
+    *request = queue->entries[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    histogramRecordSince(&queue->wait, request->acceptedAt);
+    if (++dispatchedRequests % ADMISSION_REPORT_INTERVAL == 0)
+        printAdmissionStats();
+    return 1;
+}
+
+void addWaitingConnection(WaitingConnection *conn) {
+    conn->prev = waitingTail;
+    conn->next = NULL;
+    if (waitingTail != NULL) waitingTail->next = conn; else waitingHead = conn;
+    waitingTail = conn;
+    waitingCount++;
+}
+
+void unlinkWaitingConnection(WaitingConnection *conn) {
+    if (conn->prev != NULL) conn->prev->next = conn->next; else waitingHead = conn->next;
+    if (conn->next != NULL) conn->next->prev = conn->prev; else waitingTail = conn->prev;
+    waitingCount--;
+}
+
+// Take a connection off the waiting list and out of the epoll set (it stays open)
+void removeWaitingConnection(int epollFd, WaitingConnection *conn) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->clientSocket, NULL);
+    unlinkWaitingConnection(conn);
+    free(conn);
+}
+
+// Accept up to ACCEPT_BATCH connections from the listen backlog and wait for their requests
+void acceptConnections(int epollFd, int listenSocket) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        int clientSocket = accept(listenSocket, (struct sockaddr *)&clientAddr, &clientAddrLen);
+        if (clientSocket < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors: stop listening for a moment instead of spinning
+                LOG_INFO("(LodiServer) Out of file descriptors, pausing accept() (%d connections waiting)\n",
+                       waitingCount);
+                struct epoll_event paused = {0, {.ptr = NULL}};
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, listenSocket, &paused);
+                acceptResumeAt = nowNanos() + ACCEPT_PAUSE_NANOS;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("(LodiServer) accept() failed");
+            }
+            return;
+        }
+
+        LOG_INFO("(LodiServer) TCP connection from %s:%d\n",
+               inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+
+        WaitingConnection *conn = malloc(sizeof(WaitingConnection));
+        struct epoll_event event = {EPOLLIN, {.ptr = conn}};
+        if (conn == NULL || epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+            LOG_ERROR("(LodiServer) Error: Could not wait for a request from %s:%d\n",
+                   inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+            free(conn);
+            close(clientSocket);
+            continue;
+        }
+        conn->clientSocket = clientSocket;
+        conn->clientAddr = clientAddr;
+        conn->acceptedAt = nowNanos();
+        conn->receivedLength = 0;
+        conn->finished = 0;
+        addWaitingConnection(conn);
+    }
+}
+
+// Check a received request against the rate limits and queue it by class, or
+// turn it away
+void admitPendingRequest(PendingRequest *request, int listenSocket) {
+    // Over-limit requests are turned away before any handler work
+    const char *rejection = admitRequest(&rateLimiter, &request->msg, listenSocket);
+    if (rejection == NULL && !enqueueRequest(request))
+        rejection = "Server overloaded, try again later";
+    if (rejection != NULL) {
+        rejectRequest(&request->msg, request->clientSocket, request->varlen, rejection);
+        close(request->clientSocket);
+    }
+}
+
+// Take what a readable connection has sent without blocking. A partial request
+// stays in the connection's buffer until the rest arrives (or it is closed as
+// idle); a whole one is checked against the rate limits and queued by class.
+void readWaitingConnection(int epollFd, int listenSocket, WaitingConnection *conn) {
+    int received = recv(conn->clientSocket, conn->received + conn->receivedLength,
+                        REQUEST_MAX_SIZE - conn->receivedLength, MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+
+    PendingRequest request;
+    request.size = 0;
+    if (received > 0) {
+        conn->receivedLength += received;
+        request.size = parseRequest(conn->received, conn->receivedLength, &request.msg, &request.varlen);
+        if (request.size == 0 && conn->receivedLength < REQUEST_MAX_SIZE) return;
+    }
+
+    request.clientSocket = conn->clientSocket;
+    request.clientAddr = conn->clientAddr;
+    request.acceptedAt = conn->acceptedAt;
+    removeWaitingConnection(epollFd, conn);
+    if (request.size <= 0) {
+        close(request.clientSocket);
+        LOG_INFO("(LodiServer) Incomplete or invalid request received\n");
+        return;
+    }
+    admitPendingRequest(&request, listenSocket);
+}
+
+// Close connections that never sent a request, and re-arm the listener once a
+// pause for running out of descriptors is over
+void expireWaitingConnections(int epollFd, int listenSocket) {
+    unsigned long now = nowNanos();
+    while (waitingHead != NULL && now - waitingHead->acceptedAt > CONNECTION_IDLE_NANOS) {
+        int clientSocket = waitingHead->clientSocket;
+        LOG_INFO("(LodiServer) Closing connection from %s:%d, no request after %d s\n",
+               inet_ntoa(waitingHead->clientAddr.sin_addr), ntohs(waitingHead->clientAddr.sin_port),
+               (int)(CONNECTION_IDLE_NANOS / 1000000000UL));
+        removeWaitingConnection(epollFd, waitingHead);
+        close(clientSocket);
+    }
+
+    if (acceptResumeAt != 0 && now >= acceptResumeAt) {
+        struct epoll_event event = {EPOLLIN, {.ptr = NULL}};
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, listenSocket, &event);
+        acceptResumeAt = 0;
+    }
+}
+
+// Blocking backend (-i blocking): wait in accept() and read the request on the
+// dispatch thread, one connection at a time
+void acceptBlocking(int listenSocket) {
+    PendingRequest request;
+    socklen_t clientAddrLen = sizeof(request.clientAddr);
+    request.clientSocket = accept(listenSocket, (struct sockaddr *)&request.clientAddr, &clientAddrLen);
+    if (request.clientSocket < 0) {
+        if (errno == EMFILE || errno == ENFILE)
+            usleep(ACCEPT_PAUSE_NANOS / 1000);
+        else if (errno != EINTR && errno != ECONNABORTED)
+            perror("(LodiServer) accept() failed");
+        return;
+    }
+    request.acceptedAt = nowNanos();
+    LOG_INFO("(LodiServer) TCP connection from %s:%d\n",
+           inet_ntoa(request.clientAddr.sin_addr), ntohs(request.clientAddr.sin_port));
+
+    struct timeval tv = {REQUEST_READ_TIMEOUT, 0};
+    setsockopt(request.clientSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    request.size = receiveRequest(request.clientSocket, &request.msg, &request.varlen);
+    if (request.size == 0) {
+        close(request.clientSocket);
+        LOG_INFO("(LodiServer) Incomplete or invalid request received\n");
+        return;
+    }
+    admitPendingRequest(&request, listenSocket);
+}
+
+// io_uring backend (-i uring): one ring takes the place of epoll for the
+// listener and the connections waiting to send their request. A multishot
+// accept hands over every new connection, and each connection gets one
+// multishot recv that fills buffers from a ring registered with the kernel, so
+// a request arrives without a readiness wake-up, a recv() call or a buffer of
+// its own. Uses the system calls directly (no liburing); needs Linux 6.0.
+typedef struct {
+    int fd;
+    unsigned int entries;
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufferRing;   // Receive buffers the kernel picks from
+    char *buffers;
+    unsigned short bufferTail;
+    int acceptArmed;
+} IoUring;
+
+IoUring uring;
+
+// Queue an empty submission entry, submitting the full queue first if needed
+struct io_uring_sqe *uringGetSqe() {
+    unsigned int tail = *uring.sqTail;
+    while (tail - __atomic_load_n(uring.sqHead, __ATOMIC_ACQUIRE) == uring.entries)
+        syscall(__NR_io_uring_enter, uring.fd, uring.entries, 0, 0, NULL, 0);
+
+    struct io_uring_sqe *sqe = &uring.sqes[tail & uring.sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sqArray[tail & uring.sqMask] = tail & uring.sqMask;
+    __atomic_store_n(uring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Hand a receive buffer back to the kernel
+void uringRecycleBuffer(unsigned short id) {
+    struct io_uring_buf *buffer = &uring.bufferRing->bufs[uring.bufferTail & (URING_BUFFERS - 1)];
+    buffer->addr = (unsigned long)(uring.buffers + (size_t)id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = id;
+    uring.bufferTail++;
+    __atomic_store_n(&uring.bufferRing->tail, uring.bufferTail, __ATOMIC_RELEASE);
+}
+
+void uringArmAccept(int listenSocket) {
+    struct io_uring_sqe *sqe = uringGetSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+    uring.acceptArmed = 1;
+}
+
+void uringArmRecv(WaitingConnection *conn) {
+    struct io_uring_sqe *sqe = uringGetSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->clientSocket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (unsigned long)conn;
+}
+
+// Stop a connection's multishot recv, its last completion follows
+void uringCancelRecv(WaitingConnection *conn) {
+    struct io_uring_sqe *sqe = uringGetSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long)conn;
+    sqe->user_data = URING_CANCEL;
+}
+
+// Set up the ring and its receive buffers, returns 0 if the kernel cannot
+// (io_uring missing or turned off)
+int uringStart(int listenSocket) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.fd < 0) return 0;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(uring.fd);
+        return 0;
+    }
+
+    // The submission and completion rings share one mapping
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings = mmap(NULL, sqSize > cqSize ? sqSize : cqSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        close(uring.fd);
+        return 0;
+    }
+    uring.entries = params.sq_entries;
+    uring.sqHead = (unsigned int *)(rings + params.sq_off.head);
+    uring.sqTail = (unsigned int *)(rings + params.sq_off.tail);
+    uring.sqMask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    uring.sqArray = (unsigned int *)(rings + params.sq_off.array);
+    uring.cqHead = (unsigned int *)(rings + params.cq_off.head);
+    uring.cqTail = (unsigned int *)(rings + params.cq_off.tail);
+    uring.cqMask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    uring.bufferRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring.buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (uring.bufferRing == MAP_FAILED || uring.buffers == NULL) {
+        close(uring.fd);
+        return 0;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)uring.bufferRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        close(uring.fd);
+        return 0;
+    }
+    for (int i = 0; i < URING_BUFFERS; i++)
+        uringRecycleBuffer(i);
+
+    uringArmAccept(listenSocket);
+    return 1;
+}
+
+// Done with a connection whose recv has ended: queue its request, or close it
+// if none arrived
+void uringReleaseConnection(WaitingConnection *conn, int listenSocket) {
+    if (!conn->finished)
+        unlinkWaitingConnection(conn);
+
+    PendingRequest request;
+    request.clientSocket = conn->clientSocket;
+    request.clientAddr = conn->clientAddr;
+    request.acceptedAt = conn->acceptedAt;
+    request.size = conn->finished == URING_EXPIRED ? 0 :
+                   parseRequest(conn->received, conn->receivedLength, &request.msg, &request.varlen);
+    if (request.size > 0) {
+        admitPendingRequest(&request, listenSocket);
+    } else {
+        close(request.clientSocket);
+        if (conn->finished != URING_EXPIRED)
+            LOG_INFO("(LodiServer) Incomplete or invalid request received\n");
+    }
+    free(conn);
+}
+
+void uringAddConnection(int clientSocket) {
+    WaitingConnection *conn = malloc(sizeof(WaitingConnection));
+    if (conn == NULL) {
+        LOG_ERROR("(LodiServer) Error: Could not wait for a request, out of memory\n");
+        close(clientSocket);
+        return;
+    }
+    socklen_t clientAddrLen = sizeof(conn->clientAddr);
+    memset(&conn->clientAddr, 0, sizeof(conn->clientAddr));
+    getpeername(clientSocket, (struct sockaddr *)&conn->clientAddr, &clientAddrLen);
+    LOG_INFO("(LodiServer) TCP connection from %s:%d\n",
+           inet_ntoa(conn->clientAddr.sin_addr), ntohs(conn->clientAddr.sin_port));
+
+    conn->clientSocket = clientSocket;
+    conn->acceptedAt = nowNanos();
+    conn->receivedLength = 0;
+    conn->finished = 0;
+    addWaitingConnection(conn);
+    uringArmRecv(conn);
+}
+
+void uringHandleCompletion(struct io_uring_cqe *cqe, int listenSocket) {
+    if (cqe->user_data == URING_CANCEL) return;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (cqe->user_data == URING_ACCEPT) {
+        if (cqe->res >= 0) {
+            uringAddConnection(cqe->res);
+        } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+            // Out of descriptors: stop accepting for a moment instead of spinning
+            LOG_INFO("(LodiServer) Out of file descriptors, pausing accept() (%d connections waiting)\n",
+                   waitingCount);
+            acceptResumeAt = nowNanos() + ACCEPT_PAUSE_NANOS;
+        } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+            LOG_ERROR("(LodiServer) accept() failed: %s\n", strerror(-cqe->res));
+        }
+        if (!more) {
+            uring.acceptArmed = 0;
+            if (acceptResumeAt == 0)
+                uringArmAccept(listenSocket);
+        }
+        return;
+    }
+
+    WaitingConnection *conn = (WaitingConnection *)cqe->user_data;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->finished) {
+            int length = REQUEST_MAX_SIZE - conn->receivedLength;
+            if (cqe->res < length) length = cqe->res;
+            memcpy(conn->received + conn->receivedLength, uring.buffers + (size_t)id * URING_BUFFER_SIZE, length);
+            conn->receivedLength += length;
+        }
+        uringRecycleBuffer(id);
+    }
+
+    if (!conn->finished) {
+        // Every receive buffer was taken: wait again once some come back
+        if (cqe->res == -ENOBUFS && !more) {
+            uringArmRecv(conn);
+            return;
+        }
+        PClientToLodiServer msg;
+        int varlen;
+        if (cqe->res <= 0 || conn->receivedLength == REQUEST_MAX_SIZE ||
+            parseRequest(conn->received, conn->receivedLength, &msg, &varlen) != 0) {
+            unlinkWaitingConnection(conn);
+            conn->finished = URING_RECEIVED;
+            if (more)
+                uringCancelRecv(conn);
+        }
+    }
+    if (!more)
+        uringReleaseConnection(conn, listenSocket);
+}
+
+// One turn of the io_uring backend: submit what is queued, wait up to
+// timeoutMillis (-1 forever) for completions and handle them
+void uringPoll(int listenSocket, int timeoutMillis) {
+    struct __kernel_timespec ts = {timeoutMillis / 1000, (timeoutMillis % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = timeoutMillis >= 0 ? (unsigned long)&ts : 0;
+    unsigned int toSubmit = *uring.sqTail - __atomic_load_n(uring.sqHead, __ATOMIC_ACQUIRE);
+    unsigned int flags = IORING_ENTER_EXT_ARG | (timeoutMillis != 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (syscall(__NR_io_uring_enter, uring.fd, toSubmit, timeoutMillis != 0, flags, &arg, sizeof(arg)) < 0 &&
+        errno != EINTR && errno != ETIME && errno != EBUSY)
+        DieWithError("(LodiServer) io_uring_enter() failed");
+
+    unsigned int head = *uring.cqHead;
+    unsigned int tail = __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe cqe = uring.cqes[head & uring.cqMask];
+        __atomic_store_n(uring.cqHead, head + 1, __ATOMIC_RELEASE);
+        uringHandleCompletion(&cqe, listenSocket);
+    }
+
+    // Close connections that never sent a request, and accept again after a pause
+    unsigned long now = nowNanos();
+    while (waitingHead != NULL && now - waitingHead->acceptedAt > CONNECTION_IDLE_NANOS) {
+        WaitingConnection *conn = waitingHead;
+        LOG_INFO("(LodiServer) Closing connection from %s:%d, no request after %d s\n",
+               inet_ntoa(conn->clientAddr.sin_addr), ntohs(conn->clientAddr.sin_port),
+               (int)(CONNECTION_IDLE_NANOS / 1000000000UL));
+        unlinkWaitingConnection(conn);
+        conn->finished = URING_EXPIRED;
+        uringCancelRecv(conn);
+    }
+    if (acceptResumeAt != 0 && now >= acceptResumeAt) {
+        acceptResumeAt = 0;
+        if (!uring.acceptArmed)
+            uringArmAccept(listenSocket);
+    }
+}
+
+// Handle feed request - sends multiple messages
+int handleFeedMultiple(PClientToLodiServer *msg, int clientSocket, struct sockaddr_in *clientAddr, int varlen) {
+    LOG_INFO("\n(LodiServer) --- HANDLE FEED ---\n");
+    LOG_INFO("(LodiServer) User %u requesting feed\n", msg->userID);
+
+    LodiServerMessage response;
+    response.messageType = ackFeed;
+    response.userID = msg->userID;
+
+    // Find the user's following list
+    FollowList* userList = findFollowList(&followingGraph, msg->userID);
+    unsigned long cursor;
+    unsigned int idolID;
+
+    // Check if user is following anyone
+    if (userList == NULL || userList->count == 0) {
+        LOG_INFO("(LodiServer) User %u is not following anyone\n", msg->userID);
+        if (varlen || (msg->feedFlags & FEED_FLAG_BATCHED))
+            return sendFeedFrames(clientSocket, ackFeed, msg->userID, NULL, 0, feedFrameFlags(msg, varlen), NULL, NULL);
+        strcpy(response.message, "END_OF_FEED");
+
+        // Send the end signal
+        unsigned int responseLen = sizeof(response);
+        unsigned int sent = 0;
+        while (sent < responseLen) {
+            int s = send(clientSocket, ((char *)&response) + sent, responseLen - sent, 0);
+            if (s <= 0) return 0;
+            sent += s;
+        }
+        return 1;
+    }
+
+    LOG_INFO("(LodiServer) User %u follows %u users\n", msg->userID, userList->count);
+
+    // A repeat of a cached request gets the bytes sent last time
+    int format = varlen ? ((msg->feedFlags & FEED_FLAG_LOG_LAYOUT) ? feedFormatLogLayout : feedFormatVarlen) :
+                 (msg->feedFlags & FEED_FLAG_BATCHED) ? feedFormatBatched : feedFormatLegacy;
+    if (format != feedFormatLegacy && (msg->feedFlags & FEED_FLAG_COMPRESSED))
+        format |= feedFormatCompressed;
+    FeedCacheEntry *cached = lookupFeedCache(msg, format);
+    if (cached != NULL) {
+        struct iovec iov = {cached->bytes, cached->length};
+        if (!sendAllv(clientSocket, &iov, 1)) {
+            LOG_ERROR("(LodiServer) Error sending cached feed\n");
+            return 0;
+        }
+        LOG_INFO("(LodiServer) Feed sent from cache (%zu bytes)\n", cached->length);
+        printFeedCacheStats();
+        return 1;
+    }
+
+    // Timelines still missing queued posts must not be cached
+    int cacheable = feedCache.maxBytes > 0;
+    if (feedMode == feedModeWrite || feedMode == feedModeHybrid) {
+        pthread_mutex_lock(&fanoutQueueLock);
+        cacheable = cacheable && fanoutQueueCount == 0 && !fanoutBusy;
+        pthread_mutex_unlock(&fanoutQueueLock);
+    }
+    char *serialized = NULL;
+    size_t serializedLength = 0;
+
+    // Work out which page of the feed is wanted
+    int bound;
+    int after = resolveFeedCursor(msg, &bound);
+    int limit = msg->feedLimit;
+    if (limit <= 0) limit = FEED_DEFAULT_LIMIT;
+    if (limit > FEED_MAX_LIMIT) limit = FEED_MAX_LIMIT;
+
+    LOG_INFO("(LodiServer) Page: %d posts %s post ID %d\n", limit, after ? "after" : "before", bound);
+
+    int page[FEED_MAX_LIMIT];
+    int pageLen;
+    if (feedMode == feedModeScan && postMaxAuthor < SCAN_MAX_AUTHOR) {
+        // Fan-out-on-scan: test the author of every post against the following set
+        unsigned long start = nowNanos();
+        pageLen = scanFeedPage(userList, after, bound, limit, page);
+        recordLatency(&scanLatency, start);
+        LOG_INFO("(LodiServer) Scanned %lu posts on %d thread(s) with the %s kernel\n",
+               scanPool.scannedPosts, scanPool.activeThreads, scanKernelName);
+    } else {
+        // Gather the sorted post lists the feed is merged from
+        FeedSource *sources = malloc(sizeof(FeedSource) * (userList->count + 1));
+        if (sources == NULL) {
+            LOG_ERROR("(LodiServer) ERROR: Out of memory building feed\n");
+            return 0;
+        }
+        int sourceCount = 0;
+        int timelinePosts[TIMELINE_CAPACITY];
+
+        if (feedMode == feedModeRead || feedMode == feedModeScan) {
+            // Fan-out-on-read: merge the post lists of every followed author
+            for (cursor = 0; nextInFollowList(&followingGraph, userList, &cursor, &idolID);) {
+                AuthorPosts* author = findAuthorPosts(idolID);
+                if (author == NULL || author->count == 0) continue;
+                sources[sourceCount].postIndex = author->postIndex;
+                sources[sourceCount].count = author->count;
+                sourceCount++;
+            }
+        } else {
+            // Fan-out-on-write: the requester's timeline already holds most of their feed
+            unsigned long start = nowNanos();
+            int timelineRaw[TIMELINE_CAPACITY];
+            int timelineRawLen = readTimeline(msg->userID, timelineRaw);
+            int timelineLen = 0;
+
+            for (int i = 0; i < timelineRawLen; i++) {
+                // Skip posts from idols the user has unfollowed since they were pushed
+                if (followListContains(&followingGraph, userList, postRecord(timelineRaw[i])->userID))
+                    timelinePosts[timelineLen++] = timelineRaw[i];
+            }
+            // Inline fan-out when the queue was full can push slightly out of order
+            qsort(timelinePosts, timelineLen, sizeof(int), compareInts);
+            sources[sourceCount].postIndex = timelinePosts;
+            sources[sourceCount].count = timelineLen;
+            sourceCount++;
+            recordLatency(&timelineLatency, start);
+
+            if (feedMode == feedModeHybrid) {
+                // Followed authors above the threshold are merged in from their pull lists
+                for (cursor = 0; nextInFollowList(&followingGraph, userList, &cursor, &idolID);) {
+                    AuthorPosts* author = findAuthorPosts(idolID);
+                    if (author == NULL || author->pulledCount == 0) continue;
+                    sources[sourceCount].postIndex = author->pulledIndex;
+                    sources[sourceCount].count = author->pulledCount;
+                    sourceCount++;
+                }
+            }
+        }
+
+        unsigned long mergeStart = nowNanos();
+        pageLen = mergeFeedPage(sources, sourceCount, after, bound, limit, page);
+        free(sources);
+        if (feedMode == feedModeHybrid)
+            recordLatency(&pullLatency, mergeStart);
+    }
+
+    // Pages always go out newest first
+    if (after) {
+        for (int i = 0; i < pageLen / 2; i++) {
+            int tmp = page[i];
+            page[i] = page[pageLen - 1 - i];
+            page[pageLen - 1 - i] = tmp;
+        }
+    }
+
+    if (varlen || (msg->feedFlags & FEED_FLAG_BATCHED)) {
+        if (!sendFeedFrames(clientSocket, ackFeed, msg->userID, page, pageLen, feedFrameFlags(msg, varlen),
+                            cacheable ? &serialized : NULL, &serializedLength)) {
+            free(serialized);
+            return 0;
+        }
+        LOG_INFO("(LodiServer) Feed sent successfully (%d posts, %s frames)\n",
+               pageLen, varlen ? "variable-length" : "fixed-size");
+        if (serialized != NULL)
+            storeFeedCache(msg, format, after, pageLen == limit, serialized, serializedLength);
+        printFeedCacheStats();
+        return 1;
+    }
+
+    // Old clients get one message per post, formatted back to back and kept for the cache
+    LodiServerMessage *messages = formatFeedMessages(ackFeed, msg->userID, page, pageLen);
+    if (messages == NULL) {
+        LOG_ERROR("(LodiServer) ERROR: Out of memory building feed\n");
+        return 0;
+    }
+    LOG_INFO("(LodiServer) Found %d posts from followed users\n", pageLen);
+
+    struct iovec iov = {messages, sizeof(LodiServerMessage) * (pageLen + 1)};
+    if (!sendAllv(clientSocket, &iov, 1)) {
+        LOG_ERROR("(LodiServer) Error sending feed\n");
+        free(messages);
+        return 0;
+    }
+
+    LOG_INFO("(LodiServer) Feed sent successfully (%d posts)\n", pageLen);
+    if (cacheable)
+        storeFeedCache(msg, format, after, pageLen == limit, (char *)messages, sizeof(LodiServerMessage) * (pageLen + 1));
+    else
+        free(messages);
+    printFeedCacheStats();
+    return 1;
+}
+
+// Handle subscribe request: ack it and keep the connection open for pushed posts.
+// Returns 0 if the connection should be closed.
+int handleSubscribe(PClientToLodiServer *msg, int clientSocket, int varlen) {
+    LOG_INFO("\n(LodiServer) --- HANDLE SUBSCRIBE ---\n");
+    LOG_INFO("(LodiServer) User %u subscribing to their live feed\n", msg->userID);
+
+    LodiServerMessage response;
+    response.messageType = ackSubscribe;
+    response.userID = msg->userID;
+
+    pruneSubscribers();
+    if (subscriberCount == MAX_SUBSCRIBERS) {
+        LOG_INFO("(LodiServer) Too many live feed subscribers, rejecting user %u\n", msg->userID);
+        strcpy(response.message, "Error: Too many live feed subscribers, try again later");
+        sendResponse(clientSocket, &response, varlen);
+        return 0;
+    }
+
+    strcpy(response.message, "Subscribed, new posts will be pushed as they arrive");
+    if (!sendResponse(clientSocket, &response, varlen)) {
+        LOG_ERROR("(LodiServer) Error: Failed to send ackSubscribe\n");
+        return 0;
+    }
+
+    subscribers[subscriberCount].userID = msg->userID;
+    subscribers[subscriberCount].clientSocket = clientSocket;
+    subscribers[subscriberCount].varlen = varlen;
+    subscriberCount++;
+    LOG_INFO("(LodiServer) User %u subscribed (%d live subscriber(s))\n", msg->userID, subscriberCount);
+    return 1;
+}
+
+// Handle search request: the newest posts containing every word of the query in
+// msg->message, sent like a feed page. A before-ID or before-time cursor pages to older results.
+int handleSearch(PClientToLodiServer *msg, int clientSocket, int varlen) {
+    LOG_INFO("\n(LodiServer) --- HANDLE SEARCH ---\n");
+    LOG_INFO("(LodiServer) User %u searching for \"%s\"\n", msg->userID, msg->message);
+
+    int limit = msg->feedLimit;
+    if (limit <= 0) limit = FEED_DEFAULT_LIMIT;
+    if (limit > FEED_MAX_LIMIT) limit = FEED_MAX_LIMIT;
+    int bound = publishedPosts;
+    if (msg->cursorType == cursorBeforeID || msg->cursorType == cursorBeforeTime)
+        resolveFeedCursor(msg, &bound);
+
+    unsigned long start = nowNanos();
+    int results[FEED_MAX_LIMIT];
+    int resultCount = searchPosts(&searchIndex, msg->message, bound, limit, results);
+    if (resultCount < 0) {
+        LOG_INFO("(LodiServer) Search query has no words\n");
+        resultCount = 0;
+    }
+    LOG_INFO("(LodiServer) Found %d posts in %.3f ms\n", resultCount, (nowNanos() - start) / 1e6);
+
+    if (varlen || (msg->feedFlags & FEED_FLAG_BATCHED))
+        return sendFeedFrames(clientSocket, ackSearch, msg->userID, results, resultCount,
+                              feedFrameFlags(msg, varlen), NULL, NULL);
+
+    LodiServerMessage *messages = formatFeedMessages(ackSearch, msg->userID, results, resultCount);
+    if (messages == NULL) return 0;
+    struct iovec iov = {messages, sizeof(LodiServerMessage) * (resultCount + 1)};
+    int sent = sendAllv(clientSocket, &iov, 1);
+    free(messages);
+    return sent;
+}
+
+// Handle trending request: the top hashtags and terms of the window named in
+// msg->message ("5m" or "1h", default 5m), feedLimit of each, one response per
+// line and END_OF_TRENDING last
+int handleTrending(PClientToLodiServer *msg, int clientSocket, int varlen) {
+    LOG_INFO("\n(LodiServer) --- HANDLE TRENDING ---\n");
+
+    TrendingWindow *window = &trendingWindows[0];
+    for (int w = 0; w < TRENDING_WINDOWS; w++) {
+        if (strcmp(msg->message, trendingWindows[w].name) == 0)
+            window = &trendingWindows[w];
+    }
+    int limit = msg->feedLimit;
+    if (limit <= 0) limit = TRENDING_DEFAULT_LIMIT;
+    if (limit > TRENDING_TOP) limit = TRENDING_TOP;
+    LOG_INFO("(LodiServer) User %u asking for the top %d of the last %s\n", msg->userID, limit, window->name);
+
+    LodiServerMessage response;
+    response.messageType = ackTrending;
+    response.userID = msg->userID;
+
+    unsigned long now = nowMicros();
+    TrendingEntry top[TRENDING_TOP];
+    TrendingHeap *heaps[2] = {&window->hashtags, &window->terms};
+    for (int h = 0; h < 2; h++) {
+        int count = trendingTop(window, heaps[h], now, limit, top);
+        for (int i = 0; i < count; i++) {
+            snprintf(response.message, sizeof(response.message), "%s %d. %s (~%.1f posts)",
+                     h == 0 ? "hashtag" : "term", i + 1, top[i].key, top[i].weight);
+            LOG_INFO("(LodiServer) %s\n", response.message);
+            if (!sendResponse(clientSocket, &response, varlen)) return 0;
+        }
+    }
+
+    strcpy(response.message, "END_OF_TRENDING");
+    return sendResponse(clientSocket, &response, varlen);
+}
+
+// Handling time of each request type, from dispatch until the handler returns
+// (posts and follows stop at the commit queue; commitLatency covers the rest)
+#define REQUEST_TYPES 10
+const char *requestTypeNames[REQUEST_TYPES] = {"login", "post", "feed", "follow", "unfollow", "logout",
+                                               "subscribe", "search", "trending", "stats"};
+LatencyHistogram requestLatency[REQUEST_TYPES];
+LatencyHistogram publicKeyLatency;      // PKE round trip of a login
+LatencyHistogram tfaLatency;            // TFA round trip of a login, including the user's approval
+
+// Register the histograms and counters dumped by a stats request
+void registerStats() {
+    statsStart("lodi");
+    for (int i = 0; i < REQUEST_TYPES; i++)
+        statsRegisterHistogram(requestTypeNames[i], &requestLatency[i]);
+    statsRegisterHistogram("pke.requestKey", &publicKeyLatency);
+    statsRegisterHistogram("tfa.requestAuth", &tfaLatency);
+    statsRegisterHistogram("feed.push", &pushLatency.histogram);
+    statsRegisterHistogram("feed.timeline", &timelineLatency.histogram);
+    statsRegisterHistogram("feed.pull", &pullLatency.histogram);
+    statsRegisterHistogram("feed.scan", &scanLatency.histogram);
+    statsRegisterHistogram("commit.ack", &commitLatency.histogram);
+    statsRegisterHistogram("follow.snapshotPause", &snapshotPause);
+    statsRegisterHistogram("follow.snapshotWrite", &snapshotWrite);
+    statsRegisterHistogram("queue.cheap", &admissionQueues[classCheap].wait);
+    statsRegisterHistogram("queue.expensive", &admissionQueues[classExpensive].wait);
+    statsRegisterCounter("rate.userLimited", &rateLimiter.userLimited);
+    statsRegisterCounter("rate.globalLimited", &rateLimiter.globalLimited);
+    statsRegisterCounter("rate.shed", &rateLimiter.shed);
+    statsRegisterCounter("queue.cheapFull", &admissionQueues[classCheap].full);
+    statsRegisterCounter("queue.expensiveFull", &admissionQueues[classExpensive].full);
+    statsRegisterCounter("queue.loginFull", &loginQueueFull);
+    statsRegisterCounter("feedCache.hits", &feedCache.hits);
+    statsRegisterCounter("feedCache.misses", &feedCache.misses);
+    statsRegisterCounter("feedCache.invalidations", &feedCache.invalidations);
+    statsRegisterCounter("feedCache.evictions", &feedCache.evictions);
+    statsRegisterCounter("feed.compressedPages", &compressedPages);
+    statsRegisterCounter("feed.compressSkippedPages", &compressSkippedPages);
+    statsRegisterCounter("feed.compressSavedBytes", &compressSavedBytes);
+    statsRegisterCounter("commit.batches", &commitBatches);
+    statsRegisterCounter("commit.posts", &committedPosts);
+}
+
+// Handle stats request: the reply is the text dump of the stats registry, then
+// the connection is closed. Only answered for clients on this host.
+int handleStats(int clientSocket) {
+    if (!statsPeerIsLocal(clientSocket)) {
+        LOG_WARN("(LodiServer) Ignoring a stats request from another host\n");
+        return 0;
+    }
+    char dump[STATS_DUMP_MAX];
+    struct iovec iov = {dump, statsDump(dump, sizeof(dump))};
+    return sendAllv(clientSocket, &iov, 1);
+}
+
+// Handle logout request
+void handleLogout(PClientToLodiServer *msg, LodiServerMessage *response) {
+    LOG_INFO("\n(LodiServer) --- HANDLE LOGOUT ---\n");
+    LOG_INFO("(LodiServer) User %u logging out\n", msg->userID);
+
+    // Send success response
+    response->messageType = ackLogout;
+    response->userID = msg->userID;
+    strcpy(response->message, "Logout successful. Goodbye!");
+
+    // Logging out ends the user's live feed subscriptions
+    for (int i = subscriberCount - 1; i >= 0; i--) {
+        if (subscribers[i].userID == msg->userID)
+            dropSubscriber(i, "logged out");
+    }
+
+    LOG_INFO("(LodiServer) User %u has logged out\n", msg->userID);
+    LOG_INFO("(LodiServer) Logout processed successfully\n");
+}
+
+// Post length distribution for benchmarks: share of posts (percent) per length
+// range, skewed towards short posts like a typical short-message feed
+typedef struct {
+    int minLength;
+    int maxLength;
+    int percent;
+} PostLengthBucket;
+
+PostLengthBucket benchLengths[] = {
+    {1, 10, 15}, {11, 20, 20}, {21, 40, 27}, {41, 60, 17}, {61, 80, 11}, {81, 99, 10}
+};
+
+// Random post length drawn from benchLengths
+int benchPostLength() {
+    int pick = rand() % 100;
+    for (int b = 0; b < (int)(sizeof(benchLengths) / sizeof(benchLengths[0])); b++) {
+        if (pick < benchLengths[b].percent) {
+            int span = benchLengths[b].maxLength - benchLengths[b].minLength + 1;
+            return benchLengths[b].minLength + rand() % span;
+        }
+        pick -= benchLengths[b].percent;
+    }
+    return MAX_POST_LENGTH;
+}
+
+#define BENCH_POSTS 100000       // Posts generated by the benchmarks
+#define BENCH_COMMIT_POSTS 2000  // Posts per group commit configuration
+#define BENCH_COMMIT_CLIENTS 64  // Clients each waiting for their ack before posting again
+#define BENCH_AUTHORS 100        // Users the generated posts are spread over
+
+// Open a post log in a fresh directory under parent for a benchmark, returns 0 on failure
+int benchOpenPostLog(char *dir, size_t size, const char *parent) {
+    snprintf(dir, size, "%s/lodi-bench-XXXXXX", parent);
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp() failed");
+        return 0;
+    }
+    openPostLog(dir);
+    return 1;
+}
+
+// Drop the benchmark post log and its directory
+void benchClosePostLog(char *dir) {
+    closePostLog(1);
+    rmdir(dir);
+}
+
+// Fill the post log with posts whose lengths follow benchLengths,
+// returns the total text bytes written
+unsigned long benchFillPosts(int count) {
+    char text[MAX_POST_LENGTH];
+    memset(text, 'x', sizeof(text));
+
+    srand(42);
+    unsigned long textBytes = 0;
+    for (int i = 0; i < count; i++) {
+        int length = benchPostLength();
+        if (storePost(1 + rand() % BENCH_AUTHORS, i % 500, text, length) < 0) break;
+        textBytes += length;
+    }
+    return textBytes;
+}
+
+// Memory and bandwidth of fixed-size vs. length-prefixed posts
+void benchPostSize() {
+    char dir[300];
+    if (!benchOpenPostLog(dir, sizeof(dir), "/tmp")) return;
+
+    unsigned long textBytes = benchFillPosts(BENCH_POSTS);
+    int count = postCount;
+    double avgLength = (double)textBytes / count;
+    unsigned long logBytes = 0;
+    for (int i = 0; i < segmentCount; i++)
+        logBytes += postSegments[i].used;
+    benchClosePostLog(dir);
+
+    int pagePosts = FEED_MAX_LIMIT;
+    int pageFrames = (pagePosts + FEED_FRAME_POSTS - 1) / FEED_FRAME_POSTS;
+
+    // Fixed-size layout: 100 byte text buffer in every post, frame and request
+    double fixedStore = 128.0;  // sizeof(Post) with an embedded char message[100]
+    double varStore = (double)logBytes / count + sizeof(PostLocation);
+    double legacyFeed = (pagePosts + 1) * (double)sizeof(LodiServerMessage);
+    double fixedFeed = pageFrames * sizeof(FeedFrameHeader) + pagePosts * (double)sizeof(FeedPostRecord);
+    double varFeed = pageFrames * sizeof(FeedFrameHeader) + pagePosts * (sizeof(PostRecordHeader) + avgLength);
+    double fixedRequest = LEGACY_REQUEST_SIZE;
+    double varRequest = sizeof(LodiRequestHeader) + avgLength;
+
+    printf("Post length distribution (%d posts, average %.1f bytes):\n", count, avgLength);
+    for (int b = 0; b < (int)(sizeof(benchLengths) / sizeof(benchLengths[0])); b++)
+        printf("  %2d-%2d bytes: %d%%\n", benchLengths[b].minLength, benchLengths[b].maxLength, benchLengths[b].percent);
+    printf("\n%-32s %12s %12s %8s\n", "", "fixed", "variable", "saved");
+    printf("%-32s %12.1f %12.1f %7.1f%%\n", "Store bytes per post (log+index)",
+           fixedStore, varStore, 100.0 * (1 - varStore / fixedStore));
+    printf("%-32s %12.1f %12.1f %7.1f%%\n", "Post request bytes",
+           fixedRequest, varRequest, 100.0 * (1 - varRequest / fixedRequest));
+    printf("%-32s %12.1f %12.1f %7.1f%%\n", "Feed page bytes (batched)",
+           fixedFeed, varFeed, 100.0 * (1 - varFeed / fixedFeed));
+    printf("%-32s %12.1f %12.1f %7.1f%%\n", "Feed page bytes (vs. per-post)",
+           legacyFeed, varFeed, 100.0 * (1 - varFeed / legacyFeed));
+}
+
+// Throughput and ack latency of group commit for several batch sizes and windows.
+// BENCH_COMMIT_CLIENTS clients each post again as soon as their ack arrives.
+void benchGroupCommit(const char *parent) {
+    int batchSizes[] = {1, 8, 32, 128};
+    int windows[] = {0, 1000, 5000};
+    char dir[300];
+    char text[MAX_POST_LENGTH];
+    memset(text, 'x', sizeof(text));
+
+    if (!benchOpenPostLog(dir, sizeof(dir), parent)) return;
+
+    pthread_t commitThread;
+    if (pthread_create(&commitThread, NULL, commitWorker, NULL) != 0) {
+        perror("pthread_create() failed");
+        benchClosePostLog(dir);
+        return;
+    }
+    pthread_detach(commitThread);
+
+    printf("Group commit: %d posts per run, %d concurrent clients, log in %s\n",
+           BENCH_COMMIT_POSTS, BENCH_COMMIT_CLIENTS, parent);
+    printf("\n%6s %9s %12s %10s %12s %12s\n", "batch", "window", "posts/sec", "posts/sync", "avg ack", "max ack");
+
+    LodiServerMessage response;
+    response.messageType = ackPost;
+    strcpy(response.message, "Post successful");
+
+    srand(42);
+    for (int b = 0; b < (int)(sizeof(batchSizes) / sizeof(batchSizes[0])); b++) {
+        for (int w = 0; w < (int)(sizeof(windows) / sizeof(windows[0])); w++) {
+            // A window only matters when a batch can wait for more posts
+            if (batchSizes[b] == 1 && windows[w] > 0) continue;
+
+            pthread_mutex_lock(&commitQueueLock);
+            commitBatchSize = batchSizes[b];
+            commitWindowMicros = windows[w];
+            commitBatches = 0;
+            committedPosts = 0;
+            pthread_mutex_unlock(&commitQueueLock);
+            pthread_mutex_lock(&latencyLock);
+            commitLatency.count = commitLatency.totalNanos = commitLatency.maxNanos = 0;
+            pthread_mutex_unlock(&latencyLock);
+
+            unsigned long start = nowNanos();
+            for (int i = 0; i < BENCH_COMMIT_POSTS; i++) {
+                // Each client has at most one post waiting for its ack
+                pthread_mutex_lock(&commitQueueLock);
+                while (commitQueueCount + commitInFlight >= BENCH_COMMIT_CLIENTS)
+                    pthread_cond_wait(&commitQueueSpace, &commitQueueLock);
+                pthread_mutex_unlock(&commitQueueLock);
+
+                response.userID = 1 + rand() % BENCH_AUTHORS;
+                // Nobody reads benchmark posts, they are only made durable, not published
+                if (storePost(response.userID, i % 500, text, benchPostLength()) < 0) break;
+                CommitEntry change = {-1, 0, response, -1, 0, commitEpoch, 0};
+                enqueueCommit(&change);
+            }
+
+            // Wait for the last batch
+            pthread_mutex_lock(&commitQueueLock);
+            while (commitQueueCount + commitInFlight > 0)
+                pthread_cond_wait(&commitQueueSpace, &commitQueueLock);
+            double postsPerSync = commitBatches ? (double)committedPosts / commitBatches : 0;
+            pthread_mutex_unlock(&commitQueueLock);
+            double seconds = (nowNanos() - start) / 1e9;
+
+            pthread_mutex_lock(&latencyLock);
+            unsigned long avg = commitLatency.count ? commitLatency.totalNanos / commitLatency.count : 0;
+            printf("%6d %7dus %12.0f %10.1f %10luus %10luus\n", batchSizes[b], windows[w],
+                   commitLatency.count / seconds, postsPerSync, avg / 1000, commitLatency.maxNanos / 1000);
+            pthread_mutex_unlock(&latencyLock);
+        }
+    }
+
+    benchClosePostLog(dir);
+}
+
+#define BENCH_GRAPH_USERS 100000    // Users in the follow graph benchmark
+#define BENCH_GRAPH_EDGES 2000000   // Follows made by the follow graph benchmark
+#define BENCH_GRAPH_LOOKUPS 1000000 // Membership tests per layout
+
+// Random follow for the graph benchmark: one in ten goes to one of 100 popular users
+void benchRandomEdge(unsigned int *user, unsigned int *idol) {
+    *user = 1 + rand() % BENCH_GRAPH_USERS;
+    *idol = rand() % 10 == 0 ? 1 + rand() % 100 : 1 + rand() % BENCH_GRAPH_USERS;
+}
+
+// Membership tests per second against the current layout of the following lists
+double benchFollowLookups(unsigned long *hits) {
+    unsigned long start = nowNanos();
+    *hits = 0;
+    for (int i = 0; i < BENCH_GRAPH_LOOKUPS; i++) {
+        unsigned int user, idol;
+        benchRandomEdge(&user, &idol);
+        FollowList* list = findFollowList(&followingGraph, user);
+        if (list != NULL && followListContains(&followingGraph, list, idol))
+            (*hits)++;
+    }
+    return BENCH_GRAPH_LOOKUPS / ((nowNanos() - start) / 1e9);
+}
+
+// Follow graph storage and persistence: logged follows, lookups in the hash set and
+// CSR layouts, unfollows, snapshot write and load
+void benchFollowGraph() {
+    char dir[300];
+    char path[300];
+    if (!benchOpenPostLog(dir, sizeof(dir), "/tmp")) return;
+    openFollowLog();
+
+    srand(42);
+    unsigned long start = nowNanos();
+    for (int i = 0; i < BENCH_GRAPH_EDGES; i++) {
+        unsigned int user, idol;
+        benchRandomEdge(&user, &idol);
+        if (addFollowing(user, idol) > 0)
+            appendFollowLog(follow, user, idol);
+    }
+    double followSeconds = (nowNanos() - start) / 1e9;
+
+    // Rewind to the point where the follows were made so the lookups hit
+    unsigned long hashHits, csrHits;
+    srand(42);
+    double hashLookups = benchFollowLookups(&hashHits);
+    unsigned long hashBytes = followGraphBytes(&followingGraph);
+    start = nowNanos();
+    compactFollowGraph(&followingGraph);
+    double compactMillis = (nowNanos() - start) / 1e6;
+    srand(42);
+    double csrLookups = benchFollowLookups(&csrHits);
+    unsigned long csrBytes = followGraphBytes(&followingGraph);
+
+    // Unfollow a tenth of the follows, turning the touched lists back into hash sets
+    srand(42);
+    start = nowNanos();
+    int unfollows = 0;
+    for (int i = 0; i < BENCH_GRAPH_EDGES / 10; i++) {
+        unsigned int user, idol;
+        benchRandomEdge(&user, &idol);
+        if (removeFollowing(user, idol) > 0 && appendFollowLog(unfollow, user, idol))
+            unfollows++;
+    }
+    double unfollowSeconds = (nowNanos() - start) / 1e9;
+
+    // Only the copy holds up requests, the snapshot thread sorts and writes it
+    unsigned long edges = followingGraph.edgeCount;
+    size_t snapshotBytes = 0;
+    start = nowNanos();
+    char *snapshot = copyFollowSnapshot(&snapshotBytes);
+    double copyMillis = (nowNanos() - start) / 1e6;
+    start = nowNanos();
+    if (snapshot != NULL)
+        sortFollowSnapshot(snapshot, snapshotBytes);
+    if (snapshot != NULL && storeFollowSnapshot(snapshot, snapshotBytes) && ftruncate(followLogFd, 0) == 0)
+        followLogRecords = 0;
+    double snapshotMillis = (nowNanos() - start) / 1e6;
+    free(snapshot);
+
+    // Forget the graph and load it back like a restart would
+    clearFollowGraph(&followingGraph);
+    start = nowNanos();
+    unsigned long loaded = loadFollowSnapshot();
+    double loadMillis = (nowNanos() - start) / 1e6;
+
+    printf("Follow graph: %lu edges, %u users following, %u users followed\n",
+           edges, followingGraph.listCount, followerIndex.setCount);
+    printf("  follow + log append   %10.0f ops/sec\n", BENCH_GRAPH_EDGES / followSeconds);
+    printf("  unfollow + log append %10.0f ops/sec\n", unfollows / unfollowSeconds);
+    printf("  lookups, hash sets    %10.0f ops/sec (%lu hits, %.1f MB)\n",
+           hashLookups, hashHits, hashBytes / 1048576.0);
+    printf("  lookups, CSR          %10.0f ops/sec (%lu hits, %.1f MB, compacted in %.1f ms)\n",
+           csrLookups, csrHits, csrBytes / 1048576.0, compactMillis);
+    printf("  snapshot copy         %10.2f ms (%.1f MB, requests wait for this)\n",
+           copyMillis, snapshotBytes / 1048576.0);
+    printf("  snapshot write        %10.2f ms (in the background)\n", snapshotMillis);
+    printf("  snapshot load         %10.2f ms (%lu edges, follower index included)\n", loadMillis, loaded);
+
+    closeFollowLog();
+    followFilePath(path, sizeof(path), "lodi_follows.snap");
+    unlink(path);
+    followFilePath(path, sizeof(path), "lodi_follows.wal");
+    unlink(path);
+    benchClosePostLog(dir);
+}
+
+// Sorted copy of an idol's followers, for comparing against plain sorted arrays
+unsigned int *benchFollowerArray(unsigned int idolID, unsigned int *count) {
+    FollowerSet* set = findFollowerSet(&followerIndex, idolID);
+    *count = set == NULL ? 0 : set->followers.count;
+    unsigned int *ids = malloc(sizeof(unsigned int) * (*count + 1));
+    unsigned long cursor = 0;
+    for (unsigned int i = 0; set != NULL && roaringNext(&set->followers, &cursor, &ids[i]); i++)
+        ;
+    return ids;
+}
+
+// Size of the intersection of two sorted arrays by merging
+unsigned long benchMergeCount(unsigned int *a, unsigned int aCount, unsigned int *b, unsigned int bCount) {
+    unsigned long count = 0;
+    unsigned int i = 0, j = 0;
+    while (i < aCount && j < bCount) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            count++;
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+// Common follower counts of two idols: roaring intersection vs. merging sorted arrays
+void benchIntersect(const char *label, unsigned int a, unsigned int b, int rounds) {
+    unsigned int aCount, bCount;
+    unsigned int *aIDs = benchFollowerArray(a, &aCount);
+    unsigned int *bIDs = benchFollowerArray(b, &bCount);
+
+    unsigned long roaringCommon = 0, mergeCommon = 0;
+    unsigned long start = nowNanos();
+    for (int r = 0; r < rounds; r++)
+        roaringCommon += countCommonFollowers(a, b);
+    double roaringMicros = (nowNanos() - start) / 1e3 / rounds;
+
+    start = nowNanos();
+    for (int r = 0; r < rounds; r++)
+        mergeCommon += benchMergeCount(aIDs, aCount, bIDs, bCount);
+    double mergeMicros = (nowNanos() - start) / 1e3 / rounds;
+
+    printf("  %-22s %7u x %7u  %7lu common  %9.2f us %9.2f us\n", label, aCount, bCount,
+           roaringCommon / rounds, roaringMicros, mergeMicros);
+    if (roaringCommon != mergeCommon)
+        printf("  MISMATCH: roaring %lu, merge %lu\n", roaringCommon, mergeCommon);
+    free(aIDs);
+    free(bIDs);
+}
+
+// Reverse follower index: memory of the roaring sets and the speed of common-follower counts
+void benchFollowerIndex() {
+    // Two huge accounts followed by half the users each, a few popular ones, and a long tail
+    srand(42);
+    for (unsigned int user = 1; user <= BENCH_GRAPH_USERS; user++) {
+        if (rand() % 2) addFollowing(user, 1);
+        if (rand() % 2) addFollowing(user, 2);
+        for (int k = 0; k < 16; k++) {
+            unsigned int someone, idol;
+            benchRandomEdge(&someone, &idol);
+            addFollowing(user, idol);
+        }
     }
-    
-    printf("(LodiServer) Request sent to TFA Server at %s:%u\n", tfaServerIP, tfaServerPort);
-    printf("(LodiServer) Waiting for user to approve on TFA client...\n");
-    
-    // Receive response from TFA Server
+    compactFollowGraph(&followingGraph);
 
-    struct sockaddr_in fromAddr;
-    unsigned int fromSize = sizeof(fromAddr);
-    
-    if ((recvMsgSize = recvfrom(sock, &response, sizeof(response), 0,
-                                (struct sockaddr *)&fromAddr, &fromSize)) < 0) {
-        printf("(LodiServer) Error: Failed to receive response from TFA Server\n");
-        return 0;
+    unsigned long edges = followerIndex.edgeCount;
+    unsigned long roaringBytes = followerIndexBytes(&followerIndex);
+    printf("Follower index: %lu edges, %u idols\n", edges, followerIndex.setCount);
+    printf("  roaring sets          %10.1f MB (%.2f bytes per edge)\n", roaringBytes / 1048576.0, (double)roaringBytes / edges);
+    printf("  sorted arrays (CSR)   %10.1f MB (%.2f bytes per edge)\n",
+           followGraphBytes(&followingGraph) / 1048576.0, (double)followGraphBytes(&followingGraph) / edges);
+
+    printf("\n  %-22s %17s  %14s %12s %12s\n", "common followers", "set sizes", "", "roaring", "merge");
+    benchIntersect("huge x huge", 1, 2, 200);
+    benchIntersect("huge x popular", 1, 50, 2000);
+    benchIntersect("popular x popular", 50, 60, 2000);
+    benchIntersect("ordinary x ordinary", 5000, 6000, 20000);
+}
+
+#define BENCH_SCAN_POSTS 1000000    // Posts in the scan benchmark
+#define BENCH_SCAN_COMPARES 50000000 // Author comparisons the nested loop gets per following size
+
+// Matching posts per second of one scan kernel over the whole author column
+double benchScanKernel(PostScanKernel kernel, const unsigned int *authors, const unsigned int *following,
+                       int posts, int *out, int *found) {
+    unsigned long start = nowNanos();
+    int rounds = 5;
+    for (int r = 0; r < rounds; r++)
+        *found = kernel(authors, following, 0, posts, out);
+    return (double)posts * rounds / ((nowNanos() - start) / 1e9);
+}
+
+// Fan-out-on-read post scan: the old nested loop over posts and following list vs. the
+// bitmap scan kernels
+void benchPostScan() {
+    unsigned int *authors = malloc(sizeof(unsigned int) * BENCH_SCAN_POSTS);
+    int *out = malloc(sizeof(int) * BENCH_SCAN_POSTS);
+    unsigned int *following = calloc((BENCH_GRAPH_USERS >> 5) + 1, sizeof(unsigned int));
+    unsigned int *followingIDs = malloc(sizeof(unsigned int) * 1000);
+    if (authors == NULL || out == NULL || following == NULL || followingIDs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
-    
-    printf("(LodiServer) Received response from %s:%u\n",
-           inet_ntoa(fromAddr.sin_addr), ntohs(fromAddr.sin_port));
-    
-    if (response.messageType == responseAuth && response.userID == userID) {
-        printf("(LodiServer) Authentication successful for user %u\n", userID);
-        return 1;
+
+    srand(42);
+    for (int i = 0; i < BENCH_SCAN_POSTS; i++) {
+        unsigned int someone;
+        benchRandomEdge(&someone, &authors[i]);
     }
-    else if (response.messageType == responseAuthFail && response.userID == userID) {
-        printf("(LodiServer) Authentication denied for user %u\n", userID);
-        return 0;
+
+    PostScanKernel kernels[3] = {scanPostsScalar};
+    const char *names[3] = {"scalar"};
+    int kernelCount = 1;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        kernels[kernelCount] = scanPostsSSE4;
+        names[kernelCount++] = "sse4.1";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[kernelCount] = scanPostsAVX2;
+        names[kernelCount++] = "avx2";
     }
+#endif
 
-    printf("(LodiServer) Error: Invalid response from TFA Server\n");
-    return 0;
+    printf("Post scan: %d posts by %d authors, Mposts/s\n", BENCH_SCAN_POSTS, BENCH_GRAPH_USERS);
+    printf("  %-10s %10s", "following", "nested");
+    for (int k = 0; k < kernelCount; k++)
+        printf(" %10s", names[k]);
+    printf("\n");
+
+    int sizes[] = {10, 100, 1000};
+    for (int s = 0; s < 3; s++) {
+        int size = sizes[s];
+        memset(following, 0, sizeof(unsigned int) * ((BENCH_GRAPH_USERS >> 5) + 1));
+        for (int f = 0; f < size; f++) {
+            unsigned int someone;
+            benchRandomEdge(&someone, &followingIDs[f]);
+            following[followingIDs[f] >> 5] |= 1U << (followingIDs[f] & 31);
+        }
+
+        // The nested loop only gets a prefix of the posts, it is too slow for all of them
+        int nestedPosts = BENCH_SCAN_COMPARES / size < BENCH_SCAN_POSTS ? BENCH_SCAN_COMPARES / size : BENCH_SCAN_POSTS;
+        int nestedFound = 0;
+        unsigned long start = nowNanos();
+        for (int i = 0; i < nestedPosts; i++) {
+            for (int f = 0; f < size; f++) {
+                if (authors[i] == followingIDs[f]) {
+                    out[nestedFound++] = i;
+                    break;
+                }
+            }
+        }
+        double nestedRate = nestedPosts / ((nowNanos() - start) / 1e9);
+        printf("  %-10d %10.1f", size, nestedRate / 1e6);
+
+        int expected = scanPostsScalar(authors, following, 0, nestedPosts, out);
+        int mismatch = nestedFound != expected;
+        int scalarFound = 0;
+        for (int k = 0; k < kernelCount; k++) {
+            int found;
+            printf(" %10.1f", benchScanKernel(kernels[k], authors, following, BENCH_SCAN_POSTS, out, &found) / 1e6);
+            if (k == 0)
+                scalarFound = found;
+            else if (found != scalarFound)
+                mismatch = 1;
+        }
+        printf("  (%d matches)\n", scalarFound);
+        if (mismatch)
+            printf("  MISMATCH between scan kernels\n");
+    }
+    printf("  runtime dispatch picks: %s\n", scanKernelName);
+
+    free(authors);
+    free(out);
+    free(following);
+    free(followingIDs);
 }
 
-//  Handle post message
-void handlePost(PClientToLodiServer *msg, LodiServerMessage *response) {
-    printf("\n(LodiServer) --- HANDLE POST ---\n");
-    printf("(LodiServer) User %u wants to post: \"%s\"\n", msg->userID, msg->message);
+#define BENCH_PARALLEL_POSTS 8000000  // Posts in the parallel scan benchmark
 
-    // Check if we have space for more posts
-    if (postCount >= MAX_POSTS) {
-        printf("(LodiServer) ERROR: Post storage is full\n");
-        response->messageType = ackPost;
-        response->userID = msg->userID;
-        strcpy(response->message, "Error: Server post storage is full");
-        return;
+// Feed scan split over 1 to maxThreads threads: a whole-log scan for a user who
+// follows 100 people, as posts per second and speedup over one thread
+void benchParallelScan(int maxThreads) {
+    unsigned int *authors = malloc(sizeof(unsigned int) * BENCH_PARALLEL_POSTS);
+    int *page = malloc(sizeof(int) * BENCH_PARALLEL_POSTS);
+    int *expected = malloc(sizeof(int) * BENCH_PARALLEL_POSTS);
+    unsigned int *following = calloc((BENCH_GRAPH_USERS >> 5) + 1, sizeof(unsigned int));
+    if (authors == NULL || page == NULL || expected == NULL || following == NULL ||
+        !startScanPool(maxThreads)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
 
-    // Store the post
-    posts[postCount].userID = msg->userID;
-    posts[postCount].timestamp = msg->timestamp;
-    strncpy(posts[postCount].message, msg->message, sizeof(posts[postCount].message) - 1);
-    posts[postCount].message[sizeof(posts[postCount].message) - 1] = '\0';
+    srand(42);
+    for (int i = 0; i < BENCH_PARALLEL_POSTS; i++) {
+        unsigned int someone;
+        benchRandomEdge(&someone, &authors[i]);
+    }
+    for (int f = 0; f < 100; f++) {
+        unsigned int someone, idol;
+        benchRandomEdge(&someone, &idol);
+        following[idol >> 5] |= 1U << (idol & 31);
+    }
 
-    printf("(LodiServer) Post stored at index %d\n", postCount);
-    printf("(LodiServer) User ID: %u\n", posts[postCount].userID);
-    printf("(LodiServer) Timestamp: %lu\n", posts[postCount].timestamp);
-    printf("(LodiServer) Message: \"%s\"\n", posts[postCount].message);
+    printf("Parallel scan: %d posts, following 100 users, %s kernel\n", BENCH_PARALLEL_POSTS, scanKernelName);
+    printf("  %-8s %12s %10s %10s\n", "threads", "Mposts/s", "speedup", "matches");
+    double single = 0;
+    int expectedLen = 0;
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > maxThreads) threads = maxThreads;
+        scanPool.activeThreads = threads;
+        int rounds = 3;
+        int pageLen = 0;
+        unsigned long start = nowNanos();
+        for (int r = 0; r < rounds; r++)
+            pageLen = scanPostsParallel(authors, BENCH_PARALLEL_POSTS, following, 0,
+                                        BENCH_PARALLEL_POSTS, BENCH_PARALLEL_POSTS, page);
+        double rate = (double)BENCH_PARALLEL_POSTS * rounds / ((nowNanos() - start) / 1e9);
 
-    postCount++;
-    printf("(LodiServer) Total posts now: %d\n", postCount);
+        if (threads == 1) {
+            single = rate;
+            expectedLen = pageLen;
+            memcpy(expected, page, sizeof(int) * pageLen);
+        }
+        printf("  %-8d %12.1f %9.2fx %10d\n", threads, rate / 1e6, rate / single, pageLen);
+        if (pageLen != expectedLen || memcmp(page, expected, sizeof(int) * pageLen) != 0)
+            printf("  MISMATCH with the single-threaded scan\n");
+        if (threads == maxThreads) break;
+    }
 
-    // Send success response
-    response->messageType = ackPost;
-    response->userID = msg->userID;
-    strcpy(response->message, "Post successful");
-    printf("(LodiServer) Post successfully stored\n");
+    free(authors);
+    free(page);
+    free(expected);
+    free(following);
 }
 
-// Skeleton: Handle follow request
-void handleFollow(PClientToLodiServer *msg, LodiServerMessage *response) {
-    printf("\n(LodiServer) --- HANDLE FOLLOW ---\n");
-    printf("(LodiServer) User %u wants to follow user %u\n", msg->userID, msg->recipientID);
+#define BENCH_SEARCH_POSTS 2000000   // Posts indexed by the search benchmark
+#define BENCH_SEARCH_WORDS 50000     // Vocabulary of the generated posts
+#define BENCH_SEARCH_LIMIT 20        // Results asked for by each query
+#define BENCH_SEARCH_QUERIES 9       // Queries timed by the search benchmark
 
-    // Get or create the user's following list
-    UserFollowingList* userList = getUserFollowingList(msg->userID);
-    if (userList == NULL) {
-        printf("(LodiServer) ERROR: Could not get/create following list for user %u\n", msg->userID);
-        response->messageType = ackFollow;
-        response->userID = msg->userID;
-        strcpy(response->message, "Error: Server user storage is full");
-        return;
+// Text of the next generated post: eight words, skewed so low-numbered words are common
+unsigned int benchPostText(char *text) {
+    unsigned int length = 0;
+    for (int w = 0; w < 8; w++) {
+        unsigned long r = rand() % BENCH_SEARCH_WORDS;
+        length += sprintf(text + length, "%sw%lu", w ? " " : "", r * r / BENCH_SEARCH_WORDS * r / BENCH_SEARCH_WORDS);
     }
+    return length;
+}
 
-    // Check if user's following list is full
-    if (userList->followingCount >= MAX_FOLLOWING_PER_USER) {
-        printf("(LodiServer) ERROR: User %u has reached max following limit (%d)\n",
-               msg->userID, MAX_FOLLOWING_PER_USER);
-        response->messageType = ackFollow;
-        response->userID = msg->userID;
-        strcpy(response->message, "Error: You have reached max following limit");
-        return;
+// Newest BENCH_SEARCH_LIMIT posts holding every word of each query, found by
+// regenerating the posts and testing every one of them
+void benchSearchScan(const char **queries, int queryCount, int expected[][BENCH_SEARCH_LIMIT], int *expectedCount) {
+    static char queryTokens[BENCH_SEARCH_QUERIES][SEARCH_MAX_TOKENS][SEARCH_MAX_TOKEN + 1];
+    char tokens[SEARCH_MAX_TOKENS][SEARCH_MAX_TOKEN + 1];
+    int queryTokenCount[BENCH_SEARCH_QUERIES];
+    int matches[BENCH_SEARCH_QUERIES] = {0};
+
+    for (int q = 0; q < queryCount; q++)
+        queryTokenCount[q] = tokenize(queries[q], strlen(queries[q]), queryTokens[q], NULL, SEARCH_MAX_TOKENS);
+
+    srand(42);
+    for (int p = 0; p < BENCH_SEARCH_POSTS; p++) {
+        char text[128];
+        int tokenCount = tokenize(text, benchPostText(text), tokens, NULL, SEARCH_MAX_TOKENS);
+        for (int q = 0; q < queryCount; q++) {
+            int match = 1;
+            for (int k = 0; k < queryTokenCount[q] && match; k++) {
+                match = 0;
+                for (int t = 0; t < tokenCount && !match; t++)
+                    match = strcmp(queryTokens[q][k], tokens[t]) == 0;
+            }
+            // Newest first: shift the older results down
+            if (match) {
+                int keep = matches[q] < BENCH_SEARCH_LIMIT - 1 ? matches[q] : BENCH_SEARCH_LIMIT - 1;
+                memmove(&expected[q][1], &expected[q][0], sizeof(int) * keep);
+                expected[q][0] = p;
+                matches[q]++;
+            }
+        }
     }
+    for (int q = 0; q < queryCount; q++)
+        expectedCount[q] = matches[q] < BENCH_SEARCH_LIMIT ? matches[q] : BENCH_SEARCH_LIMIT;
+}
 
-    // Check if already following this idol
-    for (int i = 0; i < userList->followingCount; i++) {
-        if (userList->following[i] == msg->recipientID) {
-            printf("(LodiServer) User %u is already following user %u\n", msg->userID, msg->recipientID);
-            response->messageType = ackFollow;
-            response->userID = msg->userID;
-            strcpy(response->message, "You are already following this user");
-            return;
+// Full-text search: index build rate and size, and top-N query latency
+void benchSearch() {
+    srand(42);
+    unsigned long start = nowNanos();
+    unsigned long textBytes = 0;
+    for (int p = 0; p < BENCH_SEARCH_POSTS; p++) {
+        char text[128];
+        unsigned int length = benchPostText(text);
+        textBytes += length;
+        if (!indexPostText(&searchIndex, p, text, length)) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
         }
     }
+    double buildSeconds = (nowNanos() - start) / 1e9;
+    unsigned long bytes = searchIndexBytes(&searchIndex);
 
-    // Add the idol to the user's following list
-    userList->following[userList->followingCount] = msg->recipientID;
-    userList->followingCount++;
+    printf("Search index: %d posts (%.1f MB of text), %u terms, %lu postings\n", BENCH_SEARCH_POSTS,
+           textBytes / 1048576.0, searchIndex.termCount, searchIndex.postings);
+    printf("  built at %.0f posts/s, %.1f MB (%.2f bytes per posting, 4 uncompressed)\n",
+           BENCH_SEARCH_POSTS / buildSeconds, bytes / 1048576.0, (double)bytes / searchIndex.postings);
 
-    printf("(LodiServer) User %u now following user %u\n", msg->userID, msg->recipientID);
-    printf("(LodiServer) User %u is now following %d users\n", msg->userID, userList->followingCount);
+    const char *queries[BENCH_SEARCH_QUERIES] = {"w0", "w17", "w1000", "w20000", "w0 w1", "w0 w1000",
+                                                 "w3 w5 w8", "w20000 w1", "nothing"};
+    int expected[BENCH_SEARCH_QUERIES][BENCH_SEARCH_LIMIT];
+    int expectedCount[BENCH_SEARCH_QUERIES];
+    benchSearchScan(queries, BENCH_SEARCH_QUERIES, expected, expectedCount);
 
-    // Send success response
-    response->messageType = ackFollow;
-    response->userID = msg->userID;
-    strcpy(response->message, "Follow successful");
-    printf("(LodiServer) Follow relationship successfully stored\n");
+    printf("\n  %-12s %8s %12s\n", "query", "top-N", "latency");
+    for (int q = 0; q < BENCH_SEARCH_QUERIES; q++) {
+        int results[BENCH_SEARCH_LIMIT];
+        int found = 0;
+        int rounds = 100;
+        start = nowNanos();
+        for (int r = 0; r < rounds; r++)
+            found = searchPosts(&searchIndex, queries[q], BENCH_SEARCH_POSTS, BENCH_SEARCH_LIMIT, results);
+        printf("  %-12s %8d %9.1f us\n", queries[q], found, (nowNanos() - start) / 1e3 / rounds);
+
+        if (found != expectedCount[q] || memcmp(expected[q], results, sizeof(int) * found) != 0)
+            printf("  MISMATCH with a scan of every post\n");
+    }
 }
 
-// Skeleton: Handle unfollow request
-void handleUnfollow(PClientToLodiServer *msg, LodiServerMessage *response) {
-    printf("\n(LodiServer) --- HANDLE UNFOLLOW ---\n");
-    printf("(LodiServer) User %u wants to unfollow user %u\n", msg->userID, msg->recipientID);
+#define BENCH_TRENDING_POSTS 2000000   // Posts counted by the trending benchmark
+#define BENCH_TRENDING_WORDS 50000     // Vocabulary of words and of hashtags
+#define BENCH_TRENDING_TOP 10          // Entries compared with the exact counts
 
-    // Get the user's following list
-    UserFollowingList* userList = NULL;
-    for (int i = 0; i < userListCount; i++) {
-        if (userFollowingLists[i].userID == msg->userID) {
-            userList = &userFollowingLists[i];
-            break;
+// Skewed pick from the vocabulary, low numbers are common
+unsigned long benchTrendingPick() {
+    unsigned long r = rand() % BENCH_TRENDING_WORDS;
+    return r * r / BENCH_TRENDING_WORDS * r / BENCH_TRENDING_WORDS;
+}
+
+// How many of the sketch's top entries of kind prefix are in the exact top
+int benchTrendingRecall(TrendingWindow *window, TrendingHeap *heap, const char *prefix, unsigned int *counts) {
+    int exact[BENCH_TRENDING_TOP];
+    for (int i = 0; i < BENCH_TRENDING_TOP; i++) {
+        exact[i] = -1;
+        for (int w = 0; w < BENCH_TRENDING_WORDS; w++) {
+            int taken = 0;
+            for (int j = 0; j < i && !taken; j++)
+                taken = exact[j] == w;
+            if (!taken && (exact[i] < 0 || counts[w] > counts[exact[i]])) exact[i] = w;
         }
     }
 
-    // Check if user has a following list
-    if (userList == NULL) {
-        printf("(LodiServer) User %u has no following list\n", msg->userID);
-        response->messageType = ackUnfollow;
-        response->userID = msg->userID;
-        strcpy(response->message, "You are not following anyone");
-        return;
+    TrendingEntry top[TRENDING_TOP];
+    int count = trendingTop(window, heap, window->landmark, BENCH_TRENDING_TOP, top);
+    int recall = 0;
+    for (int i = 0; i < count; i++) {
+        int word;
+        if (sscanf(top[i].key, prefix[0] == '#' ? "#tag%d" : "word%d", &word) != 1) continue;
+        for (int j = 0; j < BENCH_TRENDING_TOP; j++)
+            recall += exact[j] == word;
+        if (i < 3)
+            printf("    %-12s estimate %9.0f  exact %9u\n", top[i].key, top[i].weight, counts[word]);
     }
+    return recall;
+}
 
-    // Find and remove the idol from the user's following list
-    int found = -1;
-    for (int i = 0; i < userList->followingCount; i++) {
-        if (userList->following[i] == msg->recipientID) {
-            found = i;
-            break;
-        }
+// Trending counters: update rate, memory and top-N recall against exact counts.
+// The windows get a lifetime far longer than the stream so nothing decays and the
+// estimates can be compared with plain counts.
+void benchTrending() {
+    unsigned int *wordCounts = calloc(BENCH_TRENDING_WORDS, sizeof(unsigned int));
+    unsigned int *tagCounts = calloc(BENCH_TRENDING_WORDS, sizeof(unsigned int));
+    unsigned long (*picks)[7] = malloc(sizeof(*picks) * BENCH_TRENDING_POSTS);
+    if (wordCounts == NULL || tagCounts == NULL || picks == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
 
-    if (found == -1) {
-        printf("(LodiServer) User %u is not following user %u\n", msg->userID, msg->recipientID);
-        response->messageType = ackUnfollow;
-        response->userID = msg->userID;
-        strcpy(response->message, "You are not following this user");
-        return;
+    // Six words and a hashtag per post, generated up front so only counting is timed
+    srand(42);
+    for (int p = 0; p < BENCH_TRENDING_POSTS; p++) {
+        for (int w = 0; w < 7; w++)
+            picks[p][w] = benchTrendingPick();
+        tagCounts[picks[p][6]]++;
+        for (int w = 0; w < 6; w++) {
+            int repeated = 0;
+            for (int j = 0; j < w && !repeated; j++)
+                repeated = picks[p][j] == picks[p][w];
+            if (!repeated) wordCounts[picks[p][w]]++;
+        }
     }
 
-    // Remove the idol by shifting all subsequent elements left
-    for (int i = found; i < userList->followingCount - 1; i++) {
-        userList->following[i] = userList->following[i + 1];
+    for (int w = 0; w < TRENDING_WINDOWS; w++)
+        trendingWindows[w].lifetimeMicros = 1e18;
+
+    double seconds = 0;
+    for (int p = 0; p < BENCH_TRENDING_POSTS; p++) {
+        char text[128];
+        unsigned long *pick = picks[p];
+        unsigned int length = sprintf(text, "word%lu word%lu word%lu word%lu word%lu word%lu #tag%lu",
+                                      pick[0], pick[1], pick[2], pick[3], pick[4], pick[5], pick[6]);
+        unsigned long start = nowNanos();
+        countTrending(text, length, p + 1);
+        seconds += (nowNanos() - start) / 1e9;
     }
-    userList->followingCount--;
 
-    printf("(LodiServer) User %u unfollowed user %u\n", msg->userID, msg->recipientID);
-    printf("(LodiServer) User %u is now following %d users\n", msg->userID, userList->followingCount);
+    printf("Trending: %d posts, %d windows\n", BENCH_TRENDING_POSTS, TRENDING_WINDOWS);
+    printf("  counted at %.0f posts/s, %lu KB of sketches and heaps whatever the stream length\n",
+           BENCH_TRENDING_POSTS / seconds, (unsigned long)sizeof(trendingWindows) / 1024);
+    TrendingWindow *window = &trendingWindows[0];
+    printf("  hashtags:\n");
+    int tagRecall = benchTrendingRecall(window, &window->hashtags, "#", tagCounts);
+    printf("  words:\n");
+    int wordRecall = benchTrendingRecall(window, &window->terms, "", wordCounts);
+    printf("  top-%d recall: hashtags %d/%d, words %d/%d\n", BENCH_TRENDING_TOP,
+           tagRecall, BENCH_TRENDING_TOP, wordRecall, BENCH_TRENDING_TOP);
 
-    // Send success response
-    response->messageType = ackUnfollow;
-    response->userID = msg->userID;
-    strcpy(response->message, "Unfollow successful");
-    printf("(LodiServer) Unfollow successfully processed\n");
+    free(wordCounts);
+    free(tagCounts);
+    free(picks);
 }
 
-// Handle feed request - sends multiple messages
-int handleFeedMultiple(PClientToLodiServer *msg, int clientSocket, struct sockaddr_in *clientAddr) {
-    printf("\n(LodiServer) --- HANDLE FEED ---\n");
-    printf("(LodiServer) User %u requesting feed\n", msg->userID);
+// Run an in-process benchmark by name, returns the process exit status
+#define BENCH_IO_REQUESTS 10000   // Feed requests per backend and client count
+#define BENCH_IO_PORT 29260       // Port of the servers started by the I/O benchmark
+#define BENCH_IO_AUTHORS 8        // Users followed by the benchmark reader
+#define BENCH_IO_POSTS 200        // Posts made by them before the runs
+#define BENCH_IO_MAX_CLIENTS 64   // Most client threads, runs use 1, 4, 16 ... up to it
 
-    LodiServerMessage response;
-    response.messageType = ackFeed;
-    response.userID = msg->userID;
+int benchIoNext = 0;              // Requests handed out to the client threads so far
+int benchIoFailures = 0;
+LatencyHistogram benchIoLatency;
 
-    // Find the user's following list
-    UserFollowingList* userList = NULL;
-    for (int i = 0; i < userListCount; i++) {
-        if (userFollowingLists[i].userID == msg->userID) {
-            userList = &userFollowingLists[i];
-            break;
-        }
+// One request over its own connection, as lodi_client makes them: send a
+// variable-length request and read until the server closes. Returns 0 on failure.
+int benchIoRequest(unsigned int messageType, unsigned int userID, unsigned int recipientID, const char *text) {
+    int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) return 0;
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddr.sin_port = htons(BENCH_IO_PORT);
+    if (connect(sock, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
+        close(sock);
+        return 0;
     }
 
-    // Check if user is following anyone
-    if (userList == NULL || userList->followingCount == 0) {
-        printf("(LodiServer) User %u is not following anyone\n", msg->userID);
-        strcpy(response.message, "END_OF_FEED");
+    char frame[sizeof(LodiRequestHeader) + MAX_POST_LENGTH];
+    LodiRequestHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = LODI_WIRE_MAGIC;
+    header.messageType = messageType;
+    header.userID = userID;
+    header.recipientID = recipientID;
+    header.feedLimit = FEED_DEFAULT_LIMIT;
+    header.bodyLength = strlen(text);
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), text, header.bodyLength);
 
-        // Send the end signal
-        unsigned int responseLen = sizeof(response);
-        unsigned int sent = 0;
-        while (sent < responseLen) {
-            int s = send(clientSocket, ((char *)&response) + sent, responseLen - sent, 0);
-            if (s <= 0) return 0;
-            sent += s;
-        }
-        return 1;
+    int received = 0;
+    if (send(sock, frame, sizeof(header) + header.bodyLength, MSG_NOSIGNAL) > 0) {
+        char buffer[16384];
+        int r;
+        while ((r = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+            received += r;
+    }
+    close(sock);
+    return received > 0;
+}
+
+// Client thread: feed requests for the benchmark reader until all are taken
+void *benchIoClient(void *arg) {
+    while (__atomic_fetch_add(&benchIoNext, 1, __ATOMIC_RELAXED) < BENCH_IO_REQUESTS) {
+        unsigned long start = statsNow();
+        if (benchIoRequest(feed, 1, 0, ""))
+            histogramRecordSince(&benchIoLatency, start);
+        else
+            __atomic_fetch_add(&benchIoFailures, 1, __ATOMIC_RELAXED);
     }
+    return NULL;
+}
 
-    printf("(LodiServer) User %u follows %d users\n", msg->userID, userList->followingCount);
+// Start this binary as a server on BENCH_IO_PORT with the given backend,
+// returns its process ID once it accepts connections, or -1
+pid_t benchIoStartServer(const char *backend, const char *dir) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", "lodi_server", "127.0.0.1", "-P", "29260", "-i", backend, "-d", dir,
+              "-r", "0", "-g", "0", "-q", "0", (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0) return -1;
 
-    int feedPostCount = 0;
+    for (int i = 0; i < 100; i++) {
+        usleep(50000);
+        int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        struct sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        serverAddr.sin_port = htons(BENCH_IO_PORT);
+        int up = connect(sock, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) == 0;
+        close(sock);
+        if (up) return pid;
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
 
-    // Iterate through all posts and send each one that matches
-    for (int i = 0; i < postCount; i++) {
-        // Check if this post is from someone the user follows
-        int isFollowing = 0;
-        for (int j = 0; j < userList->followingCount; j++) {
-            if (posts[i].userID == userList->following[j]) {
-                isFollowing = 1;
-                break;
-            }
+// Feed request throughput and latency of the blocking, epoll and io_uring
+// backends. Each runs as a separate server process (one after the other, on
+// the same post log) driven by 1 to maxClients client threads.
+void benchIoBackends(int maxClients, const char *parent) {
+    const char *backends[] = {"blocking", "epoll", "uring"};
+    char dir[300];
+    char path[300];
+    snprintf(dir, sizeof(dir), "%s/lodi-bench-XXXXXX", parent);
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp() failed");
+        return;
+    }
+
+    // The servers only log warnings, the clients would drown in their output
+    setenv("SERVER_LOG_LEVEL", "warn", 1);
+    setenv("SERVER_TRACE_DIR", "off", 1);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("I/O backends: %d feed requests (%d posts per page) per run, one connection each, log in %s\n",
+           BENCH_IO_REQUESTS, FEED_DEFAULT_LIMIT, parent);
+    printf("\n%-9s %8s %12s %10s %10s %10s\n", "backend", "clients", "requests/s", "p50", "p99", "max");
+
+    for (int b = 0; b < (int)(sizeof(backends) / sizeof(backends[0])); b++) {
+        pid_t server = benchIoStartServer(backends[b], dir);
+        if (server < 0) {
+            fprintf(stderr, "Could not start a %s server on port %d\n", backends[b], BENCH_IO_PORT);
+            break;
         }
 
-        if (isFollowing) {
-            feedPostCount++;
+        // The first server writes the posts the others read
+        if (b == 0) {
+            for (unsigned int author = 2; author < 2 + BENCH_IO_AUTHORS; author++)
+                benchIoRequest(follow, 1, author, "");
+            for (int i = 0; i < BENCH_IO_POSTS; i++)
+                benchIoRequest(post, 2 + i % BENCH_IO_AUTHORS, 0, "benchmark post with a few words #io");
+        }
 
-            // Format the post message
-            snprintf(response.message, sizeof(response.message),
-                    "User %u: %s", posts[i].userID, posts[i].message);
+        for (int clients = 1;; clients = clients * 4 < maxClients ? clients * 4 : maxClients) {
+            memset(&benchIoLatency, 0, sizeof(benchIoLatency));
+            benchIoNext = 0;
+            benchIoFailures = 0;
 
-            printf("(LodiServer) Sending post %d: %s\n", feedPostCount, response.message);
+            pthread_t threads[BENCH_IO_MAX_CLIENTS];
+            unsigned long start = statsNow();
+            int started = 0;
+            while (started < clients && pthread_create(&threads[started], NULL, benchIoClient, NULL) == 0)
+                started++;
+            for (int i = 0; i < started; i++)
+                pthread_join(threads[i], NULL);
+            double seconds = (statsNow() - start) / 1e9;
 
-            // Send this post
-            unsigned int responseLen = sizeof(response);
-            unsigned int sent = 0;
-            while (sent < responseLen) {
-                int s = send(clientSocket, ((char *)&response) + sent, responseLen - sent, 0);
-                if (s <= 0) {
-                    printf("(LodiServer) Error sending post\n");
-                    return 0;
-                }
-                sent += s;
-            }
+            printf("%-9s %8d %12.0f %8luus %8luus %8luus", backends[b], started, benchIoLatency.count / seconds,
+                   histogramPercentile(&benchIoLatency, 50) / 1000, histogramPercentile(&benchIoLatency, 99) / 1000,
+                   benchIoLatency.maxNanos / 1000);
+            if (benchIoFailures > 0)
+                printf("  (%d failed)", benchIoFailures);
+            printf("\n");
+            if (clients == maxClients) break;
         }
+
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
     }
 
-    printf("(LodiServer) Found %d posts from followed users\n", feedPostCount);
+    // Map the servers' post log here only to remove it
+    openPostLog(dir);
+    followFilePath(path, sizeof(path), "lodi_follows.snap");
+    unlink(path);
+    followFilePath(path, sizeof(path), "lodi_follows.wal");
+    unlink(path);
+    benchClosePostLog(dir);
+}
 
-    // Send end-of-feed signal
-    strcpy(response.message, "END_OF_FEED");
-    unsigned int responseLen = sizeof(response);
-    unsigned int sent = 0;
-    while (sent < responseLen) {
-        int s = send(clientSocket, ((char *)&response) + sent, responseLen - sent, 0);
-        if (s <= 0) {
-            printf("(LodiServer) Error sending end signal\n");
-            return 0;
-        }
-        sent += s;
+int runBenchmark(char *name, char *arg) {
+    if (name != NULL && strcmp(name, "postsize") == 0) {
+        benchPostSize();
+        return 0;
+    }
+    if (name != NULL && strcmp(name, "commit") == 0) {
+        benchGroupCommit(arg != NULL ? arg : "/tmp");
+        return 0;
+    }
+    if (name != NULL && strcmp(name, "graph") == 0) {
+        benchFollowGraph();
+        return 0;
+    }
+    if (name != NULL && strcmp(name, "followers") == 0) {
+        benchFollowerIndex();
+        return 0;
+    }
+    if (name != NULL && strcmp(name, "scan") == 0) {
+        selectScanKernel();
+        benchPostScan();
+        return 0;
+    }
+    if (name != NULL && strcmp(name, "parallel") == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        int threads = arg != NULL ? atoi(arg) : cores;
+        if (threads < 1) threads = 1;
+        if (threads > SCAN_MAX_THREADS) threads = SCAN_MAX_THREADS;
+        selectScanKernel();
+        benchParallelScan(threads);
+        return 0;
+    }
+    if (name != NULL && strcmp(name, "search") == 0) {
+        benchSearch();
+        return 0;
+    }
+    if (name != NULL && strcmp(name, "trending") == 0) {
+        benchTrending();
+        return 0;
+    }
+    if (name != NULL && strcmp(name, "io") == 0) {
+        int clients = arg != NULL ? atoi(arg) : BENCH_IO_MAX_CLIENTS;
+        if (clients < 1) clients = 1;
+        if (clients > BENCH_IO_MAX_CLIENTS) clients = BENCH_IO_MAX_CLIENTS;
+        benchIoBackends(clients, "/tmp");
+        return 0;
     }
 
-    printf("(LodiServer) Feed sent successfully (%d posts)\n", feedPostCount);
+    fprintf(stderr, "Benchmarks: postsize, commit [dir], graph, followers, scan, parallel [threads], search, trending,\n"
+                    "            io [clients]\n");
     return 1;
 }
 
-// Handle logout request
-void handleLogout(PClientToLodiServer *msg, LodiServerMessage *response) {
-    printf("\n(LodiServer) --- HANDLE LOGOUT ---\n");
-    printf("(LodiServer) User %u logging out\n", msg->userID);
+// Where logins are checked (set at startup)
+char *pkeServerIP;
+unsigned short pkeServerPort = 2924;
+char *tfaServerIP;
+unsigned short tfaServerPort = 2925;
+unsigned long rsaModulus = 533;
 
-    // Send success response
-    response->messageType = ackLogout;
-    response->userID = msg->userID;
-    strcpy(response->message, "Logout successful. Goodbye!");
+// Verify a login: the timestamp, the signature against the user's public key from
+// the PKE server and the user's approval through the TFA server, then send ackLogin.
+// Runs on a login worker, sock is the worker's own UDP socket.
+void handleLogin(int sock, PendingRequest *request) {
+    PClientToLodiServer *msg = &request->msg;
+    LOG_INFO("(LodiServer) Processing LOGIN request\n");
+
+    // Trace every login, under the client's trace ID when it sent one. The
+    // login span starts when the connection was accepted.
+    unsigned long traceID = msg->traceID ? msg->traceID : traceNewID();
+    unsigned long loginStart = traceNow() - (nowNanos() - request->acceptedAt) / 1000;
+    unsigned long stageStart = traceNow();
+    traceSpan("login.queue", traceID, loginStart, msg->userID, NULL);
+    LOG_INFO("(LodiServer) Trace ID: %016lx\n", traceID);
+
+    // verify timestamp
+    unsigned long currentTime = time(NULL) % 500;
+    long timeDiff = (long)(currentTime - msg->timestamp);
+
+    LOG_INFO("\n(LodiServer) Verifying timestamp...\n");
+    LOG_INFO("(LodiServer) Current time: %lu\n", currentTime);
+    LOG_INFO("(LodiServer) Time difference: %ld seconds\n", timeDiff);
+
+    if (abs(timeDiff) > MAX_TIMESTAMP_DIFF) {
+        LOG_ERROR("(LodiServer) FAILED: Timestamp too old or invalid\n");
+        LOG_WARN("[Auth] Rejecting login from user %u\n\n", msg->userID);
+        traceSpan("login.timestamp", traceID, stageStart, msg->userID, "rejected");
+        traceSpan("login", traceID, loginStart, msg->userID, "bad timestamp");
+        return;
+    }
+    LOG_INFO("(LodiServer) SUCCESS: Timestamp is valid\n");
+    traceSpan("login.timestamp", traceID, stageStart, msg->userID, NULL);
+
+    // Verify using PKE Server
+    LOG_INFO("\n(LodiServer) Verifying digital signature...\n");
+    
+    unsigned long upstreamStart = statsNow();
+    stageStart = traceNow();
+    unsigned int publicKey = requestPublicKey(sock, pkeServerIP, pkeServerPort, 
+                                              msg->userID, rsaModulus, traceID);
+    histogramRecordSince(&publicKeyLatency, upstreamStart);
+    traceSpan("login.pkeRoundTrip", traceID, stageStart, msg->userID, publicKey ? NULL : "no key");
+    
+    if (publicKey == 0) {
+        LOG_ERROR("(LodiServer) FAILED: Could not retrieve public key\n");
+        LOG_WARN("(LodiServer) Rejecting login from user %u\n\n", msg->userID);
+        traceSpan("login", traceID, loginStart, msg->userID, "no public key");
+        return;
+    }
+    
+    // Verify the digital signature: Dec(DS) should equal timestamp
+    stageStart = traceNow();
+    unsigned long decryptedTimestamp = modExp(msg->digitalSig, publicKey, rsaModulus);
+    traceSpan("login.verifySignature", traceID, stageStart, msg->userID,
+              decryptedTimestamp == msg->timestamp ? NULL : "mismatch");
+    
+    LOG_INFO("(LodiServer) Decrypted timestamp: %lu\n", decryptedTimestamp);
+    LOG_INFO("(LodiServer) Original timestamp:  %lu\n", msg->timestamp);
+    
+    if (decryptedTimestamp != msg->timestamp) {
+        LOG_ERROR("(LodiServer)FAILED: Digital signature verification failed\n");
+        LOG_INFO("(LodiServer) Signature does not match timestamp\n");
+        LOG_WARN("(LodiServer) Rejecting login from user %u\n\n", msg->userID);
+        traceSpan("login", traceID, loginStart, msg->userID, "bad signature");
+        return;
+    }
+    LOG_INFO("(LodiServer) SUCCESS: Digital signature verified\n");
+
+    // Require TFA
+    LOG_INFO("(LodiServer) Requesting Two-Factor Authentication\n");
+    upstreamStart = statsNow();
+    stageStart = traceNow();
+    int tfa_ok = requestTFAAuthentication(
+        sock,
+        tfaServerIP,
+        tfaServerPort,
+        msg->userID,
+        traceID
+    );
+    histogramRecordSince(&tfaLatency, upstreamStart);
+    traceSpan("login.tfaRoundTrip", traceID, stageStart, msg->userID, tfa_ok ? NULL : "denied");
+    if (!tfa_ok) {
+        LOG_ERROR("(LodiServer) FAILED: TFA authentication for user %u\n", msg->userID);
+        traceSpan("login", traceID, loginStart, msg->userID, "tfa denied");
+        return;
+    }
+    LOG_INFO("(LodiServer) SUCCESS: TFA approved for user %u\n", msg->userID);
+       
+    
+    LOG_INFO("\n(LodiServer) All authentication steps passed!\n");
+    LOG_INFO("(LodiServer) Sending ackLogin to client...\n");
+
+    LodiServerMessage ackMsg;
+    ackMsg.messageType = ackLogin;
+    ackMsg.userID = msg->userID;
+    strcpy(ackMsg.message, "Login successful");
+    
+    // Ack Client over the accepted TCP connection
+    stageStart = traceNow();
+    int acked = sendResponse(request->clientSocket, &ackMsg, request->varlen);
+    traceSpan("login.sendAck", traceID, stageStart, msg->userID, acked ? NULL : "send failed");
+    traceSpan("login", traceID, loginStart, msg->userID, acked ? "ok" : "ack not sent");
+    if (!acked) {
+        LOG_ERROR("(LodiServer) Error: Failed to send ackLogin\n");
+    } else {
+        char clientIP[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &request->clientAddr.sin_addr, clientIP, sizeof(clientIP));
+        LOG_INFO("(LodiServer) ackLogin sent to %s:%d\n", clientIP, ntohs(request->clientAddr.sin_port));
+        LOG_INFO("(LodiServer) User %u successfully authenticated!\n", msg->userID);
+    }
+}
+
+// Background thread: serves queued logins one at a time. Each worker has its own
+// UDP socket so the PKE and TFA replies reach the worker that asked.
+void *loginWorker(void *arg) {
+    int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+        DieWithError("(LodiServer) socket() failed");
+    // A lost reply fails the login instead of holding the worker forever
+    struct timeval tv = {LOGIN_REPLY_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    for (;;) {
+        pthread_mutex_lock(&loginQueueLock);
+        while (loginQueueCount == 0)
+            pthread_cond_wait(&loginQueueReady, &loginQueueLock);
+        PendingRequest request = loginQueue[loginQueueHead];
+        loginQueueHead = (loginQueueHead + 1) % LOGIN_QUEUE_SIZE;
+        loginQueueCount--;
+        pthread_mutex_unlock(&loginQueueLock);
+
+        unsigned long start = statsNow();
+        handleLogin(sock, &request);
+        close(request.clientSocket);
+        histogramRecordSince(&requestLatency[login], start);
+    }
+    return NULL;
+}
+
+// Hand a login to the login workers, returns 0 if their queue is full
+int enqueueLogin(PendingRequest *request) {
+    pthread_mutex_lock(&loginQueueLock);
+    if (loginQueueCount == LOGIN_QUEUE_SIZE) {
+        loginQueueFull++;
+        pthread_mutex_unlock(&loginQueueLock);
+        return 0;
+    }
+    loginQueue[(loginQueueHead + loginQueueCount) % LOGIN_QUEUE_SIZE] = *request;
+    loginQueueCount++;
+    pthread_cond_signal(&loginQueueReady);
+    pthread_mutex_unlock(&loginQueueLock);
+    return 1;
+}
+
+// Start the login workers, returns 0 if a thread could not be created
+int startLoginWorkers() {
+    for (int i = 0; i < LOGIN_WORKERS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, loginWorker, NULL) != 0) return 0;
+        pthread_detach(thread);
+    }
+    return 1;
+}
 
-    printf("(LodiServer) User %u has logged out\n", msg->userID);
-    printf("(LodiServer) Logout processed successfully\n");
+void printUsage(char *program) {
+    fprintf(stderr, "Usage: %s <IP Address> [options]\n", program);
+    fprintf(stderr, "       %s --bench <name> [dir]\n", program);
+    fprintf(stderr, "  -s              fan-out-on-read by scanning the author column of all posts\n");
+    fprintf(stderr, "  -p <threads>    threads scanning the posts for -s (default: one per core)\n");
+    fprintf(stderr, "  -f              fan-out-on-write: materialize feeds into per-follower timelines\n");
+    fprintf(stderr, "  -t <threshold>  hybrid: like -f, but posts from authors with more than\n");
+    fprintf(stderr, "                  <threshold> followers are merged at read time\n");
+    fprintf(stderr, "  -c <MB>         memory for cached feed pages, 0 turns the cache off (default %d)\n",
+            FEED_CACHE_DEFAULT_MB);
+    fprintf(stderr, "  -r <rate>       request tokens per second of each user, 0 for no limit (default %d);\n"
+                    "                  feeds take 2 tokens, searches and logins 4, the rest 1\n",
+            RATE_DEFAULT_USER);
+    fprintf(stderr, "  -g <rate>       request tokens per second of the whole server, 0 for no limit (default %d)\n",
+            RATE_DEFAULT_GLOBAL);
+    fprintf(stderr, "  -q <depth>      queued work above which requests are shed, 0 never sheds (default %d)\n",
+            RATE_DEFAULT_SHED_DEPTH);
+    fprintf(stderr, "  -l <backlog>    connections the kernel queues for accept() (default %d)\n", MAXPENDING);
+    fprintf(stderr, "  -a <requests>   requests each priority class can queue, more are turned away\n"
+                    "                  (default %d)\n", ADMISSION_DEFAULT_QUEUE);
+    fprintf(stderr, "  -d <dir>        directory for the post log (default: current directory)\n");
+    fprintf(stderr, "  -b <posts>      group commit: most posts made durable by one sync (default %d)\n",
+            COMMIT_DEFAULT_BATCH);
+    fprintf(stderr, "  -w <us>         group commit: longest wait for a batch to fill (default %d)\n",
+            COMMIT_DEFAULT_WINDOW);
+    fprintf(stderr, "  -i <backend>    I/O backend for accepting connections and reading requests:\n"
+                    "                  epoll (default), uring or blocking\n");
+    fprintf(stderr, "  -P <port>       TCP port (default %d)\n", LODI_DEFAULT_PORT);
+    fprintf(stderr, "  -S <i>/<n>      run as shard i of n behind lodi_router (see README)\n");
+    exit(1);
 }
 
 int main(int argc, char *argv[]) {
-    int sock;
     int tcpServSock;
     int tcpClntSock;
-    struct sockaddr_in lodiServerAddr;
     struct sockaddr_in tcpServerAddr;
     struct sockaddr_in clientAddr;
-    unsigned int clientAddrLen;
     unsigned short lodiServerPort;
-    char *pkeServerIP;
-    unsigned short pkeServerPort;
-    char *tfaServerIP;
-    unsigned short tfaServerPort;
     PClientToLodiServer incomingMsg;
     int recvMsgSize;
-    unsigned long n = 533;
+    char *dataDir = ".";
+    lodiServerPort = LODI_DEFAULT_PORT;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <IP Address>\n", argv[0]);
-        exit(1);
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+        return runBenchmark(argc > 2 ? argv[2] : NULL, argc > 3 ? argv[3] : NULL);
+
+    if (argc < 2)
+        printUsage(argv[0]);
+    logStart();
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            feedMode = feedModeWrite;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            feedMode = feedModeScan;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            int megabytes = atoi(argv[++i]);
+            if (megabytes < 0)
+                printUsage(argv[0]);
+            feedCache.maxBytes = (size_t)megabytes << 20;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            scanThreads = atoi(argv[++i]);
+            if (scanThreads < 1 || scanThreads > SCAN_MAX_THREADS)
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            feedMode = feedModeHybrid;
+            hybridThreshold = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rateLimiter.userRate = atof(argv[++i]);
+            if (rateLimiter.userRate < 0)
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            rateLimiter.globalRate = atof(argv[++i]);
+            if (rateLimiter.globalRate < 0)
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            rateLimiter.shedDepth = atoi(argv[++i]);
+            if (rateLimiter.shedDepth < 0)
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            listenBacklog = atoi(argv[++i]);
+            if (listenBacklog < 1)
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            admissionQueueSize = atoi(argv[++i]);
+            if (admissionQueueSize < 1)
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            dataDir = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            commitBatchSize = atoi(argv[++i]);
+            if (commitBatchSize < 1 || commitBatchSize > COMMIT_QUEUE_SIZE)
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            commitWindowMicros = atoi(argv[++i]);
+            if (commitWindowMicros < 0)
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "epoll") == 0)
+                ioBackend = ioBackendEpoll;
+            else if (strcmp(argv[i], "uring") == 0)
+                ioBackend = ioBackendUring;
+            else if (strcmp(argv[i], "blocking") == 0)
+                ioBackend = ioBackendBlocking;
+            else
+                printUsage(argv[0]);
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            int port = atoi(argv[++i]);
+            if (port < 1 || port > 65535)
+                printUsage(argv[0]);
+            lodiServerPort = port;
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u/%u", &shardIndex, &shardCount) != 2 || shardCount == 0 ||
+                shardIndex >= shardCount)
+                printUsage(argv[0]);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            printUsage(argv[0]);
+        }
     }
     
-    lodiServerPort = 2926; 
+    selectScanKernel();
+    if (scanThreads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        scanThreads = cores < 1 ? 1 : cores > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : cores;
+    }
     pkeServerIP = argv[1];
-    pkeServerPort = 2924;
     tfaServerIP = argv[1];
-    tfaServerPort = 2925;
     
-    printf("(LodiServer) Lodi Server: \n");
-    printf("(LodiServer) Listening on port: %u\n", lodiServerPort);
-    printf("(LodiServer) RSA Modulus (n): %lu\n", n);
-    printf("\n\n");
+    LOG_INFO("(LodiServer) Lodi Server: \n");
+    LOG_INFO("(LodiServer) Listening on port: %u\n", lodiServerPort);
+    if (shardCount > 1)
+        LOG_INFO("(LodiServer) Shard %u of %u\n", shardIndex, shardCount);
+    LOG_INFO("(LodiServer) RSA Modulus (n): %lu\n", rsaModulus);
+    if (feedMode == feedModeHybrid)
+        LOG_INFO("(LodiServer) Feed mode: hybrid (threshold %d followers)\n", hybridThreshold);
+    else if (feedMode == feedModeScan)
+        LOG_INFO("(LodiServer) Feed mode: fan-out-on-read, scanning posts on %d thread(s) with the %s kernel\n",
+               scanThreads, scanKernelName);
+    else
+        LOG_INFO("(LodiServer) Feed mode: %s\n", feedMode == feedModeWrite ? "fan-out-on-write" : "fan-out-on-read");
+
+    // Re-map the post log segments left by earlier runs
+    int recovered = openPostLog(dataDir);
+    LOG_INFO("(LodiServer) Post log: %s (%d posts in %d segments)\n", dataDir, recovered, segmentCount);
+    openFollowLog();
+    buildSearchIndex();
+    buildTrending();
+    LOG_INFO("(LodiServer) Group commit: up to %d posts per sync, %d us window\n",
+           commitBatchSize, commitWindowMicros);
+    LOG_INFO("(LodiServer) Feed cache: %.1f MB\n", feedCache.maxBytes / 1048576.0);
+    LOG_INFO("(LodiServer) Rate limits: %.0f/s per user, %.0f/s overall (0 = none), shedding past %d queued\n",
+           rateLimiter.userRate, rateLimiter.globalRate, rateLimiter.shedDepth);
+    LOG_INFO("\n\n");
+
+    // Start the group commit thread, it acks posts and follow changes once they are on disk
+    pthread_t commitThread;
+    if (pthread_create(&commitThread, NULL, commitWorker, NULL) != 0)
+        DieWithError("(LodiServer) pthread_create() failed");
+    pthread_detach(commitThread);
+
+    // Start the thread that writes follow graph snapshots
+    pthread_t snapshotThread;
+    if (pthread_create(&snapshotThread, NULL, snapshotWorker, NULL) != 0)
+        DieWithError("(LodiServer) pthread_create() failed");
+    pthread_detach(snapshotThread);
+
+    // Start the threads that split feed scans between them
+    if (feedMode == feedModeScan && !startScanPool(scanThreads))
+        DieWithError("(LodiServer) Could not start the scan threads");
+
+    // Start the background fan-out thread
+    if (feedMode == feedModeWrite || feedMode == feedModeHybrid) {
+        pthread_t fanoutThread;
+        if (pthread_create(&fanoutThread, NULL, fanoutWorker, NULL) != 0)
+            DieWithError("(LodiServer) pthread_create() failed");
+        pthread_detach(fanoutThread);
+    }
     
-    // Socket creation for UDP (used to contact PKE/TFA servers)
-    if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-        DieWithError("(LodiServer) socket() failed");
+    // Start the login workers, each contacts the PKE and TFA servers over its own UDP socket
+    if (!startLoginWorkers())
+        DieWithError("(LodiServer) pthread_create() failed");
 
     // TCP socket creation (listen for client connections)
     if ((tcpServSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
         DieWithError("(LodiServer) TCP socket() failed");
 
-    printf("(LodiServer) Sockets created successfully\n");
-
-    // Configure UDP server address (for PKE/TFA)
-    memset(&lodiServerAddr, 0, sizeof(lodiServerAddr));
-    lodiServerAddr.sin_family = AF_INET;
-    lodiServerAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    lodiServerAddr.sin_port = htons(lodiServerPort);
-
-    // Bind UDP socket
-    if (bind(sock, (struct sockaddr *)&lodiServerAddr, sizeof(lodiServerAddr)) < 0)
-        DieWithError("(LodiServer) bind() failed");
-
-    printf("(LodiServer) UDP Socket bound to port %u\n", lodiServerPort);
+    LOG_INFO("(LodiServer) Sockets created successfully\n");
 
     // Configure TCP server address
     memset(&tcpServerAddr, 0, sizeof(tcpServerAddr));
@@ -542,207 +6488,187 @@ int main(int argc, char *argv[]) {
     tcpServerAddr.sin_addr.s_addr = htonl(INADDR_ANY);
     tcpServerAddr.sin_port = htons(lodiServerPort);
 
+    // Let a restarted server bind while old connections are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(tcpServSock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Bind TCP listening socket
     if (bind(tcpServSock, (struct sockaddr *)&tcpServerAddr, sizeof(tcpServerAddr)) < 0)
         DieWithError("(LodiServer) bind() for TCP failed");
 
-    if (listen(tcpServSock, MAXPENDING) < 0)
+    if (listen(tcpServSock, listenBacklog) < 0)
         DieWithError("(LodiServer) listen() failed");
 
-    printf("(LodiServer) TCP Socket listening on port %u\n", lodiServerPort);
-    printf("(LodiServer) Lodi Server ready and listening...\n\n");
-
-    // loop
-    for (;;) {
-        clientAddrLen = sizeof(clientAddr);
+    if (ioBackend == ioBackendUring && !uringStart(tcpServSock)) {
+        LOG_WARN("(LodiServer) io_uring is not available, using epoll\n");
+        ioBackend = ioBackendEpoll;
+    }
 
-        printf("(LodiServer) Waiting for client TCP connection...\n");
+    // The listener never blocks so each wake-up can drain the backlog; requests are
+    // read as their connections become readable and queued by priority class
+    int epollFd = -1;
+    if (ioBackend == ioBackendEpoll) {
+        epollFd = epoll_create1(0);
+        if (epollFd < 0)
+            DieWithError("(LodiServer) epoll_create1() failed");
+        fcntl(tcpServSock, F_SETFL, fcntl(tcpServSock, F_GETFL) | O_NONBLOCK);
+        struct epoll_event listenEvent = {EPOLLIN, {.ptr = NULL}};
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, tcpServSock, &listenEvent) < 0)
+            DieWithError("(LodiServer) epoll_ctl() failed");
+    }
+    if (!startAdmission())
+        DieWithError("(LodiServer) Out of memory for the admission queues");
+    registerStats();
+    traceStart("lodi");
 
-        if ((tcpClntSock = accept(tcpServSock, (struct sockaddr *)&clientAddr, &clientAddrLen)) < 0)
-            DieWithError("(LodiServer) accept() failed");
+    LOG_INFO("(LodiServer) TCP Socket listening on port %u (backlog %d, %s)\n", lodiServerPort, listenBacklog,
+           ioBackendNames[ioBackend]);
+    LOG_INFO("(LodiServer) Lodi Server ready and listening...\n\n");
 
-        printf("(LodiServer) TCP connection from %s:%d\n",
-               inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+    // loop
+    unsigned long dispatchStart = 0;
+    int dispatchType = 0;
+    for (;;) {
+        // Control only comes back here once the last request is fully handled
+        if (dispatchStart != 0) {
+            histogramRecordSince(&requestLatency[dispatchType], dispatchStart);
+            dispatchStart = 0;
+        }
 
-        // Receive the login struct over TCP (handle partial reads)
-        unsigned int expected = sizeof(incomingMsg);
-        unsigned int totalBytesRcvd = 0;
-        char *recvPtr = (char *)&incomingMsg;
-        while (totalBytesRcvd < expected) {
-            int r = recv(tcpClntSock, recvPtr + totalBytesRcvd, (int)(expected - totalBytesRcvd), 0);
-            if (r < 0) {
-                close(tcpClntSock);
-                DieWithError("(LodiServer) recv() failed");
+        // Wait for connections and requests, without blocking while requests are queued
+        int queued = admissionQueues[classCheap].count + admissionQueues[classExpensive].count;
+        int timeout = queued > 0 ? 0 : (waitingCount > 0 || acceptResumeAt != 0) ? 100 : -1;
+        if (ioBackend == ioBackendUring) {
+            uringPoll(tcpServSock, timeout);
+        } else if (ioBackend == ioBackendBlocking) {
+            if (queued == 0)
+                acceptBlocking(tcpServSock);
+        } else {
+            struct epoll_event events[EPOLL_BATCH];
+            int ready = epoll_wait(epollFd, events, EPOLL_BATCH, timeout);
+            if (ready < 0 && errno != EINTR)
+                DieWithError("(LodiServer) epoll_wait() failed");
+            for (int i = 0; i < ready; i++) {
+                if (events[i].data.ptr == NULL)
+                    acceptConnections(epollFd, tcpServSock);
+                else
+                    readWaitingConnection(epollFd, tcpServSock, events[i].data.ptr);
             }
-            if (r == 0) break; // connection closed
-            totalBytesRcvd += r;
+            expireWaitingConnections(epollFd, tcpServSock);
         }
 
-        if (totalBytesRcvd < expected) {
-            close(tcpClntSock);
-            printf("(LodiServer) Incomplete login message received (got %u of %u)\n", totalBytesRcvd, expected);
+        // Serve one queued request, then look for new arrivals again
+        PendingRequest request;
+        if (!nextRequest(&request))
             continue;
+        tcpClntSock = request.clientSocket;
+        clientAddr = request.clientAddr;
+        incomingMsg = request.msg;
+        recvMsgSize = request.size;
+        int varlen = request.varlen;
+        // Login workers time their own logins
+        if (incomingMsg.messageType < REQUEST_TYPES && incomingMsg.messageType != login) {
+            dispatchStart = statsNow();
+            dispatchType = incomingMsg.messageType;
         }
 
-        recvMsgSize = totalBytesRcvd;
-        
-        printf("(LodiServer) Received %d bytes from %s:%d\n",
+        LOG_DEBUG("(LodiServer) Received %d bytes from %s:%d\n",
                recvMsgSize,
                inet_ntoa(clientAddr.sin_addr),
                ntohs(clientAddr.sin_port));
 
-        printf("(LodiServer) Message type: %d from User ID: %u\n",
+        LOG_DEBUG("(LodiServer) Message type: %d from User ID: %u\n",
                incomingMsg.messageType, incomingMsg.userID);
-        printf("(LodiServer) Timestamp: %lu\n", incomingMsg.timestamp);
-        printf("(LodiServer) Digital Signature: %lu\n", incomingMsg.digitalSig);
+        LOG_DEBUG("(LodiServer) Timestamp: %lu\n", incomingMsg.timestamp);
+        LOG_DEBUG("(LodiServer) Digital Signature: %lu\n", incomingMsg.digitalSig);
 
         // Route message based on type
         if (incomingMsg.messageType == login) {
-            printf("(LodiServer) Processing LOGIN request\n");
-
-        // verify timestamp
-        unsigned long currentTime = time(NULL) % 500;
-        long timeDiff = (long)(currentTime - incomingMsg.timestamp);
-
-        printf("\n(LodiServer) Verifying timestamp...\n");
-        printf("(LodiServer) Current time: %lu\n", currentTime);
-        printf("(LodiServer) Time difference: %ld seconds\n", timeDiff);
-
-        if (abs(timeDiff) > MAX_TIMESTAMP_DIFF) {
-            printf("(LodiServer) FAILED: Timestamp too old or invalid\n");
-            printf("[Auth] Rejecting login from user %u\n\n", incomingMsg.userID);
-            continue;
-        }
-        printf("(LodiServer) SUCCESS: Timestamp is valid\n");
-
-        // Verify using PKE Server
-        printf("\n(LodiServer) Verifying digital signature...\n");
-        
-        unsigned int publicKey = requestPublicKey(sock, pkeServerIP, pkeServerPort, 
-                                                  incomingMsg.userID, n);
-        
-        if (publicKey == 0) {
-            printf("(LodiServer) FAILED: Could not retrieve public key\n");
-            printf("(LodiServer) Rejecting login from user %u\n\n", incomingMsg.userID);
-            continue;
-        }
-        
-        // Verify the digital signature: Dec(DS) should equal timestamp
-        unsigned long decryptedTimestamp = modExp(incomingMsg.digitalSig, publicKey, n);
-        
-        printf("(LodiServer) Decrypted timestamp: %lu\n", decryptedTimestamp);
-        printf("(LodiServer) Original timestamp:  %lu\n", incomingMsg.timestamp);
-        
-        if (decryptedTimestamp != incomingMsg.timestamp) {
-            printf("(LodiServer)FAILED: Digital signature verification failed\n");
-            printf("(LodiServer) Signature does not match timestamp\n");
-            printf("(LodiServer) Rejecting login from user %u\n\n", incomingMsg.userID);
-            continue;
-        }
-        printf("(LodiServer) SUCCESS: Digital signature verified\n");
-
-        // Require TFA
-        printf("(LodiServer) Requesting Two-Factor Authentication\n");
-        int tfa_ok = requestTFAAuthentication(
-            sock,
-            tfaServerIP,
-            tfaServerPort,
-            incomingMsg.userID
-        );
-        if (!tfa_ok) {
-            printf("(LodiServer) FAILED: TFA authentication for user %u\n", incomingMsg.userID);
-            continue;
-        }
-        printf("(LodiServer) SUCCESS: TFA approved for user %u\n", incomingMsg.userID);
-       
-        
-        printf("\n(LodiServer) All authentication steps passed!\n");
-        printf("(LodiServer) Sending ackLogin to client...\n");
-
-        LodiServerMessage ackMsg;
-        ackMsg.messageType = ackLogin;
-        ackMsg.userID = incomingMsg.userID;
-        strcpy(ackMsg.message, "Login successful");
-        
-        // Ack Client over the accepted TCP connection
-        unsigned int ackLen = sizeof(ackMsg);
-        unsigned int sent = 0;
-        char *sendPtr = (char *)&ackMsg;
-        while (sent < ackLen) {
-            int s = send(tcpClntSock, sendPtr + sent, ackLen - sent, 0);
-            if (s <= 0) {
-                printf("(LodiServer) Error: Failed to send ackLogin\n");
-                break;
+            // PKE and TFA round trips block, so logins wait for a login worker instead
+            // of holding up the dispatch thread
+            if (!enqueueLogin(&request)) {
+                rejectRequest(&incomingMsg, tcpClntSock, varlen, "Server busy, try again later");
+                close(tcpClntSock);
             }
-            sent += s;
-        }
-
-        if (sent == ackLen) {
-            printf("(LodiServer) ackLogin sent to %s:%d\n",
-                   inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
-            printf("(LodiServer) User %u successfully authenticated!\n", incomingMsg.userID);
-        }
-
-        close(tcpClntSock);
-
         } else {
-            // Handle non-login messages (post, feed, follow, unfollow, logout)
-            printf("(LodiServer) Processing non-login request\n");
+            // Handle non-login messages (post, feed, follow, unfollow, logout, subscribe, search, trending, stats)
+            LOG_INFO("(LodiServer) Processing non-login request\n");
+
+            // Requests only see published changes, the committer waits while one is served
+            pthread_mutex_lock(&publishLock);
 
             // Special handling for feed - it sends multiple responses
             if (incomingMsg.messageType == feed) {
-                handleFeedMultiple(&incomingMsg, tcpClntSock, &clientAddr);
+                handleFeedMultiple(&incomingMsg, tcpClntSock, &clientAddr, varlen);
                 close(tcpClntSock);
+            } else if (incomingMsg.messageType == stats) {
+                handleStats(tcpClntSock);
+                close(tcpClntSock);
+            } else if (incomingMsg.messageType == trending) {
+                handleTrending(&incomingMsg, tcpClntSock, varlen);
+                close(tcpClntSock);
+            } else if (incomingMsg.messageType == search) {
+                handleSearch(&incomingMsg, tcpClntSock, varlen);
+                close(tcpClntSock);
+            } else if (incomingMsg.messageType == subscribe) {
+                // The connection stays open, new posts are pushed down it
+                if (!handleSubscribe(&incomingMsg, tcpClntSock, varlen))
+                    close(tcpClntSock);
             } else {
                 // Handle other message types normally (single response)
                 LodiServerMessage response;
+                int deferAck = 0;
+                int postIndex = -1;
 
                 // Route to appropriate handler based on message type
                 switch (incomingMsg.messageType) {
                     case post:
-                        handlePost(&incomingMsg, &response);
+                        postIndex = handlePost(&incomingMsg, &response);
+                        deferAck = postIndex >= 0;
                         break;
                     case follow:
-                        handleFollow(&incomingMsg, &response);
+                        deferAck = handleFollow(&incomingMsg, &response);
                         break;
                     case unfollow:
-                        handleUnfollow(&incomingMsg, &response);
+                        deferAck = handleUnfollow(&incomingMsg, &response);
                         break;
                     case logout:
                         handleLogout(&incomingMsg, &response);
                         break;
                     default:
-                        printf("(LodiServer) Error: Unknown message type %d\n", incomingMsg.messageType);
+                        LOG_ERROR("(LodiServer) Error: Unknown message type %d\n", incomingMsg.messageType);
                         response.messageType = ackLogin; // Use ackLogin as error response
                         response.userID = incomingMsg.userID;
                         strcpy(response.message, "Error: Unknown message type");
                         break;
                 }
 
-                // Send response back to client
-                unsigned int responseLen = sizeof(response);
-                unsigned int sent = 0;
-                char *sendPtr = (char *)&response;
-                while (sent < responseLen) {
-                    int s = send(tcpClntSock, sendPtr + sent, responseLen - sent, 0);
-                    if (s <= 0) {
-                        printf("(LodiServer) Error: Failed to send response\n");
-                        break;
-                    }
-                    sent += s;
+                // The committer publishes the change, sends the ack and closes the socket once
+                // the change is durable. Queue it outside publishLock, the committer may need
+                // the lock before it can make room.
+                if (deferAck) {
+                    CommitEntry change = {tcpClntSock, varlen, response, postIndex,
+                                          incomingMsg.messageType != post, commitEpoch, 0};
+                    pthread_mutex_unlock(&publishLock);
+                    enqueueCommit(&change);
+                    continue;
                 }
 
-                if (sent == responseLen) {
-                    printf("(LodiServer) Response sent to %s:%d\n",
+                // Send response back to client
+                if (!sendResponse(tcpClntSock, &response, varlen)) {
+                    LOG_ERROR("(LodiServer) Error: Failed to send response\n");
+                } else {
+                    LOG_INFO("(LodiServer) Response sent to %s:%d\n",
                            inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
                 }
 
                 close(tcpClntSock);
             }
+            pthread_mutex_unlock(&publishLock);
         }
 
     }
     
-    close(sock);
+    close(tcpServSock);
     return 0;
 }
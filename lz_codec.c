@@ -0,0 +1,168 @@
+#include <string.h>
+#include "lz_codec.h"
+
+#define LZ_HASH_BITS 12         // 4096 hash table entries
+#define LZ_MIN_MATCH 4          // Shortest match worth an offset
+#define LZ_LAST_LITERALS 5      // The block ends with at least this many literals
+#define LZ_MATCH_MARGIN 12      // No match starts this close to the end of the input
+#define LZ_MAX_OFFSET 65535     // Farthest a match can point back
+#define LZ_SKIP_SHIFT 5         // Every 32 misses in a row the search step grows by a byte
+
+unsigned int lzRead32(const unsigned char *p) {
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+unsigned long lzRead64(const unsigned char *p) {
+    unsigned long value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+unsigned int lzHash(unsigned int value) {
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Bytes a length takes after its 4-bit token field
+unsigned int lzLengthBytes(unsigned int length) {
+    return length < 15 ? 0 : (length - 15) / 255 + 1;
+}
+
+unsigned char *lzPutLength(unsigned char *op, unsigned int length) {
+    for (length -= 15; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+// Append one sequence: literalCount literals, then a match of matchLength bytes
+// offset back (none if matchLength is 0). Returns the new end of the output,
+// NULL if it would run past end.
+unsigned char *lzPutSequence(unsigned char *op, unsigned char *end, const unsigned char *literals,
+                             unsigned int literalCount, unsigned int offset, unsigned int matchLength) {
+    unsigned int code = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    size_t need = 1 + lzLengthBytes(literalCount) + literalCount + (matchLength > 0 ? 2 + lzLengthBytes(code) : 0);
+    if ((size_t)(end - op) < need) return NULL;
+
+    unsigned char *token = op++;
+    *token = (literalCount < 15 ? literalCount : 15) << 4;
+    if (literalCount >= 15) op = lzPutLength(op, literalCount);
+    memcpy(op, literals, literalCount);
+    op += literalCount;
+    if (matchLength == 0) return op;
+
+    op[0] = offset & 0xFF;
+    op[1] = offset >> 8;
+    op += 2;
+    *token |= code < 15 ? code : 15;
+    if (code >= 15) op = lzPutLength(op, code);
+    return op;
+}
+
+int lzCompress(const char *source, int srcLength, char *destination, int dstCapacity) {
+    const unsigned char *src = (const unsigned char *)source;
+    unsigned char *op = (unsigned char *)destination;
+    unsigned char *end = op + (dstCapacity > 0 ? dstCapacity : 0);
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    int anchor = 0;
+    int i = 0;
+    int misses = 0;
+    while (i < srcLength - LZ_MATCH_MARGIN) {
+        unsigned int value = lzRead32(src + i);
+        unsigned int h = lzHash(value);
+        int ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > LZ_MAX_OFFSET || lzRead32(src + ref) != value) {
+            // Step further the longer nothing matches, so incompressible input is skipped quickly
+            i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+
+        // Grow the match backwards over pending literals, then forwards
+        while (i > anchor && ref > 0 && src[i - 1] == src[ref - 1]) {
+            i--;
+            ref--;
+        }
+        // Compare 8 bytes at a time, the first differing bit gives the end of the match
+        int length = LZ_MIN_MATCH;
+        int limit = srcLength - LZ_LAST_LITERALS - i;
+        while (length + 8 <= limit) {
+            unsigned long diff = lzRead64(src + i + length) ^ lzRead64(src + ref + length);
+            if (diff != 0) {
+                length += __builtin_ctzl(diff) / 8;
+                break;
+            }
+            length += 8;
+        }
+        if (length + 8 > limit) {
+            while (length < limit && src[i + length] == src[ref + length])
+                length++;
+        }
+
+        op = lzPutSequence(op, end, src + anchor, i - anchor, i - ref, length);
+        if (op == NULL) return 0;
+        i += length;
+        anchor = i;
+    }
+
+    op = lzPutSequence(op, end, src + anchor, srcLength - anchor, 0, 0);
+    if (op == NULL) return 0;
+    return op - (unsigned char *)destination;
+}
+
+int lzDecompress(const char *source, int srcLength, char *destination, int dstCapacity) {
+    const unsigned char *ip = (const unsigned char *)source;
+    const unsigned char *ipEnd = ip + srcLength;
+    unsigned char *dst = (unsigned char *)destination;
+    unsigned char *op = dst;
+    unsigned char *opEnd = dst + dstCapacity;
+
+    while (ip < ipEnd) {
+        unsigned int token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned int more;
+            do {
+                if (ip == ipEnd) return -1;
+                more = *ip++;
+                literals += more;
+            } while (more == 255);
+        }
+        if ((size_t)(ipEnd - ip) < literals || (size_t)(opEnd - op) < literals) return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == ipEnd) break;     // The last sequence has no match
+
+        if (ipEnd - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        size_t length = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            unsigned int more;
+            do {
+                if (ip == ipEnd) return -1;
+                more = *ip++;
+                length += more;
+            } while (more == 255);
+        }
+        if ((size_t)(opEnd - op) < length) return -1;
+
+        // A match closer than its length overlaps the bytes it produces and is
+        // copied byte by byte
+        const unsigned char *match = op - offset;
+        if (offset >= length) {
+            memcpy(op, match, length);
+            op += length;
+        } else {
+            while (length-- > 0)
+                *op++ = *match++;
+        }
+    }
+    return op - dst;
+}
@@ -0,0 +1,20 @@
+#ifndef LZ_CODEC_H
+#define LZ_CODEC_H
+
+// Byte-oriented LZ compression in the LZ4 block format, used for feed pages.
+// Each sequence is a token (literal count and match length, 4 bits each, 15
+// meaning more length bytes follow), the literals, a 2-byte little-endian
+// offset back into the output and the match; the last sequence is literals
+// only. Matches are found with a single 4096-entry hash table of 4-byte
+// prefixes, which is fast and needs no state between calls.
+
+// Compress srcLength bytes into dst. Returns the compressed length, or 0 if it
+// would not fit in dstCapacity (pass less than srcLength to only keep output
+// that saves space).
+int lzCompress(const char *src, int srcLength, char *dst, int dstCapacity);
+
+// Decompress srcLength bytes into dst. Returns the decompressed length, or -1 if
+// the input is malformed or would not fit in dstCapacity.
+int lzDecompress(const char *src, int srcLength, char *dst, int dstCapacity);
+
+#endif
@@ -4,6 +4,9 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include "server_log.h"
+#include "server_stats.h"
+#include "server_trace.h"
 
 #define BUFFER_SIZE 1024  
 
@@ -15,9 +18,10 @@ void DieWithError(char *errorMessage)
 
 // Messages coming to the PKE Server (from clients)
 typedef struct {
-    enum {registerKey, requestKey} messageType;
+    enum {registerKey, requestKey, requestStats} messageType;
     unsigned int userID;
     unsigned int publicKey;
+    unsigned long traceID;      // Login trace of a Lodi Server requestKey, absent (12-byte message) from other clients
 } PClientToPKServer;
 
 // DATABASE
@@ -40,13 +44,20 @@ typedef struct {
 UserKeyEntry keyDatabase[MAX_USERS];
 int totalUsers = 0;
 
+// Handling time of each message type, dumped by requestStats
+LatencyHistogram registerKeyLatency;
+LatencyHistogram requestKeyLatency;
+unsigned long keysNotFound = 0;
+unsigned long unknownMessages = 0;
+unsigned long rejectedStats = 0;      // Stats requests not padded to STATS_REQUEST_MIN
+
 void initializeDatabase() {
     for (int i = 0; i < MAX_USERS; i++) {
         keyDatabase[i].active = 0;
         keyDatabase[i].userID = 0;
         keyDatabase[i].publicKey = 0;
     }
-    printf("(PKEServer) Database initialized (capacity: %d users)\n", MAX_USERS);
+    LOG_INFO("(PKEServer) Database initialized (capacity: %d users)\n", MAX_USERS);
 }
 
 int storePublicKey(unsigned int userID, unsigned int publicKey) {
@@ -54,7 +65,7 @@ int storePublicKey(unsigned int userID, unsigned int publicKey) {
     for (int i = 0; i < MAX_USERS; i++) {
         if (keyDatabase[i].active && keyDatabase[i].userID == userID) {
             keyDatabase[i].publicKey = publicKey;
-            printf("(PKEServer) Updated key for user %u\n", userID);
+            LOG_INFO("(PKEServer) Updated key for user %u\n", userID);
             return 1;
         }
     }
@@ -66,24 +77,25 @@ int storePublicKey(unsigned int userID, unsigned int publicKey) {
             keyDatabase[i].publicKey = publicKey;
             keyDatabase[i].active = 1;
             totalUsers++;
-            printf("(PKEServer) Stored new key for user %u (total users: %d)\n", 
+            LOG_INFO("(PKEServer) Stored new key for user %u (total users: %d)\n", 
                    userID, totalUsers);
             return 1;
         }
     }
     
-    printf("(PKEServer) ERROR: Database full!\n");
+    LOG_ERROR("(PKEServer) ERROR: Database full!\n");
     return 0;
 }
 
 unsigned int getPublicKey(unsigned int userID) {
     for (int i = 0; i < MAX_USERS; i++) {
         if (keyDatabase[i].active && keyDatabase[i].userID == userID) {
-            printf("Found key for user %u\n", userID);
+            LOG_INFO("Found key for user %u\n", userID);
             return keyDatabase[i].publicKey;
         }
     }
-    printf("(PKEServer) Key not found for user %u\n", userID);
+    LOG_WARN("(PKEServer) Key not found for user %u\n", userID);
+    keysNotFound++;
     return 0;  
 }
 
@@ -103,14 +115,15 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     
+    logStart();
     serverPort = 2924;
-    printf("(PKEServer) PKE Server starting on port %u...\n", serverPort);
+    LOG_INFO("(PKEServer) PKE Server starting on port %u...\n", serverPort);
     
     // Create socket
     if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
         DieWithError("socket() failed");
     
-    printf("(PKEServer) Socket created successfully!\n");
+    LOG_INFO("(PKEServer) Socket created successfully!\n");
     
     // Construct local address structure
     memset(&serverAddr, 0, sizeof(serverAddr));
@@ -118,40 +131,50 @@ int main(int argc, char *argv[]) {
     serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
     serverAddr.sin_port = htons(serverPort);
     
-    printf("(PKEServer) Address structure configured!\n");
+    LOG_INFO("(PKEServer) Address structure configured!\n");
     
     // Bind 
     if (bind(sock, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
         DieWithError("(PKEServer) bind() failed");
     
-    printf("(PKEServer) Socket bound to port %u!\n", serverPort);
-    printf("(PKEServer) PKE Server ready and listening...\n");
+    LOG_INFO("(PKEServer) Socket bound to port %u!\n", serverPort);
+    LOG_INFO("(PKEServer) PKE Server ready and listening...\n");
     
     // Initialize database
     initializeDatabase();
+    statsStart("pke");
+    statsRegisterHistogram("registerKey", &registerKeyLatency);
+    statsRegisterHistogram("requestKey", &requestKeyLatency);
+    statsRegisterCounter("keysNotFound", &keysNotFound);
+    statsRegisterCounter("unknownMessages", &unknownMessages);
+    statsRegisterCounter("rejectedStats", &rejectedStats);
+    traceStart("pke");
     
     for (;;) {
        clientAddrLen = sizeof(clientAddr);
         
-        printf("(PKEServer) Waiting for a message...");
-        // If receive message 
-        if ((recvMsgSize = recvfrom(sock, buffer, BUFFER_SIZE, 0,
+        LOG_DEBUG("(PKEServer) Waiting for a message...");
+        // If receive message (MSG_TRUNC: the length is the whole datagram's, even past BUFFER_SIZE)
+        if ((recvMsgSize = recvfrom(sock, buffer, BUFFER_SIZE, MSG_TRUNC,
                                     (struct sockaddr *)&clientAddr, 
                                     &clientAddrLen)) < 0)
             DieWithError("(PKEServer) recvfrom() failed");
         
-        printf("(PKEServer) Received %d bytes from %s (port %d)\n", 
+        LOG_DEBUG("(PKEServer) Received %d bytes from %s (port %d)\n", 
                recvMsgSize, 
                inet_ntoa(clientAddr.sin_addr),
                ntohs(clientAddr.sin_port));
         
         PClientToPKServer *request = (PClientToPKServer *)buffer;
+        unsigned long start = statsNow();
+        unsigned long traceStartedAt = traceNow();
+        unsigned long traceID = recvMsgSize >= (int)sizeof(PClientToPKServer) ? request->traceID : 0;
         
         // Check if Register 
         if (request->messageType == registerKey) {
-            printf("(PKEServer) Message Type: registerKey\n");
-            printf("(PKEServer) User ID: %u\n", request->userID);
-            printf("(PKEServer) Public Key: %u\n", request->publicKey);
+            LOG_DEBUG("(PKEServer) Message Type: registerKey\n");
+            LOG_DEBUG("(PKEServer) User ID: %u\n", request->userID);
+            LOG_DEBUG("(PKEServer) Public Key: %u\n", request->publicKey);
             
             storePublicKey(request->userID, request->publicKey);
             
@@ -166,12 +189,14 @@ int main(int argc, char *argv[]) {
                        sizeof(clientAddr)) != sizeof(response))
                 DieWithError("(PKEServer) sendto() sent different number of bytes");
             
-            printf("(PKEServer) Sent ackRegisterKey to client\n");
+            LOG_INFO("(PKEServer) Sent ackRegisterKey to client\n");
+            histogramRecordSince(&registerKeyLatency, start);
         }
         // Check if request
         else if (request->messageType == requestKey) {
-            printf("(PKEServer) Message Type: requestKey\n");
-            printf("(PKEServer) Requested User ID: %u\n", request->userID);
+            LOG_DEBUG("(PKEServer) Message Type: requestKey\n");
+            LOG_DEBUG("(PKEServer) Requested User ID: %u\n", request->userID);
+            LOG_DEBUG("(PKEServer) Trace ID: %016lx\n", traceID);
             
             unsigned int publicKey = getPublicKey(request->userID);
             
@@ -185,10 +210,28 @@ int main(int argc, char *argv[]) {
                        sizeof(clientAddr)) != sizeof(response))
                 DieWithError("(PKEServer) sendto() sent different number of bytes");
             
-            printf("(PKEServer) Sent responsePublicKey (key: %u)\n", publicKey);
+            LOG_INFO("(PKEServer) Sent responsePublicKey (key: %u)\n", publicKey);
+            histogramRecordSince(&requestKeyLatency, start);
+            if (traceID != 0)
+                traceSpan("pke.requestKey", traceID, traceStartedAt, request->userID,
+                          publicKey ? "found" : "not found");
+        }
+        // Check if stats: the reply is the text dump of the stats registry
+        else if (request->messageType == requestStats) {
+            if (!statsRequestAllowed(recvMsgSize)) {
+                LOG_WARN("(PKEServer) Ignoring a %d byte stats request from %s\n",
+                         recvMsgSize, inet_ntoa(clientAddr.sin_addr));
+                rejectedStats++;
+                continue;
+            }
+            char dump[STATS_DUMP_MAX];
+            int length = statsDump(dump, sizeof(dump));
+            if (sendto(sock, dump, length, 0, (struct sockaddr *)&clientAddr, sizeof(clientAddr)) != length)
+                LOG_ERROR("(PKEServer) Failed to send stats\n");
         }
         else {
-            printf("(PKEServer) Message Type: UNKNOWN (%d)\n", request->messageType);
+            LOG_INFO("(PKEServer) Message Type: UNKNOWN (%d)\n", request->messageType);
+            unknownMessages++;
         }
     }
     
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "server_log.h"
+
+#define LOG_WRITE_BUFFER 65536      // Bytes gathered before one write() to stdout
+#define LOG_IDLE_NANOS 1000000      // Writer sleep when every ring is empty (1 ms)
+
+// One formatted line
+typedef struct {
+    unsigned short length;
+    char text[LOG_LINE_MAX];
+} LogLine;
+
+// Single-producer single-consumer ring: only the owning thread moves tail, only
+// the writer moves head, so neither needs a lock
+typedef struct LogRing {
+    LogLine lines[LOG_RING_LINES];
+    unsigned long head;         // Next line to write out (writer)
+    unsigned long tail;         // Next free line (owning thread)
+    unsigned long dropped;      // Lines lost to a full ring (owning thread)
+    unsigned long reported;     // Dropped lines already reported (writer)
+    struct LogRing *next;
+} LogRing;
+
+int logLevel = LOG_LEVEL_INFO;
+
+// Rings of every thread that has logged (the list only grows, under ringListLock)
+LogRing *ringList = NULL;
+pthread_mutex_t ringListLock = PTHREAD_MUTEX_INITIALIZER;
+__thread LogRing *threadRing = NULL;
+
+int logRunning = 0;
+pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;   // One drainer at a time (writer or logFlush)
+char writeBuffer[LOG_WRITE_BUFFER];
+
+// The calling thread's ring, created on its first log line; NULL if out of memory
+LogRing *getThreadRing() {
+    if (threadRing != NULL) return threadRing;
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (ring == NULL) return NULL;
+    pthread_mutex_lock(&ringListLock);
+    ring->next = ringList;
+    __atomic_store_n(&ringList, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ringListLock);
+    threadRing = ring;
+    return ring;
+}
+
+void logWrite(int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    LogRing *ring = __atomic_load_n(&logRunning, __ATOMIC_ACQUIRE) ? getThreadRing() : NULL;
+    if (ring == NULL) {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    unsigned long tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_LINES) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+
+    LogLine *line = &ring->lines[tail % LOG_RING_LINES];
+    int length = vsnprintf(line->text, sizeof(line->text), format, args);
+    va_end(args);
+    if (length < 0) return;
+    line->length = length < LOG_LINE_MAX ? length : LOG_LINE_MAX - 1;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Write out a full buffer, retrying short writes
+void writeOut(char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, buffer, length);
+        if (written <= 0) return;
+        buffer += written;
+        length -= written;
+    }
+}
+
+// Move every waiting line to stdout, returns how many were written
+int drainRings() {
+    size_t used = 0;
+    int lines = 0;
+
+    pthread_mutex_lock(&drainLock);
+    for (LogRing *ring = __atomic_load_n(&ringList, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        unsigned long head = ring->head;
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            LogLine *line = &ring->lines[head % LOG_RING_LINES];
+            if (used + line->length > sizeof(writeBuffer)) {
+                writeOut(writeBuffer, used);
+                used = 0;
+            }
+            memcpy(writeBuffer + used, line->text, line->length);
+            used += line->length;
+            lines++;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported && used + 64 <= sizeof(writeBuffer)) {
+            used += snprintf(writeBuffer + used, 64, "(Log) %lu lines dropped, ring full\n",
+                             dropped - ring->reported);
+            ring->reported = dropped;
+        }
+    }
+    writeOut(writeBuffer, used);
+    pthread_mutex_unlock(&drainLock);
+    return lines;
+}
+
+void *logWriter(void *arg) {
+    struct timespec idle = {0, LOG_IDLE_NANOS};
+    for (;;) {
+        if (drainRings() == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+void logFlush() {
+    if (__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE))
+        drainRings();
+}
+
+void logStart() {
+    const char *names[] = {"debug", "info", "warn", "error", "off"};
+    const char *level = getenv("SERVER_LOG_LEVEL");
+    for (int i = 0; level != NULL && i <= LOG_LEVEL_OFF; i++) {
+        if (strcmp(level, names[i]) == 0)
+            logLevel = i;
+    }
+
+    // Lines printed before the writer starts must come out first
+    fflush(stdout);
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, logWriter, NULL) != 0) return;
+    pthread_detach(writer);
+    atexit(logFlush);
+    __atomic_store_n(&logRunning, 1, __ATOMIC_RELEASE);
+}
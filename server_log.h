@@ -0,0 +1,65 @@
+#ifndef SERVER_LOG_H
+#define SERVER_LOG_H
+
+// Asynchronous logging shared by the servers. A log call formats its line into a
+// ring buffer owned by the calling thread (no locks, no I/O) and a background
+// thread writes the rings to stdout in large batches. A full ring drops lines
+// rather than blocking, and the writer reports how many were dropped.
+//
+// Levels below LOG_COMPILE_LEVEL are compiled out entirely, e.g.
+//     make CFLAGS="-Wall -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO"
+// and levels below the runtime level (SERVER_LOG_LEVEL=debug|info|warn|error|off,
+// default info) cost one comparison.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_LINE_MAX 496        // Longest line kept, longer ones are cut
+#define LOG_RING_LINES 1024     // Lines each thread can have waiting for the writer
+
+// Lowest level written, set by logStart() from SERVER_LOG_LEVEL
+extern int logLevel;
+
+// Start the writer thread. Until it runs (and in programs that never call it,
+// like the benchmarks) lines are printed straight away.
+void logStart();
+
+// Write out everything logged so far, also run at exit
+void logFlush();
+
+void logWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, ...) do { if ((level) >= logLevel) logWrite((level), __VA_ARGS__); } while (0)
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do { } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do { } while (0)
+#endif
+
+#endif
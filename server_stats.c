@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "server_stats.h"
+
+// One registered histogram or counter
+typedef struct {
+    const char *name;
+    LatencyHistogram *histogram;    // NULL for a counter
+    unsigned long *counter;
+} StatsEntry;
+
+const char *statsServer = "server";
+unsigned long statsStartedAt = 0;
+StatsEntry statsEntries[STATS_MAX_ENTRIES];
+int statsEntryCount = 0;
+
+unsigned long statsNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Bucket of a value: exact below 2 * STATS_SUB_BUCKETS, then STATS_SUB_BUCKETS per power of two
+int histogramBucket(unsigned long value) {
+    if (value < 2 * STATS_SUB_BUCKETS) return value;
+
+    int magnitude = 63 - __builtin_clzl(value);
+    if (magnitude > STATS_MAX_MAGNITUDE) return STATS_BUCKETS - 1;
+    int shift = magnitude - 5;
+    return (magnitude - 4) * STATS_SUB_BUCKETS + (value >> shift) - STATS_SUB_BUCKETS;
+}
+
+// Largest value that lands in a bucket
+unsigned long histogramBucketValue(int bucket) {
+    if (bucket < 2 * STATS_SUB_BUCKETS) return bucket;
+
+    int magnitude = bucket / STATS_SUB_BUCKETS + 4;
+    unsigned long low = (unsigned long)(bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS) << (magnitude - 5);
+    return low + (1UL << (magnitude - 5)) - 1;
+}
+
+void histogramRecord(LatencyHistogram *histogram, unsigned long nanos) {
+    __atomic_fetch_add(&histogram->counts[histogramBucket(nanos)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->totalNanos, nanos, __ATOMIC_RELAXED);
+
+    unsigned long max = __atomic_load_n(&histogram->maxNanos, __ATOMIC_RELAXED);
+    while (nanos > max &&
+           !__atomic_compare_exchange_n(&histogram->maxNanos, &max, nanos, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void histogramRecordSince(LatencyHistogram *histogram, unsigned long startNanos) {
+    histogramRecord(histogram, statsNow() - startNanos);
+}
+
+unsigned long histogramPercentile(LatencyHistogram *histogram, double percentile) {
+    unsigned long count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    if (count == 0) return 0;
+
+    unsigned long target = (unsigned long)(percentile / 100.0 * count + 0.5);
+    if (target < 1) target = 1;
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += __atomic_load_n(&histogram->counts[bucket], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            // The bucket's top can overshoot the largest sample actually seen
+            unsigned long value = histogramBucketValue(bucket);
+            unsigned long max = __atomic_load_n(&histogram->maxNanos, __ATOMIC_RELAXED);
+            return value < max ? value : max;
+        }
+    }
+    return __atomic_load_n(&histogram->maxNanos, __ATOMIC_RELAXED);
+}
+
+void statsStart(const char *server) {
+    statsServer = server;
+    statsStartedAt = statsNow();
+}
+
+void statsRegisterHistogram(const char *name, LatencyHistogram *histogram) {
+    if (statsEntryCount == STATS_MAX_ENTRIES) return;
+    statsEntries[statsEntryCount].name = name;
+    statsEntries[statsEntryCount].histogram = histogram;
+    statsEntries[statsEntryCount].counter = NULL;
+    statsEntryCount++;
+}
+
+void statsRegisterCounter(const char *name, unsigned long *counter) {
+    if (statsEntryCount == STATS_MAX_ENTRIES) return;
+    statsEntries[statsEntryCount].name = name;
+    statsEntries[statsEntryCount].histogram = NULL;
+    statsEntries[statsEntryCount].counter = counter;
+    statsEntryCount++;
+}
+
+int statsDump(char *buffer, size_t size) {
+    size_t used = 0;
+    if (size == 0) return 0;
+
+    used += snprintf(buffer, size, "stats %s uptime=%lu\n", statsServer,
+                     (statsNow() - statsStartedAt) / 1000000000UL);
+    for (int i = 0; i < statsEntryCount && used < size; i++) {
+        StatsEntry *entry = &statsEntries[i];
+        if (entry->histogram == NULL) {
+            used += snprintf(buffer + used, size - used, "counter %s %lu\n", entry->name,
+                             __atomic_load_n(entry->counter, __ATOMIC_RELAXED));
+            continue;
+        }
+
+        LatencyHistogram *histogram = entry->histogram;
+        unsigned long count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        unsigned long total = __atomic_load_n(&histogram->totalNanos, __ATOMIC_RELAXED);
+        used += snprintf(buffer + used, size - used,
+                         "latency %s count=%lu mean=%lu p50=%lu p90=%lu p99=%lu p999=%lu max=%lu\n",
+                         entry->name, count, count ? total / count : 0,
+                         histogramPercentile(histogram, 50), histogramPercentile(histogram, 90),
+                         histogramPercentile(histogram, 99), histogramPercentile(histogram, 99.9),
+                         __atomic_load_n(&histogram->maxNanos, __ATOMIC_RELAXED));
+    }
+    return used < size ? used : size - 1;
+}
+
+int statsRequestAllowed(int length) {
+    return length >= STATS_REQUEST_MIN;
+}
+
+int statsPeerIsLocal(int sock) {
+    struct sockaddr_in peer, local;
+    socklen_t peerLength = sizeof(peer);
+    socklen_t localLength = sizeof(local);
+    if (getpeername(sock, (struct sockaddr *)&peer, &peerLength) < 0 || peer.sin_family != AF_INET ||
+        getsockname(sock, (struct sockaddr *)&local, &localLength) < 0)
+        return 0;
+    return (ntohl(peer.sin_addr.s_addr) >> 24) == 127 || peer.sin_addr.s_addr == local.sin_addr.s_addr;
+}
@@ -0,0 +1,61 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stddef.h>
+
+// Latency histograms and counters shared by the servers, dumped as text by each
+// server's stats message. Histograms are HDR-style: values below 64 ns get a
+// bucket each, above that every power of two is split into 32 buckets, so any
+// percentile is within about 3% of the true value from 1 ns up to 73 minutes in
+// a fixed 10 KB. Recording is a few atomic adds, safe from any thread.
+
+#define STATS_SUB_BUCKETS 32        // Buckets per power of two
+#define STATS_MAX_MAGNITUDE 42      // Largest power of two tracked (2^42 ns), larger values are clamped
+#define STATS_BUCKETS ((STATS_MAX_MAGNITUDE - 3) * STATS_SUB_BUCKETS)
+#define STATS_MAX_ENTRIES 64        // Histograms and counters one server can register
+#define STATS_DUMP_MAX 8192         // Largest dump, fits one UDP datagram
+#define STATS_REQUEST_MIN STATS_DUMP_MAX  // Bytes a UDP stats request is padded to, so no reply outgrows it
+
+typedef struct {
+    unsigned long counts[STATS_BUCKETS];
+    unsigned long count;
+    unsigned long totalNanos;
+    unsigned long maxNanos;
+} LatencyHistogram;
+
+// Add one sample (in nanoseconds)
+void histogramRecord(LatencyHistogram *histogram, unsigned long nanos);
+
+// Add one sample measured from startNanos (a statsNow() reading) until now
+void histogramRecordSince(LatencyHistogram *histogram, unsigned long startNanos);
+
+// Smallest value at or below which percentile % of the samples fall, 0 if empty
+unsigned long histogramPercentile(LatencyHistogram *histogram, double percentile);
+
+// Monotonic clock in nanoseconds
+unsigned long statsNow();
+
+// Name the server in dumps and start its uptime clock
+void statsStart(const char *server);
+
+// Add a histogram or counter to the dump (the name and storage must outlive the server)
+void statsRegisterHistogram(const char *name, LatencyHistogram *histogram);
+void statsRegisterCounter(const char *name, unsigned long *counter);
+
+// Write the registry as text, one line per entry:
+//   stats <server> uptime=<s>
+//   latency <name> count=<n> mean=<ns> p50=<ns> p90=<ns> p99=<ns> p999=<ns> max=<ns>
+//   counter <name> <value>
+// Returns the length written (cut at size - 1)
+int statsDump(char *buffer, size_t size);
+
+// Stats are only sent where they cannot be bounced at someone else. A UDP request
+// of length bytes is answered only if it is padded to STATS_REQUEST_MIN, so a
+// spoofed source address gets no more bytes than the spoofer sent.
+int statsRequestAllowed(int length);
+
+// A TCP stats request is answered only from this host: a loopback address, or the
+// address the connection came in on
+int statsPeerIsLocal(int sock);
+
+#endif
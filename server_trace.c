@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "server_trace.h"
+
+FILE *traceFile = NULL;
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long traceNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+unsigned long traceNewID() {
+    static __thread unsigned long state = 0;
+    if (state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        state = (unsigned long)ts.tv_nsec ^ traceNow() ^ ((unsigned long)getpid() << 32) ^
+                (unsigned long)syscall(SYS_gettid);
+    }
+
+    // splitmix64
+    unsigned long id;
+    do {
+        state += 0x9E3779B97F4A7C15UL;
+        id = state;
+        id = (id ^ (id >> 30)) * 0xBF58476D1CE4E5B9UL;
+        id = (id ^ (id >> 27)) * 0x94D049BB133111EBUL;
+        id ^= id >> 31;
+    } while (id == 0);
+    return id;
+}
+
+void traceStart(const char *server) {
+    const char *dir = getenv("SERVER_TRACE_DIR");
+    if (dir == NULL || dir[0] == '\0') dir = ".";
+    if (strcmp(dir, "off") == 0) return;
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s_trace.json", dir, server);
+    traceFile = fopen(path, "a");
+    if (traceFile == NULL) {
+        perror("(Trace) Cannot open trace file");
+        return;
+    }
+
+    // A new file opens the JSON array, later runs only add events (the closing
+    // bracket is optional in the trace event format)
+    if (ftell(traceFile) == 0)
+        fprintf(traceFile, "[\n");
+    fprintf(traceFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s_server\"}},\n",
+            getpid(), server);
+    fflush(traceFile);
+}
+
+void traceSpan(const char *name, unsigned long traceID, unsigned long startMicros,
+               unsigned int userID, const char *result) {
+    if (traceFile == NULL) return;
+    unsigned long now = traceNow();
+
+    char resultArg[128] = "";
+    if (result != NULL)
+        snprintf(resultArg, sizeof(resultArg), ",\"result\":\"%s\"", result);
+
+    // Spans are rare (a handful per login), so each one goes straight to disk
+    // and survives the server being killed
+    pthread_mutex_lock(&traceLock);
+    fprintf(traceFile,
+            "{\"name\":\"%s\",\"cat\":\"login\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":%d,\"tid\":%ld,"
+            "\"args\":{\"traceId\":\"%016lx\",\"userId\":%u%s}},\n",
+            name, startMicros, now > startMicros ? now - startMicros : 0, getpid(),
+            (long)syscall(SYS_gettid), traceID, userID, resultArg);
+    fflush(traceFile);
+    pthread_mutex_unlock(&traceLock);
+}
@@ -0,0 +1,27 @@
+#ifndef SERVER_TRACE_H
+#define SERVER_TRACE_H
+
+// Login tracing shared by the servers. A login carries a 64-bit trace ID from
+// the Lodi client through the Lodi, PKE and TFA servers, and each server writes
+// the stages it ran as Chrome trace-event "complete" events to its own file,
+// <SERVER_TRACE_DIR>/<server>_trace.json (default directory ".", "off" turns
+// tracing off). Times are wall clock microseconds, so the files of servers on
+// one host line up when merged:
+//     (echo '['; grep -h '^{' lodi_trace.json pke_trace.json tfa_trace.json) > login.json
+// and loaded into chrome://tracing or https://ui.perfetto.dev.
+
+// Open this server's trace file (appending to earlier runs)
+void traceStart(const char *server);
+
+// A new random trace ID, never 0 (0 means "not traced" on the wire)
+unsigned long traceNewID();
+
+// Wall clock in microseconds, the start time of a span
+unsigned long traceNow();
+
+// Write one span from startMicros (a traceNow() reading) until now. result
+// (NULL for none) is shown with the span, e.g. why a login was rejected.
+void traceSpan(const char *name, unsigned long traceID, unsigned long startMicros,
+               unsigned int userID, const char *result);
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "server_stats.h"
+
+#define LODI_WIRE_MAGIC 0x32444F4C  // "LOD2": first word of a variable-length frame
+
+void DieWithError(char *errorMessage)
+{
+    perror(errorMessage);
+    exit(1);
+}
+
+// requestStats to the PKE Server (same layout as PClientToPKServer)
+typedef struct {
+    enum {registerKey, requestKey, requestStats} messageType;
+    unsigned int userID;
+    unsigned int publicKey;
+} PClientToPKServer;
+
+// requestStats to the TFA Server (same layout as TFAClientOrLodiServerToTFAServer)
+typedef struct {
+    enum {registerTFA, ackRegTFA, ackPushTFA, denyPushTFA, requestAuth, requestStatsTFA} messageType;
+    unsigned int userID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+} TFAClientOrLodiServerToTFAServer;
+
+// Variable-length Lodi request header with no body
+typedef struct {
+    unsigned int magic;         // LODI_WIRE_MAGIC
+    unsigned int messageType;   // 9 = stats
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    unsigned int feedLimit;
+    unsigned int cursorType;
+    unsigned long cursor;
+    unsigned int feedFlags;
+    unsigned int bodyLength;
+} LodiRequestHeader;
+
+#define LODI_STATS 9
+
+// Ask a UDP server (PKE or TFA) for its stats, returns the dump length or -1.
+// The request is padded to STATS_REQUEST_MIN, shorter ones are ignored.
+int udpStats(char *serverIP, unsigned short port, void *request, int requestLength, char *dump) {
+    int sock;
+    struct sockaddr_in serverAddr;
+    char padded[STATS_REQUEST_MIN];
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, request, requestLength);
+
+    if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+        DieWithError("socket() failed");
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = inet_addr(serverIP);
+    serverAddr.sin_port = htons(port);
+
+    struct timeval tv = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    int length = -1;
+    if (sendto(sock, padded, sizeof(padded), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) == sizeof(padded))
+        length = recvfrom(sock, dump, STATS_DUMP_MAX - 1, 0, NULL, NULL);
+    close(sock);
+    return length;
+}
+
+// Ask the Lodi Server for its stats over TCP, returns the dump length or -1
+int lodiStats(char *serverIP, char *dump) {
+    int sock;
+    struct sockaddr_in serverAddr;
+
+    if ((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        DieWithError("socket() failed");
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = inet_addr(serverIP);
+    serverAddr.sin_port = htons(2926);
+
+    if (connect(sock, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    LodiRequestHeader request;
+    memset(&request, 0, sizeof(request));
+    request.magic = LODI_WIRE_MAGIC;
+    request.messageType = LODI_STATS;
+    if (send(sock, &request, sizeof(request), 0) != sizeof(request)) {
+        close(sock);
+        return -1;
+    }
+
+    struct timeval tv = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // The server closes the connection after the dump
+    int length = 0;
+    for (;;) {
+        int r = recv(sock, dump + length, STATS_DUMP_MAX - 1 - length, 0);
+        if (r < 0) length = -1;
+        if (r <= 0 || length == STATS_DUMP_MAX - 1) break;
+        length += r;
+    }
+    close(sock);
+    return length;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <pke|tfa|lodi> <Server IP> [poll seconds]\n", argv[0]);
+        exit(1);
+    }
+    char *server = argv[1];
+    char *serverIP = argv[2];
+    int interval = argc == 4 ? atoi(argv[3]) : 0;
+
+    for (;;) {
+        char dump[STATS_DUMP_MAX];
+        int length;
+
+        if (strcmp(server, "pke") == 0) {
+            PClientToPKServer request = {requestStats, 0, 0};
+            length = udpStats(serverIP, 2924, &request, sizeof(request), dump);
+        } else if (strcmp(server, "tfa") == 0) {
+            TFAClientOrLodiServerToTFAServer request = {requestStatsTFA, 0, 0, 0};
+            length = udpStats(serverIP, 2925, &request, sizeof(request), dump);
+        } else if (strcmp(server, "lodi") == 0) {
+            length = lodiStats(serverIP, dump);
+        } else {
+            fprintf(stderr, "Unknown server: %s (use pke, tfa or lodi)\n", server);
+            exit(1);
+        }
+
+        if (length < 0) {
+            fprintf(stderr, "(StatsClient) No stats from the %s server\n", server);
+            if (interval == 0) exit(1);
+        } else {
+            fwrite(dump, 1, length, stdout);
+            fflush(stdout);
+        }
+
+        if (interval == 0) break;
+        sleep(interval);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "test_server.h"
+
+// A post must not show up in anyone's feed before it is durable and acked. With a
+// long group commit window the post waits for its batch; a feed read meanwhile
+// comes back without it, and once the ack arrives the feed has it.
+
+#define TEST_PORT 29463
+#define COMMIT_WINDOW_MICROS 500000
+#define COMMIT_WINDOW_NANOS (COMMIT_WINDOW_MICROS * 1000UL)
+
+// Same wire structs as lodi_server (the fixed-size request is the original
+// 136-byte layout)
+typedef struct {
+    enum{login,post,feed,follow,unfollow,logout} messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    char message[100];
+} PClientToLodiServer;
+
+typedef struct {
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
+    unsigned int userID;
+    char message[100];
+} LodiServerMessage;
+
+// Send one request on a new connection, returns the socket to read the reply from
+int sendRequest(int type, unsigned int userID, unsigned int recipientID, const char *text) {
+    PClientToLodiServer msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.messageType = type;
+    msg.userID = userID;
+    msg.recipientID = recipientID;
+    strncpy(msg.message, text, sizeof(msg.message) - 1);
+
+    int sock = connectLodiServer(TEST_PORT);
+    if (!sendAll(sock, &msg, sizeof(msg))) testFail("Could not send request type %d\n", type);
+    return sock;
+}
+
+LodiServerMessage receiveReply(int sock) {
+    LodiServerMessage reply;
+    if (!recvAll(sock, &reply, sizeof(reply))) testFail("Connection closed without a reply\n");
+    reply.message[sizeof(reply.message) - 1] = '\0';
+    return reply;
+}
+
+// Read user 1's feed, returns the number of posts and copies the newest one
+int readFeed(char *newest, size_t size) {
+    int sock = sendRequest(feed, 1, 0, "");
+    int count = 0;
+    newest[0] = '\0';
+    for (;;) {
+        LodiServerMessage message = receiveReply(sock);
+        if (strcmp(message.message, "END_OF_FEED") == 0) break;
+        if (count++ == 0) snprintf(newest, size, "%s", message.message);
+    }
+    close(sock);
+    return count;
+}
+
+int main() {
+    char window[16];
+    snprintf(window, sizeof(window), "%d", COMMIT_WINDOW_MICROS);
+    const char *options[] = {"-w", window, NULL};
+    startLodiServer(TEST_PORT, options);
+
+    int sock = sendRequest(follow, 1, 2, "");
+    LodiServerMessage ack = receiveReply(sock);
+    close(sock);
+    if (strncmp(ack.message, "Follow successful", 17) != 0) testFail("Follow got \"%s\"\n", ack.message);
+
+    // The post waits for its batch, so the feed read right after it must not see it
+    unsigned long postedAt = nowNanos();
+    int postSock = sendRequest(post, 2, 0, "not yet durable");
+    usleep(50000);
+    char newest[100];
+    int count = readFeed(newest, sizeof(newest));
+    unsigned long readAt = nowNanos() - postedAt;
+    if (readAt >= COMMIT_WINDOW_NANOS) testFail("Feed read took %lu ms, longer than the commit window\n", readAt / 1000000);
+    if (count != 0) testFail("Feed showed \"%s\" before the post was acked\n", newest);
+
+    ack = receiveReply(postSock);
+    close(postSock);
+    if (strcmp(ack.message, "Post successful") != 0) testFail("Post got \"%s\"\n", ack.message);
+    if (nowNanos() - postedAt < COMMIT_WINDOW_NANOS / 2) testFail("Post was acked before its commit window ran out\n");
+
+    // Acked, so now everyone sees it
+    count = readFeed(newest, sizeof(newest));
+    if (count != 1 || strcmp(newest, "#0 User 2: not yet durable") != 0)
+        testFail("Feed after the ack has %d post(s), newest \"%s\"\n", count, newest);
+
+    stopLodiServer();
+    printf("PASS commit_visibility_test\n");
+    return 0;
+}
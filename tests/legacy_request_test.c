@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "test_server.h"
+
+// Old fixed-size clients keep working: requests in the original 136-byte
+// PClientToLodiServer layout (no paging fields) are answered in full, and a
+// feed gets the default page from the newest post.
+
+#define TEST_PORT 29461
+#define BASELINE_REQUEST_SIZE 136
+#define DEFAULT_FEED_LIMIT 20       // lodi_server's FEED_DEFAULT_LIMIT
+#define TEST_POSTS 25
+
+// PClientToLodiServer as sent by the original lodi_client
+typedef struct {
+    enum{login,post,feed,follow,unfollow,logout} messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    char message[100];
+} BaselineRequest;
+
+typedef struct {
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
+    unsigned int userID;
+    char message[100];
+} LodiServerMessage;
+
+// Send one baseline request on a new connection and return the socket
+int sendBaselineRequest(int type, unsigned int userID, unsigned int recipientID, const char *text) {
+    BaselineRequest request;
+    memset(&request, 0, sizeof(request));
+    request.messageType = type;
+    request.userID = userID;
+    request.recipientID = recipientID;
+    strncpy(request.message, text, sizeof(request.message) - 1);
+
+    int sock = connectLodiServer(TEST_PORT);
+    if (!sendAll(sock, &request, sizeof(request))) testFail("send() of a baseline request failed\n");
+    return sock;
+}
+
+// Expect one ack of the type starting with prefix
+void expectAck(int sock, int type, const char *prefix) {
+    LodiServerMessage ack;
+    if (!recvAll(sock, &ack, sizeof(ack)))
+        testFail("No ack for a %d-byte request (expected \"%s\")\n", BASELINE_REQUEST_SIZE, prefix);
+    ack.message[sizeof(ack.message) - 1] = '\0';
+    if ((int)ack.messageType != type || strncmp(ack.message, prefix, strlen(prefix)) != 0)
+        testFail("Got ack %d \"%s\", expected %d \"%s\"\n", ack.messageType, ack.message, type, prefix);
+}
+
+int main() {
+    if (sizeof(BaselineRequest) != BASELINE_REQUEST_SIZE)
+        testFail("BaselineRequest is %zu bytes, not %d\n", sizeof(BaselineRequest), BASELINE_REQUEST_SIZE);
+
+    startLodiServer(TEST_PORT, NULL);
+
+    int sock = sendBaselineRequest(follow, 1, 2, "");
+    expectAck(sock, ackFollow, "Follow successful");
+    close(sock);
+
+    char text[100];
+    for (int i = 0; i < TEST_POSTS; i++) {
+        snprintf(text, sizeof(text), "baseline post %d", i);
+        sock = sendBaselineRequest(post, 2, 0, text);
+        expectAck(sock, ackPost, "Post successful");
+        close(sock);
+    }
+
+    // The feed comes back as fixed-size messages, newest first, up to the default limit
+    sock = sendBaselineRequest(feed, 1, 0, "");
+    int received = 0;
+    LodiServerMessage message;
+    while (1) {
+        if (!recvAll(sock, &message, sizeof(message))) testFail("Feed ended without END_OF_FEED\n");
+        message.message[sizeof(message.message) - 1] = '\0';
+        if (strcmp(message.message, "END_OF_FEED") == 0) break;
+        snprintf(text, sizeof(text), "baseline post %d", TEST_POSTS - 1 - received);
+        if (message.messageType != ackFeed || strstr(message.message, text) == NULL)
+            testFail("Feed message %d is \"%s\", expected \"%s\"\n", received, message.message, text);
+        received++;
+    }
+    close(sock);
+    if (received != DEFAULT_FEED_LIMIT)
+        testFail("Feed had %d posts, expected the default page of %d\n", received, DEFAULT_FEED_LIMIT);
+
+    stopLodiServer();
+    printf("PASS legacy_request_test\n");
+    return 0;
+}
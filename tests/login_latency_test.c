@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "test_server.h"
+
+// A login waits for the user to approve it on the TFA client, which can take
+// seconds. Stand-ins for the PKE and TFA servers approve logins after
+// TFA_DELAY_MILLIS; posts sent meanwhile must still be acked quickly, and the
+// login must succeed once the TFA reply arrives.
+
+#define TEST_PORT 29464
+#define PKE_PORT 2924
+#define TFA_PORT 2925
+#define TFA_DELAY_MILLIS 2000
+#define TEST_POSTS 10
+#define MAX_POST_MILLIS 500
+#define FAKE_SERVER_LIFETIME 30     // Seconds before the stand-in servers exit on their own
+
+// Same wire structs as lodi_server (the fixed-size request is the original
+// 136-byte layout)
+typedef struct {
+    enum{login,post,feed,follow,unfollow,logout} messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    char message[100];
+} PClientToLodiServer;
+
+typedef struct {
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
+    unsigned int userID;
+    char message[100];
+} LodiServerMessage;
+
+typedef struct {
+    enum { ackRegisterKey, responsePublicKey } messageType;
+    unsigned int userID;
+    unsigned int publicKey;
+} PKServerToPClientOrLodiServer;
+
+typedef struct {
+    enum { responseAuth, responseAuthFail } messageType;
+    unsigned int userID;
+} TFAServerToLodiServer;
+
+typedef struct {
+    enum {registerKey, requestKey} messageType;
+    unsigned int userID;
+    unsigned int publicKey;
+    unsigned long traceID;
+} LodiServerToPKEServer;
+
+typedef struct {
+    enum {registerTFA, ackRegTFA, ackPushTFA, denyPushTFA, requestAuth} messageType;
+    unsigned int userID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    unsigned long traceID;
+} LodiServerToTFAServer;
+
+pid_t fakePid = 0;
+
+int bindUdp(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+
+    int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+    return sock;
+}
+
+// Stand-in PKE and TFA servers: every public key is 1, so a signature equal to the
+// timestamp verifies, and each authentication is approved after TFA_DELAY_MILLIS
+void runFakeServers(int pkeSock, int tfaSock) {
+    alarm(FAKE_SERVER_LIFETIME);
+    struct sockaddr_in waiting;
+    unsigned int waitingUser = 0;
+    unsigned long approveAt = 0;
+
+    for (;;) {
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(pkeSock, &ready);
+        FD_SET(tfaSock, &ready);
+        struct timeval timeout = {0, 10000};
+        select((pkeSock > tfaSock ? pkeSock : tfaSock) + 1, &ready, NULL, NULL, &timeout);
+
+        struct sockaddr_in from;
+        socklen_t fromLength = sizeof(from);
+        if (FD_ISSET(pkeSock, &ready)) {
+            LodiServerToPKEServer request;
+            if (recvfrom(pkeSock, &request, sizeof(request), 0, (struct sockaddr *)&from, &fromLength) > 0 &&
+                request.messageType == requestKey) {
+                PKServerToPClientOrLodiServer reply = {responsePublicKey, request.userID, 1};
+                sendto(pkeSock, &reply, sizeof(reply), 0, (struct sockaddr *)&from, fromLength);
+            }
+        }
+        fromLength = sizeof(from);
+        if (FD_ISSET(tfaSock, &ready)) {
+            LodiServerToTFAServer request;
+            if (recvfrom(tfaSock, &request, sizeof(request), 0, (struct sockaddr *)&from, &fromLength) > 0 &&
+                request.messageType == requestAuth) {
+                waiting = from;
+                waitingUser = request.userID;
+                approveAt = nowNanos() + TFA_DELAY_MILLIS * 1000000UL;
+            }
+        }
+        if (approveAt != 0 && nowNanos() >= approveAt) {
+            TFAServerToLodiServer reply = {responseAuth, waitingUser};
+            sendto(tfaSock, &reply, sizeof(reply), 0, (struct sockaddr *)&waiting, sizeof(waiting));
+            approveAt = 0;
+        }
+    }
+}
+
+void startFakeServers() {
+    int pkeSock = bindUdp(PKE_PORT);
+    int tfaSock = bindUdp(TFA_PORT);
+    if (pkeSock < 0 || tfaSock < 0) {
+        fprintf(stderr, "FAIL: UDP ports %d and %d must be free (stop pke_server and tfa_server)\n", PKE_PORT, TFA_PORT);
+        exit(1);
+    }
+
+    fakePid = fork();
+    if (fakePid < 0) {
+        perror("fork() failed");
+        exit(1);
+    }
+    if (fakePid == 0)
+        runFakeServers(pkeSock, tfaSock);
+    close(pkeSock);
+    close(tfaSock);
+}
+
+void stopFakeServers() {
+    if (fakePid <= 0) return;
+    kill(fakePid, SIGKILL);
+    waitpid(fakePid, NULL, 0);
+    fakePid = 0;
+}
+
+void fail(const char *what, unsigned long value) {
+    stopFakeServers();
+    testFail("%s (%lu)\n", what, value);
+}
+
+int sendRequest(int type, unsigned int userID, unsigned long timestamp, const char *text) {
+    PClientToLodiServer msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.messageType = type;
+    msg.userID = userID;
+    msg.timestamp = timestamp;
+    msg.digitalSig = timestamp;
+    strncpy(msg.message, text, sizeof(msg.message) - 1);
+
+    int sock = connectLodiServer(TEST_PORT);
+    if (!sendAll(sock, &msg, sizeof(msg))) fail("Could not send request type", type);
+    return sock;
+}
+
+LodiServerMessage receiveReply(int sock) {
+    LodiServerMessage reply;
+    if (!recvAll(sock, &reply, sizeof(reply))) fail("Connection closed without a reply, socket", sock);
+    reply.message[sizeof(reply.message) - 1] = '\0';
+    return reply;
+}
+
+int main() {
+    startFakeServers();
+    startLodiServer(TEST_PORT, NULL);
+
+    // The login waits on TFA approval. Timestamps wrap every 500 s, so do not
+    // log in just before they do.
+    while (time(NULL) % 500 > 490)
+        usleep(100000);
+    unsigned long loginAt = nowNanos();
+    int loginSock = sendRequest(login, 1, time(NULL) % 500, "");
+    usleep(100000);
+
+    // Posts are answered while it waits
+    unsigned long slowest = 0;
+    for (int i = 0; i < TEST_POSTS; i++) {
+        char text[100];
+        snprintf(text, sizeof(text), "post %d during a login", i);
+        unsigned long start = nowNanos();
+        int sock = sendRequest(post, 2, 0, text);
+        LodiServerMessage ack = receiveReply(sock);
+        close(sock);
+        unsigned long elapsed = nowNanos() - start;
+        if (strcmp(ack.message, "Post successful") != 0) fail("Post was not acked, post", i);
+        if (elapsed > slowest) slowest = elapsed;
+    }
+    if (slowest > MAX_POST_MILLIS * 1000000UL) fail("A post waited behind the login, ms", slowest / 1000000);
+    if (nowNanos() - loginAt >= TFA_DELAY_MILLIS * 1000000UL)
+        fail("Posts finished after the TFA approval, ms", (nowNanos() - loginAt) / 1000000);
+
+    // The login completes once the TFA approval arrives
+    LodiServerMessage ack = receiveReply(loginSock);
+    close(loginSock);
+    unsigned long loginMillis = (nowNanos() - loginAt) / 1000000;
+    if (ack.messageType != ackLogin || strcmp(ack.message, "Login successful") != 0) fail("Login failed, type", ack.messageType);
+    if (loginMillis < TFA_DELAY_MILLIS) fail("Login was acked before the TFA approval, ms", loginMillis);
+
+    stopFakeServers();
+    stopLodiServer();
+    printf("PASS login_latency_test (slowest post %.1f ms, login %lu ms)\n", slowest / 1e6, loginMillis);
+    return 0;
+}
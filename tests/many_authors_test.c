@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "test_server.h"
+
+// The author index has no fixed number of slots. One user follows more authors
+// than the old 100-author table held, each of them posts once, and the newest
+// page of the follower's feed (authors #101 to #120) must have every post.
+// Timelines have none either: a post is pushed to all of 120 followers.
+
+#define TEST_PORT 29465
+#define TEST_AUTHORS 120
+#define FIRST_AUTHOR 1001
+#define FOLLOWER 1
+#define EARLY_FOLLOWER 2    // Follows every author before they post
+#define FEED_PAGE 20        // Default feed page of a fixed-size request
+#define POPULAR_AUTHOR 3000
+#define FIRST_FAN 2001      // Followers of POPULAR_AUTHOR
+#define FANOUT_WAIT_MILLIS 1000  // Time the fan-out thread gets to reach a follower
+
+// Same wire structs as lodi_server (the fixed-size request is the original
+// 136-byte layout)
+typedef struct {
+    enum{login,post,feed,follow,unfollow,logout} messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    char message[100];
+} PClientToLodiServer;
+
+typedef struct {
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
+    unsigned int userID;
+    char message[100];
+} LodiServerMessage;
+
+// Send one request on a new connection, returns the socket to read the reply from
+int sendRequest(int type, unsigned int userID, unsigned int recipientID, const char *text) {
+    PClientToLodiServer msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.messageType = type;
+    msg.userID = userID;
+    msg.recipientID = recipientID;
+    strncpy(msg.message, text, sizeof(msg.message) - 1);
+
+    int sock = connectLodiServer(TEST_PORT);
+    if (!sendAll(sock, &msg, sizeof(msg))) testFail("Could not send request type %d\n", type);
+    return sock;
+}
+
+LodiServerMessage receiveReply(int sock) {
+    LodiServerMessage reply;
+    if (!recvAll(sock, &reply, sizeof(reply))) testFail("Connection closed without a reply\n");
+    reply.message[sizeof(reply.message) - 1] = '\0';
+    return reply;
+}
+
+// Send a request and check that its one reply starts with expected
+void expectReply(int type, unsigned int userID, unsigned int recipientID, const char *text, const char *expected) {
+    int sock = sendRequest(type, userID, recipientID, text);
+    LodiServerMessage reply = receiveReply(sock);
+    close(sock);
+    if (strncmp(reply.message, expected, strlen(expected)) != 0)
+        testFail("Request type %d from user %u got \"%s\"\n", type, userID, reply.message);
+}
+
+// The follower's newest page must be the last FEED_PAGE posts, newest first
+void checkFeed(const char *mode) {
+    int sock = sendRequest(feed, FOLLOWER, 0, "");
+    int count = 0;
+    for (;;) {
+        LodiServerMessage message = receiveReply(sock);
+        if (strcmp(message.message, "END_OF_FEED") == 0) break;
+
+        int postID = TEST_AUTHORS - 1 - count;
+        char expected[100];
+        snprintf(expected, sizeof(expected), "#%d User %d: post by author #%d",
+                 postID, FIRST_AUTHOR + postID, postID + 1);
+        if (count >= FEED_PAGE || strcmp(message.message, expected) != 0)
+            testFail("%s feed post %d is \"%s\", expected \"%s\"\n", mode, count, message.message, expected);
+        count++;
+    }
+    close(sock);
+    if (count != FEED_PAGE) testFail("%s feed has %d posts, expected %d\n", mode, count, FEED_PAGE);
+}
+
+// Make follower follow every author
+void followEveryAuthor(unsigned int follower) {
+    for (int i = 0; i < TEST_AUTHORS; i++)
+        expectReply(follow, follower, FIRST_AUTHOR + i, "", "Follow successful");
+}
+
+// Post once as each author
+void postAsEveryAuthor() {
+    for (int i = 0; i < TEST_AUTHORS; i++) {
+        char text[100];
+        snprintf(text, sizeof(text), "post by author #%d", i + 1);
+        expectReply(post, FIRST_AUTHOR + i, 0, text, "Post successful");
+    }
+}
+
+// Returns the number of posts in a user's feed and copies the newest one
+int readFeed(unsigned int userID, char *newest, size_t size) {
+    int sock = sendRequest(feed, userID, 0, "");
+    int count = 0;
+    newest[0] = '\0';
+    for (;;) {
+        LodiServerMessage message = receiveReply(sock);
+        if (strcmp(message.message, "END_OF_FEED") == 0) break;
+        if (count++ == 0) snprintf(newest, size, "%s", message.message);
+    }
+    close(sock);
+    return count;
+}
+
+int main() {
+    // Hybrid mode with threshold 0: every author already has a follower when they
+    // post, so their posts are left for readers to merge from the author's pull
+    // list. That is the only way the follower, who follows them afterwards, can see
+    // them (pushed posts only reach followers the author had at the time). The
+    // followers make more requests than their rate allows.
+    const char *hybrid[] = {"-t", "0", "-r", "0", NULL};
+    startLodiServer(TEST_PORT, hybrid);
+    followEveryAuthor(EARLY_FOLLOWER);
+    postAsEveryAuthor();
+    followEveryAuthor(FOLLOWER);
+    checkFeed("Hybrid");
+    stopLodiServer();
+
+    // Default mode: the feed is a k-way merge of every followed author's post list.
+    // After a restart the lists are rebuilt from the post log.
+    const char *read[] = {"-r", "0", NULL};
+    startLodiServer(TEST_PORT, read);
+    followEveryAuthor(FOLLOWER);
+    postAsEveryAuthor();
+    checkFeed("Merged");
+    restartLodiServer(TEST_PORT, read);
+    checkFeed("Replayed");
+    stopLodiServer();
+
+    // Fan-out-on-write: the one post lands in every follower's timeline
+    const char *write[] = {"-f", "-r", "0", NULL};
+    startLodiServer(TEST_PORT, write);
+    for (int i = 0; i < TEST_AUTHORS; i++)
+        expectReply(follow, FIRST_FAN + i, POPULAR_AUTHOR, "", "Follow successful");
+    expectReply(post, POPULAR_AUTHOR, 0, "post to every follower", "Post successful");
+    for (int i = 0; i < TEST_AUTHORS; i++) {
+        char expected[100], newest[100];
+        snprintf(expected, sizeof(expected), "#0 User %d: post to every follower", POPULAR_AUTHOR);
+        unsigned long deadline = nowNanos() + FANOUT_WAIT_MILLIS * 1000000UL;
+        int count;
+        while ((count = readFeed(FIRST_FAN + i, newest, sizeof(newest))) == 0 && nowNanos() < deadline)
+            usleep(10000);
+        if (count != 1 || strcmp(newest, expected) != 0)
+            testFail("Follower #%d has %d post(s) in their timeline, newest \"%s\"\n", i + 1, count, newest);
+    }
+    stopLodiServer();
+
+    printf("PASS many_authors_test (%d authors)\n", TEST_AUTHORS);
+    return 0;
+}
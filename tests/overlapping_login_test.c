@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "test_server.h"
+
+// Two logins wait on the real tfa_server at once (lodi_server runs them on
+// separate login workers). The test plays both users' TFA clients: each must get
+// its own push, and answering them in the other order must log both users in.
+
+#define TEST_PORT 29466
+#define PKE_PORT 2924
+#define TFA_PORT 2925
+#define REPLY_TIMEOUT 5          // Seconds to wait for a PKE or TFA message
+#define STARTUP_TRIES 100        // Attempts, 50 ms apart, to reach pke_server and tfa_server
+#define TEST_LIFETIME 60         // Seconds before the test gives up on a hung server
+#define FIRST_USER 1
+#define SECOND_USER 2
+
+// Same wire structs as lodi_server, pke_server and tfa_server (the fixed-size
+// request is the original 136-byte layout)
+typedef struct {
+    enum{login,post,feed,follow,unfollow,logout} messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    char message[100];
+} PClientToLodiServer;
+
+typedef struct {
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
+    unsigned int userID;
+    char message[100];
+} LodiServerMessage;
+
+typedef struct {
+    enum {registerKey, requestKey} messageType;
+    unsigned int userID;
+    unsigned int publicKey;
+} PClientToPKServer;
+
+typedef struct {
+    enum {ackRegisterKey, responsePublicKey} messageType;
+    unsigned int userID;
+    unsigned int publicKey;
+} PKServerToPClient;
+
+typedef struct {
+    enum {registerTFA, ackRegTFA, ackPushTFA, denyPushTFA, requestAuth} messageType;
+    unsigned int userID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    unsigned long traceID;
+} TFAClientToTFAServer;
+
+typedef struct {
+    enum {confirmTFA, pushTFA} messageType;
+    unsigned int userID;
+    unsigned long traceID;
+} TFAServerToTFAClient;
+
+pid_t pkePid = 0;
+pid_t tfaPid = 0;
+
+// Run one of the other servers with its output in the lodi_server data directory
+pid_t launchServer(const char *argv[], const char *logName) {
+    char logPath[128];
+    snprintf(logPath, sizeof(logPath), "%s/%s", lodiServerDataDir(), logName);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork() failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        int fd = open(logPath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        setenv("SERVER_TRACE_DIR", "off", 1);
+        execv(argv[0], (char **)argv);
+        perror("execv() failed");
+        _exit(127);
+    }
+    return pid;
+}
+
+// Stop pke_server and tfa_server, also when the test fails
+void stopServers() {
+    if (pkePid > 0) kill(pkePid, SIGKILL);
+    if (tfaPid > 0) kill(tfaPid, SIGKILL);
+    if (pkePid > 0) waitpid(pkePid, NULL, 0);
+    if (tfaPid > 0) waitpid(tfaPid, NULL, 0);
+    pkePid = tfaPid = 0;
+}
+
+// UDP socket on an ephemeral local port that gives up on replies after REPLY_TIMEOUT
+int openUdp() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) testFail("Could not open a UDP socket\n");
+    struct timeval timeout = {REPLY_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+void sendUdp(int sock, int port, const void *msg, size_t size) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+    if (sendto(sock, msg, size, 0, (struct sockaddr *)&addr, sizeof(addr)) != (ssize_t)size)
+        testFail("Could not send to UDP port %d\n", port);
+}
+
+// Register the user's public key (1, so a signature equal to the timestamp verifies)
+// with pke_server, retrying while it starts up
+void registerPublicKey(unsigned int userID) {
+    int sock = openUdp();
+    struct timeval retry = {0, 50000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &retry, sizeof(retry));
+
+    PClientToPKServer request = {registerKey, userID, 1};
+    PKServerToPClient reply;
+    for (int i = 0; i < STARTUP_TRIES; i++) {
+        sendUdp(sock, PKE_PORT, &request, sizeof(request));
+        if (recv(sock, &reply, sizeof(reply), 0) == sizeof(reply) &&
+            reply.messageType == ackRegisterKey && reply.userID == userID) {
+            close(sock);
+            return;
+        }
+    }
+    testFail("pke_server did not register the key of user %u\n", userID);
+}
+
+// Register a TFA client for the user, retrying while tfa_server starts up.
+// Returns the socket its pushes arrive on.
+int registerTFAClient(unsigned int userID) {
+    int sock = openUdp();
+    struct timeval retry = {0, 50000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &retry, sizeof(retry));
+
+    unsigned long timestamp = time(NULL) % 500;
+    TFAClientToTFAServer request = {registerTFA, userID, timestamp, timestamp, 0};
+    TFAServerToTFAClient reply;
+    int registered = 0;
+    for (int i = 0; i < STARTUP_TRIES && !registered; i++) {
+        sendUdp(sock, TFA_PORT, &request, sizeof(request));
+        registered = recv(sock, &reply, sizeof(reply), 0) >= 8 &&
+                     reply.messageType == confirmTFA && reply.userID == userID;
+    }
+    if (!registered) testFail("tfa_server did not register user %u\n", userID);
+
+    TFAClientToTFAServer ack = {ackRegTFA, userID, 0, 0, 0};
+    sendUdp(sock, TFA_PORT, &ack, sizeof(ack));
+    struct timeval timeout = {REPLY_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+// Wait for the push of a user's login, returns its trace ID
+unsigned long receivePush(int sock, unsigned int userID) {
+    TFAServerToTFAClient push;
+    if (recv(sock, &push, sizeof(push), 0) != sizeof(push))
+        testFail("No push for the login of user %u\n", userID);
+    if (push.messageType != pushTFA || push.userID != userID)
+        testFail("User %u got push type %d for user %u\n", userID, push.messageType, push.userID);
+    return push.traceID;
+}
+
+// Start a login, returns the socket its ack arrives on
+int sendLogin(unsigned int userID) {
+    PClientToLodiServer msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.messageType = login;
+    msg.userID = userID;
+    msg.timestamp = time(NULL) % 500;
+    msg.digitalSig = msg.timestamp;
+
+    int sock = connectLodiServer(TEST_PORT);
+    if (!sendAll(sock, &msg, sizeof(msg))) testFail("Could not send the login of user %u\n", userID);
+    return sock;
+}
+
+void expectLoginAck(int sock, unsigned int userID) {
+    LodiServerMessage reply;
+    if (!recvAll(sock, &reply, sizeof(reply))) testFail("Login of user %u was not acked\n", userID);
+    reply.message[sizeof(reply.message) - 1] = '\0';
+    if (reply.messageType != ackLogin || strcmp(reply.message, "Login successful") != 0)
+        testFail("Login of user %u got \"%s\"\n", userID, reply.message);
+    close(sock);
+}
+
+int main() {
+    alarm(TEST_LIFETIME);
+    startLodiServer(TEST_PORT, NULL);
+    atexit(stopServers);
+    const char *pkeArgs[] = {"./pke_server", NULL};
+    const char *tfaArgs[] = {"./tfa_server", "127.0.0.1", NULL};
+    pkePid = launchServer(pkeArgs, "pke_server.log");
+    tfaPid = launchServer(tfaArgs, "tfa_server.log");
+
+    registerPublicKey(FIRST_USER);
+    registerPublicKey(SECOND_USER);
+    int firstClient = registerTFAClient(FIRST_USER);
+    int secondClient = registerTFAClient(SECOND_USER);
+
+    // Timestamps wrap every 500 s, so do not log in just before they do
+    while (time(NULL) % 500 > 490)
+        usleep(100000);
+
+    // Both logins wait on tfa_server before either user answers
+    int firstLogin = sendLogin(FIRST_USER);
+    int secondLogin = sendLogin(SECOND_USER);
+    unsigned long firstTrace = receivePush(firstClient, FIRST_USER);
+    unsigned long secondTrace = receivePush(secondClient, SECOND_USER);
+
+    // The later login is approved first
+    TFAClientToTFAServer approve = {ackPushTFA, SECOND_USER, 0, 0, secondTrace};
+    sendUdp(secondClient, TFA_PORT, &approve, sizeof(approve));
+    expectLoginAck(secondLogin, SECOND_USER);
+
+    approve.userID = FIRST_USER;
+    approve.traceID = firstTrace;
+    sendUdp(firstClient, TFA_PORT, &approve, sizeof(approve));
+    expectLoginAck(firstLogin, FIRST_USER);
+
+    stopServers();
+    stopLodiServer();
+    printf("PASS overlapping_login_test\n");
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "test_server.h"
+
+// A client that sends part of a request and stalls must not hold up anyone
+// else. While one post arrives in pieces, posts on other connections are acked
+// quickly, and the split post is acked once its last piece is in.
+
+#define TEST_PORT 29467
+#define TEST_POSTS 5
+#define MAX_POST_MILLIS 200
+#define FIRST_PIECE 10      // Bytes of the split request sent before the other posts
+#define SECOND_PIECE 50     // Bytes sent after them, the rest follows later
+
+// Same wire structs as lodi_server (the fixed-size request is the original
+// 136-byte layout)
+typedef struct {
+    enum{login,post,feed,follow,unfollow,logout} messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    char message[100];
+} PClientToLodiServer;
+
+typedef struct {
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
+    unsigned int userID;
+    char message[100];
+} LodiServerMessage;
+
+PClientToLodiServer postRequest(unsigned int userID, const char *text) {
+    PClientToLodiServer msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.messageType = post;
+    msg.userID = userID;
+    strncpy(msg.message, text, sizeof(msg.message) - 1);
+    return msg;
+}
+
+void expectPostAck(int sock, const char *what) {
+    LodiServerMessage reply;
+    if (!recvAll(sock, &reply, sizeof(reply))) testFail("%s was not acked\n", what);
+    reply.message[sizeof(reply.message) - 1] = '\0';
+    if (strcmp(reply.message, "Post successful") != 0) testFail("%s got \"%s\"\n", what, reply.message);
+}
+
+int main() {
+    startLodiServer(TEST_PORT, NULL);
+
+    // The split post starts arriving
+    PClientToLodiServer split = postRequest(1, "sent in pieces");
+    const char *bytes = (const char *)&split;
+    int splitSock = connectLodiServer(TEST_PORT);
+    if (!sendAll(splitSock, bytes, FIRST_PIECE)) testFail("Could not send the first piece\n");
+    usleep(50000);
+
+    // Other clients are served meanwhile
+    unsigned long slowest = 0;
+    for (int i = 0; i < TEST_POSTS; i++) {
+        PClientToLodiServer msg = postRequest(2, "sent whole");
+        unsigned long start = nowNanos();
+        int sock = connectLodiServer(TEST_PORT);
+        if (!sendAll(sock, &msg, sizeof(msg))) testFail("Could not send post %d\n", i);
+        expectPostAck(sock, "A whole post");
+        close(sock);
+        if (nowNanos() - start > slowest) slowest = nowNanos() - start;
+    }
+    if (slowest > MAX_POST_MILLIS * 1000000UL)
+        testFail("A post waited %lu ms behind a partial request\n", slowest / 1000000);
+
+    // The split post is answered once its last piece arrives
+    if (!sendAll(splitSock, bytes + FIRST_PIECE, SECOND_PIECE)) testFail("Could not send the second piece\n");
+    usleep(50000);
+    if (!sendAll(splitSock, bytes + FIRST_PIECE + SECOND_PIECE, sizeof(split) - FIRST_PIECE - SECOND_PIECE))
+        testFail("Could not send the last piece\n");
+    expectPostAck(splitSock, "The split post");
+    close(splitSock);
+
+    stopLodiServer();
+    printf("PASS partial_request_test (slowest post %.1f ms)\n", slowest / 1e6);
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "test_server.h"
+
+// A crash can leave a record half written. The server is killed, one byte of a
+// stored post is flipped and on restart the log must end just before that post:
+// the posts before it are served, and the next post reuses its ID.
+
+#define TEST_PORT 29462
+#define TEST_POSTS 6
+#define TORN_POST 4
+#define POST_SEGMENT_SIZE (4 * 1024 * 1024)
+#define MAX_POST_LENGTH 99
+
+// Same wire and log structs as lodi_server (the fixed-size request is the
+// original 136-byte layout)
+typedef struct {
+    enum{login,post,feed,follow,unfollow,logout} messageType;
+    unsigned int userID;
+    unsigned int recipientID;
+    unsigned long timestamp;
+    unsigned long digitalSig;
+    char message[100];
+} PClientToLodiServer;
+
+typedef struct {
+    enum{ackLogin,ackPost,ackFeed,ackFollow,ackUnfollow,ackLogout,ackSubscribe,ackSearch,ackTrending,ackBusy} messageType;
+    unsigned int userID;
+    char message[100];
+} LodiServerMessage;
+
+typedef struct {
+    unsigned long postedAt;
+    unsigned int postID;
+    unsigned int userID;
+    unsigned int length;
+    unsigned int timestamp;
+} PostRecordHeader;
+
+// Send one request on a new connection, returns the first reply
+LodiServerMessage request(int type, unsigned int userID, unsigned int recipientID, const char *text, int *sockOut) {
+    PClientToLodiServer msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.messageType = type;
+    msg.userID = userID;
+    msg.recipientID = recipientID;
+    strncpy(msg.message, text, sizeof(msg.message) - 1);
+
+    int sock = connectLodiServer(TEST_PORT);
+    LodiServerMessage reply;
+    if (!sendAll(sock, &msg, sizeof(msg)) || !recvAll(sock, &reply, sizeof(reply)))
+        testFail("No reply to request type %d\n", type);
+    reply.message[sizeof(reply.message) - 1] = '\0';
+    if (sockOut != NULL)
+        *sockOut = sock;
+    else
+        close(sock);
+    return reply;
+}
+
+void storeTestPost(const char *text) {
+    LodiServerMessage ack = request(post, 2, 0, text, NULL);
+    if (strcmp(ack.message, "Post successful") != 0) testFail("Post \"%s\" got \"%s\"\n", text, ack.message);
+}
+
+// Read user 1's feed and compare it with the expected messages, newest first
+void expectFeed(const char *expected[], int count) {
+    int sock;
+    LodiServerMessage message = request(feed, 1, 0, "", &sock);
+    for (int i = 0; ; i++) {
+        if (strcmp(message.message, "END_OF_FEED") == 0) {
+            if (i != count) testFail("Feed had %d posts, expected %d\n", i, count);
+            break;
+        }
+        if (i == count || strcmp(message.message, expected[i]) != 0)
+            testFail("Feed message %d is \"%s\", expected \"%s\"\n", i, message.message, i < count ? expected[i] : "END_OF_FEED");
+        if (!recvAll(sock, &message, sizeof(message))) testFail("Feed ended without END_OF_FEED\n");
+        message.message[sizeof(message.message) - 1] = '\0';
+    }
+    close(sock);
+}
+
+// Flip the last text byte of post postID in the first log segment (the server is down)
+void tearPost(int postID) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s/lodi_posts_000000.log", lodiServerDataDir());
+    int fd = open(path, O_RDWR);
+    if (fd < 0) testFail("Cannot open %s\n", path);
+    char *base = mmap(NULL, POST_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) testFail("Cannot map %s\n", path);
+
+    // Records are the header, the text and a 4-byte checksum, padded to 8 bytes
+    unsigned int offset = 0;
+    for (int i = 0; i < postID; i++) {
+        PostRecordHeader *record = (PostRecordHeader *)(base + offset);
+        if (record->postID != (unsigned int)i || record->length > MAX_POST_LENGTH)
+            testFail("Post %d not found in the log\n", i);
+        offset += (sizeof(PostRecordHeader) + record->length + sizeof(unsigned int) + 7) & ~7U;
+    }
+    PostRecordHeader *record = (PostRecordHeader *)(base + offset);
+    if (record->postID != (unsigned int)postID) testFail("Post %d not found in the log\n", postID);
+    ((char *)(record + 1))[record->length - 1] ^= 0x20;
+
+    munmap(base, POST_SEGMENT_SIZE);
+    close(fd);
+}
+
+int main() {
+    startLodiServer(TEST_PORT, NULL);
+
+    LodiServerMessage ack = request(follow, 1, 2, "", NULL);
+    if (strncmp(ack.message, "Follow successful", 17) != 0) testFail("Follow got \"%s\"\n", ack.message);
+    char text[100];
+    for (int i = 0; i < TEST_POSTS; i++) {
+        snprintf(text, sizeof(text), "post number %d", i);
+        storeTestPost(text);
+    }
+
+    // Every post was acked, so all of them survive a crash
+    restartLodiServer(TEST_PORT, NULL);
+    const char *all[] = {"#5 User 2: post number 5", "#4 User 2: post number 4", "#3 User 2: post number 3",
+                         "#2 User 2: post number 2", "#1 User 2: post number 1", "#0 User 2: post number 0"};
+    expectFeed(all, TEST_POSTS);
+
+    // A damaged record ends the log there
+    killLodiServer();
+    tearPost(TORN_POST);
+    restartLodiServer(TEST_PORT, NULL);
+    expectFeed(all + TEST_POSTS - TORN_POST, TORN_POST);
+
+    // The next post takes the first free ID and survives another restart
+    storeTestPost("after recovery");
+    restartLodiServer(TEST_PORT, NULL);
+    const char *recovered[] = {"#4 User 2: after recovery", "#3 User 2: post number 3", "#2 User 2: post number 2",
+                               "#1 User 2: post number 1", "#0 User 2: post number 0"};
+    expectFeed(recovered, TORN_POST + 1);
+
+    stopLodiServer();
+    printf("PASS post_log_recovery_test\n");
+    return 0;
+}
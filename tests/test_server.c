@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "test_server.h"
+
+#define STARTUP_TRIES 100           // Connection attempts, 50 ms apart, before giving up on the server
+
+pid_t serverPid = 0;
+char dataDir[64];
+
+int tryConnect(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+
+    int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Run the server on dataDir and wait for it to accept connections
+void launchLodiServer(int port, const char *options[]) {
+    char portArg[16];
+    char logPath[96];
+    snprintf(portArg, sizeof(portArg), "%d", port);
+    snprintf(logPath, sizeof(logPath), "%s/server.log", dataDir);
+
+    const char *argv[32] = {"./lodi_server", "127.0.0.1", "-P", portArg, "-d", dataDir, "-r", "0", "-g", "0"};
+    int argc = 10;
+    for (int i = 0; options != NULL && options[i] != NULL && argc < 31; i++)
+        argv[argc++] = options[i];
+    argv[argc] = NULL;
+
+    serverPid = fork();
+    if (serverPid < 0) {
+        perror("fork() failed");
+        exit(1);
+    }
+    if (serverPid == 0) {
+        int fd = open(logPath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        setenv("SERVER_TRACE_DIR", "off", 1);
+        execv(argv[0], (char **)argv);
+        perror("execv() failed");
+        _exit(127);
+    }
+
+    for (int i = 0; i < STARTUP_TRIES; i++) {
+        int sock = tryConnect(port);
+        if (sock >= 0) {
+            close(sock);
+            return;
+        }
+        int status;
+        if (waitpid(serverPid, &status, WNOHANG) == serverPid) {
+            serverPid = 0;
+            testFail("lodi_server exited at startup\n");
+        }
+        usleep(50000);
+    }
+    testFail("lodi_server did not accept connections on port %d\n", port);
+}
+
+void startLodiServer(int port, const char *options[]) {
+    signal(SIGPIPE, SIG_IGN);
+    strcpy(dataDir, "/tmp/lodi_test_XXXXXX");
+    if (mkdtemp(dataDir) == NULL) {
+        perror("mkdtemp() failed");
+        exit(1);
+    }
+    launchLodiServer(port, options);
+}
+
+void killLodiServer() {
+    if (serverPid <= 0) return;
+    kill(serverPid, SIGKILL);
+    waitpid(serverPid, NULL, 0);
+    serverPid = 0;
+}
+
+void restartLodiServer(int port, const char *options[]) {
+    killLodiServer();
+    launchLodiServer(port, options);
+}
+
+const char *lodiServerDataDir() {
+    return dataDir;
+}
+
+void stopLodiServer() {
+    killLodiServer();
+
+    DIR *dir = opendir(dataDir);
+    if (dir == NULL) return;
+    struct dirent *entry;
+    char path[512];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dataDir, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(dataDir);
+}
+
+int connectLodiServer(int port) {
+    int sock = tryConnect(port);
+    if (sock < 0) testFail("Could not connect to lodi_server on port %d\n", port);
+    return sock;
+}
+
+int sendAll(int sock, const void *buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t s = send(sock, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+        if (s <= 0) return 0;
+        sent += s;
+    }
+    return 1;
+}
+
+int recvAll(int sock, void *buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t r = recv(sock, (char *)buf + received, len - received, 0);
+        if (r <= 0) return 0;
+        received += r;
+    }
+    return 1;
+}
+
+unsigned long nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void testFail(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, format, args);
+    va_end(args);
+
+    killLodiServer();
+    if (dataDir[0] != '\0')
+        fprintf(stderr, "Server log kept in %s/server.log\n", dataDir);
+    exit(1);
+}
@@ -0,0 +1,40 @@
+#ifndef TEST_SERVER_H
+#define TEST_SERVER_H
+
+#include <stddef.h>
+
+// Helpers for the tests in this directory, run from the repo root by make test:
+// each test starts its own ./lodi_server on a spare port with a fresh data
+// directory, talks to it over TCP and stops it again. The server's output goes
+// to server.log in the data directory, which is kept if the test fails.
+
+// Start ./lodi_server on 127.0.0.1:port with the extra options (NULL-terminated,
+// may be NULL) and wait until it accepts connections. Exits the test on failure.
+void startLodiServer(int port, const char *options[]);
+
+// Kill the server (SIGKILL, as in a crash), keeping its data directory
+void killLodiServer();
+
+// Kill the server if it is running and start it again on the same data directory
+void restartLodiServer(int port, const char *options[]);
+
+// Data directory of the running server
+const char *lodiServerDataDir();
+
+// Stop the server and remove its data directory
+void stopLodiServer();
+
+// Connect to the server, exits the test on failure
+int connectLodiServer(int port);
+
+// Send or receive exactly len bytes, return 0 on failure or early close
+int sendAll(int sock, const void *buf, size_t len);
+int recvAll(int sock, void *buf, size_t len);
+
+// Monotonic clock in nanoseconds
+unsigned long nowNanos();
+
+// Print the failure, stop the server (keeping its log) and exit
+void testFail(const char *format, ...);
+
+#endif
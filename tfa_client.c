@@ -18,11 +18,13 @@ typedef struct {
     unsigned int userID;
     unsigned long timestamp;
     unsigned long digitalSig;
+    unsigned long traceID;      // Login trace, echoed from pushTFA in the reply
 } TFAClientOrLodiServerToTFAServer;
 
 typedef struct {
     enum {confirmTFA, pushTFA} messageType;
     unsigned int userID;
+    unsigned long traceID;      // Login trace of a pushTFA
 } TFAServerToTFAClient;
 
 // RSA
@@ -63,6 +65,7 @@ void registerWithTFAServer(int sock, struct sockaddr_in *tfaServAddr,
     registerMsg.userID = userID;
     registerMsg.timestamp = randomInt;
     registerMsg.digitalSig = modExp(randomInt, privateKey, n);
+    registerMsg.traceID = 0;
     
     printf("(TFAClient) Digital signature: %lu\n", registerMsg.digitalSig);
     printf("(TFAClient) Sending registerTFA to TFA Server...\n");
@@ -91,6 +94,7 @@ void registerWithTFAServer(int sock, struct sockaddr_in *tfaServAddr,
     ackMsg.userID = userID;
     ackMsg.timestamp = 0;
     ackMsg.digitalSig = 0;
+    ackMsg.traceID = 0;
     
     printf("(TFAClient) Sending ackRegTFA to TFA Server...\n");
     
@@ -125,6 +129,9 @@ void listenForPushNotifications(int sock, struct sockaddr_in *tfaServAddr,
         if ((recvMsgSize = recvfrom(sock, &pushMsg, sizeof(pushMsg), 0,
                                     (struct sockaddr *)&fromAddr, &fromSize)) < 0)
             DieWithError("(TFAClient) recvfrom() failed");
+        // Servers that predate tracing send pushTFA without a traceID
+        if (recvMsgSize < (int)sizeof(pushMsg))
+            pushMsg.traceID = 0;
         
         printf("(TFAClient) Push Notification Received\n");
         printf("(TFAClient) From: %s:%d\n", inet_ntoa(fromAddr.sin_addr), ntohs(fromAddr.sin_port));
@@ -143,6 +150,8 @@ void listenForPushNotifications(int sock, struct sockaddr_in *tfaServAddr,
         }
         
         printf("(TFAClient) User ID: %u\n", pushMsg.userID);
+        if (pushMsg.traceID != 0)
+            printf("(TFAClient) Trace ID: %016lx\n", pushMsg.traceID);
         
         // Prompt user
         printf("\n(TFAClient) Authentication request received!\n");
@@ -161,6 +170,7 @@ void listenForPushNotifications(int sock, struct sockaddr_in *tfaServAddr,
                 ackMsg.userID = userID;
                 ackMsg.timestamp = 0;
                 ackMsg.digitalSig = 0;
+                ackMsg.traceID = pushMsg.traceID;
                 
                 if (sendto(sock, &ackMsg, sizeof(ackMsg), 0,
                            (struct sockaddr *)&fromAddr, sizeof(fromAddr)) != sizeof(ackMsg))
@@ -177,6 +187,7 @@ void listenForPushNotifications(int sock, struct sockaddr_in *tfaServAddr,
                 ackMsg.userID = userID;
                 ackMsg.timestamp = 0;
                 ackMsg.digitalSig = 0;
+                ackMsg.traceID = pushMsg.traceID;
 
                 if (sendto(sock, &ackMsg, sizeof(ackMsg), 0,
                            (struct sockaddr *)&fromAddr, sizeof(fromAddr)) != sizeof(ackMsg))
@@ -5,8 +5,16 @@
 #include <string.h>     
 #include <unistd.h>     
 #include <sys/time.h>
+#include <sys/select.h>
+#include <errno.h>
+#include "server_log.h"
+#include "server_stats.h"
+#include "server_trace.h"
 
 #define MAX_USERS 100   
+#define MAX_PENDING_AUTHS 256   // Logins that can wait for their user's approval at once
+#define AUTH_WAIT_SECONDS 15    // Time a user has to approve a login
+#define PKE_REPLY_TIMEOUT 5     // Seconds to wait for the PKE Server's public key
 
 void DieWithError(char *errorMessage)
 {
@@ -16,15 +24,17 @@ void DieWithError(char *errorMessage)
 
 // Message Structs
 typedef struct {
-    enum {registerTFA, ackRegTFA, ackPushTFA, denyPushTFA, requestAuth} messageType;
+    enum {registerTFA, ackRegTFA, ackPushTFA, denyPushTFA, requestAuth, requestStats} messageType;
     unsigned int userID;
     unsigned long timestamp;
     unsigned long digitalSig;
+    unsigned long traceID;      // Login trace of a requestAuth, echoed in ackPushTFA; 0 (or absent) otherwise
 } TFAClientOrLodiServerToTFAServer;
 
 typedef struct {
     enum {confirmTFA, pushTFA} messageType;
     unsigned int userID;
+    unsigned long traceID;      // Login trace of a pushTFA, older clients read only the first 8 bytes
 } TFAServerToTFAClient;
 
 typedef struct {
@@ -55,6 +65,30 @@ typedef struct {
 UserEntry userTable[MAX_USERS];
 int userCount = 0;
 
+// Login pushed to a TFA Client and waiting for the user to answer
+typedef struct {
+    int active;
+    unsigned int userID;
+    unsigned long traceID;
+    struct sockaddr_in lodiServerAddr;  // Where the answer goes
+    unsigned long requestedAt;          // statsNow() when the requestAuth arrived
+    unsigned long requestTraceStart;    // traceNow() when the requestAuth arrived
+    unsigned long waitTraceStart;       // traceNow() when the push went out
+    unsigned long deadline;             // statsNow() after which the login fails
+} PendingAuth;
+
+PendingAuth pendingAuths[MAX_PENDING_AUTHS];
+int pendingAuthCount = 0;
+
+// Handling time of each message type and of the PKE round trip, dumped by requestStats
+LatencyHistogram registerTFALatency;
+LatencyHistogram ackRegTFALatency;
+LatencyHistogram requestAuthLatency;    // Includes the wait for the user to approve
+LatencyHistogram publicKeyLatency;
+unsigned long unknownMessages = 0;
+unsigned long rejectedStats = 0;      // Stats requests not padded to STATS_REQUEST_MIN
+unsigned long pendingAuthsFull = 0;   // Logins failed because MAX_PENDING_AUTHS were already waiting
+
 // RSA
 unsigned long modExp(unsigned long base, unsigned long exp, unsigned long n)
 {
@@ -96,8 +130,9 @@ int addUser(unsigned int userID, struct sockaddr_in *clientAddr)
     return userCount - 1;
 }
 
-// Request public key from TFA Server
-unsigned int requestPublicKey(int sock, char *pkeServerIP, unsigned short pkeServerPort,
+// Request public key from PKE Server. The request goes out on its own socket so
+// the reply cannot be mixed up with TFA messages arriving on the server socket.
+unsigned int requestPublicKey(char *pkeServerIP, unsigned short pkeServerPort,
                                unsigned int userID, unsigned long n)
 {
     struct sockaddr_in pkeServerAddr;
@@ -106,7 +141,8 @@ unsigned int requestPublicKey(int sock, char *pkeServerIP, unsigned short pkeSer
     unsigned int fromSize;
     int recvMsgSize;
     
-    printf("(TFAServer) Requesting public key for user %u from PKE Server\n", userID);
+    LOG_INFO("(TFAServer) Requesting public key for user %u from PKE Server\n", userID);
+    unsigned long start = statsNow();
     
     request.messageType = requestKey;
     request.userID = userID;
@@ -118,30 +154,43 @@ unsigned int requestPublicKey(int sock, char *pkeServerIP, unsigned short pkeSer
     pkeServerAddr.sin_addr.s_addr = inet_addr(pkeServerIP);
     pkeServerAddr.sin_port = htons(pkeServerPort);
     
+    int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        LOG_ERROR("(TFAServer) Failed to create a socket for the PKE Server\n");
+        return 0;
+    }
+    struct timeval timeout = {PKE_REPLY_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
     // Send 
     if (sendto(sock, &request, sizeof(request), 0,
                (struct sockaddr *)&pkeServerAddr, sizeof(pkeServerAddr)) != sizeof(request))
     {
-        printf("(TFAServer) Failed to send request to PKE Server\n");
+        LOG_ERROR("(TFAServer) Failed to send request to PKE Server\n");
+        close(sock);
         return 0;
     }
     
     // Receive
     fromSize = sizeof(pkeServerAddr);
-    if ((recvMsgSize = recvfrom(sock, &response, sizeof(response), 0,
-                                (struct sockaddr *)&pkeServerAddr, &fromSize)) < 0)
+    recvMsgSize = recvfrom(sock, &response, sizeof(response), 0,
+                           (struct sockaddr *)&pkeServerAddr, &fromSize);
+    close(sock);
+    if (recvMsgSize < 0)
     {
-        printf("(TFAServer) Failed to receive response from PKE Server\n");
+        LOG_ERROR("(TFAServer) Failed to receive response from PKE Server\n");
         return 0;
     }
+    histogramRecordSince(&publicKeyLatency, start);
     
     if (response.messageType == responsePublicKey && response.userID == userID)
     {
-        printf("(TFAServer) Public key received: %u\n", response.publicKey);
+        LOG_INFO("(TFAServer) Public key received: %u\n", response.publicKey);
         return response.publicKey;
     }
     
-    printf("(TFAServer) Invalid response from PKE Server\n");
+    LOG_WARN("(TFAServer) Invalid response from PKE Server\n");
     return 0;
 }
 
@@ -155,16 +204,17 @@ void handleRegistration(int sock, TFAClientOrLodiServerToTFAServer *msg,
     unsigned long decryptedInt;
     int userIndex;
     
-    printf("(TFAServer) Processing registration for user %u\n", msg->userID);
+    LOG_INFO("(TFAServer) Processing registration for user %u\n", msg->userID);
     
     // Check if registered
     userIndex = findUser(msg->userID);
     if (userIndex >= 0)
     {
-        printf("(TFAServer) User %u already registered\n", msg->userID);
+        LOG_INFO("(TFAServer) User %u already registered\n", msg->userID);
         
         confirmMsg.messageType = confirmTFA;
         confirmMsg.userID = msg->userID;
+        confirmMsg.traceID = 0;
         
         if (sendto(sock, &confirmMsg, sizeof(confirmMsg), 0,
                    (struct sockaddr *)clientAddr, sizeof(*clientAddr)) != sizeof(confirmMsg))
@@ -174,199 +224,223 @@ void handleRegistration(int sock, TFAClientOrLodiServerToTFAServer *msg,
     }
     
     // Request public Key from PKE
-    publicKey = requestPublicKey(sock, pkeServerIP, pkeServerPort, msg->userID, n);
+    publicKey = requestPublicKey(pkeServerIP, pkeServerPort, msg->userID, n);
     if (publicKey == 0)
     {
-        printf("Failed to get public key for user %u\n", msg->userID);
+        LOG_ERROR("Failed to get public key for user %u\n", msg->userID);
         return;
     }
     
     // Verify DS
     decryptedInt = modExp(msg->digitalSig, publicKey, n);
     
-    printf("(TFAServer) Verifying digital signature:\n");
-    printf("(TFAServer) Timestamp: %lu\n", msg->timestamp);
-    printf("(TFAServer) Decrypted: %lu\n", decryptedInt);
+    LOG_INFO("(TFAServer) Verifying digital signature:\n");
+    LOG_DEBUG("(TFAServer) Timestamp: %lu\n", msg->timestamp);
+    LOG_DEBUG("(TFAServer) Decrypted: %lu\n", decryptedInt);
     
     if (decryptedInt != msg->timestamp)
     {
-        printf("(TFAServer) Digital signature verification failed\n");
+        LOG_ERROR("(TFAServer) Digital signature verification failed\n");
         return;
     }
     
-    printf("(TFAServer) Digital signature verified\n");
+    LOG_INFO("(TFAServer) Digital signature verified\n");
     
     // Add user to table
     if (addUser(msg->userID, clientAddr) < 0)
     {
-        printf("(TFAServer) User table full\n");
+        LOG_WARN("(TFAServer) User table full\n");
         return;
     }
     
-    printf("(TFAServer) User %u registered from %s:%d\n",
+    LOG_INFO("(TFAServer) User %u registered from %s:%d\n",
            msg->userID, inet_ntoa(clientAddr->sin_addr), ntohs(clientAddr->sin_port));
     
     // Confirm TFA
     confirmMsg.messageType = confirmTFA;
     confirmMsg.userID = msg->userID;
+    confirmMsg.traceID = 0;
     
     if (sendto(sock, &confirmMsg, sizeof(confirmMsg), 0,
                (struct sockaddr *)clientAddr, sizeof(*clientAddr)) != sizeof(confirmMsg))
         DieWithError("(TFAServer) sendto() failed");
     
-    printf("(TFAServer) Sent confirmTFA to user %u\n", msg->userID);
+    LOG_INFO("(TFAServer) Sent confirmTFA to user %u\n", msg->userID);
 }
 
-// Auth from Lodi Server
+// Trace one stage of a traced requestAuth
+void traceAuthStage(const char *name, PendingAuth *auth, unsigned long startMicros, const char *result)
+{
+    if (auth->traceID != 0)
+        traceSpan(name, auth->traceID, startMicros, auth->userID, result);
+}
+
+// Send responseAuth or responseAuthFail to Lodi Server
+void sendAuthResponse(int sock, unsigned int userID, struct sockaddr_in *lodiServerAddr, int approved)
+{
+    TFAServerToLodiServer responseMsg;
+    responseMsg.messageType = approved ? responseAuth : responseAuthFail;
+    responseMsg.userID = userID;
+
+    if (sendto(sock, &responseMsg, sizeof(responseMsg), 0,
+               (struct sockaddr *)lodiServerAddr, sizeof(*lodiServerAddr)) != sizeof(responseMsg))
+        LOG_ERROR("(TFAServer) Failed to send response to Lodi Server\n");
+    else if (approved)
+        LOG_INFO("(TFAServer) Sent responseAuth to Lodi Server\n");
+    else
+        LOG_WARN("(TFAServer) Sent failure response to Lodi Server for user %u\n", userID);
+}
+
+// Answer a waiting login's Lodi Server and free its slot
+void finishAuth(int sock, PendingAuth *auth, int approved)
+{
+    sendAuthResponse(sock, auth->userID, &auth->lodiServerAddr, approved);
+    histogramRecordSince(&requestAuthLatency, auth->requestedAt);
+    traceAuthStage("tfa.requestAuth", auth, auth->requestTraceStart, NULL);
+    auth->active = 0;
+    pendingAuthCount--;
+}
+
+// Auth from Lodi Server: push it to the user's TFA client and leave it waiting.
+// The answer is sent from handleAuthReply() or expirePendingAuths(), so other
+// logins and registrations are served meanwhile.
 void handleAuthRequest(int sock, TFAClientOrLodiServerToTFAServer *msg,
-                       struct sockaddr_in *lodiServerAddr)
+                       struct sockaddr_in *lodiServerAddr, unsigned long requestedAt)
 {
     TFAServerToTFAClient pushMsg;
-    TFAClientOrLodiServerToTFAServer ackMsg;
-    TFAServerToLodiServer responseMsg;
-    struct sockaddr_in fromAddr;
-    unsigned int fromSize;
-    int recvMsgSize;
     int userIndex;
     
-    printf("(TFAServer) Processing authentication request for user %u\n", msg->userID);
+    LOG_INFO("(TFAServer) Processing authentication request for user %u\n", msg->userID);
     
     // Find user
     userIndex = findUser(msg->userID);
     if (userIndex < 0)
     {
-        printf("(TFAServer) User %u not registered\n", msg->userID);
+        LOG_WARN("(TFAServer) User %u not registered\n", msg->userID);
         return;
     }
+
+    PendingAuth *auth = NULL;
+    for (int i = 0; i < MAX_PENDING_AUTHS && auth == NULL; i++)
+        if (!pendingAuths[i].active)
+            auth = &pendingAuths[i];
+    if (auth == NULL)
+    {
+        LOG_WARN("(TFAServer) %d logins already waiting, failing the one of user %u\n",
+                 MAX_PENDING_AUTHS, msg->userID);
+        pendingAuthsFull++;
+        sendAuthResponse(sock, msg->userID, lodiServerAddr, 0);
+        histogramRecordSince(&requestAuthLatency, requestedAt);
+        return;
+    }
+    auth->active = 1;
+    auth->userID = msg->userID;
+    auth->traceID = msg->traceID;
+    auth->lodiServerAddr = *lodiServerAddr;
+    auth->requestedAt = requestedAt;
+    auth->requestTraceStart = traceNow();
+    pendingAuthCount++;
     
-    printf("(TFAServer) User %u found, sending push notification\n", msg->userID);
+    LOG_INFO("(TFAServer) User %u found, sending push notification\n", msg->userID);
     
     // pushTFA to TFA Client
     pushMsg.messageType = pushTFA;
     pushMsg.userID = msg->userID;
+    pushMsg.traceID = msg->traceID;
     
+    unsigned long stageStart = traceNow();
     if (sendto(sock, &pushMsg, sizeof(pushMsg), 0,
                (struct sockaddr *)&userTable[userIndex].clientAddr,
                sizeof(userTable[userIndex].clientAddr)) != sizeof(pushMsg))
     {
-        printf("(TFAServer) Failed to send push notification\n");
+        LOG_ERROR("(TFAServer) Failed to send push notification\n");
+        traceAuthStage("tfa.push", auth, stageStart, "send failed");
+        finishAuth(sock, auth, 0);
         return;
     }
+    traceAuthStage("tfa.push", auth, stageStart, NULL);
     
-    printf("(TFAServer) Push notification sent to %s:%d\n",
-           inet_ntoa(userTable[userIndex].clientAddr.sin_addr),
+    char clientIP[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &userTable[userIndex].clientAddr.sin_addr, clientIP, sizeof(clientIP));
+    LOG_INFO("(TFAServer) Push notification sent to %s:%d\n", clientIP,
            ntohs(userTable[userIndex].clientAddr.sin_port));
-    
-    // Wait for ackPushTFA from TFA Client 
-
-    printf("(TFAServer) Waiting for user approval...\n");
-    
-    // Temporarily set a receive timeout so we don't block forever waiting for client
-    struct timeval tv;
-    struct timeval tv_orig;
-    socklen_t optlen = sizeof(tv_orig);
-    int got_orig = 0;
-
-    tv.tv_sec = 15; // wait up to 15 seconds for client response
-    tv.tv_usec = 0;
+    LOG_INFO("(TFAServer) Waiting for user approval...\n");
 
-    if (getsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv_orig, &optlen) == 0)
-        got_orig = 1;
-
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+    // The user's approval is usually most of a login's time
+    auth->waitTraceStart = traceNow();
+    auth->deadline = statsNow() + AUTH_WAIT_SECONDS * 1000000000UL;
+}
 
-    fromSize = sizeof(fromAddr);
-    if ((recvMsgSize = recvfrom(sock, &ackMsg, sizeof(ackMsg), 0,
-                                (struct sockaddr *)&fromAddr, &fromSize)) < 0)
+// ackPushTFA or denyPushTFA from a TFA Client: answer the login it is for. A user
+// with several logins waiting answers the one whose trace ID it echoes, or the
+// oldest if its client does not echo trace IDs.
+void handleAuthReply(int sock, TFAClientOrLodiServerToTFAServer *msg)
+{
+    PendingAuth *auth = NULL;
+    for (int i = 0; i < MAX_PENDING_AUTHS; i++)
     {
-        // restore original timeout (or clear) before returning
-        if (got_orig)
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv_orig, sizeof(tv_orig));
-        else {
-            struct timeval tv_clear = {0,0};
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv_clear, sizeof(tv_clear));
+        PendingAuth *candidate = &pendingAuths[i];
+        if (!candidate->active || candidate->userID != msg->userID) continue;
+        if (msg->traceID != 0 && candidate->traceID == msg->traceID)
+        {
+            auth = candidate;
+            break;
         }
-
-        printf("(TFAServer) Failed to receive ack from TFA Client (timeout or error)\n");
-        // Inform Lodi server that authentication failed
-        TFAServerToLodiServer failMsg;
-        failMsg.messageType = responseAuthFail;
-        failMsg.userID = msg->userID;
-        if (sendto(sock, &failMsg, sizeof(failMsg), 0,
-                   (struct sockaddr *)lodiServerAddr, sizeof(*lodiServerAddr)) != sizeof(failMsg))
-            printf("(TFAServer) Failed to send failure response to Lodi Server\n");
-        else
-            printf("(TFAServer) Sent failure response to Lodi Server due to timeout\n");
-        return;
-    }
-
-    /* restore original timeout (or clear) now that recvfrom returned */
-    if (got_orig)
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv_orig, sizeof(tv_orig));
-    else {
-        struct timeval tv_clear = {0,0};
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv_clear, sizeof(tv_clear));
+        if (auth == NULL || candidate->requestedAt < auth->requestedAt)
+            auth = candidate;
     }
-    
-    if (ackMsg.userID != msg->userID)
+    if (auth == NULL)
     {
-        printf("(TFAServer) Invalid ack from TFA Client (wrong user)\n");
-        // Notify Lodi server of failure
-        TFAServerToLodiServer failMsg;
-        failMsg.messageType = responseAuthFail;
-        failMsg.userID = msg->userID;
-        if (sendto(sock, &failMsg, sizeof(failMsg), 0,
-                   (struct sockaddr *)lodiServerAddr, sizeof(*lodiServerAddr)) != sizeof(failMsg))
-            printf("(TFAServer) Failed to send failure response to Lodi Server\n");
+        LOG_WARN("(TFAServer) No login of user %u is waiting for approval\n", msg->userID);
         return;
     }
+    if (msg->traceID != auth->traceID)
+        LOG_DEBUG("(TFAServer) Ack carries trace %016lx, expected %016lx\n", msg->traceID, auth->traceID);
 
-    if (ackMsg.messageType == denyPushTFA)
-    {
-        printf("(TFAServer) User %u denied authentication\n", msg->userID);
-        TFAServerToLodiServer failMsg;
-        failMsg.messageType = responseAuthFail;
-        failMsg.userID = msg->userID;
-        if (sendto(sock, &failMsg, sizeof(failMsg), 0,
-                   (struct sockaddr *)lodiServerAddr, sizeof(*lodiServerAddr)) != sizeof(failMsg))
-            printf("(TFAServer) Failed to send failure response to Lodi Server\n");
-        else
-            printf("(TFAServer) Sent failure response to Lodi Server (user denied)\n");
-        return;
-    }
+    int approved = msg->messageType == ackPushTFA;
+    traceAuthStage("tfa.userWait", auth, auth->waitTraceStart, approved ? "approved" : "denied");
+    if (approved)
+        LOG_INFO("(TFAServer) User %u approved authentication\n", msg->userID);
+    else
+        LOG_WARN("(TFAServer) User %u denied authentication\n", msg->userID);
+    finishAuth(sock, auth, approved);
+}
 
-    if (ackMsg.messageType != ackPushTFA)
+// Fail every login whose user did not answer within AUTH_WAIT_SECONDS
+void expirePendingAuths(int sock)
+{
+    unsigned long now = statsNow();
+    for (int i = 0; i < MAX_PENDING_AUTHS && pendingAuthCount > 0; i++)
     {
-        printf("(TFAServer) Invalid ack from TFA Client (unexpected type=%d)\n", ackMsg.messageType);
-        TFAServerToLodiServer failMsg;
-        failMsg.messageType = responseAuthFail;
-        failMsg.userID = msg->userID;
-        if (sendto(sock, &failMsg, sizeof(failMsg), 0,
-                   (struct sockaddr *)lodiServerAddr, sizeof(*lodiServerAddr)) != sizeof(failMsg))
-            printf("(TFAServer) Failed to send failure response to Lodi Server\n");
-        return;
-    }
+        PendingAuth *auth = &pendingAuths[i];
+        if (!auth->active || now < auth->deadline) continue;
 
-    printf("(TFAServer) User %u approved authentication\n", msg->userID);
-    
-    // Send responseAuth to Lodi Server 
-    responseMsg.messageType = responseAuth;
-    responseMsg.userID = msg->userID;
-    
-    if (sendto(sock, &responseMsg, sizeof(responseMsg), 0,
-               (struct sockaddr *)lodiServerAddr, sizeof(*lodiServerAddr)) != sizeof(responseMsg))
-    {
-        printf("(TFAServer) Failed to send response to Lodi Server\n");
-        return;
+        LOG_ERROR("(TFAServer) No ack from the TFA Client of user %u (timeout)\n", auth->userID);
+        traceAuthStage("tfa.userWait", auth, auth->waitTraceStart, "timeout");
+        finishAuth(sock, auth, 0);
     }
-    
-    printf("(TFAServer) Sent responseAuth to Lodi Server\n");
+}
+
+// Time until the next waiting login expires, NULL (wait forever) if none is waiting
+struct timeval *nextAuthTimeout(struct timeval *timeout)
+{
+    unsigned long now = statsNow();
+    unsigned long next = 0;
+    for (int i = 0; i < MAX_PENDING_AUTHS && pendingAuthCount > 0; i++)
+        if (pendingAuths[i].active && (next == 0 || pendingAuths[i].deadline < next))
+            next = pendingAuths[i].deadline;
+    if (next == 0) return NULL;
+
+    unsigned long wait = next > now ? next - now : 0;
+    timeout->tv_sec = wait / 1000000000UL;
+    timeout->tv_usec = wait % 1000000000UL / 1000;
+    return timeout;
 }
 
 // Handle ackRegTFA from TFA Client 
 void handleAckRegTFA(TFAClientOrLodiServerToTFAServer *msg)
 {
-    printf("(TFAServer) Received ackRegTFA from user %u\n", msg->userID);
+    LOG_INFO("(TFAServer) Received ackRegTFA from user %u\n", msg->userID);
 }
 
 int main(int argc, char *argv[])
@@ -389,14 +463,15 @@ int main(int argc, char *argv[])
         exit(1);
     }
     
+    logStart();
     tfaServPort = 2925;     
     pkeServerIP = argv[1];           
     pkeServerPort = 2924;   
     
-    printf("(TFAServer) TFA Server starting...\n");
-    printf("(TFAServer) Listening on port: %u\n", tfaServPort);
-    printf("(TFAServer) PKE Server: %s:%u\n", pkeServerIP, pkeServerPort);
-    printf("(TFAServer) RSA Modulus (n): %lu\n\n", n);
+    LOG_INFO("(TFAServer) TFA Server starting...\n");
+    LOG_INFO("(TFAServer) Listening on port: %u\n", tfaServPort);
+    LOG_INFO("(TFAServer) PKE Server: %s:%u\n", pkeServerIP, pkeServerPort);
+    LOG_INFO("(TFAServer) RSA Modulus (n): %lu\n\n", n);
     
     // Create Socket
     if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
@@ -412,37 +487,89 @@ int main(int argc, char *argv[])
     if (bind(sock, (struct sockaddr *) &tfaServAddr, sizeof(tfaServAddr)) < 0)
         DieWithError("(TFAServer) bind() failed");
     
-    printf("(TFAServer) TFA Server ready. Waiting for messages...\n\n");
+    statsStart("tfa");
+    statsRegisterHistogram("registerTFA", &registerTFALatency);
+    statsRegisterHistogram("ackRegTFA", &ackRegTFALatency);
+    statsRegisterHistogram("requestAuth", &requestAuthLatency);
+    statsRegisterHistogram("pke.requestKey", &publicKeyLatency);
+    statsRegisterCounter("unknownMessages", &unknownMessages);
+    statsRegisterCounter("rejectedStats", &rejectedStats);
+    statsRegisterCounter("pendingAuthsFull", &pendingAuthsFull);
+    traceStart("tfa");
+
+    LOG_INFO("(TFAServer) TFA Server ready. Waiting for messages...\n\n");
     
     for (;;) 
     {
+        // Wait for a message, or until the next waiting login times out
+        fd_set readable;
+        struct timeval timeout;
+        FD_ZERO(&readable);
+        FD_SET(sock, &readable);
+        int ready = select(sock + 1, &readable, NULL, NULL, nextAuthTimeout(&timeout));
+        if (ready < 0 && errno != EINTR)
+            DieWithError("(TFAServer) select() failed");
+        expirePendingAuths(sock);
+        if (ready <= 0)
+            continue;
+
         clntAddrLen = sizeof(clntAddr);
         
         // Until receive message from a client
-        if ((recvMsgSize = recvfrom(sock, &recvMsg, sizeof(recvMsg), 0,
+        // MSG_TRUNC: the length is the whole datagram's, even past sizeof(recvMsg)
+        if ((recvMsgSize = recvfrom(sock, &recvMsg, sizeof(recvMsg), MSG_TRUNC,
                                     (struct sockaddr *) &clntAddr, &clntAddrLen)) < 0)
             DieWithError("(TFAServer) recvfrom() failed");
+        // Senders that predate tracing send the message without its traceID
+        if (recvMsgSize < (int)sizeof(recvMsg))
+            recvMsg.traceID = 0;
         
-        printf("(TFAServer) Handling client %s\n", inet_ntoa(clntAddr.sin_addr));
-        printf("(TFAServer) Message type: %d\n", recvMsg.messageType);
+        LOG_INFO("(TFAServer) Handling client %s\n", inet_ntoa(clntAddr.sin_addr));
+        LOG_DEBUG("(TFAServer) Message type: %d\n", recvMsg.messageType);
         
         // Switch to process message based on type
+        unsigned long start = statsNow();
         switch (recvMsg.messageType)
         {
             case registerTFA:
                 handleRegistration(sock, &recvMsg, &clntAddr, pkeServerIP, pkeServerPort, n);
+                histogramRecordSince(&registerTFALatency, start);
                 break;
                 
             case ackRegTFA:
                 handleAckRegTFA(&recvMsg);
+                histogramRecordSince(&ackRegTFALatency, start);
                 break;
                 
             case requestAuth:
-                handleAuthRequest(sock, &recvMsg, &clntAddr);
+                // Timed once the login is answered, the user's approval included
+                handleAuthRequest(sock, &recvMsg, &clntAddr, start);
+                break;
+
+            case ackPushTFA:
+            case denyPushTFA:
+                handleAuthReply(sock, &recvMsg);
+                break;
+
+            case requestStats:
+            {
+                // The reply is the text dump of the stats registry
+                if (!statsRequestAllowed(recvMsgSize)) {
+                    LOG_WARN("(TFAServer) Ignoring a %d byte stats request from %s\n",
+                             recvMsgSize, inet_ntoa(clntAddr.sin_addr));
+                    rejectedStats++;
+                    break;
+                }
+                char dump[STATS_DUMP_MAX];
+                int length = statsDump(dump, sizeof(dump));
+                if (sendto(sock, dump, length, 0, (struct sockaddr *)&clntAddr, sizeof(clntAddr)) != length)
+                    LOG_ERROR("(TFAServer) Failed to send stats\n");
                 break;
+            }
                 
             default:
-                printf("(TFAServer) Unknown message type: %d\n", recvMsg.messageType);
+                LOG_INFO("(TFAServer) Unknown message type: %d\n", recvMsg.messageType);
+                unknownMessages++;
                 break;
         }
         